@@ -271,12 +271,57 @@ char * xstrdup(apr_pool_t *p, const char *src)
     return dup;
     }
 
+/** turn a topic with key references a la $key into a subscription filter
+  * matching it for any values: levels holding a reference become '+'
+  * \param p    allocation pool
+  * \param tgt  original topic with key references
+  * \return topic filter
+  */
+const char * kvPattern (apr_pool_t *p, const char *tgt )
+    {
+    char * b = xstrdup(p, tgt);
+    char * o = b;
+
+    for ( const char * level = tgt; level; )
+        {
+        const char * end = strchr(level, '/');
+        size_t len = ( end ? (size_t) ( end - level ) : strlen(level) );
+
+        if ( memchr(level, '$', len) )
+            *o++ = '+';
+        else
+            {
+            memcpy(o, level, len);
+            o += len;
+            }
+
+        if ( end )
+            *o++ = '/';
+        level = ( end ? end + 1 : NULL );
+        }
+    *o = 0;
+
+    DPRINTF ( "--> kvPattern %s: %s\n", tgt, b );
+    return b;
+    }
+
 /** convert a keyValuePair datastr to json
   * \param p    allocation pool
   * \param vars vars to convert
   * \return json string data
   */
 const char * kv2json(apr_pool_t *p, keyValuePair *vars)
+    {
+    return kv2json_extra(p, vars, NULL);
+    }
+
+/** convert a keyValuePair datastr to json with more keys added
+  * \param p     allocation pool
+  * \param vars  vars to convert
+  * \param extra NULL or keys set by us, request vars cannot override them
+  * \return json string data
+  */
+const char * kv2json_extra(apr_pool_t *p, keyValuePair *vars, keyValuePair *extra)
     {
     DPRINTF ( "--> kv2json %ld\n", (long int) vars ) ;
 
@@ -298,6 +343,12 @@ const char * kv2json(apr_pool_t *p, keyValuePair *vars)
             }
         }
 
+    for ( int i = 0; extra && extra[i].key; i++ )
+        {
+        if ( json_object_set_new(json, extra[i].key, json_string( extra[i].value )) )
+            fprintf(stderr, "json error 3 for %s: %s\n", extra[i].key, extra[i].value );
+        }
+
     size_t flags = JSON_SORT_KEYS;
     char *buf1 = json_dumps(json, flags);
 
@@ -336,7 +387,9 @@ keyValuePair * json2kv(apr_pool_t *p, const char *jsonbuf)
     json_object_foreach(json, key, value) 
         {
         ret[i].key      = xstrdup(p, key);
-        ret[i].value    = xstrdup(p, json_string_value(value));
+        /* numbers as text, eg max-age of an answer */
+        ret[i].value    = ( json_is_integer(value) ? apr_psprintf(p, "%" JSON_INTEGER_FORMAT, json_integer_value(value))
+                            : xstrdup(p, json_string_value(value)) );
         DPRINTF ( "--> json2kv %d %s %s\n", i, ret[i].key, ret[i].value );
         i++;
         if ( i>MQTT_MAX_VARS )
@@ -24,7 +24,9 @@ const char *keyValue(keyValuePair *kvp, const char *key);
 const char *keySubst(apr_pool_t *p, keyValuePair *kvp, const char *key, const char *tgt);
 const char * kvSubst (apr_pool_t *p, keyValuePair *kvp, const char *tgt );
 char * xstrdup(apr_pool_t *p, const char *src);
+const char * kvPattern (apr_pool_t *p, const char *tgt );
 const char * kv2json(apr_pool_t *p, keyValuePair *vars);
+const char * kv2json_extra(apr_pool_t *p, keyValuePair *vars, keyValuePair *extra);
 keyValuePair * json2kv(apr_pool_t *p, const char *json);
 
 #endif
@@ -6,8 +6,13 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <regex.h>
+#include <unistd.h>
 
+#include "apr_lib.h"
+#include "apr_strings.h"
+#include "mpm_common.h"
 #include "mod_mqtt.h"
 #include "mqtt_common.h"
 
@@ -22,7 +27,7 @@ module AP_MODULE_DECLARE_DATA mqtt_module =
     STANDARD20_MODULE_STUFF,
     create_dir_conf,    /* Per-directory configuration handler */
     merge_dir_conf,     /* Merge handler for per-directory configurations */
-    NULL,               /* Per-server configuration handler */
+    create_server_conf, /* Per-server configuration handler */
     NULL,               /* Merge handler for per-server configurations */
     mqtt_directives,    /* Any directives we may have for httpd */
     mqtt_register_hooks /* Our hook registering function */
@@ -39,6 +44,24 @@ int    DumpCfg(mqtt_config * config)
     DPRINTF ( "-->enb %d\n", config -> enabled );
     DPRINTF ( "MQTTServer: %s\n", ( config->mqtt_server ? config->mqtt_server : "(NULL)") );
     DPRINTF ( "MQTTPort: %d\n", config->mqtt_port );
+    DPRINTF ( "MQTTProtocol: %d\n", config->mqtt_protocol );
+    DPRINTF ( "MQTTQoS: %d\n", config->mqtt_qos );
+    DPRINTF ( "MQTTRetain: %d\n", config->mqtt_retain );
+    DPRINTF ( "MQTTMaxInflight: %d\n", config->mqtt_max_inflight );
+    DPRINTF ( "MQTTTimeout: %d\n", config->mqtt_timeout );
+    DPRINTF ( "MQTTAsync: %d\n", config->mqtt_async );
+    DPRINTF ( "MQTTHedge: %d\n", ( config->mqtt_hedge ? config->mqtt_hedge->percentile : 0 ) );
+    DPRINTF ( "MQTTConcurrency: %s\n", ( config->mqtt_limit ? "on" : "off" ) );
+    DPRINTF ( "MQTTCoalesce: %d\n", config->mqtt_coalesce );
+    DPRINTF ( "MQTTResponseCount: %d\n", config->mqtt_response_count );
+    DPRINTF ( "MQTTResponseWindow: %d\n", config->mqtt_response_window );
+    DPRINTF ( "MQTTCache: %d %s\n", config->mqtt_cache, ( config->mqtt_cache_topic ? config->mqtt_cache_topic : "(NULL)") );
+    DPRINTF ( "MQTTCacheStale: %d\n", config->mqtt_cache_stale );
+    DPRINTF ( "MQTTResponseCache: %s\n", ( config->mqtt_rcache ? "on" : "off" ) );
+    DPRINTF ( "MQTTMaxAge: %d\n", config->mqtt_max_age );
+    DPRINTF ( "MQTTMode: %d\n", config->mode );
+    DPRINTF ( "MQTTUsername: %s\n", ( config->mqtt_username ? config->mqtt_username : "(NULL)") );
+    DPRINTF ( "MQTTTLS: %s\n", ( config->mqtt_tls ? config->mqtt_tls->key : "(NULL)") );
     DPRINTF ( "MQTT PubTopic: %s\n", (config->mqtt_pubtopic ? config->mqtt_pubtopic : "(NULL)") );
     DPRINTF ( "MQTT SubTopic: %s\n", (config->mqtt_subtopic ? config->mqtt_subtopic : "(NULL)") );
     DPRINTF ( "vars: %ld\n",(long int) config ->mqtt_var_table );
@@ -63,9 +86,243 @@ void mqtt_register_hooks ( apr_pool_t *pool )
     mqtt_set_pool ( pool );
 
     DPRINTF ( "--> HOOKS\n" );
+    ap_hook_post_config ( mqtt_post_config, NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_child_init ( mqtt_child_init, NULL, NULL, APR_HOOK_MIDDLE );
     ap_hook_handler ( mqtt_handler, NULL, NULL, APR_HOOK_LAST );
     }
 
+/** resolve the brokers of a config and have the first reactors connect to them
+  * \param pool child pool
+  * \param config merged config of a location
+  * \param warm reactors to connect
+  * \param seen connection keys already warmed
+  * \param keys connection keys of all brokers, for the spool
+  * \param waiters connects to wait for
+  */
+static void warm_config ( apr_pool_t *pool, mqtt_config *config, int warm,
+                          apr_hash_t *seen, apr_hash_t *keys, apr_array_header_t *waiters )
+    {
+    struct mqtt_broker broker = { config->mqtt_server, config->mqtt_port,
+                                  config->mqtt_username, config->mqtt_password,
+                                  config->mqtt_protocol,
+                                  ( config->mqtt_tls && config->mqtt_tls->enabled ? config->mqtt_tls : NULL ),
+                                  config->mqtt_max_inflight, config->mqtt_qos, config->mqtt_retain };
+    int count = ( config->mqtt_ring ? config->mqtt_ring->count : 1 );
+    int n, i;
+
+    /* sections without a topic are not ours */
+    if ( !config->mqtt_pubtopic )
+        return;
+
+    for ( n = 0; n < count; n++ )
+        {
+        if ( config->mqtt_ring )
+            {
+            broker.host = config->mqtt_ring->nodes[n].host;
+            broker.port = ( config->mqtt_ring->nodes[n].port > 0 ? config->mqtt_ring->nodes[n].port
+                            : config->mqtt_port );
+            }
+        mqtt_dns_add ( broker.host );
+
+        if ( mqtt_spool_enabled() )
+            {
+            struct mqtt_job *job = mqtt_job_create ( JOB_CONNECT, &broker, "", NULL, 0, NULL );
+
+            if ( job )
+                {
+                const char *key = apr_pstrdup ( pool, job->key );
+                apr_hash_set ( keys, key, APR_HASH_KEY_STRING, key );
+                free ( job );
+                }
+            }
+
+        for ( i = 0; i < warm && i < mqtt_reactor_count(); i++ )
+            {
+            struct mqtt_job *job = mqtt_job_create ( JOB_CONNECT, &broker, "", NULL, 0, NULL );
+            struct mqtt_waiter *waiter;
+            const char *key;
+
+            if ( !job )
+                return;
+            key = apr_psprintf ( pool, "%d:%s", i, job->key );
+            if ( apr_hash_get ( seen, key, APR_HASH_KEY_STRING ) || ! ( waiter = mqtt_waiter_get() ) )
+                {
+                free ( job );
+                continue;
+                }
+            apr_hash_set ( seen, key, APR_HASH_KEY_STRING, key );
+            job->waiter = waiter;
+            *( struct mqtt_waiter ** ) apr_array_push ( waiters ) = waiter;
+            mqtt_reactor_submit_to ( i, job );
+            }
+        }
+    }
+
+/** resolve all configured brokers and connect to them before the child
+  * takes requests: every <Location> and <Directory> of every virtual host.
+  * The spool learns which brokers are configured.
+  * \param pool child pool
+  * \param s first server record
+  * \param warm reactors to connect to each broker
+  */
+static void warm_brokers ( apr_pool_t *pool, server_rec *s, int warm )
+    {
+    apr_hash_t *seen = apr_hash_make ( pool );
+    apr_hash_t *keys = apr_hash_make ( pool );
+    apr_array_header_t *waiters = apr_array_make ( pool, 8, sizeof ( struct mqtt_waiter * ) );
+    apr_time_t deadline = mqtt_clock() + apr_time_from_sec ( MQTT_WARM_WAIT );
+    int i, j, up = 0;
+
+    for ( ; s; s = s->next )
+        {
+        core_server_config *core = ap_get_core_module_config ( s->module_config );
+        mqtt_config *base = ap_get_module_config ( s->lookup_defaults, &mqtt_module );
+        apr_array_header_t *secs[2] = { core->sec_dir, core->sec_url };
+
+        warm_config ( pool, base, warm, seen, keys, waiters );
+        for ( j = 0; j < 2; j++ )
+            {
+            for ( i = 0; secs[j] && i < secs[j]->nelts; i++ )
+                {
+                mqtt_config *config = ap_get_module_config ( ( ( ap_conf_vector_t ** ) secs[j]->elts )[i],
+                                                             &mqtt_module );
+                if ( config )
+                    warm_config ( pool, merge_dir_conf ( pool, base, config ), warm, seen, keys, waiters );
+                }
+            }
+        }
+    mqtt_spool_keys ( keys );
+
+    for ( i = 0; i < waiters->nelts; i++ )
+        {
+        struct mqtt_waiter *waiter = ( ( struct mqtt_waiter ** ) waiters->elts )[i];
+
+        if ( mqtt_waiter_wait ( waiter, deadline ) == MOSQ_ERR_SUCCESS )
+            up++;
+        mqtt_waiter_release ( waiter );
+        }
+
+    DPRINTF ( "warm connections: %d of %d up\n", up, waiters->nelts );
+    }
+
+/** the cache subscriber gives up root like the children: User and Group
+  * \param pool configuration pool
+  * \param data first server record
+  * \return OK or error
+  */
+static int cache_drop_privileges ( apr_pool_t *pool, void *data )
+    {
+    return ap_run_drop_privileges ( pool, ( server_rec * ) data );
+    }
+
+/** before the children are forked: the shared memory of the last-value
+  * cache and the process subscribing to its topics
+  * \param pconf configuration pool, cleared on restart
+  * \param plog log pool
+  * \param ptemp temporary pool
+  * \param s first server record
+  * \return OK
+  */
+int mqtt_post_config ( apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s )
+    {
+    mqtt_server_config *sconf = ( mqtt_server_config * )
+                                ap_get_module_config ( s->module_config, &mqtt_module );
+    mqtt_config *base = ap_get_module_config ( s->lookup_defaults, &mqtt_module );
+    struct mqtt_broker broker = { base->mqtt_server, base->mqtt_port,
+                                  base->mqtt_username, base->mqtt_password,
+                                  base->mqtt_protocol,
+                                  ( base->mqtt_tls && base->mqtt_tls->enabled ? base->mqtt_tls : NULL ),
+                                  base->mqtt_max_inflight, 0, 0 };
+
+    /* the first pass only checks the configuration */
+    if ( ap_state_query ( AP_SQ_MAIN_STATE ) == AP_SQ_MS_CREATE_PRE_CONFIG || !sconf->cache_filters )
+        return OK;
+
+    /* the first broker of the list, as parsed: MQTTServer may be host:port */
+    if ( base->mqtt_ring )
+        {
+        broker.host = base->mqtt_ring->nodes[0].host;
+        broker.port = ( base->mqtt_ring->nodes[0].port > 0 ? base->mqtt_ring->nodes[0].port : base->mqtt_port );
+        }
+
+    DPRINTF ( "--> post config, cache of %d topics\n", sconf->cache_slots );
+
+    if ( mqtt_cache_create ( pconf, sconf->cache_slots, sconf->cache_value ) != MOSQ_ERR_SUCCESS
+         || mqtt_cache_start ( pconf, &broker, sconf->cache_filters, cache_drop_privileges, s ) != MOSQ_ERR_SUCCESS )
+        LPRINTF ( "mod_mqtt: no last-value cache\n" );
+
+    return OK;
+    }
+
+/** per process init: start the reactor threads owning the broker connections
+  * \param pool - child pool, lives as long as the process
+  * \param s - server record
+  */
+void mqtt_child_init ( apr_pool_t *pool, server_rec *s )
+    {
+    mqtt_server_config *sconf = ( mqtt_server_config * )
+                                ap_get_module_config ( s->module_config, &mqtt_module );
+
+    DPRINTF ( "--> child init, %d reactors\n", sconf->reactors );
+
+    mqtt_breaker_init ( sconf->breaker_failures, sconf->breaker_max );
+    mqtt_conn_init ( sconf->tcp_nodelay, sconf->sndbuf, sconf->rcvbuf, sconf->keepalive );
+    mqtt_sse_init ( sconf->stream_clients );
+
+    if ( mqtt_spool_init ( pool, sconf->spool_dir, sconf->spool_size,
+                           sconf->spool_sync, sconf->spool_rate ) != MOSQ_ERR_SUCCESS )
+        LPRINTF ( "mod_mqtt: no spool, failed publishes are lost\n" );
+
+    /* before the reactors, which look addresses up until they are stopped */
+    if ( mqtt_dns_init ( pool, sconf->dns_ttl ) != MOSQ_ERR_SUCCESS )
+        LPRINTF ( "mod_mqtt: no broker address cache\n" );
+
+    if ( mqtt_limit_init ( pool ) != MOSQ_ERR_SUCCESS )
+        LPRINTF ( "mod_mqtt: no concurrency limits\n" );
+
+    if ( mqtt_rcache_init ( pool ) != MOSQ_ERR_SUCCESS )
+        LPRINTF ( "mod_mqtt: no response caches\n" );
+
+    /* without reactors requests fail with 503, there is nothing to warm */
+    if ( mqtt_outbound_init ( pool, sconf->queue_size, sconf->queue_overflow,
+                              sconf->batch_size, sconf->batch_delay ) != MOSQ_ERR_SUCCESS
+         || mqtt_reactor_init ( pool, sconf->reactors ) != MOSQ_ERR_SUCCESS )
+        {
+        LPRINTF ( "mod_mqtt: cannot start reactor threads\n" );
+        return;
+        }
+
+    warm_brokers ( pool, s, sconf->warm );
+    }
+
+/** create the per server config
+  * \param pool - memory pool to use
+  * \param s - server record
+  * \return config with defaults
+  */
+void *create_server_conf ( apr_pool_t *pool, server_rec *s )
+    {
+    mqtt_server_config *sconf = apr_pcalloc ( pool, sizeof ( mqtt_server_config ) );
+
+    sconf->reactors = 1;
+    sconf->queue_size = MQTT_OUTBOUND_SIZE;
+    sconf->queue_overflow = MQTT_OVERFLOW_REJECT;
+    sconf->batch_size = MQTT_BATCH_SIZE;
+    sconf->batch_delay = MQTT_BATCH_DELAY;
+    sconf->breaker_failures = MQTT_BREAKER_FAILURES;
+    sconf->breaker_max = MQTT_BREAKER_MAX;
+    sconf->tcp_nodelay = 1;
+    sconf->keepalive = MQTT_KEEPALIVE;
+    sconf->spool_size = MQTT_SPOOL_SIZE;
+    sconf->spool_sync = MQTT_SPOOL_SYNC_SECOND;
+    sconf->spool_rate = MQTT_SPOOL_RATE;
+    sconf->dns_ttl = MQTT_DNS_TTL;
+    sconf->cache_slots = MQTT_CACHE_SLOTS;
+    sconf->cache_value = MQTT_CACHE_VALUE;
+
+    return sconf;
+    }
+
 /** create a config object for a directory
   * \param pool - memory pool to use
   * \param context - location for this conf
@@ -85,9 +342,30 @@ void *create_dir_conf ( apr_pool_t *pool, char *context )
         strcpy ( cfg->context, context );
         cfg->enabled = -1;
         cfg->mqtt_server = NULL;
+        cfg->mqtt_ring = NULL;
         cfg->mqtt_pubtopic = NULL;
         cfg->mqtt_subtopic = NULL;
         cfg->mqtt_port = -1;
+        cfg->mqtt_username = NULL;
+        cfg->mqtt_password = NULL;
+        cfg->mqtt_tls = NULL;
+        cfg->mqtt_protocol = 0;
+        cfg->mqtt_qos = -1;
+        cfg->mqtt_retain = -1;
+        cfg->mqtt_max_inflight = -1;
+        cfg->mqtt_timeout = -1;
+        cfg->mqtt_async = -1;
+        cfg->mqtt_hedge = NULL;
+        cfg->mqtt_limit = NULL;
+        cfg->mqtt_coalesce = -1;
+        cfg->mqtt_response_count = -1;
+        cfg->mqtt_response_window = -1;
+        cfg->mqtt_cache = -1;
+        cfg->mqtt_cache_topic = NULL;
+        cfg->mqtt_cache_stale = -1;
+        cfg->mqtt_rcache = NULL;
+        cfg->mqtt_max_age = -1;
+        cfg->mode = INVALIDMode;
         cfg->mqtt_var_table = NULL;   /* apr_table_copy (pool, const apr_table_t *t); */
         cfg->mqtt_var_re_table = NULL; /* apr_table_copy (apr_pool_t *p, const apr_table_t *t) ; */
         cfg->methods = INVALIDMethod;
@@ -119,6 +397,27 @@ void *merge_dir_conf ( apr_pool_t *pool, void *BASE, void *ADD )
     conf->encodings = ( add->encodings == INVALIDEncoding ) ? base->encodings : add->encodings;
 
     conf->mqtt_server =  (add->mqtt_server ? add->mqtt_server : base->mqtt_server) ;
+    conf->mqtt_ring =  (add->mqtt_ring ? add->mqtt_ring : base->mqtt_ring) ;
+    conf->mqtt_protocol = ( add->mqtt_protocol ? add->mqtt_protocol : base->mqtt_protocol );
+    conf->mqtt_qos = ( add->mqtt_qos < 0 ) ? base->mqtt_qos : add->mqtt_qos;
+    conf->mqtt_retain = ( add->mqtt_retain < 0 ) ? base->mqtt_retain : add->mqtt_retain;
+    conf->mqtt_max_inflight = ( add->mqtt_max_inflight < 0 ) ? base->mqtt_max_inflight : add->mqtt_max_inflight;
+    conf->mqtt_timeout = ( add->mqtt_timeout < 0 ) ? base->mqtt_timeout : add->mqtt_timeout;
+    conf->mqtt_async = ( add->mqtt_async < 0 ) ? base->mqtt_async : add->mqtt_async;
+    conf->mqtt_hedge =  (add->mqtt_hedge ? add->mqtt_hedge : base->mqtt_hedge) ;
+    conf->mqtt_limit =  (add->mqtt_limit ? add->mqtt_limit : base->mqtt_limit) ;
+    conf->mqtt_coalesce = ( add->mqtt_coalesce < 0 ) ? base->mqtt_coalesce : add->mqtt_coalesce;
+    conf->mqtt_response_count = ( add->mqtt_response_count < 0 ) ? base->mqtt_response_count : add->mqtt_response_count;
+    conf->mqtt_response_window = ( add->mqtt_response_window < 0 ) ? base->mqtt_response_window : add->mqtt_response_window;
+    conf->mqtt_cache = ( add->mqtt_cache < 0 ) ? base->mqtt_cache : add->mqtt_cache;
+    conf->mqtt_cache_topic =  (add->mqtt_cache_topic ? add->mqtt_cache_topic : base->mqtt_cache_topic) ;
+    conf->mqtt_cache_stale = ( add->mqtt_cache_stale < 0 ) ? base->mqtt_cache_stale : add->mqtt_cache_stale;
+    conf->mqtt_rcache =  (add->mqtt_rcache ? add->mqtt_rcache : base->mqtt_rcache) ;
+    conf->mqtt_max_age = ( add->mqtt_max_age < 0 ) ? base->mqtt_max_age : add->mqtt_max_age;
+    conf->mode = ( add->mode == INVALIDMode ) ? base->mode : add->mode;
+    conf->mqtt_username =  (add->mqtt_username ? add->mqtt_username : base->mqtt_username) ;
+    conf->mqtt_password =  (add->mqtt_password ? add->mqtt_password : base->mqtt_password) ;
+    conf->mqtt_tls =  (add->mqtt_tls ? add->mqtt_tls : base->mqtt_tls) ;
    
     conf->mqtt_subtopic =  (add->mqtt_subtopic ? add->mqtt_subtopic : base->mqtt_subtopic) ;
     conf->mqtt_pubtopic =  (add->mqtt_pubtopic ? add->mqtt_pubtopic : base->mqtt_subtopic) ;
@@ -140,6 +439,130 @@ void *merge_dir_conf ( apr_pool_t *pool, void *BASE, void *ADD )
       ==============================================================================
 */
 
+/** prepare the hedge of a query if the location hedges and its answers
+  * are usually in before the deadline
+  * \param r request
+  * \param config per dir config
+  * \param broker where the query goes
+  * \param formData request variables
+  * \param pubtopic topic of the query
+  * \param subtopic response topic filter
+  * \param msg query
+  * \param msglen query size
+  * \param response MQTT v5: topic the answer is expected on, or NULL
+  * \param correlation MQTT v5: correlation data, or NULL
+  * \param deadline mqtt_clock() time the request gives up
+  * \param at set to the mqtt_clock() time to send the hedge
+  * \return job for mqtt_sub_hedge or mqtt_async_suspend, or NULL
+  */
+static struct mqtt_job *hedge_job ( request_rec *r, mqtt_config *config, const struct mqtt_broker *broker,
+                                    keyValuePair *formData, const char *pubtopic, const char *subtopic,
+                                    const char *msg, int msglen, const char *response, const char *correlation,
+                                    apr_time_t deadline, apr_time_t *at )
+    {
+    struct mqtt_hedge *hedge = config->mqtt_hedge;
+    apr_interval_time_t delay = mqtt_hedge_delay ( hedge );
+    struct mqtt_broker target = *broker;
+
+    *at = mqtt_clock() + delay;
+    if ( !delay || *at >= deadline )
+        return NULL;
+
+    /* another broker: its answers need the response subscription too */
+    if ( hedge->host )
+        {
+        target.host = hedge->host;
+        target.port = ( hedge->port > 0 ? hedge->port : config->mqtt_port );
+        if ( mqtt_breaker_open ( target.host, target.port )
+             || mqtt_sub_filter ( &target, subtopic ) != MOSQ_ERR_SUCCESS )
+            return NULL;
+        }
+
+    return mqtt_pub_job ( r->pool, &target, ( hedge->topic ? kvSubst ( r->pool, formData, hedge->topic ) : pubtopic ),
+                          msg, msglen, response, correlation, deadline );
+    }
+
+/** the deadline of a request: the budget counts from the start of the
+  * request, waiting uses the monotonic clock. Tells the client with
+  * X-MQTT-Deadline.
+  * \param r request
+  * \param config per dir config
+  * \param expires_ms set to the deadline in ms since the epoch, for responders
+  * \return mqtt_clock() time the request gives up
+  */
+apr_time_t mqtt_deadline ( request_rec *r, mqtt_config *config, const char **expires_ms )
+    {
+    apr_interval_time_t timeout = apr_time_from_msec ( config->mqtt_timeout > 0 ? config->mqtt_timeout
+                                                       : MQTT_RESPONSE_TIMEOUT * 1000 );
+    apr_time_t expires = r->request_time + timeout;
+    apr_interval_time_t left = expires - apr_time_now();
+
+    *expires_ms = apr_psprintf ( r->pool, "%" APR_TIME_T_FMT, apr_time_as_msec ( expires ) );
+    apr_table_setn ( r->err_headers_out, "X-MQTT-Deadline", *expires_ms );
+
+    return mqtt_clock() + ( left > 0 ? left : 0 );
+    }
+
+/** the message of a query with a fresh correlation id: the variables
+  * with the deadline and, before v5, the correlation id; v5 carries the
+  * id and the response topic as properties instead
+  * \param r request
+  * \param config per dir config
+  * \param vars request variables
+  * \param expires_ms deadline for responders, from mqtt_deadline
+  * \param query set to the message
+  */
+void mqtt_query_build ( request_rec *r, mqtt_config *config, keyValuePair *vars, const char *expires_ms,
+                        struct mqtt_query *query )
+    {
+    int v5 = ( config->mqtt_protocol == MQTT_PROTOCOL_V5 );
+    keyValuePair extra[] = { { MQTT_DEADLINE_KEY, expires_ms },
+                             { MQTT_CORRELATION_KEY, NULL },
+                             { NULL, NULL } };
+
+    mqtt_mux_id ( query->correlation );
+    extra[1].value = query->correlation;
+    if ( v5 )
+        extra[1].key = NULL;
+    query->msg = kv2json_extra ( r->pool, vars, extra );
+    query->msglen = strlen ( query->msg );
+    query->response_topic = ( v5 ? kvSubst ( r->pool, vars, config->mqtt_subtopic ) : NULL );
+    query->v5_correlation = ( v5 ? query->correlation : NULL );
+    }
+
+/** the broker a topic goes to: the same one for a sensor while it is up
+  * \param config per dir config
+  * \param pubtopic topic of the query
+  * \param broker set to server, port and credentials, the topic's own
+  *        broker if all circuits are open
+  * \return 0 or seconds until the broker's circuit closes
+  */
+int mqtt_broker_pick ( mqtt_config *config, const char *pubtopic, struct mqtt_broker *broker )
+    {
+    struct mqtt_broker pick = { config->mqtt_server, config->mqtt_port,
+                                config->mqtt_username, config->mqtt_password,
+                                config->mqtt_protocol,
+                                ( config->mqtt_tls && config->mqtt_tls->enabled ? config->mqtt_tls : NULL ),
+                                config->mqtt_max_inflight, config->mqtt_qos, config->mqtt_retain };
+    int retry_after = 0;
+
+    if ( config->mqtt_ring )
+        {
+        const struct mqtt_ring_node *node = mqtt_ring_pick ( config->mqtt_ring, pubtopic, config->mqtt_port,
+                                                             &retry_after );
+        /* all down: the shard the topic belongs to, spooled publishes wait for it */
+        if ( !node )
+            node = mqtt_ring_home ( config->mqtt_ring, pubtopic );
+        pick.host = node->host;
+        pick.port = ( node->port > 0 ? node->port : config->mqtt_port );
+        }
+    else
+        mqtt_breaker_allow ( pick.host, pick.port, &retry_after );
+
+    *broker = pick;
+    return retry_after;
+    }
+
 /** handle mqtt requests
   * \param r request to service
   * \return status code
@@ -147,6 +570,9 @@ void *merge_dir_conf ( apr_pool_t *pool, void *BASE, void *ADD )
 int mqtt_handler ( request_rec *r )
     {
 
+    if ( r->handler && !strcmp ( r->handler, "mqtt-status" ) )
+        return mqtt_status ( r );
+
     if ( !r->handler || strcmp ( r->handler, "mqtt-handler" ) )
         return ( DECLINED );
 
@@ -158,6 +584,14 @@ int mqtt_handler ( request_rec *r )
 
     DumpCfg(config) ;
 
+    /* many variable sets, one answer each */
+    if ( config->mode == GATHERMode )
+        return mqtt_gather ( r, config );
+
+    /* many records, published back to back */
+    if ( config->mode == BATCHMode )
+        return mqtt_batch ( r, config );
+
     keyValuePair *urlData = NULL;
     DPRINTF ( "-->handler2 %s\n", config->context );
 
@@ -178,52 +612,290 @@ int mqtt_handler ( request_rec *r )
         return HTTP_BAD_REQUEST;
         }
 
+    /* server-sent events: no query, messages on the topic until the client leaves */
+    if ( config->mode == STREAMMode )
+        return mqtt_sse ( r, config, formData );
+
+    /* a recent enough last value from shared memory, else the live path */
+    if ( config->mqtt_cache == MQTT_CACHE_LASTVALUE && config->mode != PUBLISHMode )
+        {
+        int status = mqtt_lastvalue ( r, config, formData );
+        if ( status != DECLINED )
+            return status;
+        }
+
+    /* current value: the broker's retained message, nobody is asked */
+    if ( config->mode == RETAINEDMode )
+        return mqtt_retained ( r, config, formData );
+
     const char *pubtopic =  kvSubst ( r->pool, formData, config->mqtt_pubtopic ); 
-    const char *subtopic =  kvSubst ( r->pool, formData, config->mqtt_subtopic ); 
+    const char *expires_ms;
+    apr_time_t deadline = mqtt_deadline ( r, config, &expires_ms );
+    struct mqtt_broker broker;
+    int retry_after = mqtt_broker_pick ( config, pubtopic, &broker );
+
+    /* circuit open: fail fast instead of queueing for a broker that is down,
+       publishes go to the spool if there is one */
+    if ( retry_after && config->mode == PUBLISHMode && mqtt_spool_enabled() )
+        retry_after = 0;
+
+    /* a recent answer to the same query, a stale one while it is refreshed,
+       or while the broker is down */
+    if ( config->mqtt_rcache && config->mode != PUBLISHMode && !mqtt_stream_enabled ( config ) )
+        {
+        int status = mqtt_rcache_lookup ( r, config, &broker, formData, pubtopic, expires_ms, deadline,
+                                          retry_after != 0 );
+        if ( status != DECLINED )
+            return status;
+        }
 
+    if ( retry_after )
+        {
+        apr_table_setn ( r->err_headers_out, "Retry-After", apr_itoa ( r->pool, retry_after ) );
+        return HTTP_SERVICE_UNAVAILABLE ;
+        }
+
+    if ( config->mode == PUBLISHMode )
         {
         const char * msg = kv2json(r->pool, formData) ;
-        int msglen = strlen(msg) ;
+        int mqtt_err = mqtt_post(r->pool, &broker, pubtopic, msg, strlen(msg), deadline);
+
+        DPRINTF ( "post %s: %d\n", pubtopic, mqtt_err );
+        if ( mqtt_err != MOSQ_ERR_SUCCESS && mqtt_err != MQTT_ERR_DROPPED )
+            return HTTP_SERVICE_UNAVAILABLE ;
+
+        r->status = HTTP_ACCEPTED ;
+        ap_set_content_type(r, "text/ascii");
+        return OK ;
+        }
+
+    const char *subtopic =  kvPattern ( r->pool, config->mqtt_subtopic ); 
+    int stream = mqtt_stream_enabled ( config );
+    struct mqtt_flight *flight = NULL;
+
+    /* the same query is on its way: share its answer instead of asking again */
+    if ( config->mqtt_coalesce > 0 && !stream )
+        {
+        struct mosq_config *follow = NULL;
+        const char *key = apr_psprintf ( r->pool, "%s:%d\n%s\n%s\n%s", ( broker.host ? broker.host : "" ),
+                                         broker.port, pubtopic, subtopic, kv2json ( r->pool, formData ) );
+
+        if ( mqtt_sub_follow ( r->pool, key, &follow, &flight ) )
+            {
+            char *response = NULL;
+            int responselen = 0;
+            int mqtt_err;
+
+            if ( mqtt_async_enabled(config) )
+                return mqtt_async_suspend(r, config, follow, subtopic, deadline, NULL, 0, 0);
+            mqtt_err = mqtt_sub_loop(r->pool, follow, deadline, &response, &responselen);
+            return mqtt_respond(r, config, mqtt_err, response, subtopic);
+            }
+        }
+
+    /* a slow route must not take all workers: queue briefly or fail fast */
+    if ( mqtt_limit_acquire ( config->mqtt_limit, deadline ) != MOSQ_ERR_SUCCESS )
+        {
+        if ( flight )
+            mqtt_mux_land ( flight, MQTT_ERR_QUEUE_FULL, NULL, 0 );
+        if ( mqtt_rcache_fallback ( r, config ) == OK )
+            return OK;
+        apr_table_setn ( r->err_headers_out, "Retry-After", "1" );
+        return HTTP_SERVICE_UNAVAILABLE ;
+        }
+
+        {
+        struct mqtt_query query;
+        mqtt_query_build(r, config, formData, expires_ms, &query);
+        const char * msg = query.msg ;
+        int msglen = query.msglen ;
         char *response = NULL;
         int responselen ;
         int mqtt_err ;
 
         struct mosq_config * cfg = NULL ;
-        struct mosquitto * mosq = NULL;
 
-	    mqtt_err = mqtt_sub_prepare(r->pool, config->mqtt_server, config->mqtt_port, subtopic, &cfg, &mosq);
+	    mqtt_err = mqtt_sub_prepare(r->pool, &broker, subtopic, query.correlation,
+	                                ( stream ? ( config->mqtt_response_count < 0 ? 1 : config->mqtt_response_count ) : 1 ),
+	                                &cfg);
+	    cfg->flight = flight;
 	    if ( mqtt_err != MOSQ_ERR_SUCCESS )
+		    {
+		    mqtt_sub_abort(cfg);
+		    mqtt_limit_release(config->mqtt_limit, -1, 0);
 		    return HTTP_SERVICE_UNAVAILABLE ;
+		    }
+
+        apr_time_t sent = mqtt_clock();
+        apr_time_t hedge_at = 0;
+        /* a hedge would have every responder answer twice */
+        struct mqtt_job *hedge = ( stream ? NULL
+                                   : hedge_job(r, config, &broker, formData, pubtopic, subtopic, msg, msglen,
+                                               query.response_topic, query.v5_correlation, deadline, &hedge_at) );
+
+        if ( mqtt_async_enabled(config) && !stream )
+            {
+            /* the answer resumes the request, no worker waits for it */
+            mqtt_err = mqtt_pub_submit(r->pool, &broker, pubtopic, msg, msglen,
+                                       query.response_topic, query.v5_correlation, deadline);
+            if (mqtt_err == 0 )
+                return mqtt_async_suspend(r, config, cfg, subtopic, deadline, hedge, hedge_at, sent);
+            free(hedge);
+            mqtt_sub_abort(cfg);
+            mqtt_limit_release(config->mqtt_limit, -1, 0);
+            return mqtt_respond(r, config, mqtt_err, NULL, subtopic);
+            }
 
-        mqtt_err = mqtt_pub(r->pool, config->mqtt_server, config->mqtt_port, pubtopic, msg, msglen);
+        mqtt_err = mqtt_pub(r->pool, &broker, pubtopic, msg, msglen,
+                            query.response_topic, query.v5_correlation, deadline);
         DPRINTF ( "pub done %d, get resp\n", mqtt_err );
+        if (mqtt_err == 0 && stream )
+            {
+            /* answers go out as they arrive, until enough came or the window closed */
+            apr_time_t until = ( config->mqtt_response_window > 0
+                                 ? sent + apr_time_from_msec(config->mqtt_response_window) : deadline );
+            return mqtt_stream(r, config, cfg, subtopic, ( until < deadline ? until : deadline ), sent);
+            }
         if (mqtt_err == 0 )
-            mqtt_err = mqtt_sub_loop(r->pool, cfg, mosq, &response, &responselen);
-
-        if (response)
             {
-            keyValuePair *responseData = json2kv(r->pool, response) ;
-            const char * cType = keyValue(responseData, "content-type");
-            if ( ! cType )
-                return HTTP_INTERNAL_SERVER_ERROR ;
-            ap_set_content_type(r, (cType ? cType : "text/html"));
-            const char * cData = keyValue(responseData, ".data");
-            if ( ! cData )
-                return HTTP_INTERNAL_SERVER_ERROR ;
-            ap_rwrite(cData, strlen(cData), r);
+            if ( hedge )
+                mqtt_sub_hedge(cfg, hedge_at, config->mqtt_hedge, hedge);
+            mqtt_err = mqtt_sub_loop(r->pool, cfg, deadline, &response, &responselen);
+            if (mqtt_err == 0 )
+                mqtt_hedge_record(config->mqtt_hedge, mqtt_clock() - sent);
             }
         else
             {
-            LPRINTF ( "No response for %s:%d/%s \n", config->mqtt_server, config->mqtt_port, subtopic );
-            ap_set_content_type(r, "text/ascii");
-            ap_rprintf(r, "No response, see log\n");
-		    return HTTP_SERVICE_UNAVAILABLE ;
+            free(hedge);
+            mqtt_sub_abort(cfg);
             }
+
+        mqtt_limit_release(config->mqtt_limit,
+                           ( mqtt_err == 0 || mqtt_err == MQTT_ERR_TIMEOUT ? mqtt_clock() - sent : -1 ),
+                           mqtt_err == 0);
+
+        return mqtt_respond(r, config, mqtt_err, response, subtopic);
         }
-        
-    return OK;
     } 
 
+/** the state of this child: SetHandler mqtt-status
+ * \param r the http request
+ * \return OK
+ */
+int mqtt_status(request_rec *r)
+    {
+    ap_set_content_type(r, "text/plain");
+    if ( r->header_only )
+        return OK;
+
+    ap_rprintf(r, "pid %d\n", (int) getpid());
+    ap_rputs(mqtt_limit_report(r->pool), r);
+    ap_rputs(mqtt_cache_report(r->pool), r);
+    ap_rputs(mqtt_rcache_report(r->pool), r);
+    return OK;
+    }
+
+/** a responder's max-age: all digits, clamped to MQTT_MAX_AGE_MAX
+ * \param max_age seconds as sent
+ * \return seconds or -1 if it is not a number
+ */
+static int responder_max_age(const char *max_age)
+    {
+    const char *p;
+    int age;
+
+    if ( !*max_age )
+        return -1;
+    for ( p = max_age; *p; p++ )
+        if ( !apr_isdigit(*p) )
+            return -1;
+
+    /* atoi would overflow on more digits */
+    if ( p - max_age > 9 )
+        return MQTT_MAX_AGE_MAX;
+    age = atoi(max_age);
+    return ( age > MQTT_MAX_AGE_MAX ? MQTT_MAX_AGE_MAX : age );
+    }
+
+/** send a body with its validators: ETag, the responder's or a hash of
+ *  the body, and Cache-Control if the responder or MQTTMaxAge gives a
+ *  max-age. A GET whose If-None-Match matches gets 304 without the body.
+ * \param r the http request
+ * \param config per dir config
+ * \param ctype content type
+ * \param data body
+ * \param len body size
+ * \param etag entity tag of the responder, NULL to hash the body
+ * \param max_age seconds from the responder, NULL for MQTTMaxAge
+ * \return OK or HTTP_NOT_MODIFIED
+ */
+int mqtt_send_body(request_rec *r, mqtt_config *config, const char *ctype, const char *data, apr_size_t len,
+                   const char *etag, const char *max_age)
+    {
+    int age = ( max_age ? responder_max_age(max_age) : -1 );
+    char *tag = apr_palloc(r->pool, MQTT_ETAG_LEN);
+    int status;
+
+    /* what does not fit in a header is ignored */
+    if ( age < 0 )
+        age = config->mqtt_max_age;
+    mqtt_etag(tag, etag, data, len);
+    apr_table_setn(r->headers_out, "ETag", tag);
+    if ( age >= 0 )
+        apr_table_setn(r->headers_out, "Cache-Control", apr_psprintf(r->pool, "max-age=%d", age));
+    ap_set_content_type(r, ctype);
+
+    /* If-None-Match on GET and HEAD, like static files */
+    if ( r->method_number == M_GET && ( status = ap_meets_conditions(r) ) != OK )
+        {
+        r->status = status;
+        return status;
+        }
+
+    if ( !r->header_only )
+        ap_rwrite(data, len, r);
+    return OK;
+    }
+
+/** send the answer of the responder to the http client
+ * \param r the http request
+ * \param config per dir config
+ * \param mqtt_err result of publish and wait
+ * \param response answer or NULL
+ * \param subtopic where we waited for it
+ * \return OK or http error status
+ */
+int mqtt_respond(request_rec *r, mqtt_config *config, int mqtt_err, const char *response, const char *subtopic)
+    {
+    if (response)
+        {
+        keyValuePair *responseData = json2kv(r->pool, response) ;
+        if ( ! responseData )
+            return HTTP_INTERNAL_SERVER_ERROR ;
+        const char * cType = keyValue(responseData, "content-type");
+        if ( ! cType )
+            return HTTP_INTERNAL_SERVER_ERROR ;
+        const char * cData = keyValue(responseData, ".data");
+        if ( ! cData )
+            return HTTP_INTERNAL_SERVER_ERROR ;
+        /* optional validators of the responder */
+        const char * eTag = keyValue(responseData, "etag");
+        const char * maxAge = keyValue(responseData, "max-age");
+        mqtt_rcache_keep(r, config, cType, eTag, maxAge, cData);
+        return mqtt_send_body(r, config, cType, cData, strlen(cData), eTag, maxAge);
+        }
+    else
+        {
+        /* stale-if-error: an older answer beats none */
+        if ( mqtt_rcache_fallback(r, config) == OK )
+            return OK;
+        LPRINTF ( "No response for %s/%s \n", config->mqtt_server, subtopic );
+        ap_set_content_type(r, "text/ascii");
+        ap_rprintf(r, "No response, see log\n");
+        return ( mqtt_err == MQTT_ERR_TIMEOUT ? HTTP_GATEWAY_TIME_OUT : HTTP_SERVICE_UNAVAILABLE ) ;
+        }
+    }
+
 /** assert variables meet constraints configured
  * \param variables in this requet
  * return 1 / OK or 0 / ERROR
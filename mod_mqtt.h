@@ -43,23 +43,180 @@ typedef enum _Encodings
     INVALIDEncoding = 128
 } Encodings;
 
+typedef enum _Modes
+{
+    REQUESTMode = 0,
+    PUBLISHMode = 1,
+    GATHERMode = 2,
+    STREAMMode = 3,
+    RETAINEDMode = 4,
+    BATCHMode = 5,
+    INVALIDMode = 128
+} Modes;
+
 /* Allow max 20 vars in MQTTVariables */
 #define MQTT_MAX_VARS 20
 
+/* MQTTMode gather: max. variable sets and body size of one request */
+#define MQTT_MAX_GATHER 256
+#define MQTT_GATHER_BODY ( 1024 * 1024 )
+
+/* MQTTMode batch: max. records and body size of one request */
+#define MQTT_MAX_BATCH 10000
+#define MQTT_BATCH_BODY ( 8 * 1024 * 1024 )
+
+/* max-age of responders is clamped to a year */
+#define MQTT_MAX_AGE_MAX 31536000
+
 typedef struct
 {
     char context[256];
     int enabled;                        /* Enable or disable our module */
-    const char *mqtt_server;            /* MQTT Server spec */
+    const char *mqtt_server;            /* MQTT Server spec, the first one of a list */
+    struct mqtt_ring *mqtt_ring;        /* all MQTT Servers, topics are hashed onto them */
     int mqtt_port;                      /* MQTT Server port */
+    const char *mqtt_username;          /* MQTT Server user name, NULL for anonymous */
+    const char *mqtt_password;          /* MQTT Server password */
+    struct mqtt_tls *mqtt_tls;          /* TLS settings, NULL for plain TCP, eg MQTTTLS on */
+    int mqtt_protocol;                  /* MQTT protocol version, eg MQTTProtocol 5 */
+    int mqtt_qos;                       /* QoS of publishes, eg MQTTQoS 1 */
+    int mqtt_retain;                    /* retain publishes, eg MQTTRetain on */
+    int mqtt_max_inflight;              /* unacknowledged QoS 1/2 publishes, eg MQTTMaxInflight 100 */
+    int mqtt_timeout;                   /* ms to wait for an answer, eg MQTTTimeout 250 */
+    int mqtt_async;                     /* suspend the request while waiting, eg MQTTAsync on */
+    struct mqtt_hedge *mqtt_hedge;      /* send late queries again, eg MQTTHedge 95 5 */
+    struct mqtt_limit *mqtt_limit;      /* requests waiting at once, eg MQTTConcurrency 100 50 */
+    int mqtt_coalesce;                  /* share the answer of identical queries, eg MQTTCoalesce on */
+    int mqtt_response_count;            /* answers to stream, 0 for all, eg MQTTResponseCount 10 */
+    int mqtt_response_window;           /* ms to collect answers, eg MQTTResponseWindow 500 */
+    int mqtt_cache;                     /* MQTT_CACHE_OFF or _LASTVALUE, eg MQTTCache lastvalue */
+    const char * mqtt_cache_topic;      /* topic looked up, NULL for MQTTSubTopic */
+    int mqtt_cache_stale;               /* ms a cached message is served, eg MQTTCacheStale 5000 */
+    struct mqtt_rcache *mqtt_rcache;    /* answers kept a while, eg MQTTResponseCache 1000 5000 60000 */
+    int mqtt_max_age;                   /* Cache-Control max-age of answers, eg MQTTMaxAge 60 */
     const char * mqtt_pubtopic;         /* MQTT Server publish topic for query */
     const char * mqtt_subtopic;         /* MQTT Server subscribe topic for answer */
     apr_table_t * mqtt_var_table;       /* MQTT variables send , eg "MQTTVariables   Id Name Action" */
     apr_table_t * mqtt_var_re_table;    /* MQTT variables check regexpressions, 'MQTTCheckVariable Action ^submit|receive$' */
     Methods methods;                    /* Methods serviced (GET POST ALL) eg MQTTMethods ALL */
     Encodings encodings;                /* Allowed enctypes for post: application/x-www-form-urlencoded, multipart/form-data, ALL */
+    Modes mode;                         /* wait for an answer, just publish, gather, stream, retained or batch, eg MQTTMode publish */
 } mqtt_config;
 
+/* per server (process wide) settings, used in child_init */
+typedef struct
+{
+    int reactors;                       /* MQTT I/O threads per child process */
+    int queue_size;                     /* fire-and-forget publishes queued per child */
+    int queue_overflow;                 /* MQTT_OVERFLOW_REJECT, _DROP or _WAIT */
+    int batch_size;                     /* publishes sent in one go */
+    int batch_delay;                    /* ms a publish waits for its batch */
+    int breaker_failures;               /* connect failures that open a broker's circuit */
+    int breaker_max;                    /* max. seconds a circuit stays open */
+    int tcp_nodelay;                    /* TCP_NODELAY on broker sockets */
+    int sndbuf;                         /* broker socket send buffer, 0 for the default */
+    int rcvbuf;                         /* broker socket receive buffer, 0 for the default */
+    int keepalive;                      /* MQTT and TCP keepalive seconds */
+    const char *spool_dir;              /* spool of failed publishes, NULL for none */
+    int spool_size;                     /* MB per spool file */
+    int spool_sync;                     /* MQTT_SPOOL_SYNC_NEVER, _SECOND or _ALWAYS */
+    int spool_rate;                     /* spooled publishes replayed per second */
+    int dns_ttl;                        /* seconds broker addresses are cached, 0 for no cache */
+    int warm;                           /* reactors connecting to each broker at child start */
+    int stream_clients;                 /* stream clients per child, 0 for half the worker threads */
+    apr_array_header_t *cache_filters;  /* topics of the last-value cache, NULL for none */
+    int cache_slots;                    /* topics the cache keeps */
+    int cache_value;                    /* max. bytes of a cached message */
+} mqtt_server_config;
+
+/* the message of a query, as mqtt_query_build renders it */
+struct mqtt_query
+{
+    char correlation[MQTT_CORRELATION_LEN]; /* key in the response multiplexer */
+    const char *msg;                    /* variables, deadline and, before v5, correlation id */
+    int msglen;
+    const char *response_topic;         /* v5: rendered MQTTSubTopic, else NULL */
+    const char *v5_correlation;         /* v5: correlation, else NULL */
+};
+
+/* Handler for the "MQTTHedge" directive */
+const char *mqtt_set_hedge(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2);
+
+/* Handler for the "MQTTHedgeTarget" directive */
+const char *mqtt_set_hedge_target(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2);
+
+/* Handler for the "MQTTConcurrency" directive */
+const char *mqtt_set_concurrency(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2);
+
+/* Handler for the "MQTTCoalesce" directive */
+const char *mqtt_set_coalesce(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTResponseCount" directive */
+const char *mqtt_set_response_count(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTResponseWindow" directive */
+const char *mqtt_set_response_window(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTCache" directive */
+const char *mqtt_set_cache(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2);
+
+/* Handler for the "MQTTCacheStale" directive */
+const char *mqtt_set_cache_stale(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTCacheSubscribe" directive */
+const char *mqtt_set_cache_subscribe(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTCacheSize" directive */
+const char *mqtt_set_cache_size(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2);
+
+/* Handler for the "MQTTResponseCache" directive */
+const char *mqtt_set_response_cache(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2, const char *arg3);
+
+/* Handler for the "MQTTMaxAge" directive */
+const char *mqtt_set_max_age(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTReactors" directive */
+const char *mqtt_set_reactors(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTQueueSize" directive */
+const char *mqtt_set_queue_size(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTQueueOverflow" directive */
+const char *mqtt_set_queue_overflow(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTBatch" directive */
+const char *mqtt_set_batch(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2);
+
+/* Handler for the "MQTTBreaker" directive */
+const char *mqtt_set_breaker(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2);
+
+/* Handler for the "MQTTTCPNoDelay" directive */
+const char *mqtt_set_tcp_nodelay(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTSocketBuffers" directive */
+const char *mqtt_set_socket_buffers(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2);
+
+/* Handler for the "MQTTKeepAlive" directive */
+const char *mqtt_set_keepalive(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTSpool" directive */
+const char *mqtt_set_spool(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2, const char *arg3);
+
+/* Handler for the "MQTTSpoolRate" directive */
+const char *mqtt_set_spool_rate(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTDNSCache" directive */
+const char *mqtt_set_dns_cache(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTWarmConnections" directive */
+const char *mqtt_set_warm_connections(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTStreamClients" directive */
+const char *mqtt_set_stream_clients(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTMode" directive */
+const char *mqtt_set_mode(cmd_parms *cmd, void *cfg, const char *arg);
+
 /* Handler for the "MQTTEnabled" directive */
 const char *mqtt_set_enabled(cmd_parms *cmd, void *cfg, const char *arg);
 
@@ -75,6 +232,42 @@ const char *mqtt_set_subtopic(cmd_parms *cmd, void *cfg, const char *arg);
 /* Handler for the "MQTTPort" directive */
 const char *mqtt_set_port(cmd_parms *cmd, void *cfg, const char *arg);
 
+/* Handler for the "MQTTUsername" directive */
+const char *mqtt_set_username(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTPassword" directive */
+const char *mqtt_set_password(cmd_parms *cmd, void *cfg, const char *arg);
+
+#ifdef WITH_TLS
+/* Handlers for the "MQTTTLS*" directives */
+const char *mqtt_set_tls(cmd_parms *cmd, void *cfg, const char *arg);
+const char *mqtt_set_tls_cafile(cmd_parms *cmd, void *cfg, const char *arg);
+const char *mqtt_set_tls_capath(cmd_parms *cmd, void *cfg, const char *arg);
+const char *mqtt_set_tls_certfile(cmd_parms *cmd, void *cfg, const char *arg);
+const char *mqtt_set_tls_keyfile(cmd_parms *cmd, void *cfg, const char *arg);
+const char *mqtt_set_tls_ciphers(cmd_parms *cmd, void *cfg, const char *arg);
+const char *mqtt_set_tls_version(cmd_parms *cmd, void *cfg, const char *arg);
+const char *mqtt_set_tls_insecure(cmd_parms *cmd, void *cfg, const char *arg);
+#endif
+
+/* Handler for the "MQTTProtocol" directive */
+const char *mqtt_set_protocol(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTQoS" directive */
+const char *mqtt_set_qos(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTRetain" directive */
+const char *mqtt_set_retain(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTMaxInflight" directive */
+const char *mqtt_set_max_inflight(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTTimeout" directive */
+const char *mqtt_set_timeout(cmd_parms *cmd, void *cfg, const char *arg);
+
+/* Handler for the "MQTTAsync" directive */
+const char *mqtt_set_async(cmd_parms *cmd, void *cfg, const char *arg);
+
 /* Handler for the "MQTTVariables" directive */
 const char *mqtt_set_variables(cmd_parms *cmd, void *cfg, const char *arg);
 
@@ -92,9 +285,42 @@ apr_pool_t *mqtt_get_pool();
 apr_pool_t *mqtt_set_pool(apr_pool_t *p);
 
 int mqtt_handler(request_rec *r);
+int mqtt_status(request_rec *r);
+int mqtt_respond(request_rec *r, mqtt_config *config, int mqtt_err, const char *response, const char *subtopic);
+int mqtt_send_body(request_rec *r, mqtt_config *config, const char *ctype, const char *data, apr_size_t len,
+                   const char *etag, const char *max_age);
+apr_time_t mqtt_deadline(request_rec *r, mqtt_config *config, const char **expires_ms);
+void mqtt_query_build(request_rec *r, mqtt_config *config, keyValuePair *vars, const char *expires_ms,
+                      struct mqtt_query *query);
+int mqtt_broker_pick(mqtt_config *config, const char *pubtopic, struct mqtt_broker *broker);
+int mqtt_gather(request_rec *r, mqtt_config *config);
+char *mqtt_read_body(request_rec *r, apr_size_t max, int *status);
+keyValuePair *mqtt_json_vars(apr_pool_t *pool, struct json_t *object);
+int mqtt_batch(request_rec *r, mqtt_config *config);
+int mqtt_stream_enabled(mqtt_config *config);
+void mqtt_sse_init(int max);
+int mqtt_sse(request_rec *r, mqtt_config *config, keyValuePair *formData);
+int mqtt_retained(request_rec *r, mqtt_config *config, keyValuePair *formData);
+int mqtt_respond_message(request_rec *r, mqtt_config *config, const char *message, int len, const char *topic);
+int mqtt_lastvalue(request_rec *r, mqtt_config *config, keyValuePair *formData);
+int mqtt_rcache_lookup(request_rec *r, mqtt_config *config, struct mqtt_broker *broker, keyValuePair *formData,
+                       const char *pubtopic, const char *expires_ms, apr_time_t deadline, int failed);
+int mqtt_rcache_fallback(request_rec *r, mqtt_config *config);
+void mqtt_rcache_keep(request_rec *r, mqtt_config *config, const char *ctype, const char *etag,
+                      const char *max_age, const char *data);
+int mqtt_stream(request_rec *r, mqtt_config *config, struct mosq_config *cfg, const char *subtopic,
+                apr_time_t until, apr_time_t sent);
+struct json_t *mqtt_answer_json(apr_pool_t *pool, const char *response);
+int mqtt_async_enabled(mqtt_config *config);
+int mqtt_async_suspend(request_rec *r, mqtt_config *config, struct mosq_config *cfg,
+                       const char *subtopic, apr_time_t deadline,
+                       struct mqtt_job *hedge, apr_time_t hedge_at, apr_time_t sent);
+int mqtt_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s);
+void mqtt_child_init(apr_pool_t *pool, server_rec *s);
 void mqtt_register_hooks(apr_pool_t *pool);
 void *create_dir_conf(apr_pool_t *pool, char *context);
 void *merge_dir_conf(apr_pool_t *pool, void *BASE, void *ADD);
+void *create_server_conf(apr_pool_t *pool, server_rec *s);
 
 /* */
 int assert_variables(mqtt_config *config, keyValuePair * formdata);
@@ -106,5 +332,6 @@ int assert_variables(mqtt_config *config, keyValuePair * formdata);
 */
 
 extern const command_rec mqtt_directives[];
+extern module AP_MODULE_DECLARE_DATA mqtt_module;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,187 @@
+/*
+ * mod_mqtt : map http requests to mqtt
+ *
+ * Klaus Ramstöck
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jansson.h>
+#include <mosquitto.h>
+#include "apr_strings.h"
+#include "mod_mqtt.h"
+#include "mqtt_common.h"
+#include "keyValuePair.h"
+
+/*
+    ==============================================================================
+    batch ingestion: many records in one request, published back to back
+    over the broker connections of the reactors
+    ==============================================================================
+*/
+
+/** check and render one record: MQTTVariables, MQTTCheckVariable and
+  * MQTTPubTopic as for a single publish
+  * \param r the http request
+  * \param config per dir config
+  * \param object record, NULL if it did not parse
+  * \param record set to the message, topic NULL if it is not sent
+  * \return http status of the record so far: HTTP_OK, HTTP_BAD_REQUEST
+  *         or HTTP_SERVICE_UNAVAILABLE
+  */
+static int batch_record ( request_rec *r, mqtt_config *config, json_t *object, struct mqtt_record *record )
+    {
+    keyValuePair *vars = ( object ? mqtt_json_vars ( r->pool, object ) : NULL );
+    const char *pubtopic;
+
+    record->topic = NULL;
+    if ( !vars || !assert_variables ( config, vars ) )
+        return HTTP_BAD_REQUEST;
+
+    pubtopic = kvSubst ( r->pool, vars, config->mqtt_pubtopic );
+    if ( !pubtopic || mosquitto_pub_topic_check ( pubtopic ) != MOSQ_ERR_SUCCESS )
+        return HTTP_BAD_REQUEST;
+    if ( mqtt_broker_pick ( config, pubtopic, &record->broker ) )
+        return HTTP_SERVICE_UNAVAILABLE;
+
+    record->topic = pubtopic;
+    record->msg = kv2json ( r->pool, vars );
+    record->msglen = strlen ( record->msg );
+    return HTTP_OK;
+    }
+
+/** add one record to the batch
+  * \param r the http request
+  * \param config per dir config
+  * \param object record, NULL if it did not parse
+  * \param records messages
+  * \param status http status per record
+  * \return 0 if the batch is full
+  */
+static int batch_add ( request_rec *r, mqtt_config *config, json_t *object,
+                       apr_array_header_t *records, apr_array_header_t *status )
+    {
+    struct mqtt_record *record;
+
+    if ( records->nelts >= MQTT_MAX_BATCH )
+        return 0;
+
+    record = ( struct mqtt_record * ) apr_array_push ( records );
+    *( int * ) apr_array_push ( status ) = batch_record ( r, config, object, record );
+    return 1;
+    }
+
+/** the records of a body: a JSON array of objects, or one object per line
+  * (NDJSON). A line that does not parse fails only its record.
+  * \param r the http request
+  * \param config per dir config
+  * \param body request body
+  * \param records set to the messages
+  * \param status set to the http status per record
+  * \return OK or HTTP_BAD_REQUEST
+  */
+static int batch_parse ( request_rec *r, mqtt_config *config, char *body,
+                         apr_array_header_t *records, apr_array_header_t *status )
+    {
+    char *line, *last;
+
+    body += strspn ( body, " \t\r\n" );
+    if ( *body == '[' )
+        {
+        json_t *json = json_loads ( body, 0, NULL );
+        json_t *object;
+        size_t n;
+        int rc = OK;
+
+        if ( !json || !json_is_array ( json ) || !json_array_size ( json ) )
+            rc = HTTP_BAD_REQUEST;
+        else
+            {
+            json_array_foreach ( json, n, object )
+                {
+                if ( !batch_add ( r, config, object, records, status ) )
+                    {
+                    rc = HTTP_BAD_REQUEST;
+                    break;
+                    }
+                }
+            }
+        json_decref ( json );
+        return rc;
+        }
+
+    for ( line = apr_strtok ( body, "\n", &last ); line; line = apr_strtok ( NULL, "\n", &last ) )
+        {
+        json_t *object;
+        int full;
+
+        if ( !line[strspn ( line, " \t\r" )] )
+            continue;
+        object = json_loads ( line, 0, NULL );
+        full = !batch_add ( r, config, object, records, status );
+        json_decref ( object );
+        if ( full )
+            return HTTP_BAD_REQUEST;
+        }
+    return ( records->nelts ? OK : HTTP_BAD_REQUEST );
+    }
+
+/** MQTTMode batch: publish every record of the body (a JSON array or
+  * NDJSON) to its rendered MQTTPubTopic, all handed to the reactors before
+  * waiting for any, and answer a JSON array with the status of each
+  * record, in order: 200 sent, 400 invalid, 503 broker unavailable, 504
+  * not sent by the deadline.
+  * \param r the http request
+  * \param config per dir config
+  * \return OK or http error status
+  */
+int mqtt_batch ( request_rec *r, mqtt_config *config )
+    {
+    apr_array_header_t *records = apr_array_make ( r->pool, 64, sizeof ( struct mqtt_record ) );
+    apr_array_header_t *status = apr_array_make ( r->pool, 64, sizeof ( int ) );
+    const char *expires_ms;
+    apr_time_t deadline;
+    json_t *results;
+    char *out;
+    int rc, i;
+    char *body = mqtt_read_body ( r, MQTT_BATCH_BODY, &rc );
+
+    if ( rc != OK )
+        return rc;
+    if ( !body || batch_parse ( r, config, body, records, status ) != OK )
+        {
+        LPRINTF ( "batch: body must be a JSON array or NDJSON of 1 to %d objects\n", MQTT_MAX_BATCH );
+        return HTTP_BAD_REQUEST;
+        }
+
+    deadline = mqtt_deadline ( r, config, &expires_ms );
+    DPRINTF ( "batch: %d records\n", records->nelts );
+    mqtt_pub_records ( r->pool, ( struct mqtt_record * ) records->elts, records->nelts, deadline );
+
+    results = json_array();
+    for ( i = 0; i < records->nelts; i++ )
+        {
+        struct mqtt_record *record = &( ( struct mqtt_record * ) records->elts )[i];
+        int code = ( ( int * ) status->elts )[i];
+        json_t *result = json_object();
+
+        if ( record->topic )
+            code = ( record->rc == MOSQ_ERR_SUCCESS ? HTTP_OK
+                     : record->rc == MQTT_ERR_TIMEOUT ? HTTP_GATEWAY_TIME_OUT : HTTP_SERVICE_UNAVAILABLE );
+        json_object_set_new ( result, "status", json_integer ( code ) );
+        json_array_append_new ( results, result );
+        }
+    out = json_dumps ( results, JSON_COMPACT );
+    json_decref ( results );
+
+    if ( !out )
+        return HTTP_INTERNAL_SERVER_ERROR;
+
+    ap_set_content_type ( r, "application/json" );
+    ap_rputs ( out, r );
+    free ( out );
+    return OK;
+    }
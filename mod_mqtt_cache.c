@@ -0,0 +1,192 @@
+/*
+ * mod_mqtt : map http requests to mqtt
+ *
+ * Klaus Ramstöck
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mosquitto.h>
+#include "apr_strings.h"
+#include "mod_mqtt.h"
+#include "mqtt_common.h"
+#include "keyValuePair.h"
+
+/*
+    ==============================================================================
+    last-value cache: state messages kept in shared memory by the cache
+    subscriber, served without a broker round trip
+    ==============================================================================
+*/
+
+/** MQTTCache lastvalue: answer with the newest message on the rendered
+  * cache topic if the subscriber has one recent enough
+  * \param r the http request
+  * \param config per dir config
+  * \param formData request variables, NULL for none
+  * \return OK, or DECLINED to take the live path
+  */
+int mqtt_lastvalue ( request_rec *r, mqtt_config *config, keyValuePair *formData )
+    {
+    keyValuePair none[] = { { NULL, NULL } };
+    const char *topic = kvSubst ( r->pool, ( formData ? formData : none ),
+                                  ( config->mqtt_cache_topic ? config->mqtt_cache_topic : config->mqtt_subtopic ) );
+    apr_interval_time_t max_stale = ( config->mqtt_cache_stale >= 0 ? apr_time_from_msec ( config->mqtt_cache_stale )
+                                      : apr_time_from_sec ( MQTT_CACHE_STALE ) );
+    apr_interval_time_t age = 0;
+    char *value = NULL;
+    int len = 0;
+
+    if ( !topic || strpbrk ( topic, "+#" ) )
+        return DECLINED;
+    if ( mqtt_cache_get ( r->pool, topic, max_stale, &value, &len, &age ) != MOSQ_ERR_SUCCESS )
+        {
+        DPRINTF ( "lastvalue %s: miss\n", topic );
+        return DECLINED;
+        }
+
+    DPRINTF ( "lastvalue %s: %d bytes, %" APR_TIME_T_FMT " us old\n", topic, len, age );
+    apr_table_setn ( r->headers_out, "Age", apr_psprintf ( r->pool, "%" APR_TIME_T_FMT, apr_time_sec ( age ) ) );
+    return mqtt_respond_message ( r, config, value, len, topic );
+    }
+
+/*
+    ==============================================================================
+    response cache: answers to identical queries kept a while per location
+    and child, refreshed in the background, kept for when the live path fails
+    ==============================================================================
+*/
+
+/** send a cached answer
+  * \param r the http request
+  * \param config per dir config
+  * \param ctype content type
+  * \param etag quoted entity tag, kept as it was first sent
+  * \param max_age max-age of the responder, NULL for none
+  * \param data body
+  * \param len body size
+  * \param state MQTT_RCACHE_FRESH or MQTT_RCACHE_STALE
+  * \return OK or HTTP_NOT_MODIFIED
+  */
+static int rcache_send ( request_rec *r, mqtt_config *config, const char *ctype, const char *etag,
+                         const char *max_age, const char *data, int len, int state )
+    {
+    apr_table_setn ( r->headers_out, "X-MQTT-Cache", ( state == MQTT_RCACHE_FRESH ? "hit" : "stale" ) );
+    return mqtt_send_body ( r, config, ctype, data, len, etag, max_age );
+    }
+
+/** ask again for a stale answer without anybody waiting for it: the answer
+  * replaces the entry when it comes, none leaves it to the next request
+  * \param r the http request
+  * \param config per dir config
+  * \param broker where the query goes
+  * \param formData request variables
+  * \param pubtopic rendered MQTTPubTopic
+  * \param key cache key
+  * \param expires_ms deadline for the responder
+  * \param deadline mqtt_clock() time the query gives up
+  */
+static void rcache_revalidate ( request_rec *r, mqtt_config *config, struct mqtt_broker *broker,
+                                keyValuePair *formData, const char *pubtopic, const char *key,
+                                const char *expires_ms, apr_time_t deadline )
+    {
+    const char *subtopic = kvPattern ( r->pool, config->mqtt_subtopic );
+    struct mosq_config *cfg = NULL;
+    struct mqtt_query query;
+
+    mqtt_query_build ( r, config, formData, expires_ms, &query );
+    if ( mqtt_sub_prepare ( r->pool, broker, subtopic, query.correlation, 1, &cfg ) != MOSQ_ERR_SUCCESS
+         || mqtt_pub_submit ( r->pool, broker, pubtopic, query.msg, query.msglen,
+                              query.response_topic, query.v5_correlation, deadline ) != MOSQ_ERR_SUCCESS
+         || mqtt_rcache_refresh ( config->mqtt_rcache, key, cfg->waiter ) != MOSQ_ERR_SUCCESS )
+        {
+        LPRINTF ( "cache: no refresh of %s\n", pubtopic );
+        mqtt_sub_abort ( cfg );
+        return;
+        }
+    DPRINTF ( "cache %s: refreshing\n", pubtopic );
+    }
+
+/** MQTTResponseCache: answer a query from the cache of the location. A
+  * fresh answer is sent as is; a stale one within the stale-while-revalidate
+  * window too, the first request to see it sending the query again in the
+  * background. The key is kept for mqtt_rcache_keep and
+  * mqtt_rcache_fallback.
+  * \param r the http request
+  * \param config per dir config
+  * \param broker where a refresh goes
+  * \param formData request variables
+  * \param pubtopic rendered MQTTPubTopic
+  * \param expires_ms deadline for the responder
+  * \param deadline mqtt_clock() time a refresh gives up
+  * \param failed 1 if the live path is known to fail (broker's circuit open)
+  * \return OK, or DECLINED to take the live path
+  */
+int mqtt_rcache_lookup ( request_rec *r, mqtt_config *config, struct mqtt_broker *broker, keyValuePair *formData,
+                         const char *pubtopic, const char *expires_ms, apr_time_t deadline, int failed )
+    {
+    const char *key = apr_pstrcat ( r->pool, pubtopic, "\n", kv2json ( r->pool, formData ), NULL );
+    int timeout = ( config->mqtt_timeout > 0 ? config->mqtt_timeout : MQTT_RESPONSE_TIMEOUT * 1000 );
+    const char *ctype = NULL, *etag = NULL, *max_age = NULL;
+    const char *data = NULL;
+    int len = 0, revalidate = 0;
+    int state = mqtt_rcache_get ( config->mqtt_rcache, r->pool, key, failed, timeout,
+                                  &ctype, &etag, &max_age, &data, &len, &revalidate );
+
+    ap_set_module_config ( r->request_config, &mqtt_module, ( void * ) key );
+    DPRINTF ( "cache %s: %d%s\n", pubtopic, state, ( revalidate ? ", refresh" : "" ) );
+
+    if ( state == MQTT_RCACHE_MISS )
+        {
+        apr_table_setn ( r->headers_out, "X-MQTT-Cache", "miss" );
+        return DECLINED;
+        }
+    if ( revalidate )
+        rcache_revalidate ( r, config, broker, formData, pubtopic, key, expires_ms, deadline );
+    return rcache_send ( r, config, ctype, etag, max_age, data, len, state );
+    }
+
+/** MQTTResponseCache: the live path failed, send a stale answer if it is
+  * within the stale-if-error window
+  * \param r the http request
+  * \param config per dir config
+  * \return OK, or DECLINED to report the error
+  */
+int mqtt_rcache_fallback ( request_rec *r, mqtt_config *config )
+    {
+    const char *key = ( config->mqtt_rcache ? ap_get_module_config ( r->request_config, &mqtt_module ) : NULL );
+    const char *ctype = NULL, *etag = NULL, *max_age = NULL;
+    const char *data = NULL;
+    int len = 0, revalidate = 0;
+    int state;
+
+    if ( !key )
+        return DECLINED;
+    state = mqtt_rcache_get ( config->mqtt_rcache, r->pool, key, 1, 0,
+                              &ctype, &etag, &max_age, &data, &len, &revalidate );
+    if ( state == MQTT_RCACHE_MISS )
+        return DECLINED;
+
+    LPRINTF ( "cache: stale answer sent instead of an error\n" );
+    return rcache_send ( r, config, ctype, etag, max_age, data, len, state );
+    }
+
+/** MQTTResponseCache: keep the answer to a query that missed the cache
+  * \param r the http request
+  * \param config per dir config
+  * \param ctype content type of the answer
+  * \param etag entity tag of the responder, NULL for none
+  * \param max_age max-age of the responder, NULL for none
+  * \param data body
+  */
+void mqtt_rcache_keep ( request_rec *r, mqtt_config *config, const char *ctype, const char *etag,
+                        const char *max_age, const char *data )
+    {
+    const char *key = ( config->mqtt_rcache ? ap_get_module_config ( r->request_config, &mqtt_module ) : NULL );
+
+    if ( key )
+        mqtt_rcache_put ( config->mqtt_rcache, key, ctype, etag, max_age, data, strlen ( data ) );
+    }
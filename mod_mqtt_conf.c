@@ -5,8 +5,11 @@
  *
  */
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 
+#include "apr_lib.h"
 #include "mod_mqtt.h"
 #include "mqtt_common.h"
 #include "keyValuePair.h"
@@ -27,8 +30,95 @@ const command_rec mqtt_directives[] =
                   "MQTT Topic for response"),
     AP_INIT_TAKE1("MQTTPubTopic", mqtt_set_pubtopic, NULL, OR_ALL,
                   "MQTT Topic for query"),
-    AP_INIT_TAKE1("MQTTServer", mqtt_set_server, NULL, OR_ALL,
-                  "MQTT Server"),
+    AP_INIT_ITERATE("MQTTServer", mqtt_set_server, NULL, OR_ALL,
+                  "MQTT Server(s): host, host:port or unix:/path ..."),
+    AP_INIT_TAKE1("MQTTUsername", mqtt_set_username, NULL, OR_ALL,
+                  "MQTT Server user name"),
+    AP_INIT_TAKE1("MQTTPassword", mqtt_set_password, NULL, OR_ALL,
+                  "MQTT Server password"),
+#ifdef WITH_TLS
+    AP_INIT_TAKE1("MQTTTLS", mqtt_set_tls, NULL, OR_ALL,
+                  "Connect to the MQTT Server with TLS: on or off"),
+    AP_INIT_TAKE1("MQTTTLSCAFile", mqtt_set_tls_cafile, NULL, OR_ALL,
+                  "CA certificates to verify the MQTT Server, default the system ones"),
+    AP_INIT_TAKE1("MQTTTLSCAPath", mqtt_set_tls_capath, NULL, OR_ALL,
+                  "Directory of CA certificates to verify the MQTT Server"),
+    AP_INIT_TAKE1("MQTTTLSCertFile", mqtt_set_tls_certfile, NULL, OR_ALL,
+                  "Client certificate (chain) for the MQTT Server"),
+    AP_INIT_TAKE1("MQTTTLSKeyFile", mqtt_set_tls_keyfile, NULL, OR_ALL,
+                  "Client certificate key"),
+    AP_INIT_TAKE1("MQTTTLSCiphers", mqtt_set_tls_ciphers, NULL, OR_ALL,
+                  "OpenSSL cipher list"),
+    AP_INIT_TAKE1("MQTTTLSVersion", mqtt_set_tls_version, NULL, OR_ALL,
+                  "Min. TLS version: tlsv1, tlsv1.1, tlsv1.2 or tlsv1.3"),
+    AP_INIT_TAKE1("MQTTTLSInsecure", mqtt_set_tls_insecure, NULL, OR_ALL,
+                  "Do not check the MQTT Server host name: on or off"),
+#endif
+    AP_INIT_TAKE1("MQTTProtocol", mqtt_set_protocol, NULL, OR_ALL,
+                  "MQTT protocol version: 3.1, 3.1.1 or 5"),
+    AP_INIT_TAKE1("MQTTQoS", mqtt_set_qos, NULL, OR_ALL,
+                  "QoS of publishes: 0, 1 or 2"),
+    AP_INIT_TAKE1("MQTTRetain", mqtt_set_retain, NULL, OR_ALL,
+                  "Have the broker retain publishes: on or off"),
+    AP_INIT_TAKE1("MQTTMaxInflight", mqtt_set_max_inflight, NULL, OR_ALL,
+                  "QoS 1/2 publishes sent ahead of their acknowledgement"),
+    AP_INIT_TAKE1("MQTTTimeout", mqtt_set_timeout, NULL, OR_ALL,
+                  "Milliseconds to wait for an answer"),
+    AP_INIT_TAKE1("MQTTAsync", mqtt_set_async, NULL, OR_ALL,
+                  "Free the worker while waiting for an answer (event MPM)"),
+    AP_INIT_TAKE12("MQTTHedge", mqtt_set_hedge, NULL, OR_ALL,
+                  "Send a query again once its answer is later than this percentile, max. percent of extra queries"),
+    AP_INIT_TAKE12("MQTTHedgeTarget", mqtt_set_hedge_target, NULL, OR_ALL,
+                  "Topic (- for the same) and optional broker a hedged query goes to"),
+    AP_INIT_TAKE12("MQTTConcurrency", mqtt_set_concurrency, NULL, OR_ALL,
+                  "Max. requests waiting for answers at once, max. ms to queue for a slot"),
+    AP_INIT_TAKE1("MQTTCoalesce", mqtt_set_coalesce, NULL, OR_ALL,
+                  "Identical queries in flight share one answer: on or off"),
+    AP_INIT_TAKE1("MQTTResponseCount", mqtt_set_response_count, NULL, OR_ALL,
+                  "Answers to collect per query, all for any number"),
+    AP_INIT_TAKE1("MQTTResponseWindow", mqtt_set_response_window, NULL, OR_ALL,
+                  "Milliseconds after the query to collect answers"),
+    AP_INIT_TAKE12("MQTTCache", mqtt_set_cache, NULL, OR_ALL,
+                  "lastvalue: answer from the shared last-value cache, with the topic to look up; off"),
+    AP_INIT_TAKE1("MQTTCacheStale", mqtt_set_cache_stale, NULL, OR_ALL,
+                  "Milliseconds a cached message is served, 0 for any age"),
+    AP_INIT_ITERATE("MQTTCacheSubscribe", mqtt_set_cache_subscribe, NULL, RSRC_CONF,
+                  "Topic filters the last-value cache subscriber keeps the newest message of"),
+    AP_INIT_TAKE12("MQTTCacheSize", mqtt_set_cache_size, NULL, RSRC_CONF,
+                  "Topics the last-value cache keeps and max. bytes per message"),
+    AP_INIT_TAKE123("MQTTResponseCache", mqtt_set_response_cache, NULL, OR_ALL,
+                  "Milliseconds answers are fresh, served stale while refreshing, served stale on errors"),
+    AP_INIT_TAKE1("MQTTMaxAge", mqtt_set_max_age, NULL, OR_ALL,
+                  "Seconds clients and proxies may reuse an answer (Cache-Control max-age)"),
+    AP_INIT_TAKE1("MQTTReactors", mqtt_set_reactors, NULL, RSRC_CONF,
+                  "MQTT I/O threads per child process"),
+    AP_INIT_TAKE1("MQTTQueueSize", mqtt_set_queue_size, NULL, RSRC_CONF,
+                  "Fire-and-forget publishes queued per child process"),
+    AP_INIT_TAKE1("MQTTQueueOverflow", mqtt_set_queue_overflow, NULL, RSRC_CONF,
+                  "When the publish queue is full: reject, drop or wait"),
+    AP_INIT_TAKE12("MQTTBatch", mqtt_set_batch, NULL, RSRC_CONF,
+                  "Publishes sent in one go and max. ms to wait for them"),
+    AP_INIT_TAKE12("MQTTBreaker", mqtt_set_breaker, NULL, RSRC_CONF,
+                  "Connect failures that open a broker's circuit and max. seconds it stays open"),
+    AP_INIT_TAKE1("MQTTTCPNoDelay", mqtt_set_tcp_nodelay, NULL, RSRC_CONF,
+                  "Send small MQTT packets at once: on or off"),
+    AP_INIT_TAKE12("MQTTSocketBuffers", mqtt_set_socket_buffers, NULL, RSRC_CONF,
+                  "Broker socket send and receive buffer bytes"),
+    AP_INIT_TAKE1("MQTTKeepAlive", mqtt_set_keepalive, NULL, RSRC_CONF,
+                  "MQTT and TCP keepalive seconds"),
+    AP_INIT_TAKE123("MQTTSpool", mqtt_set_spool, NULL, RSRC_CONF,
+                  "Spool directory for publishes the broker did not get, MB per child, never|second|always msync"),
+    AP_INIT_TAKE1("MQTTSpoolRate", mqtt_set_spool_rate, NULL, RSRC_CONF,
+                  "Spooled publishes replayed per second"),
+    AP_INIT_TAKE1("MQTTDNSCache", mqtt_set_dns_cache, NULL, RSRC_CONF,
+                  "Seconds broker addresses are cached, 0 to resolve on every connect"),
+    AP_INIT_TAKE1("MQTTWarmConnections", mqtt_set_warm_connections, NULL, RSRC_CONF,
+                  "Reactors connecting to each configured broker at child start"),
+    AP_INIT_TAKE1("MQTTStreamClients", mqtt_set_stream_clients, NULL, RSRC_CONF,
+                  "Stream (server-sent events) clients per child, beyond that 503"),
+    AP_INIT_TAKE1("MQTTMode", mqtt_set_mode, NULL, OR_ALL,
+                  "request: wait for an answer, publish: answer 202 at once, gather: many queries at once, stream: server-sent events, "
+                  "retained: the broker's retained message, batch: publish many records"),
     AP_INIT_TAKE1("MQTTEnabled", mqtt_set_enabled, NULL, OR_ALL,
                   "Enable MQTT Bridge"),
     AP_INIT_ITERATE("MQTTVariables", mqtt_set_variables, NULL, OR_ALL,
@@ -83,15 +173,27 @@ mqtt_set_enabled(cmd_parms *cmd, void *cfg, const char *arg)
     return NULL;
     }
 
-/* Handler for the "MQTTServer" directive, default localhost
+/* Handler for the "MQTTServer" directive, default localhost. Takes a
+ * list of brokers, host, host:port or unix:/socket/path, without a port
+ * MQTTPort is used.
+ * Each topic goes to one of them by consistent hashing, to the next one
+ * on the ring while it is down.
  * Example: MQTTServer      localhost 
+ * Example: MQTTServer      broker1 broker2:1884 broker3
+ * Example: MQTTServer      unix:/run/mosquitto/mosquitto.sock
  */
 const char *
 mqtt_set_server(cmd_parms *cmd, void *cfg, const char *arg)
     {
     mqtt_config *config = (mqtt_config *)cfg;
-    config->mqtt_server = arg;
-    return NULL;
+
+    if (!config->mqtt_ring)
+        {
+        config->mqtt_ring = mqtt_ring_create(cmd->pool);
+        config->mqtt_server = arg;
+        }
+
+    return mqtt_ring_add(config->mqtt_ring, cmd->pool, arg);
     }
 
 /* Handler for the "MQTTPubTopic" directive. Expressions like $action
@@ -129,6 +231,849 @@ mqtt_set_port(cmd_parms *cmd, void *cfg, const char *arg)
     return NULL;
     }
 
+/* Handler for the "MQTTUsername" directive, default is anonymous
+ * Example: MQTTUsername bridge
+ */
+const char *
+mqtt_set_username(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+    config->mqtt_username = arg;
+    return NULL;
+    }
+
+/* Handler for the "MQTTPassword" directive, only used with MQTTUsername
+ * Example: MQTTPassword secret
+ */
+const char *
+mqtt_set_password(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+    config->mqtt_password = arg;
+    return NULL;
+    }
+
+#ifdef WITH_TLS
+/** the TLS settings of a section, created by its first MQTTTLS* directive.
+ * A section with TLS directives does not inherit any of its parent's.
+ * \param cmd directive
+ * \param cfg section config
+ * \return settings
+ */
+static struct mqtt_tls *
+tls_config(cmd_parms *cmd, void *cfg)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+
+    if (!config->mqtt_tls)
+        {
+        config->mqtt_tls = apr_pcalloc(cmd->pool, sizeof(struct mqtt_tls));
+        config->mqtt_tls->enabled = 1;
+        config->mqtt_tls->key = "";
+        }
+    return config->mqtt_tls;
+    }
+
+/** renew the connection key part after a change: connections are shared
+ * by sections with the same TLS settings
+ * \param cmd directive
+ * \param tls settings
+ * \return NULL
+ */
+static const char *
+tls_key(cmd_parms *cmd, struct mqtt_tls *tls)
+    {
+    tls->key = apr_psprintf(cmd->pool, "tls:%s:%s:%s:%s:%s:%s:%d",
+                            (tls->cafile ? tls->cafile : ""), (tls->capath ? tls->capath : ""),
+                            (tls->certfile ? tls->certfile : ""), (tls->keyfile ? tls->keyfile : ""),
+                            (tls->ciphers ? tls->ciphers : ""), (tls->version ? tls->version : ""),
+                            tls->insecure);
+    return NULL;
+    }
+
+/* Handler for the "MQTTTLS" directive, default is off. Any other MQTTTLS*
+ * directive turns it on. Connections stay open, so the handshake is not
+ * paid per request, and reconnects resume the TLS session.
+ * Example: MQTTTLS on
+ */
+const char *
+mqtt_set_tls(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    struct mqtt_tls *tls = tls_config(cmd, cfg);
+
+    tls->enabled = !strcasecmp(arg, "on");
+    return tls_key(cmd, tls);
+    }
+
+/* Handler for the "MQTTTLSCAFile" directive, default are the system CAs
+ * Example: MQTTTLSCAFile conf/mqtt-ca.pem
+ */
+const char *
+mqtt_set_tls_cafile(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    struct mqtt_tls *tls = tls_config(cmd, cfg);
+
+    tls->cafile = ap_server_root_relative(cmd->pool, arg);
+    return tls_key(cmd, tls);
+    }
+
+/* Handler for the "MQTTTLSCAPath" directive
+ * Example: MQTTTLSCAPath /etc/ssl/certs
+ */
+const char *
+mqtt_set_tls_capath(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    struct mqtt_tls *tls = tls_config(cmd, cfg);
+
+    tls->capath = ap_server_root_relative(cmd->pool, arg);
+    return tls_key(cmd, tls);
+    }
+
+/* Handler for the "MQTTTLSCertFile" directive, PEM, may hold the chain
+ * Example: MQTTTLSCertFile conf/mqtt-client.pem
+ */
+const char *
+mqtt_set_tls_certfile(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    struct mqtt_tls *tls = tls_config(cmd, cfg);
+
+    tls->certfile = ap_server_root_relative(cmd->pool, arg);
+    return tls_key(cmd, tls);
+    }
+
+/* Handler for the "MQTTTLSKeyFile" directive, PEM
+ * Example: MQTTTLSKeyFile conf/mqtt-client.key
+ */
+const char *
+mqtt_set_tls_keyfile(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    struct mqtt_tls *tls = tls_config(cmd, cfg);
+
+    tls->keyfile = ap_server_root_relative(cmd->pool, arg);
+    return tls_key(cmd, tls);
+    }
+
+/* Handler for the "MQTTTLSCiphers" directive, default OpenSSL's
+ * Example: MQTTTLSCiphers HIGH:!aNULL
+ */
+const char *
+mqtt_set_tls_ciphers(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    struct mqtt_tls *tls = tls_config(cmd, cfg);
+
+    tls->ciphers = arg;
+    return tls_key(cmd, tls);
+    }
+
+/* Handler for the "MQTTTLSVersion" directive: the minimum version
+ * Example: MQTTTLSVersion tlsv1.2
+ */
+const char *
+mqtt_set_tls_version(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    struct mqtt_tls *tls = tls_config(cmd, cfg);
+
+    if (strcmp(arg, "tlsv1") && strcmp(arg, "tlsv1.1") && strcmp(arg, "tlsv1.2") && strcmp(arg, "tlsv1.3"))
+        return "MQTTTLSVersion must be tlsv1, tlsv1.1, tlsv1.2 or tlsv1.3";
+    tls->version = arg;
+    return tls_key(cmd, tls);
+    }
+
+/* Handler for the "MQTTTLSInsecure" directive, default is off: the broker
+ * certificate must match the host name of MQTTServer
+ * Example: MQTTTLSInsecure on
+ */
+const char *
+mqtt_set_tls_insecure(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    struct mqtt_tls *tls = tls_config(cmd, cfg);
+
+    tls->insecure = !strcasecmp(arg, "on");
+    return tls_key(cmd, tls);
+    }
+#endif
+
+/* Handler for the "MQTTProtocol" directive, default is 3.1.
+ * With 5 the query carries response topic, correlation data and a
+ * message expiry as properties, long topics are sent as topic aliases
+ * Example: MQTTProtocol 5
+ */
+const char *
+mqtt_set_protocol(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+
+    if (strcmp(arg, "3.1") == 0 || strcmp(arg, "3") == 0)
+        config->mqtt_protocol = MQTT_PROTOCOL_V31;
+    else if (strcmp(arg, "3.1.1") == 0 || strcmp(arg, "4") == 0)
+        config->mqtt_protocol = MQTT_PROTOCOL_V311;
+    else if (strcmp(arg, "5") == 0)
+        config->mqtt_protocol = MQTT_PROTOCOL_V5;
+    else
+        return "MQTTProtocol must be 3.1, 3.1.1 or 5";
+
+    return NULL;
+    }
+
+/* Handler for the "MQTTQoS" directive, default is 0. With 1 or 2 a
+ * publish counts as sent once the broker acknowledged it; publishes of
+ * all requests are pipelined on the shared connection meanwhile
+ * Example: MQTTQoS 1
+ */
+const char *
+mqtt_set_qos(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+
+    if (strcmp(arg, "0") && strcmp(arg, "1") && strcmp(arg, "2"))
+        return "MQTTQoS must be 0, 1 or 2";
+    config->mqtt_qos = atoi(arg);
+    return NULL;
+    }
+
+/* Handler for the "MQTTRetain" directive, default is off
+ * Example: MQTTRetain on
+ */
+const char *
+mqtt_set_retain(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+
+    config->mqtt_retain = !strcasecmp(arg, "on");
+    return NULL;
+    }
+
+/* Handler for the "MQTTMaxInflight" directive: QoS 1/2 publishes sent
+ * before the first of them is acknowledged, more wait in libmosquitto.
+ * Locations with different values use different connections. Default 20
+ * Example: MQTTMaxInflight 100
+ */
+const char *
+mqtt_set_max_inflight(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+    int n = atoi(arg);
+
+    if (n < 1 || n > 65535)
+        return "MQTTMaxInflight must be between 1 and 65535";
+    config->mqtt_max_inflight = n;
+    return NULL;
+    }
+
+/* Handler for the "MQTTHedge" directive: once an answer is later than the
+ * given percentile of the answers seen so far, the query is sent once
+ * more and the first answer is taken. The optional budget caps the extra
+ * queries in percent of all, default 5. off disables it. Default is off
+ * Example: MQTTHedge 95 5
+ */
+const char *
+mqtt_set_hedge(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+    int percentile = ( strcasecmp(arg1, "off") ? atoi(arg1) : 0 );
+    int budget = ( arg2 ? atoi(arg2) : 5 );
+
+    if (percentile < 0 || percentile > 99 || (percentile == 0 && strcasecmp(arg1, "off")))
+        return "MQTTHedge percentile must be between 1 and 99, or off";
+    if (budget < 1 || budget > 100)
+        return "MQTTHedge budget must be between 1 and 100 percent";
+
+    if (!config->mqtt_hedge)
+        config->mqtt_hedge = mqtt_hedge_create(cmd->pool);
+    config->mqtt_hedge->percentile = percentile;
+    config->mqtt_hedge->budget = budget;
+    return NULL;
+    }
+
+/* Handler for the "MQTTHedgeTarget" directive: hedged queries go to this
+ * topic, may have $variables, or - for the publish topic, and optionally to
+ * another broker. That broker's answers are taken as well. Default is the
+ * same topic on the same broker
+ * Example: MQTTHedgeTarget "sensor/$sensorid/$query/hedge" standby.example.com:1883
+ */
+const char *
+mqtt_set_hedge_target(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+
+    if (!config->mqtt_hedge)
+        config->mqtt_hedge = mqtt_hedge_create(cmd->pool);
+    config->mqtt_hedge->topic = ( strcmp(arg1, "-") ? apr_pstrdup(cmd->pool, arg1) : NULL );
+
+    if (arg2)
+        {
+        /* same syntax as an MQTTServer entry */
+        struct mqtt_ring *ring = mqtt_ring_create(cmd->pool);
+        const char *err = mqtt_ring_add(ring, cmd->pool, arg2);
+
+        if (err)
+            return err;
+        config->mqtt_hedge->host = ring->nodes[0].host;
+        config->mqtt_hedge->port = ring->nodes[0].port;
+        }
+    return NULL;
+    }
+
+/* Handler for the "MQTTConcurrency" directive: requests of this location
+ * waiting for answers at the same time. The limit adapts to the round
+ * trip time between 1 and max, requests over it wait up to queue ms for
+ * a slot and get 503 then. Per child process, default is no limit
+ * Example: MQTTConcurrency 100 50
+ */
+const char *
+mqtt_set_concurrency(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+    int max = atoi(arg1);
+    int queue = ( arg2 ? atoi(arg2) : 0 );
+
+    if (max < 1)
+        return "MQTTConcurrency must be positive";
+    if (queue < 0)
+        return "MQTTConcurrency queue ms must not be negative";
+
+    config->mqtt_limit = mqtt_limit_create(cmd->pool, ( cmd->path ? cmd->path : "/" ), max, queue);
+    return NULL;
+    }
+
+/* Handler for the "MQTTTimeout" directive: ms from the start of the
+ * request until we give up waiting for an answer, default is 5000
+ * Example: MQTTTimeout 250
+ */
+const char *
+mqtt_set_timeout(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+    int ms = atoi(arg);
+
+    if (ms < 1)
+        return "MQTTTimeout must be a positive number of milliseconds";
+
+    config->mqtt_timeout = ms;
+    return NULL;
+    }
+
+/* Handler for the "MQTTAsync" directive: suspend the request after
+ * publishing and resume it when the answer arrives or the deadline
+ * passes. Needs an async MPM (event), ignored otherwise. Default is off
+ * Example: MQTTAsync on
+ */
+const char *
+mqtt_set_async(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+    if (!strcasecmp(arg, "on"))
+        config->mqtt_async = 1;
+    else
+        config->mqtt_async = 0;
+    return NULL;
+    }
+
+/* Handler for the "MQTTCoalesce" directive: while a query is waiting for
+ * its answer, requests with the same publish topic, variables and broker
+ * do not publish again but get a copy of that answer. Only for answers
+ * that do not depend on who asks. Default is off
+ * Example: MQTTCoalesce on
+ */
+const char *
+mqtt_set_coalesce(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+    if (!strcasecmp(arg, "on"))
+        config->mqtt_coalesce = 1;
+    else
+        config->mqtt_coalesce = 0;
+    return NULL;
+    }
+
+/* Handler for the "MQTTResponseCount" directive: a query may be answered
+ * by several responders. With more than one, answers are streamed to the
+ * client as they arrive, one JSON line each (NDJSON), until this many
+ * came, MQTTResponseWindow closed or MQTTTimeout passed. Default is 1
+ * Example: MQTTResponseCount all
+ */
+const char *
+mqtt_set_response_count(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+    int count = atoi(arg);
+
+    if (!strcasecmp(arg, "all"))
+        count = 0;
+    else if (count < 1)
+        return "MQTTResponseCount must be a positive number or all";
+
+    config->mqtt_response_count = count;
+    return NULL;
+    }
+
+/* Handler for the "MQTTResponseWindow" directive: ms after the query
+ * during which answers are collected and streamed, within MQTTTimeout.
+ * Default is until MQTTResponseCount answers came
+ * Example: MQTTResponseWindow 500
+ */
+const char *
+mqtt_set_response_window(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+    int ms = atoi(arg);
+
+    if (ms < 1)
+        return "MQTTResponseWindow must be a positive number of milliseconds";
+
+    config->mqtt_response_window = ms;
+    return NULL;
+    }
+
+/* Handler for the "MQTTCache" directive: lastvalue answers from the
+ * last-value cache in shared memory when it holds a message on the topic
+ * (rendered like MQTTSubTopic, which is the default) not older than
+ * MQTTCacheStale, and takes the live path otherwise. The topics must be
+ * among MQTTCacheSubscribe. Default is off
+ * Example: MQTTCache lastvalue "sensor/$sensorid/state"
+ */
+const char *
+mqtt_set_cache(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+
+    if (!strcasecmp(arg1, "lastvalue"))
+        config->mqtt_cache = MQTT_CACHE_LASTVALUE;
+    else if (!strcasecmp(arg1, "off"))
+        config->mqtt_cache = MQTT_CACHE_OFF;
+    else
+        return "MQTTCache must be lastvalue or off";
+
+    if (arg2)
+        config->mqtt_cache_topic = apr_pstrdup(cmd->pool, arg2);
+    return NULL;
+    }
+
+/* Handler for the "MQTTCacheStale" directive: ms a cached message is
+ * served after it arrived, 0 for any age. Default is 60 seconds
+ * Example: MQTTCacheStale 5000
+ */
+const char *
+mqtt_set_cache_stale(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+    int ms = atoi(arg);
+
+    if (ms < 0)
+        return "MQTTCacheStale must not be negative";
+
+    config->mqtt_cache_stale = ms;
+    return NULL;
+    }
+
+/* Handler for the "MQTTCacheSubscribe" directive: topic filters a single
+ * process, forked at startup, subscribes to on the server's MQTTServer,
+ * keeping the newest message of every topic in memory shared by all
+ * children. Server config only, default is no cache
+ * Example: MQTTCacheSubscribe sensor/+/state
+ */
+const char *
+mqtt_set_cache_subscribe(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_server_config *sconf = (mqtt_server_config *)
+                                ap_get_module_config(cmd->server->module_config, &mqtt_module);
+
+    if (mosquitto_sub_topic_check(arg) != MOSQ_ERR_SUCCESS)
+        return "MQTTCacheSubscribe needs valid topic filters";
+
+    if (!sconf->cache_filters)
+        sconf->cache_filters = apr_array_make(cmd->pool, 4, sizeof(const char *));
+    *(const char **) apr_array_push(sconf->cache_filters) = apr_pstrdup(cmd->pool, arg);
+    return NULL;
+    }
+
+/* Handler for the "MQTTCacheSize" directive: topics the last-value cache
+ * keeps and max. bytes of a message, larger ones are not cached. Server
+ * config only, default is 1024 4096
+ * Example: MQTTCacheSize 10000 1024
+ */
+const char *
+mqtt_set_cache_size(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2)
+    {
+    mqtt_server_config *sconf = (mqtt_server_config *)
+                                ap_get_module_config(cmd->server->module_config, &mqtt_module);
+    int slots = atoi(arg1);
+    int value = ( arg2 ? atoi(arg2) : sconf->cache_value );
+
+    if (slots < 1 || slots > 1000000)
+        return "MQTTCacheSize topics must be between 1 and 1000000";
+    if (value < 1 || value > 1024 * 1024)
+        return "MQTTCacheSize bytes must be between 1 and 1048576";
+
+    sconf->cache_slots = slots;
+    sconf->cache_value = value;
+    return NULL;
+    }
+
+/* Handler for the "MQTTResponseCache" directive: ms an answer is served
+ * to identical queries (same publish topic and variables) without asking
+ * again, ms after that it is still served while one query refreshes it,
+ * and ms after the first it is served when the broker or responder fails.
+ * Per child process, default is no cache
+ * Example: MQTTResponseCache 1000 5000 60000
+ */
+const char *
+mqtt_set_response_cache(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2, const char *arg3)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+    int ttl = atoi(arg1);
+    int swr = ( arg2 ? atoi(arg2) : 0 );
+    int sie = ( arg3 ? atoi(arg3) : 0 );
+
+    if (ttl < 1)
+        return "MQTTResponseCache ms must be positive";
+    if (swr < 0 || sie < 0)
+        return "MQTTResponseCache stale ms must not be negative";
+
+    config->mqtt_rcache = mqtt_rcache_create(cmd->pool, ( cmd->path ? cmd->path : "/" ), ttl, swr, sie);
+    return NULL;
+    }
+
+/* Handler for the "MQTTMaxAge" directive: Cache-Control max-age of the
+ * answers, unless the responder sends a "max-age" with its answer.
+ * Default is no Cache-Control; an ETag is always sent
+ * Example: MQTTMaxAge 60
+ */
+const char *
+mqtt_set_max_age(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+    char *end;
+    long seconds;
+
+    errno = 0;
+    seconds = strtol(arg, &end, 10);
+    if (!apr_isdigit(*arg) || *end || errno == ERANGE || seconds > MQTT_MAX_AGE_MAX)
+        return apr_psprintf(cmd->pool, "MQTTMaxAge must be a number of seconds up to %d", MQTT_MAX_AGE_MAX);
+
+    config->mqtt_max_age = (int) seconds;
+    return NULL;
+    }
+
+/* Handler for the "MQTTReactors" directive: I/O threads per child
+ * owning the broker connections. Server config only, default is 1
+ * Example: MQTTReactors 2
+ */
+const char *
+mqtt_set_reactors(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_server_config *sconf = (mqtt_server_config *)
+                                ap_get_module_config(cmd->server->module_config, &mqtt_module);
+    int n = atoi(arg);
+
+    if (n < 1 || n > MQTT_MAX_REACTORS)
+        return apr_psprintf(cmd->pool, "MQTTReactors must be between 1 and %d", MQTT_MAX_REACTORS);
+
+    sconf->reactors = n;
+    return NULL;
+    }
+
+/* Handler for the "MQTTQueueSize" directive: fire-and-forget publishes
+ * queued per child. Server config only, default is 1000
+ * Example: MQTTQueueSize 10000
+ */
+const char *
+mqtt_set_queue_size(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_server_config *sconf = (mqtt_server_config *)
+                                ap_get_module_config(cmd->server->module_config, &mqtt_module);
+    int n = atoi(arg);
+
+    if (n < 1)
+        return "MQTTQueueSize must be positive";
+
+    sconf->queue_size = n;
+    return NULL;
+    }
+
+/* Handler for the "MQTTQueueOverflow" directive: what a publish does when
+ * the queue is full. reject answers 503, drop answers 202 and discards
+ * the message, wait blocks until there is room or MQTTTimeout passes.
+ * Server config only, default is reject
+ * Example: MQTTQueueOverflow drop
+ */
+const char *
+mqtt_set_queue_overflow(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_server_config *sconf = (mqtt_server_config *)
+                                ap_get_module_config(cmd->server->module_config, &mqtt_module);
+
+    if (!strcasecmp(arg, "reject"))
+        sconf->queue_overflow = MQTT_OVERFLOW_REJECT;
+    else if (!strcasecmp(arg, "drop"))
+        sconf->queue_overflow = MQTT_OVERFLOW_DROP;
+    else if (!strcasecmp(arg, "wait"))
+        sconf->queue_overflow = MQTT_OVERFLOW_WAIT;
+    else
+        return "MQTTQueueOverflow must be reject, drop or wait";
+
+    return NULL;
+    }
+
+/* Handler for the "MQTTBatch" directive: publishes sent in one go and
+ * the max. ms the first of them waits for the rest. Server config only,
+ * default is 64 5
+ * Example: MQTTBatch 128 2
+ */
+const char *
+mqtt_set_batch(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2)
+    {
+    mqtt_server_config *sconf = (mqtt_server_config *)
+                                ap_get_module_config(cmd->server->module_config, &mqtt_module);
+    int n = atoi(arg1);
+
+    if (n < 1)
+        return "MQTTBatch size must be positive";
+    sconf->batch_size = n;
+
+    if (arg2)
+        {
+        n = atoi(arg2);
+        if (n < 0)
+            return "MQTTBatch delay must not be negative";
+        sconf->batch_delay = n;
+        }
+
+    return NULL;
+    }
+
+/* Handler for the "MQTTBreaker" directive: after this many connect failures
+ * in a row requests to a broker fail fast with 503 and Retry-After, a
+ * probe is let through after a backoff growing up to the max. seconds.
+ * Server config only, default is 5 30
+ * Example: MQTTBreaker 3 60
+ */
+const char *
+mqtt_set_breaker(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2)
+    {
+    mqtt_server_config *sconf = (mqtt_server_config *)
+                                ap_get_module_config(cmd->server->module_config, &mqtt_module);
+    int n = atoi(arg1);
+
+    if (n < 1)
+        return "MQTTBreaker failures must be positive";
+    sconf->breaker_failures = n;
+
+    if (arg2)
+        {
+        n = atoi(arg2);
+        if (n < 1)
+            return "MQTTBreaker seconds must be positive";
+        sconf->breaker_max = n;
+        }
+
+    return NULL;
+    }
+
+/* Handler for the "MQTTTCPNoDelay" directive: disable Nagle on broker
+ * sockets, so small queries and answers are not held back. Server config
+ * only, default is on
+ * Example: MQTTTCPNoDelay off
+ */
+const char *
+mqtt_set_tcp_nodelay(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_server_config *sconf = (mqtt_server_config *)
+                                ap_get_module_config(cmd->server->module_config, &mqtt_module);
+
+    sconf->tcp_nodelay = !strcasecmp(arg, "on");
+    return NULL;
+    }
+
+/* Handler for the "MQTTSocketBuffers" directive: send and receive buffer
+ * bytes of broker sockets, 0 keeps the system default. Server config
+ * only, default is 0 0
+ * Example: MQTTSocketBuffers 262144 262144
+ */
+const char *
+mqtt_set_socket_buffers(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2)
+    {
+    mqtt_server_config *sconf = (mqtt_server_config *)
+                                ap_get_module_config(cmd->server->module_config, &mqtt_module);
+    int n = atoi(arg1);
+
+    if (n < 0)
+        return "MQTTSocketBuffers send size must not be negative";
+    sconf->sndbuf = n;
+
+    n = (arg2 ? atoi(arg2) : n);
+    if (n < 0)
+        return "MQTTSocketBuffers receive size must not be negative";
+    sconf->rcvbuf = n;
+
+    return NULL;
+    }
+
+/* Handler for the "MQTTKeepAlive" directive: seconds between MQTT pings
+ * on idle broker connections, also the TCP keepalive idle time. Server
+ * config only, default is 60
+ * Example: MQTTKeepAlive 30
+ */
+const char *
+mqtt_set_keepalive(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_server_config *sconf = (mqtt_server_config *)
+                                ap_get_module_config(cmd->server->module_config, &mqtt_module);
+    int n = atoi(arg);
+
+    if (n < 5 || n > 65535)
+        return "MQTTKeepAlive must be between 5 and 65535 seconds";
+    sconf->keepalive = n;
+    return NULL;
+    }
+
+/* Handler for the "MQTTSpool" directive: fire-and-forget publishes the
+ * broker is not reachable for are kept in a memory-mapped journal per
+ * child in this directory and replayed once it is back. Oldest ones are
+ * overwritten when the MB are used up. msync never (the kernel writes
+ * back), once a second or after every publish. Server config only,
+ * default is no spool, 64 MB, second
+ * Example: MQTTSpool /var/spool/mod_mqtt 16 always
+ */
+const char *
+mqtt_set_spool(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2, const char *arg3)
+    {
+    mqtt_server_config *sconf = (mqtt_server_config *)
+                                ap_get_module_config(cmd->server->module_config, &mqtt_module);
+
+    sconf->spool_dir = ap_server_root_relative(cmd->pool, arg1);
+
+    if (arg2)
+        {
+        int n = atoi(arg2);
+        if (n < 1 || n > MQTT_SPOOL_MAX_MB)
+            return "MQTTSpool size must be between 1 and 4095 MB";
+        sconf->spool_size = n;
+        }
+
+    if (!arg3)
+        ;
+    else if (!strcasecmp(arg3, "never"))
+        sconf->spool_sync = MQTT_SPOOL_SYNC_NEVER;
+    else if (!strcasecmp(arg3, "second"))
+        sconf->spool_sync = MQTT_SPOOL_SYNC_SECOND;
+    else if (!strcasecmp(arg3, "always"))
+        sconf->spool_sync = MQTT_SPOOL_SYNC_ALWAYS;
+    else
+        return "MQTTSpool msync must be never, second or always";
+
+    return NULL;
+    }
+
+/* Handler for the "MQTTSpoolRate" directive: spooled publishes replayed
+ * per second and child, so a returning broker is not flooded. Server
+ * config only, default is 1000
+ * Example: MQTTSpoolRate 200
+ */
+const char *
+mqtt_set_spool_rate(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_server_config *sconf = (mqtt_server_config *)
+                                ap_get_module_config(cmd->server->module_config, &mqtt_module);
+    int n = atoi(arg);
+
+    if (n < 1)
+        return "MQTTSpoolRate must be positive";
+    sconf->spool_rate = n;
+    return NULL;
+    }
+
+/* Handler for the "MQTTDNSCache" directive: broker host names are resolved
+ * at child start and again in the background after this many seconds,
+ * connects use the cached address. TLS brokers are always connected by
+ * name. 0 resolves on every connect. Server config only, default is 60
+ * Example: MQTTDNSCache 300
+ */
+const char *
+mqtt_set_dns_cache(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_server_config *sconf = (mqtt_server_config *)
+                                ap_get_module_config(cmd->server->module_config, &mqtt_module);
+    int n = atoi(arg);
+
+    if (n < 0)
+        return "MQTTDNSCache must not be negative";
+    sconf->dns_ttl = n;
+    return NULL;
+    }
+
+/* Handler for the "MQTTWarmConnections" directive: at child start this
+ * many reactors connect to every broker of every MQTTServer, and the child
+ * waits up to 2 seconds for them before it takes requests. all for every
+ * reactor. Server config only, default is 0 (connect on first use)
+ * Example: MQTTWarmConnections all
+ */
+const char *
+mqtt_set_warm_connections(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_server_config *sconf = (mqtt_server_config *)
+                                ap_get_module_config(cmd->server->module_config, &mqtt_module);
+    int n = ( strcasecmp(arg, "all") ? atoi(arg) : MQTT_MAX_REACTORS );
+
+    if (n < 0)
+        return "MQTTWarmConnections must be a number or all";
+    sconf->warm = n;
+    return NULL;
+    }
+
+/* Handler for the "MQTTStreamClients" directive: stream (server-sent
+ * events) clients a child serves at once, each holds a worker thread
+ * while connected. One more is answered 503 at once. Server config only,
+ * default is half the threads of a child
+ * Example: MQTTStreamClients 100
+ */
+const char *
+mqtt_set_stream_clients(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_server_config *sconf = (mqtt_server_config *)
+                                ap_get_module_config(cmd->server->module_config, &mqtt_module);
+    int n = atoi(arg);
+
+    if (n < 1)
+        return "MQTTStreamClients must be positive";
+    sconf->stream_clients = n;
+    return NULL;
+    }
+
+/* Handler for the "MQTTMode" directive: request publishes and waits for
+ * the answer, publish queues the message and answers 202 Accepted,
+ * gather takes many variable sets (a JSON array of objects as body, or
+ * repeated url parameters), queries them all at once and answers a JSON
+ * array, stream keeps the response open and sends every message on
+ * MQTTSubTopic as a server-sent event, retained answers with the
+ * message the broker retains on MQTTSubTopic, 404 if there is none,
+ * without publishing anything, batch publishes every record of a JSON
+ * array or NDJSON body and answers the status of each. Default is request
+ * Example: MQTTMode publish
+ */
+const char *
+mqtt_set_mode(cmd_parms *cmd, void *cfg, const char *arg)
+    {
+    mqtt_config *config = (mqtt_config *)cfg;
+
+    if (!strcasecmp(arg, "request"))
+        config->mode = REQUESTMode;
+    else if (!strcasecmp(arg, "publish"))
+        config->mode = PUBLISHMode;
+    else if (!strcasecmp(arg, "gather"))
+        config->mode = GATHERMode;
+    else if (!strcasecmp(arg, "stream"))
+        config->mode = STREAMMode;
+    else if (!strcasecmp(arg, "retained"))
+        config->mode = RETAINEDMode;
+    else if (!strcasecmp(arg, "batch"))
+        config->mode = BATCHMode;
+    else
+        return "MQTTMode must be request, publish, gather, stream, retained or batch";
+
+    return NULL;
+    }
+
 /* Handler for the "MQTTVariables" directive: List of allowed variables
  * Required- no default. Use - to allow all variables.
  * eg MQTTVariables Id Name Action 
@@ -0,0 +1,431 @@
+/*
+ * mod_mqtt : map http requests to mqtt
+ *
+ * Klaus Ramstöck
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jansson.h>
+#include "apr_strings.h"
+#include "mod_mqtt.h"
+#include "mqtt_common.h"
+#include "keyValuePair.h"
+
+/*
+    ==============================================================================
+    scatter-gather: one http request, one query per variable set, all in
+    flight at once, answers collected under one deadline
+    ==============================================================================
+*/
+
+/* one variable set of a gather request */
+struct gather_item
+    {
+    keyValuePair *vars;                 /* own and common variables */
+    struct mqtt_broker broker;          /* referenced by cfg */
+    struct mosq_config *cfg;            /* from mqtt_sub_prepare, NULL if not sent */
+    char *response;                     /* answer or NULL */
+    int status;                         /* http status of this item */
+    };
+
+/** split the url parameters, keeping repeated keys
+  * \param r the http request
+  * \return array of keyValuePair, empty without parameters
+  */
+static apr_array_header_t *gather_args ( request_rec *r )
+    {
+    apr_array_header_t *args = apr_array_make ( r->pool, 8, sizeof ( keyValuePair ) );
+    char *buffer, *last, *pair;
+
+    if ( !r->args )
+        return args;
+
+    buffer = apr_pstrdup ( r->pool, r->args );
+    for ( pair = apr_strtok ( buffer, "&", &last ); pair; pair = apr_strtok ( NULL, "&", &last ) )
+        {
+        keyValuePair *kvp = ( keyValuePair * ) apr_array_push ( args );
+        char *v = strchr ( pair, '=' );
+
+        if ( v )
+            *( v++ ) = 0;
+        kvp->key = pair;
+        kvp->value = ( v ? v : "" );
+        }
+    return args;
+    }
+
+/** the n-th value of a url parameter
+  * \param args from gather_args
+  * \param key parameter name
+  * \param n 0 for the first
+  * \param count set to the number of values
+  * \return value or NULL
+  */
+static const char *gather_arg ( apr_array_header_t *args, const char *key, int n, int *count )
+    {
+    const char *value = NULL;
+    int i;
+
+    *count = 0;
+    for ( i = 0; i < args->nelts; i++ )
+        {
+        keyValuePair *kvp = &( ( keyValuePair * ) args->elts )[i];
+
+        if ( strcmp ( kvp->key, key ) )
+            continue;
+        if ( *count == n )
+            value = kvp->value;
+        ( *count )++;
+        }
+    return value;
+    }
+
+/** add a variable to a set unless the set has it already
+  * \param vars set, MQTT_MAX_VARS + 2 entries
+  * \param key name
+  * \param value value
+  * \return 0 if the set is full
+  */
+static int gather_add ( keyValuePair *vars, const char *key, const char *value )
+    {
+    int i;
+
+    for ( i = 0; vars[i].key; i++ )
+        {
+        if ( !strcmp ( vars[i].key, key ) )
+            return 1;
+        }
+    if ( i >= MQTT_MAX_VARS )
+        return 0;
+
+    vars[i].key = key;
+    vars[i].value = value;
+    return 1;
+    }
+
+/** read the request body, also for MQTTMode batch
+  * \param r the http request
+  * \param max max. bytes
+  * \param status set to OK or an http error status
+  * \return body, NULL if there is none
+  */
+char *mqtt_read_body ( request_rec *r, apr_size_t max, int *status )
+    {
+    char chunk[HUGE_STRING_LEN];
+    char *body = NULL;
+    apr_size_t len = 0, size = 0;
+    long got;
+
+    *status = ap_setup_client_block ( r, REQUEST_CHUNKED_DECHUNK );
+    if ( *status != OK || !ap_should_client_block ( r ) )
+        return NULL;
+
+    while ( ( got = ap_get_client_block ( r, chunk, sizeof ( chunk ) ) ) > 0 )
+        {
+        if ( len + got > max )
+            {
+            *status = HTTP_REQUEST_ENTITY_TOO_LARGE;
+            return NULL;
+            }
+        if ( len + got >= size )
+            {
+            char *grown;
+
+            for ( size = ( size ? size : sizeof ( chunk ) ); len + got >= size; size *= 2 )
+                ;
+            grown = apr_palloc ( r->pool, size );
+            if ( len )
+                memcpy ( grown, body, len );
+            body = grown;
+            }
+        memcpy ( body + len, chunk, got );
+        len += got;
+        }
+
+    if ( got < 0 )
+        {
+        *status = HTTP_BAD_REQUEST;
+        return NULL;
+        }
+    if ( body )
+        body[len] = 0;
+    return body;
+    }
+
+/** the variables of a JSON object of strings and integers, also for
+  * MQTTMode batch
+  * \param pool request pool
+  * \param object JSON object
+  * \return variables with room for MQTT_MAX_VARS, NULL if the object is
+  *         none, has other values or too many keys
+  */
+keyValuePair *mqtt_json_vars ( apr_pool_t *pool, json_t *object )
+    {
+    keyValuePair *vars = apr_pcalloc ( pool, sizeof ( keyValuePair ) * ( MQTT_MAX_VARS + 2 ) );
+    const char *key;
+    json_t *value;
+
+    if ( !json_is_object ( object ) )
+        return NULL;
+
+    json_object_foreach ( object, key, value )
+        {
+        const char *v;
+
+        if ( json_is_string ( value ) )
+            v = apr_pstrdup ( pool, json_string_value ( value ) );
+        else if ( json_is_integer ( value ) )
+            v = apr_psprintf ( pool, "%" APR_INT64_T_FMT, ( apr_int64_t ) json_integer_value ( value ) );
+        else
+            v = NULL;
+
+        if ( !v || !gather_add ( vars, apr_pstrdup ( pool, key ), v ) )
+            return NULL;
+        }
+    return vars;
+    }
+
+/** the variable sets of a JSON array body: objects of strings and
+  * integers, url parameters fill in keys a set does not have
+  * \param r the http request
+  * \param body JSON array
+  * \param args from gather_args
+  * \param items set to the variable sets
+  * \return OK or HTTP_BAD_REQUEST
+  */
+static int gather_json ( request_rec *r, const char *body, apr_array_header_t *args, apr_array_header_t *items )
+    {
+    json_error_t error;
+    json_t *json = json_loads ( body, 0, &error );
+    json_t *set;
+    size_t n;
+    int status = OK;
+
+    if ( !json || !json_is_array ( json ) || !json_array_size ( json )
+         || json_array_size ( json ) > MQTT_MAX_GATHER )
+        {
+        LPRINTF ( "gather: body must be a JSON array of 1 to %d objects\n", MQTT_MAX_GATHER );
+        json_decref ( json );
+        return HTTP_BAD_REQUEST;
+        }
+
+    json_array_foreach ( json, n, set )
+        {
+        struct gather_item *item = ( struct gather_item * ) apr_array_push ( items );
+        int i;
+
+        if ( !( item->vars = mqtt_json_vars ( r->pool, set ) ) )
+            {
+            status = HTTP_BAD_REQUEST;
+            break;
+            }
+
+        for ( i = 0; i < args->nelts; i++ )
+            {
+            keyValuePair *kvp = &( ( keyValuePair * ) args->elts )[i];
+
+            if ( !gather_add ( item->vars, kvp->key, kvp->value ) )
+                status = HTTP_BAD_REQUEST;
+            }
+
+        if ( status != OK )
+            break;
+        }
+
+    if ( status != OK )
+        LPRINTF ( "gather: variable set %d invalid\n", ( int ) n );
+    json_decref ( json );
+    return status;
+    }
+
+/** the variable sets of repeated url parameters: the n-th value of a
+  * parameter goes to the n-th set, a parameter given once to all of them
+  * \param r the http request
+  * \param args from gather_args
+  * \param items set to the variable sets
+  * \return OK or HTTP_BAD_REQUEST
+  */
+static int gather_url ( request_rec *r, apr_array_header_t *args, apr_array_header_t *items )
+    {
+    int sets = 1, n, i, count;
+
+    for ( i = 0; i < args->nelts; i++ )
+        {
+        gather_arg ( args, ( ( keyValuePair * ) args->elts )[i].key, 0, &count );
+        if ( count > sets )
+            sets = count;
+        }
+    if ( sets > MQTT_MAX_GATHER )
+        {
+        LPRINTF ( "gather: more than %d variable sets\n", MQTT_MAX_GATHER );
+        return HTTP_BAD_REQUEST;
+        }
+
+    for ( n = 0; n < sets; n++ )
+        {
+        struct gather_item *item = ( struct gather_item * ) apr_array_push ( items );
+
+        item->vars = apr_pcalloc ( r->pool, sizeof ( keyValuePair ) * ( MQTT_MAX_VARS + 2 ) );
+        for ( i = 0; i < args->nelts; i++ )
+            {
+            const char *key = ( ( keyValuePair * ) args->elts )[i].key;
+            const char *value = gather_arg ( args, key, n, &count );
+
+            if ( !value && count == 1 )
+                value = gather_arg ( args, key, 0, &count );
+            if ( value && !gather_add ( item->vars, key, value ) )
+                return HTTP_BAD_REQUEST;
+            }
+        }
+    return OK;
+    }
+
+/** send the query of one variable set, the answer is collected later
+  * \param r the http request
+  * \param config per dir config
+  * \param item variable set
+  * \param subtopic response topic filter
+  * \param expires_ms deadline for responders
+  * \param deadline mqtt_clock() time the request gives up
+  */
+static void gather_send ( request_rec *r, mqtt_config *config, struct gather_item *item,
+                          const char *subtopic, const char *expires_ms, apr_time_t deadline )
+    {
+    struct mqtt_query query;
+    const char *pubtopic;
+    int mqtt_err;
+
+    if ( !assert_variables ( config, item->vars ) )
+        {
+        item->status = HTTP_BAD_REQUEST;
+        return;
+        }
+
+    pubtopic = kvSubst ( r->pool, item->vars, config->mqtt_pubtopic );
+    if ( mqtt_broker_pick ( config, pubtopic, &item->broker ) )
+        {
+        item->status = HTTP_SERVICE_UNAVAILABLE;
+        return;
+        }
+
+    mqtt_query_build ( r, config, item->vars, expires_ms, &query );
+    mqtt_err = mqtt_sub_prepare ( r->pool, &item->broker, subtopic, query.correlation, 1, &item->cfg );
+    if ( mqtt_err == MOSQ_ERR_SUCCESS )
+        mqtt_err = mqtt_pub_submit ( r->pool, &item->broker, pubtopic, query.msg, query.msglen,
+                                     query.response_topic, query.v5_correlation, deadline );
+    if ( mqtt_err != MOSQ_ERR_SUCCESS )
+        {
+        DPRINTF ( "gather %s: %d\n", pubtopic, mqtt_err );
+        mqtt_sub_abort ( item->cfg );
+        item->cfg = NULL;
+        item->status = HTTP_SERVICE_UNAVAILABLE;
+        }
+    }
+
+/** the answer of one variable set as a JSON object: its status and, if
+  * answered, content type and data
+  * \param r the http request
+  * \param item variable set
+  * \return object
+  */
+static json_t *gather_result ( request_rec *r, struct gather_item *item )
+    {
+    json_t *result = ( item->status == HTTP_OK ? mqtt_answer_json ( r->pool, item->response ) : NULL );
+
+    if ( item->status == HTTP_OK && !result )
+        item->status = HTTP_INTERNAL_SERVER_ERROR;
+    if ( !result )
+        result = json_object();
+
+    json_object_set_new ( result, "status", json_integer ( item->status ) );
+    return result;
+    }
+
+/** MQTTMode gather: query every variable set of the request at once, over
+  * the reactor connection of this thread, and answer a JSON array with one
+  * object per set, in order. Sets without an answer by the deadline get
+  * status 504, the others are still returned.
+  * \param r the http request
+  * \param config per dir config
+  * \return OK or http error status
+  */
+int mqtt_gather ( request_rec *r, mqtt_config *config )
+    {
+    apr_array_header_t *args = gather_args ( r );
+    apr_array_header_t *items = apr_array_make ( r->pool, 16, sizeof ( struct gather_item ) );
+    const char *subtopic = kvPattern ( r->pool, config->mqtt_subtopic );
+    const char *expires_ms;
+    apr_time_t deadline, sent;
+    json_t *results;
+    char *out;
+    int status, i, answered = 0, late = 0, waited = 0;
+    char *body = mqtt_read_body ( r, MQTT_GATHER_BODY, &status );
+
+    if ( status != OK )
+        return status;
+
+    status = ( body ? gather_json ( r, body, args, items ) : gather_url ( r, args, items ) );
+    if ( status != OK )
+        return status;
+
+    deadline = mqtt_deadline ( r, config, &expires_ms );
+
+    /* the whole gather holds one slot */
+    if ( mqtt_limit_acquire ( config->mqtt_limit, deadline ) != MOSQ_ERR_SUCCESS )
+        {
+        apr_table_setn ( r->err_headers_out, "Retry-After", "1" );
+        return HTTP_SERVICE_UNAVAILABLE;
+        }
+
+    sent = mqtt_clock();
+    for ( i = 0; i < items->nelts; i++ )
+        gather_send ( r, config, &( ( struct gather_item * ) items->elts )[i], subtopic, expires_ms, deadline );
+
+    /* all queries are out, the first wait covers the others */
+    for ( i = 0; i < items->nelts; i++ )
+        {
+        struct gather_item *item = &( ( struct gather_item * ) items->elts )[i];
+        int responselen = 0;
+        int mqtt_err;
+
+        if ( !item->cfg )
+            continue;
+
+        waited++;
+        mqtt_err = mqtt_sub_loop ( r->pool, item->cfg, deadline, &item->response, &responselen );
+        if ( mqtt_err == MOSQ_ERR_SUCCESS && item->response )
+            {
+            item->status = HTTP_OK;
+            answered++;
+            }
+        else if ( mqtt_err == MQTT_ERR_TIMEOUT )
+            {
+            item->status = HTTP_GATEWAY_TIME_OUT;
+            late++;
+            }
+        else
+            item->status = HTTP_SERVICE_UNAVAILABLE;
+        }
+
+    mqtt_limit_release ( config->mqtt_limit, ( answered || late ? mqtt_clock() - sent : -1 ),
+                         waited && answered == waited );
+    DPRINTF ( "gather: %d sets, %d sent, %d answered\n", items->nelts, waited, answered );
+
+    results = json_array();
+    for ( i = 0; i < items->nelts; i++ )
+        json_array_append_new ( results, gather_result ( r, &( ( struct gather_item * ) items->elts )[i] ) );
+    out = json_dumps ( results, JSON_COMPACT );
+    json_decref ( results );
+
+    if ( !out )
+        return HTTP_INTERNAL_SERVER_ERROR;
+
+    ap_set_content_type ( r, "application/json" );
+    ap_rputs ( out, r );
+    free ( out );
+    return OK;
+    }
@@ -0,0 +1,304 @@
+/*
+ * mod_mqtt : map http requests to mqtt
+ *
+ * Klaus Ramstöck
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jansson.h>
+#include <mosquitto.h>
+#include "apr_atomic.h"
+#include "apr_strings.h"
+#include "ap_mpm.h"
+#include "mod_mqtt.h"
+#include "mqtt_common.h"
+#include "keyValuePair.h"
+
+/*
+    ==============================================================================
+    streamed answers: a query answered by several responders, each answer
+    sent to the client as soon as it arrives
+    ==============================================================================
+*/
+
+/** does this location collect several answers per query
+  * \param config per dir config
+  * \return 1 if MQTTResponseCount is not 1 or MQTTResponseWindow is set
+  */
+int mqtt_stream_enabled ( mqtt_config *config )
+    {
+    return ( ( config->mqtt_response_count >= 0 && config->mqtt_response_count != 1 )
+             || config->mqtt_response_window > 0 );
+    }
+
+/** an answer as a JSON object: content type and data, JSON data is
+  * embedded as is, anything else as a string
+  * \param pool request pool
+  * \param response answer of a responder
+  * \return object or NULL if the answer lacks content-type or .data
+  */
+json_t *mqtt_answer_json ( apr_pool_t *pool, const char *response )
+    {
+    keyValuePair *responseData = json2kv ( pool, response );
+    const char *cType = ( responseData ? keyValue ( responseData, "content-type" ) : NULL );
+    const char *cData = ( responseData ? keyValue ( responseData, ".data" ) : NULL );
+    json_t *answer, *data;
+
+    if ( !cType || !cData )
+        return NULL;
+
+    data = ( strncasecmp ( cType, "application/json", 16 ) ? NULL : json_loads ( cData, 0, NULL ) );
+
+    answer = json_object();
+    json_object_set_new ( answer, "content-type", json_string ( cType ) );
+    json_object_set_new ( answer, "data", ( data ? data : json_string ( cData ) ) );
+    return answer;
+    }
+
+/** send the answers to a query as they arrive, one JSON line each
+  * (application/x-ndjson, chunked), until MQTTResponseCount answers came
+  * or the window closed. The status is only known with the first answer:
+  * without any the client gets 504 like a single query.
+  * \param r the http request
+  * \param config per dir config
+  * \param cfg request state from mqtt_sub_prepare
+  * \param subtopic where the answers come from, for logging
+  * \param until mqtt_clock() time the window closes
+  * \param sent mqtt_clock() time of the query
+  * \return OK or http error status
+  */
+int mqtt_stream ( request_rec *r, mqtt_config *config, struct mosq_config *cfg, const char *subtopic,
+                  apr_time_t until, apr_time_t sent )
+    {
+    char *response = NULL;
+    int responselen = 0;
+    apr_time_t first = 0;
+    int mqtt_err, lines = 0, invalid = 0;
+
+    while ( ( mqtt_err = mqtt_sub_next ( r->pool, cfg, until, &response, &responselen ) ) == MOSQ_ERR_SUCCESS
+            && response )
+        {
+        json_t *line = mqtt_answer_json ( r->pool, response );
+        char *out = ( line ? json_dumps ( line, JSON_COMPACT ) : NULL );
+
+        json_decref ( line );
+        if ( !out )
+            {
+            LPRINTF ( "invalid answer on %s dropped\n", subtopic );
+            invalid++;
+            continue;
+            }
+
+        if ( !first )
+            {
+            first = mqtt_clock();
+            ap_set_content_type ( r, "application/x-ndjson" );
+            }
+        ap_rputs ( out, r );
+        ap_rputs ( "\n", r );
+        free ( out );
+        lines++;
+
+        /* the client went away: stop collecting */
+        if ( ap_rflush ( r ) < 0 )
+            {
+            mqtt_sub_abort ( cfg );
+            break;
+            }
+        }
+
+    DPRINTF ( "stream %s: %d answers\n", subtopic, lines );
+    mqtt_limit_release ( config->mqtt_limit, ( first ? first - sent
+                                               : ( mqtt_err == MQTT_ERR_TIMEOUT ? mqtt_clock() - sent : -1 ) ),
+                         first != 0 );
+
+    if ( first )
+        return OK;
+    if ( invalid )
+        return HTTP_INTERNAL_SERVER_ERROR;
+    return mqtt_respond ( r, config, mqtt_err, NULL, subtopic );
+    }
+
+static volatile apr_uint32_t sse_clients = 0;  /* stream clients of this child */
+static apr_uint32_t sse_max = 0;                /* MQTTStreamClients */
+
+/** set the max. stream clients, once per child
+  * \param max MQTTStreamClients, 0 for half the threads of a child
+  */
+void mqtt_sse_init ( int max )
+    {
+    int threads = 0;
+
+    if ( max <= 0 && ap_mpm_query ( AP_MPMQ_MAX_THREADS, &threads ) == APR_SUCCESS )
+        max = threads / 2;
+    sse_max = ( max > 0 ? max : 1 );
+    DPRINTF ( "stream clients: max. %u\n", sse_max );
+    }
+
+/** send one message as a server-sent event, a data line per line
+  * \param r the http request
+  * \param event message
+  */
+static void sse_event ( request_rec *r, struct mqtt_event *event )
+    {
+    char *line, *last;
+
+    ap_rprintf ( r, "id: %s\n", event->id );
+    for ( line = apr_strtok ( event->data, "\n", &last ); line; line = apr_strtok ( NULL, "\n", &last ) )
+        {
+        size_t len = strlen ( line );
+
+        if ( len && line[len - 1] == '\r' )
+            line[len - 1] = 0;
+        ap_rprintf ( r, "data: %s\n", line );
+        }
+    ap_rputs ( "\n", r );
+    }
+
+/** MQTTMode stream: keep the response open as text/event-stream and send
+  * every message on the rendered MQTTSubTopic. Clients of the same topic
+  * share one subscription; a client coming back with Last-Event-ID gets
+  * the messages it missed, as far as they are still kept. Each client
+  * holds a worker, beyond MQTTStreamClients they are turned away.
+  * \param r the http request
+  * \param config per dir config
+  * \param formData request variables, NULL for none
+  * \return OK or http error status
+  */
+int mqtt_sse ( request_rec *r, mqtt_config *config, keyValuePair *formData )
+    {
+    keyValuePair none[] = { { NULL, NULL } };
+    const char *topic = kvSubst ( r->pool, ( formData ? formData : none ), config->mqtt_subtopic );
+    struct mqtt_broker broker;
+    struct mqtt_hub *hub;
+    apr_uint64_t seq;
+    int retry_after = mqtt_broker_pick ( config, topic, &broker );
+    int events = 0;
+
+    if ( retry_after )
+        {
+        apr_table_setn ( r->err_headers_out, "Retry-After", apr_itoa ( r->pool, retry_after ) );
+        return HTTP_SERVICE_UNAVAILABLE;
+        }
+    if ( mosquitto_sub_topic_check ( topic ) != MOSQ_ERR_SUCCESS )
+        return HTTP_BAD_REQUEST;
+
+    /* keep workers for the other requests */
+    if ( apr_atomic_inc32 ( &sse_clients ) >= sse_max )
+        {
+        apr_atomic_dec32 ( &sse_clients );
+        LPRINTF ( "stream %s: more than %u clients, refused\n", topic, sse_max );
+        apr_table_setn ( r->err_headers_out, "Retry-After", "1" );
+        return HTTP_SERVICE_UNAVAILABLE;
+        }
+    if ( !( hub = mqtt_hub_join ( &broker, topic ) ) )
+        {
+        apr_atomic_dec32 ( &sse_clients );
+        apr_table_setn ( r->err_headers_out, "Retry-After", "1" );
+        return HTTP_SERVICE_UNAVAILABLE;
+        }
+
+    seq = mqtt_hub_resume ( hub, apr_table_get ( r->headers_in, "Last-Event-ID" ) );
+
+    ap_set_content_type ( r, "text/event-stream" );
+    apr_table_setn ( r->headers_out, "Cache-Control", "no-cache" );
+    /* headers out now, the first message may take a while */
+    ap_rputs ( ":\n\n", r );
+
+    /* a keep-alive comment now and then finds clients that went away */
+    while ( ap_rflush ( r ) >= 0 && !r->connection->aborted )
+        {
+        struct mqtt_event *event = mqtt_hub_next ( hub, &seq, mqtt_clock() + apr_time_from_sec ( MQTT_HUB_PING ) );
+        int state = AP_MPMQ_RUNNING;
+
+        if ( event )
+            {
+            sse_event ( r, event );
+            free ( event );
+            events++;
+            continue;
+            }
+
+        if ( ap_mpm_query ( AP_MPMQ_MPM_STATE, &state ) == APR_SUCCESS && state == AP_MPMQ_STOPPING )
+            break;
+        ap_rputs ( ":\n\n", r );
+        }
+
+    DPRINTF ( "stream %s: %d events\n", topic, events );
+    mqtt_hub_leave ( hub );
+    apr_atomic_dec32 ( &sse_clients );
+    return OK;
+    }
+
+/*
+    ==============================================================================
+    retained messages: the current value as the broker keeps it, no
+    responder involved
+    ==============================================================================
+*/
+
+/** MQTTMode retained: answer with the message the broker retains on the
+  * rendered MQTTSubTopic. Nothing is published.
+  * \param r the http request
+  * \param config per dir config
+  * \param formData request variables, NULL for none
+  * \return OK, HTTP_NOT_FOUND if nothing is retained, or http error status
+  */
+int mqtt_retained ( request_rec *r, mqtt_config *config, keyValuePair *formData )
+    {
+    keyValuePair none[] = { { NULL, NULL } };
+    const char *topic = kvSubst ( r->pool, ( formData ? formData : none ), config->mqtt_subtopic );
+    const char *expires_ms;
+    apr_time_t deadline = mqtt_deadline ( r, config, &expires_ms );
+    struct mqtt_broker broker;
+    char *response = NULL;
+    int responselen = 0;
+    int retry_after = mqtt_broker_pick ( config, topic, &broker );
+    int mqtt_err;
+
+    if ( retry_after )
+        {
+        apr_table_setn ( r->err_headers_out, "Retry-After", apr_itoa ( r->pool, retry_after ) );
+        return HTTP_SERVICE_UNAVAILABLE;
+        }
+    if ( mosquitto_sub_topic_check ( topic ) != MOSQ_ERR_SUCCESS )
+        return HTTP_BAD_REQUEST;
+
+    mqtt_err = mqtt_sub_retained ( r->pool, &broker, topic, deadline, &response, &responselen );
+    DPRINTF ( "retained %s: %d, %d bytes\n", topic, mqtt_err, responselen );
+
+    if ( mqtt_err == MQTT_ERR_NOT_FOUND )
+        return HTTP_NOT_FOUND;
+    if ( mqtt_err || !response )
+        return mqtt_respond ( r, config, mqtt_err, NULL, topic );
+
+    return mqtt_respond_message ( r, config, response, responselen, topic );
+    }
+
+/** send a message published as state rather than as an answer: in the
+  * usual form (content-type and data) like an answer, anything else as is
+  * \param r the http request
+  * \param config per dir config
+  * \param message message, NUL terminated
+  * \param len message size
+  * \param topic where it came from, for logging
+  * \return OK, HTTP_NOT_MODIFIED or http error status
+  */
+int mqtt_respond_message ( request_rec *r, mqtt_config *config, const char *message, int len, const char *topic )
+    {
+    json_t *json = json_loadb ( message, len, JSON_DECODE_ANY, NULL );
+
+    if ( json && json_is_object ( json ) && json_object_get ( json, "content-type" ) )
+        {
+        json_decref ( json );
+        return mqtt_respond ( r, config, MOSQ_ERR_SUCCESS, message, topic );
+        }
+
+    ap_set_content_type ( r, ( json ? "application/json" : "application/octet-stream" ) );
+    json_decref ( json );
+    return mqtt_send_body ( r, config, r->content_type, message, len, NULL, NULL );
+    }
@@ -6,8 +6,179 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 
+#include "apr_atomic.h"
+#include "ap_mpm.h"
 #include "mod_mqtt.h"
 #include "mqtt_common.h"
 #include "keyValuePair.h"
 
+/*
+    ==============================================================================
+    asynchronous requests: the worker is released while the answer is pending
+    ==============================================================================
+*/
+
+/* a suspended request, malloc'ed: MPM callbacks may run after the request pool is gone */
+struct mqtt_async
+    {
+    request_rec *r;
+    mqtt_config *config;
+    struct mosq_config *cfg;            /* from mqtt_sub_prepare */
+    const char *subtopic;
+    volatile apr_uint32_t refs;         /* deadline callback, answer notification and hedge */
+    volatile apr_uint32_t resumed;      /* the first of them finishes the request */
+    struct mqtt_job * volatile hedge;   /* query to send again, taken by the hedge callback */
+    struct mqtt_hedge *stats;           /* latency histogram of the location */
+    apr_time_t sent;                    /* mqtt_clock() of the query, 0 when following another */
+    struct mqtt_limit *limit;           /* concurrency limit holding a slot for us */
+    };
+
+/** drop one reference to a suspended request
+  * \param as suspended request
+  */
+static void mqtt_async_release ( struct mqtt_async *as )
+    {
+    if ( !apr_atomic_dec32 ( &as->refs ) )
+        {
+        free ( as->hedge );
+        free ( as );
+        }
+    }
+
+/** finish a suspended request on an MPM worker thread, first caller only.
+  * Runs when the answer arrived or the deadline passed.
+  * \param baton suspended request
+  */
+static void mqtt_async_resume ( void *baton )
+    {
+    struct mqtt_async *as = ( struct mqtt_async * ) baton;
+    request_rec *r = as->r;
+    char *response = NULL;
+    int responselen = 0;
+    int mqtt_err, status;
+
+    if ( apr_atomic_cas32 ( &as->resumed, 1, 0 ) )
+        {
+        mqtt_async_release ( as );
+        return;
+        }
+
+    apr_thread_mutex_lock ( r->invoke_mtx );
+
+    /* deadline first: no notification will come for an answer we stop waiting for */
+    if ( mqtt_mux_unregister ( as->cfg->waiter ) )
+        mqtt_async_release ( as );
+
+    /* does not block, the waiter is done or given up */
+    mqtt_err = mqtt_sub_loop ( r->pool, as->cfg, 0, &response, &responselen );
+    if ( mqtt_err == MOSQ_ERR_SUCCESS && as->sent )
+        mqtt_hedge_record ( as->stats, mqtt_clock() - as->sent );
+    mqtt_limit_release ( as->limit, ( mqtt_err == MOSQ_ERR_SUCCESS || mqtt_err == MQTT_ERR_TIMEOUT
+                                      ? mqtt_clock() - as->sent : -1 ), mqtt_err == MOSQ_ERR_SUCCESS );
+    status = mqtt_respond ( r, as->config, mqtt_err, response, as->subtopic );
+
+    apr_thread_mutex_unlock ( r->invoke_mtx );
+
+    if ( status == OK )
+        ap_finalize_request_protocol ( r );
+    else
+        ap_die ( status, r );
+    ap_process_request_after_handler ( r );
+
+    mqtt_async_release ( as );
+    }
+
+/** the answer is there: called on a reactor thread, move on to an MPM worker
+  * \param baton suspended request
+  */
+static void mqtt_async_notify ( void *baton )
+    {
+    ap_mpm_register_timed_callback ( 0, mqtt_async_resume, baton );
+    }
+
+/** the answer is late: send the query again, unless the request is done
+  * or the budget is used up
+  * \param baton suspended request
+  */
+static void mqtt_async_hedge ( void *baton )
+    {
+    struct mqtt_async *as = ( struct mqtt_async * ) baton;
+    struct mqtt_job *job = apr_atomic_xchgptr ( ( volatile void ** ) &as->hedge, NULL );
+
+    if ( job && !apr_atomic_read32 ( &as->resumed ) && mqtt_hedge_allow ( as->stats ) )
+        mqtt_reactor_submit ( job );
+    else
+        free ( job );
+
+    mqtt_async_release ( as );
+    }
+
+/** can requests for this location be suspended
+  * \param config per dir config
+  * \return 1 if MQTTAsync is on and the MPM is async
+  */
+int mqtt_async_enabled ( mqtt_config *config )
+    {
+    int async = 0;
+
+    if ( config->mqtt_async <= 0 )
+        return 0;
+
+    if ( ap_mpm_query ( AP_MPMQ_IS_ASYNC, &async ) != APR_SUCCESS )
+        return 0;
+
+    return async;
+    }
+
+/** suspend a request whose query has been handed to a reactor
+  * \param r the http request
+  * \param config per dir config
+  * \param cfg request state from mqtt_sub_prepare
+  * \param subtopic where the answer comes from, for logging
+  * \param deadline mqtt_clock() time to give up
+  * \param hedge query to send again at hedge_at, or NULL
+  * \param hedge_at mqtt_clock() time to hedge
+  * \param sent mqtt_clock() time of the query, 0 when following another
+  * \return SUSPENDED or http error status
+  */
+int mqtt_async_suspend ( request_rec *r, mqtt_config *config, struct mosq_config *cfg,
+                         const char *subtopic, apr_time_t deadline,
+                         struct mqtt_job *hedge, apr_time_t hedge_at, apr_time_t sent )
+    {
+    struct mqtt_async *as = calloc ( 1, sizeof ( struct mqtt_async ) );
+    apr_interval_time_t left = deadline - mqtt_clock();
+
+    if ( !as )
+        {
+        free ( hedge );
+        mqtt_sub_abort ( cfg );
+        mqtt_limit_release ( ( sent ? config->mqtt_limit : NULL ), -1, 0 );
+        return HTTP_SERVICE_UNAVAILABLE;
+        }
+
+    as->r = r;
+    as->config = config;
+    as->cfg = cfg;
+    as->subtopic = subtopic;
+    as->hedge = hedge;
+    as->stats = config->mqtt_hedge;
+    /* a follower holds no slot and measures no round trip */
+    as->limit = ( sent ? config->mqtt_limit : NULL );
+    as->sent = sent;
+    apr_atomic_set32 ( &as->refs, ( hedge ? 3 : 2 ) );
+
+    DPRINTF ( "-->suspend for %" APR_TIME_T_FMT " ms\n", apr_time_as_msec ( left ) );
+
+    /* the handler still holds r->invoke_mtx, a quick answer waits for it */
+    ap_mpm_register_timed_callback ( ( left > 0 ? left : 0 ), mqtt_async_resume, as );
+    if ( hedge )
+        {
+        apr_interval_time_t wait = hedge_at - mqtt_clock();
+        ap_mpm_register_timed_callback ( ( wait > 0 ? wait : 0 ), mqtt_async_hedge, as );
+        }
+    mqtt_waiter_notify ( cfg->waiter, mqtt_async_notify, as );
+
+    return SUSPENDED;
+    }
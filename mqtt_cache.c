@@ -0,0 +1,417 @@
+/*
+ * mqtt last-value cache: the newest message of every topic matching the
+ * configured filters, in shared memory visible to all children. A single
+ * subscriber process, forked at configuration time, is the only writer;
+ * readers copy a slot under its sequence counter and never block it.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mosquitto.h>
+#include "apr_atomic.h"
+#include "apr_shm.h"
+#include "apr_strings.h"
+#include "apr_thread_proc.h"
+#include "mqtt_common.h"
+
+/* shared memory header, followed by the slots */
+struct cache_hdr
+    {
+    apr_uint32_t slots;                 /* number of slots */
+    apr_uint32_t slot_size;             /* bytes per slot, aligned */
+    apr_uint32_t value_max;             /* max. bytes of a message */
+    apr_uint32_t pid;                   /* subscriber process */
+    volatile apr_uint32_t used;         /* slots holding a topic */
+    volatile apr_uint32_t updates;      /* messages stored */
+    volatile apr_uint32_t skipped;      /* messages too large or without room */
+    volatile apr_uint32_t hits;         /* lookups answered */
+    volatile apr_uint32_t stale;        /* lookups finding a message too old */
+    volatile apr_uint32_t misses;       /* lookups finding nothing */
+    };
+
+/* one topic and its newest message. seq is odd while the subscriber
+ * writes, readers retry if it was odd or changed while they copied. */
+struct cache_slot
+    {
+    volatile apr_uint32_t seq;
+    apr_uint32_t len;                   /* message bytes */
+    apr_time_t stamp;                   /* apr_time_now() of the message, 0 for a free slot */
+    char topic[MQTT_CACHE_TOPIC];
+    char data[];                        /* message, NUL terminated */
+    };
+
+static struct cache_hdr *cache = NULL;          /* the shared memory, NULL without cache */
+static struct mosquitto *cache_mosq = NULL;     /* subscriber process only */
+
+/** forget the cache of a configuration that is going away, the shared
+  * memory goes with its pool
+  * \param data unused
+  * \return APR_SUCCESS
+  */
+static apr_status_t cache_cleanup ( void *data )
+    {
+    cache = NULL;
+    return APR_SUCCESS;
+    }
+
+/** slot n
+  * \param n index, below cache->slots
+  * \return slot
+  */
+static struct cache_slot *cache_slot ( apr_uint32_t n )
+    {
+    return ( struct cache_slot * ) ( ( char * ) ( cache + 1 ) + ( apr_size_t ) n * cache->slot_size );
+    }
+
+/** first slot a topic may live in, it is one of the MQTT_CACHE_PROBES from there
+  * \param topic topic
+  * \return index
+  */
+static apr_uint32_t cache_home ( const char *topic )
+    {
+    apr_uint32_t h = 2166136261u;       /* FNV-1a */
+
+    while ( *topic )
+        h = ( h ^ ( unsigned char ) *topic++ ) * 16777619u;
+    return h % cache->slots;
+    }
+
+/** create the shared memory, at configuration time before the children
+  * are forked
+  * \param pool configuration pool, the memory lives as long as it
+  * \param slots topics kept
+  * \param value_max max. bytes of a message
+  * \return MOSQ_ERR_SUCCESS or MOSQ_ERR_NOMEM
+  */
+int mqtt_cache_create ( apr_pool_t *pool, int slots, int value_max )
+    {
+    apr_size_t slot_size = APR_ALIGN_DEFAULT ( sizeof ( struct cache_slot ) + value_max + 1 );
+    apr_shm_t *shm;
+    apr_status_t rv;
+
+    rv = apr_shm_create ( &shm, sizeof ( struct cache_hdr ) + slot_size * slots, NULL, pool );
+    if ( rv != APR_SUCCESS )
+        {
+        LPRINTF ( "mod_mqtt: no shared memory for %d cache slots: %d\n", slots, rv );
+        return MOSQ_ERR_NOMEM;
+        }
+
+    cache = apr_shm_baseaddr_get ( shm );
+    memset ( cache, 0, sizeof ( struct cache_hdr ) + slot_size * slots );
+    cache->slots = slots;
+    cache->slot_size = slot_size;
+    cache->value_max = value_max;
+    apr_pool_cleanup_register ( pool, NULL, cache_cleanup, apr_pool_cleanup_null );
+
+    return MOSQ_ERR_SUCCESS;
+    }
+
+/** store the newest message of a topic, subscriber process only. An empty
+  * message (a retained message cleared) frees the slot.
+  * \param topic topic of the message
+  * \param payload message
+  * \param payloadlen message size
+  */
+static void cache_put ( const char *topic, const char *payload, int payloadlen )
+    {
+    apr_uint32_t home = cache_home ( topic ), n;
+    struct cache_slot *slot = NULL, *free_slot = NULL, *oldest = NULL;
+    int fits = ( payloadlen <= ( int ) cache->value_max && strlen ( topic ) < MQTT_CACHE_TOPIC );
+
+    for ( n = 0; n < MQTT_CACHE_PROBES && n < cache->slots; n++ )
+        {
+        struct cache_slot *probe = cache_slot ( ( home + n ) % cache->slots );
+
+        if ( probe->stamp && !strcmp ( probe->topic, topic ) )
+            {
+            slot = probe;
+            break;
+            }
+        if ( !probe->stamp && !free_slot )
+            free_slot = probe;
+        if ( probe->stamp && ( !oldest || probe->stamp < oldest->stamp ) )
+            oldest = probe;
+        }
+
+    /* a message that does not fit must not leave an older one behind */
+    if ( !fits || !payloadlen )
+        {
+        if ( slot )
+            {
+            slot->seq++;
+            __sync_synchronize();
+            slot->stamp = 0;
+            slot->topic[0] = 0;
+            __sync_synchronize();
+            slot->seq++;
+            apr_atomic_dec32 ( &cache->used );
+            }
+        if ( !fits )
+            apr_atomic_inc32 ( &cache->skipped );
+        return;
+        }
+
+    if ( !slot )
+        {
+        slot = ( free_slot ? free_slot : oldest );
+        if ( !slot )
+            {
+            apr_atomic_inc32 ( &cache->skipped );
+            return;
+            }
+        if ( !slot->stamp )
+            apr_atomic_inc32 ( &cache->used );
+        }
+
+    slot->seq++;
+    __sync_synchronize();
+    strcpy ( slot->topic, topic );
+    memcpy ( slot->data, payload, payloadlen );
+    slot->data[payloadlen] = 0;
+    slot->len = payloadlen;
+    slot->stamp = apr_time_now();
+    __sync_synchronize();
+    slot->seq++;
+
+    apr_atomic_inc32 ( &cache->updates );
+    }
+
+/** the newest message of a topic, if it is recent enough
+  * \param pool request pool, gets the copy
+  * \param topic topic, no wildcards
+  * \param max_stale max. age of the message, 0 for any
+  * \param value copy of the message
+  * \param len message size
+  * \param age age of the message
+  * \return MOSQ_ERR_SUCCESS or MQTT_ERR_NOT_FOUND if it is missing or too old
+  */
+int mqtt_cache_get ( apr_pool_t *pool, const char *topic, apr_interval_time_t max_stale,
+                     char **value, int *len, apr_interval_time_t *age )
+    {
+    apr_uint32_t home, n;
+    char *buf;
+    int found = 0;
+
+    if ( !cache || strlen ( topic ) >= MQTT_CACHE_TOPIC )
+        return MQTT_ERR_NOT_FOUND;
+
+    home = cache_home ( topic );
+    buf = apr_palloc ( pool, cache->value_max + 1 );
+
+    for ( n = 0; n < MQTT_CACHE_PROBES && n < cache->slots && !found; n++ )
+        {
+        struct cache_slot *slot = cache_slot ( ( home + n ) % cache->slots );
+        int tries;
+
+        /* the subscriber writes a slot in microseconds, a few retries do */
+        for ( tries = 0; tries < 4; tries++ )
+            {
+            apr_uint32_t seq = slot->seq;
+            apr_time_t stamp;
+            apr_uint32_t size;
+
+            if ( seq & 1 )
+                continue;
+            __sync_synchronize();
+            stamp = slot->stamp;
+            size = slot->len;
+            found = ( stamp && size <= cache->value_max && !strncmp ( slot->topic, topic, MQTT_CACHE_TOPIC ) );
+            if ( found )
+                memcpy ( buf, slot->data, size );
+            __sync_synchronize();
+            if ( slot->seq != seq )
+                {
+                found = 0;
+                continue;
+                }
+
+            if ( found )
+                {
+                buf[size] = 0;
+                *value = buf;
+                *len = size;
+                *age = apr_time_now() - stamp;
+                }
+            break;
+            }
+        }
+
+    if ( !found )
+        {
+        apr_atomic_inc32 ( &cache->misses );
+        return MQTT_ERR_NOT_FOUND;
+        }
+    if ( max_stale > 0 && *age > max_stale )
+        {
+        apr_atomic_inc32 ( &cache->stale );
+        return MQTT_ERR_NOT_FOUND;
+        }
+
+    apr_atomic_inc32 ( &cache->hits );
+    return MOSQ_ERR_SUCCESS;
+    }
+
+/** subscribe to the cached filters, on every CONNACK
+  * \param mosq object
+  * \param obj filters, NULL terminated
+  * \param result from connect operation
+  */
+static void cache_connect_callback ( struct mosquitto *mosq, void *obj, int result )
+    {
+    const char **filter;
+
+    if ( result )
+        {
+        LPRINTF ( "mod_mqtt cache: %s\n", mosquitto_connack_string ( result ) );
+        return;
+        }
+    for ( filter = ( const char ** ) obj; *filter; filter++ )
+        mosquitto_subscribe ( mosq, NULL, *filter, 0 );
+    }
+
+/** keep the newest message of a topic
+  * \param mosq object
+  * \param obj filters
+  * \param message message received
+  */
+static void cache_message_callback ( struct mosquitto *mosq, void *obj, const struct mosquitto_message *message )
+    {
+    cache_put ( message->topic, ( const char * ) message->payload, message->payloadlen );
+    }
+
+/** the subscriber process: stays connected to the broker, reconnects with
+  * backoff, exits when httpd is gone
+  * \param pool configuration pool
+  * \param broker where the topics are published
+  * \param filters topic filters, NULL terminated
+  * \param drop gives up root, as the children do
+  * \param data for drop
+  */
+static void cache_subscriber ( apr_pool_t *pool, const struct mqtt_broker *broker, const char **filters,
+                               int ( *drop ) ( apr_pool_t *pool, void *data ), void *data )
+    {
+    pid_t parent = getppid();
+    struct mosq_config cfg;
+    apr_uint32_t backoff = 0;
+    unsigned int seed = ( unsigned int ) getpid();
+    int rc;
+#ifdef WITH_TLS
+    SSL_CTX *ctx = NULL;
+#endif
+
+    signal ( SIGTERM, SIG_DFL );
+    signal ( SIGHUP, SIG_DFL );
+
+#ifdef WITH_TLS
+    /* key files may be readable by root only */
+    if ( broker->tls )
+        ctx = ( mqtt_tls_init ( pool ) == MOSQ_ERR_SUCCESS ? mqtt_tls_context ( broker->tls ) : NULL );
+#endif
+    if ( drop ( pool, data ) )
+        {
+        LPRINTF ( "mod_mqtt cache: cannot switch to the User and Group of httpd\n" );
+        exit ( 1 );
+        }
+    mosquitto_lib_init();
+
+    init_config ( pool, &cfg );
+    if ( client_config_conn ( &cfg, broker ) != MOSQ_ERR_SUCCESS )
+        exit ( 1 );
+    cfg.id = apr_psprintf ( pool, "mod_mqtt-cache-%d", ( int ) getpid() );
+
+    cache_mosq = mosquitto_new ( cfg.id, true, ( void * ) filters );
+    if ( !cache_mosq || client_opts_set ( cache_mosq, &cfg ) )
+        {
+        LPRINTF ( "mod_mqtt cache: no client for %s\n", cfg.host );
+        exit ( 1 );
+        }
+#ifdef WITH_TLS
+    if ( broker->tls )
+        {
+        if ( !ctx || mosquitto_opts_set ( cache_mosq, MOSQ_OPT_SSL_CTX, ctx ) )
+            {
+            LPRINTF ( "mod_mqtt cache: TLS for %s unavailable\n", cfg.host );
+            exit ( 1 );
+            }
+        }
+#endif
+    mosquitto_connect_callback_set ( cache_mosq, cache_connect_callback );
+    mosquitto_message_callback_set ( cache_mosq, cache_message_callback );
+
+    rc = client_connect ( cache_mosq, &cfg );
+    while ( getppid() == parent )
+        {
+        if ( rc == MOSQ_ERR_SUCCESS )
+            rc = mosquitto_loop ( cache_mosq, 1000, 1 );
+        if ( rc != MOSQ_ERR_SUCCESS )
+            {
+            apr_uint32_t wait = mqtt_backoff ( backoff, &seed, &backoff );
+
+            DPRINTF ( "cache subscriber: %s, reconnect in %u ms\n", mosquitto_strerror ( rc ), wait );
+            apr_sleep ( apr_time_from_msec ( wait ) );
+            rc = mosquitto_reconnect ( cache_mosq );
+            }
+        else
+            backoff = 0;
+        }
+
+    mosquitto_destroy ( cache_mosq );
+    exit ( 0 );
+    }
+
+/** fork the subscriber process, at configuration time. It is killed when
+  * the configuration goes away, a restart forks a new one.
+  * \param pool configuration pool
+  * \param broker where the topics are published, strings from the configuration
+  * \param filters topic filters to cache
+  * \param drop run in the subscriber before it connects, gives up root
+  *        as the children do, 0 on success
+  * \param data for drop
+  * \return MOSQ_ERR_SUCCESS or ...
+  */
+int mqtt_cache_start ( apr_pool_t *pool, const struct mqtt_broker *broker, const apr_array_header_t *filters,
+                       int ( *drop ) ( apr_pool_t *pool, void *data ), void *data )
+    {
+    const char **list = apr_pcalloc ( pool, ( filters->nelts + 1 ) * sizeof ( const char * ) );
+    apr_proc_t *proc = apr_pcalloc ( pool, sizeof ( apr_proc_t ) );
+    apr_status_t rv;
+
+    if ( !cache )
+        return MOSQ_ERR_INVAL;
+    memcpy ( list, filters->elts, filters->nelts * sizeof ( const char * ) );
+
+    rv = apr_proc_fork ( proc, pool );
+    if ( rv == APR_INCHILD )
+        cache_subscriber ( pool, broker, list, drop, data );
+    if ( rv != APR_INPARENT )
+        {
+        LPRINTF ( "mod_mqtt: cannot fork the cache subscriber: %d\n", rv );
+        return MOSQ_ERR_ERRNO;
+        }
+
+    cache->pid = proc->pid;
+    apr_pool_note_subprocess ( pool, proc, APR_KILL_AFTER_TIMEOUT );
+    return MOSQ_ERR_SUCCESS;
+    }
+
+/** a line for the status page
+  * \param pool request pool
+  * \return text, empty without cache
+  */
+const char *mqtt_cache_report ( apr_pool_t *pool )
+    {
+    if ( !cache )
+        return "";
+
+    return apr_psprintf ( pool, "lastvalue cache: %u of %u slots, %u updates, %u skipped, "
+                          "%u hits, %u stale, %u misses, subscriber pid %u\n",
+                          apr_atomic_read32 ( &cache->used ), cache->slots,
+                          apr_atomic_read32 ( &cache->updates ), apr_atomic_read32 ( &cache->skipped ),
+                          apr_atomic_read32 ( &cache->hits ), apr_atomic_read32 ( &cache->stale ),
+                          apr_atomic_read32 ( &cache->misses ), cache->pid );
+    }
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #ifndef WIN32
 #include <unistd.h>
 #else
@@ -38,6 +39,63 @@ void init_config ( apr_pool_t *pool, struct mosq_config *cfg )
 
     }
 
+/** monotonic clock for request deadlines, immune to wall clock steps
+  * \return microseconds since some fixed point
+  */
+apr_time_t mqtt_clock ( void )
+    {
+    struct timespec ts;
+
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    return ( apr_time_t ) ts.tv_sec * APR_USEC_PER_SEC + ts.tv_nsec / 1000;
+    }
+
+/** the entity tag of an answer: the responder's if it is fit for a
+  * header, printable characters without quotes inside as a strong or weak
+  * (W/) tag, else a hash of the body
+  * \param buf set to the quoted tag, MQTT_ETAG_LEN bytes
+  * \param etag entity tag of the responder, quoted or not, NULL for none
+  * \param data body
+  * \param len body size
+  */
+void mqtt_etag ( char *buf, const char *etag, const char *data, apr_size_t len )
+    {
+    const char *weak = "";
+    apr_uint64_t h = APR_UINT64_C ( 14695981039346656037 );   /* FNV-1a */
+    apr_size_t n = 0, i;
+
+    if ( etag && !strncmp ( etag, "W/", 2 ) )
+        {
+        weak = "W/";
+        etag += 2;
+        }
+    if ( etag )
+        {
+        n = strlen ( etag );
+        if ( n >= 2 && etag[0] == '"' && etag[n - 1] == '"' )
+            {
+            etag++;
+            n -= 2;
+            }
+        }
+    if ( n > MQTT_ETAG_MAX )
+        n = 0;
+
+    /* etagc: no CTLs, space, DEL or '"' */
+    for ( i = 0; i < n; i++ )
+        if ( ( unsigned char ) etag[i] <= 0x20 || ( unsigned char ) etag[i] >= 0x7f || etag[i] == '"' )
+            break;
+    if ( n && i == n )
+        {
+        snprintf ( buf, MQTT_ETAG_LEN, "%s\"%.*s\"", weak, ( int ) n, etag );
+        return;
+        }
+
+    for ( i = 0; i < len; i++ )
+        h = ( h ^ ( unsigned char ) data[i] ) * APR_UINT64_C ( 1099511628211 );
+    snprintf ( buf, MQTT_ETAG_LEN, "\"%016" APR_UINT64_T_HEX_FMT "\"", h );
+    }
+
 /** free memory consumed - noop, we use the request pool
   * \param cfg config to initialize
   */
@@ -61,6 +119,18 @@ int client_config_basic (apr_pool_t *pool,  struct mosq_config *cfg, const char
     return MOSQ_ERR_SUCCESS ;
     }
 
+/** the port to connect to, as for pooled connections
+  * \param host broker host or unix:/path, NULL for localhost
+  * \param port configured port, 0 for the default
+  * \return port, 1883 by default and 0 for a unix socket
+  */
+static int client_port ( const char *host, int port )
+    {
+    if ( host && !strncmp ( host, MQTT_UNIX_PREFIX, strlen ( MQTT_UNIX_PREFIX ) ) )
+        return 0;
+    return ( port > 0 ? port : 1883 );
+    }
+
 /** set config for publishing
   * \param cfg config to initialize
   * \param mqtt_server buffer
@@ -73,9 +143,9 @@ int client_config_pub (struct mosq_config * cfg, const char * mqtt_server, int m
 {
     apr_pool_t *pool = cfg -> pool ;
 
-    cfg->port = mqtt_port;
+    cfg->port = client_port ( mqtt_server, mqtt_port );
 
-    if ( cfg->port < 1 || cfg->port > 65535 )
+    if ( cfg->port > 65535 )
         {
         fprintf ( stderr, "Error: Invalid port given: %d\n", cfg->port );
         return 1;
@@ -114,24 +184,25 @@ int client_config_pub (struct mosq_config * cfg, const char * mqtt_server, int m
   * \param mqtt_server buffer
   * \param mqtt_port buffer size
   * \param topic mqtt topic
+  * \param msg_count answers to collect, 0 for any number
   * \return MOSQ_ERR_SUCCESS
   */
 int client_config_sub (struct mosq_config * cfg, const char * mqtt_server, int mqtt_port, 
-                        const char * topic)
+                        const char * topic, int msg_count)
 {
     apr_pool_t *pool = cfg -> pool ;
 
-    cfg->port = mqtt_port;
+    cfg->port = client_port ( mqtt_server, mqtt_port );
 
-    if ( cfg->port < 1 || cfg->port > 65535 )
+    if ( cfg->port > 65535 )
         {
         fprintf ( stderr, "Error: Invalid port given: %d\n", cfg->port );
         return 1;
         }
     /* cfg->bind_address = xstrdup ( pool, mqtt_server ); */
-    cfg->msg_count = 1;
+    cfg->msg_count = msg_count;
 
-    if ( cfg->msg_count < 1 )
+    if ( cfg->msg_count < 0 )
         {
         fprintf ( stderr, "Error: Invalid message count \"%d\".\n\n", cfg->msg_count );
         return 1;
@@ -156,6 +227,43 @@ int client_config_sub (struct mosq_config * cfg, const char * mqtt_server, int m
     return MOSQ_ERR_SUCCESS;
     }
 
+/** set config for a pooled broker connection
+  * \param cfg config to initialize
+  * \param broker host, port and credentials to connect with
+  * \return MOSQ_ERR_SUCCESS
+  */
+int client_config_conn (struct mosq_config * cfg, const struct mqtt_broker *broker)
+{
+    apr_pool_t *pool = cfg -> pool ;
+
+    /* unix:/path, port 0 tells client_connect */
+    cfg->port = client_port ( broker->host, broker->port );
+
+    if ( cfg->port > 65535 )
+        {
+        fprintf ( stderr, "Error: Invalid port given: %d\n", cfg->port );
+        return 1;
+        }
+
+    cfg->host = xstrdup ( pool, ( broker->host ? broker->host : "localhost" ) );
+
+    if ( broker->username )
+        {
+        cfg->username = xstrdup ( pool, broker->username );
+        cfg->password = ( broker->password ? xstrdup ( pool, broker->password ) : NULL );
+        }
+
+    if ( broker->protocol )
+        cfg->protocol_version = broker->protocol;
+
+    if ( broker->max_inflight > 0 )
+        cfg->max_inflight = broker->max_inflight;
+
+    cfg->quiet = true ;
+
+    return MOSQ_ERR_SUCCESS;
+    }
+
 /** load configuration
   * \param pool request memory pool
   * \param cfg config to initialize
@@ -429,7 +537,6 @@ int client_opts_set ( struct mosquitto *mosq, struct mosq_config *cfg )
         if ( !cfg->quiet )
             fprintf ( stderr, "Error: Problem setting will.\n" );
 
-        mosquitto_lib_cleanup();
         return 1;
         }
 
@@ -438,7 +545,6 @@ int client_opts_set ( struct mosquitto *mosq, struct mosq_config *cfg )
         if ( !cfg->quiet )
             fprintf ( stderr, "Error: Problem setting username and password.\n" );
 
-        mosquitto_lib_cleanup();
         return 1;
         }
 
@@ -450,7 +556,6 @@ int client_opts_set ( struct mosquitto *mosq, struct mosq_config *cfg )
         if ( !cfg->quiet )
             fprintf ( stderr, "Error: Problem setting TLS options.\n" );
 
-        mosquitto_lib_cleanup();
         return 1;
         }
 
@@ -459,7 +564,6 @@ int client_opts_set ( struct mosquitto *mosq, struct mosq_config *cfg )
         if ( !cfg->quiet )
             fprintf ( stderr, "Error: Problem setting TLS insecure option.\n" );
 
-        mosquitto_lib_cleanup();
         return 1;
         }
 
@@ -470,7 +574,6 @@ int client_opts_set ( struct mosquitto *mosq, struct mosq_config *cfg )
         if ( !cfg->quiet )
             fprintf ( stderr, "Error: Problem setting TLS-PSK options.\n" );
 
-        mosquitto_lib_cleanup();
         return 1;
         }
 
@@ -481,7 +584,6 @@ int client_opts_set ( struct mosquitto *mosq, struct mosq_config *cfg )
         if ( !cfg->quiet )
             fprintf ( stderr, "Error: Problem setting TLS options.\n" );
 
-        mosquitto_lib_cleanup();
         return 1;
         }
 
@@ -495,7 +597,6 @@ int client_opts_set ( struct mosquitto *mosq, struct mosq_config *cfg )
 
         if ( rc )
             {
-            mosquitto_lib_cleanup();
             return rc;
             }
         }
@@ -525,7 +626,6 @@ int client_id_generate ( struct mosq_config *cfg, const char *id_base )
             if ( !cfg->quiet )
                 fprintf ( stderr, "Error: Out of memory.\n" );
 
-            mosquitto_lib_cleanup();
             return 1;
             }
 
@@ -544,7 +644,6 @@ int client_id_generate ( struct mosq_config *cfg, const char *id_base )
             if ( !cfg->quiet )
                 fprintf ( stderr, "Error: Out of memory.\n" );
 
-            mosquitto_lib_cleanup();
             return 1;
             }
 
@@ -560,7 +659,7 @@ int client_id_generate ( struct mosq_config *cfg, const char *id_base )
     return MOSQ_ERR_SUCCESS;
     }
 
-/** connect our client to the server
+/** start connecting our client to the server, CONNACK arrives in the reactor
   * \param mosq 
   * \param cfg config with options
   * \return MOSQ_ERR_SUCCESS or ..
@@ -570,6 +669,8 @@ int client_connect ( struct mosquitto *mosq, struct mosq_config *cfg )
     {
     char err[1024];
     int rc;
+    /* libmosquitto takes port 0 as "host is a unix socket path" */
+    const char *host = ( cfg->port ? cfg->host : cfg->host + strlen ( MQTT_UNIX_PREFIX ) );
 
     DPRINTF( "client_connect: %s %d %d %s\n", cfg->host, cfg->port, cfg->keepalive, cfg->bind_address);
 #ifdef WITH_SRV
@@ -581,12 +682,12 @@ int client_connect ( struct mosquitto *mosq, struct mosq_config *cfg )
         }
     else
         {
-        rc = mosquitto_connect_bind ( mosq, cfg->host, cfg->port, cfg->keepalive, cfg->bind_address );
+        rc = mosquitto_connect_bind_async ( mosq, host, cfg->port, cfg->keepalive, cfg->bind_address );
         }
 
 #else
     DPRINTF("client_connect_bind\n") ;
-    rc = mosquitto_connect_bind ( mosq, cfg->host, cfg->port, cfg->keepalive, cfg->bind_address );
+    rc = mosquitto_connect_bind_async ( mosq, host, cfg->port, cfg->keepalive, cfg->bind_address );
 #endif
 
     DPRINTF("client_connect %d:\n", rc) ;
@@ -613,7 +714,6 @@ int client_connect ( struct mosquitto *mosq, struct mosq_config *cfg )
                 }
             }
 
-        mosquitto_lib_cleanup();
         return rc;
         }
      cfg->connected = 1;
@@ -9,6 +9,13 @@
 #include <mosquitto.h>
 #include "apr.h"
 #include "apr_tables.h"
+#include "apr_hash.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_proc.h"
+#ifdef WITH_TLS
+#include <openssl/ssl.h>
+#endif
 
 #ifdef DEBUG
 #define DPRINTF(format, ...) fprintf(stderr, format, ##__VA_ARGS__)
@@ -37,6 +44,158 @@
 #define STATUS_WAITING 2
 #define STATUS_DISCONNECTING 3
 
+/* pooled connection states */
+#define CONN_DOWN 0
+#define CONN_CONNECTING 1
+#define CONN_UP 2
+
+/* seconds to wait for CONNACK on a pooled connection */
+#define MQTT_CONNECT_TIMEOUT 5
+
+/* seconds to wait for an answer to a query without MQTTTimeout */
+#define MQTT_RESPONSE_TIMEOUT 5
+
+/* JSON field telling responders when we stop waiting, ms since the epoch */
+#define MQTT_DEADLINE_KEY "deadline"
+
+/* no answer in time, outside of the MOSQ_ERR_* range */
+#define MQTT_ERR_TIMEOUT 1000
+
+/* outbound queue full: publish refused or dropped by the overflow policy */
+#define MQTT_ERR_QUEUE_FULL 1001
+#define MQTT_ERR_DROPPED 1002
+
+/* MQTTMode retained: the broker holds no retained message for the topic */
+#define MQTT_ERR_NOT_FOUND 1003
+
+/* outbound queue overflow policies */
+#define MQTT_OVERFLOW_REJECT 0
+#define MQTT_OVERFLOW_DROP 1
+#define MQTT_OVERFLOW_WAIT 2
+
+/* outbound queue defaults: publishes queued per child, per batch, ms per batch */
+#define MQTT_OUTBOUND_SIZE 1000
+#define MQTT_BATCH_SIZE 64
+#define MQTT_BATCH_DELAY 5
+
+/* reactor job types */
+#define JOB_PUBLISH 1
+#define JOB_SUBSCRIBE 2
+#define JOB_SEND 3                  /* fire-and-forget publish, batched */
+#define JOB_REPLAY 4                /* JOB_SEND from the spool */
+#define JOB_CONNECT 5               /* bring the connection up, nothing else */
+#define JOB_WATCH 6                 /* subscribe for a stream hub */
+#define JOB_UNWATCH 7               /* unsubscribe, unless requests use the filter too */
+#define JOB_RETAINED 8              /* fetch the retained message of a topic */
+#define JOB_BURST 9                 /* publish of a batch request, batched like JOB_SEND */
+
+/* unsubscribed after the SUBSCRIBE of a topic that stays subscribed: its
+   UNSUBACK tells all retained messages are in */
+#define MQTT_RETAINED_FENCE "$mod_mqtt/fence"
+
+/* correlation ids: 16 hex digits + NUL */
+#define MQTT_CORRELATION_LEN 17
+
+/* JSON field carrying the correlation id in queries and answers */
+#define MQTT_CORRELATION_KEY "correlation-id"
+
+/* shards of the correlation id -> waiting request map */
+#define MQTT_MUX_SHARDS 16
+
+/* broker ring: points per broker, max. brokers, circuit breaker table size */
+#define MQTT_RING_POINTS 64
+#define MQTT_RING_MAX 64
+#define MQTT_HEALTH_SLOTS 256
+
+/* circuit breaker: connect failures in a row that open it, max. seconds
+ * it stays open, first reconnect backoff in ms. See MQTTBreaker */
+#define MQTT_BREAKER_FAILURES 5
+#define MQTT_BREAKER_MAX 30
+#define MQTT_BACKOFF_MIN 500
+
+/* spool of failed fire-and-forget publishes, see MQTTSpool: files per
+ * directory, default and max. MB per file, replayed per second, when to msync */
+#define MQTT_SPOOL_FILES 256
+#define MQTT_SPOOL_SIZE 64
+#define MQTT_SPOOL_MAX_MB 4095
+#define MQTT_SPOOL_RATE 1000
+#define MQTT_SPOOL_SYNC_NEVER 0
+#define MQTT_SPOOL_SYNC_SECOND 1
+#define MQTT_SPOOL_SYNC_ALWAYS 2
+
+/* MQTTServer prefix of a broker reached through a unix domain socket */
+#define MQTT_UNIX_PREFIX "unix:"
+
+/* MQTT and TCP keepalive in seconds, see MQTTKeepAlive */
+#define MQTT_KEEPALIVE 60
+
+/* broker address cache, see MQTTDNSCache: default seconds an address is
+ * used before it is resolved again, seconds to retry a failed lookup */
+#define MQTT_DNS_TTL 60
+#define MQTT_DNS_RETRY 5
+
+/* seconds child start waits for warm connections, see MQTTWarmConnections */
+#define MQTT_WARM_WAIT 2
+
+/* request hedging: latency buckets (4 per octave of us), answers before the
+ * histogram is halved, answers needed before hedging starts, max. hedges
+ * saved up from quiet times */
+#define MQTT_HEDGE_BUCKETS 104
+#define MQTT_HEDGE_WINDOW 1024
+#define MQTT_HEDGE_MIN 20
+#define MQTT_HEDGE_BURST 10
+
+/* concurrency limits, see MQTTConcurrency: limit to start with, round trip
+ * in multiples of the lowest one lately that counts as congestion */
+#define MQTT_LIMIT_START 20
+#define MQTT_LIMIT_TOLERANCE 2
+
+/* MQTT v5: only topics at least this long get a topic alias */
+#define MQTT_ALIAS_MIN_LEN 16
+
+/* stream hubs, see MQTTMode stream: messages kept per topic, max. topics
+ * watched per child, seconds an unwatched topic keeps its subscription,
+ * seconds between keep-alive comments */
+#define MQTT_HUB_RING 64
+#define MQTT_HUB_MAX 1024
+#define MQTT_HUB_LINGER 30
+#define MQTT_HUB_PING 15
+
+/* last-value cache, see MQTTCacheSize and MQTTCacheStale: topics and
+ * bytes per message by default, max. topic length, slots a topic may
+ * live in, seconds a message is served by default */
+#define MQTT_CACHE_SLOTS 1024
+#define MQTT_CACHE_VALUE 4096
+#define MQTT_CACHE_TOPIC 256
+#define MQTT_CACHE_PROBES 8
+#define MQTT_CACHE_STALE 60
+
+/* MQTTCache modes */
+#define MQTT_CACHE_OFF 0
+#define MQTT_CACHE_LASTVALUE 1
+
+/* entity tags: max. length taken from a responder, buffer for one
+ * quoted, maybe weak */
+#define MQTT_ETAG_MAX 128
+#define MQTT_ETAG_LEN ( MQTT_ETAG_MAX + 5 )
+
+/* response cache, see MQTTResponseCache: answers kept per location and
+ * child, and what a lookup found */
+#define MQTT_RCACHE_ENTRIES 1024
+#define MQTT_RCACHE_MISS 0
+#define MQTT_RCACHE_FRESH 1
+#define MQTT_RCACHE_STALE 2
+
+/* max. reactor threads per child, see MQTTReactors */
+#define MQTT_MAX_REACTORS 16
+
+struct mqtt_conn ;
+struct mqtt_reactor ;
+struct mqtt_limit ;
+struct mqtt_rcache ;
+struct mqtt_hub ;
+struct mqtt_flight ;
+struct mqtt_waiter ;
 
 struct mosq_config
     {
@@ -104,14 +263,201 @@ struct mosq_config
     char *socks5_password;
 #endif
     apr_pool_t *pool;
+    struct mqtt_waiter *waiter; /* completion the request thread parks on */
+    const struct mqtt_broker *broker; /* where the request's jobs went */
+    struct mqtt_flight *flight; /* identical queries waiting for our answer, NULL if none */
+    };
+
+/* TLS settings of a configuration section, see MQTTTLS* */
+struct mqtt_tls
+    {
+    int enabled;                    /* 0 after MQTTTLS off */
+    const char *cafile;             /* NULL and no capath: system CAs */
+    const char *capath;
+    const char *certfile;           /* client certificate */
+    const char *keyfile;
+    const char *ciphers;
+    const char *version;            /* min. version, eg tlsv1.2 */
+    int insecure;                   /* no host name check */
+    const char *key;                /* all of the above, part of the connection key */
+    };
+
+/* where and as whom to connect, used as connection pool key */
+struct mqtt_broker
+    {
+    const char *host;
+    int port;
+    const char *username;
+    const char *password;
+    int protocol;                   /* MQTT_PROTOCOL_V31 .. V5, 0 for the default */
+    const struct mqtt_tls *tls;     /* NULL for plain TCP, lives as long as the configuration */
+    int max_inflight;               /* QoS 1/2 publishes awaiting their ack, 0 for the default */
+    int qos;                        /* of publishes, not part of the key */
+    int retain;                     /* of publishes, not part of the key */
+    };
+
+/* one message of a batch for mqtt_pub_records */
+struct mqtt_record
+    {
+    struct mqtt_broker broker;      /* where it goes */
+    const char *topic;              /* NULL to skip the record */
+    const char *msg;
+    int msglen;
+    int rc;                         /* set by mqtt_pub_records */
+    };
+
+/* request hedging of a location, see MQTTHedge: settings from the
+ * configuration and the latency histogram of the child, updated atomically */
+struct mqtt_hedge
+    {
+    int percentile;                 /* hedge once this share of answers would be in, 0 for off */
+    int budget;                     /* max. hedges in percent of requests */
+    const char *topic;              /* alternate topic, may have $variables, NULL for the same */
+    const char *host;               /* alternate broker, NULL for the same */
+    int port;                       /* of the alternate broker, 0 for MQTTPort */
+    volatile apr_uint32_t credit;   /* hedges left, in 1/100 */
+    volatile apr_uint32_t buckets[MQTT_HEDGE_BUCKETS]; /* answers per latency bucket */
+    };
+
+/* one broker of an MQTTServer list */
+struct mqtt_ring_node
+    {
+    const char *host;
+    int port;                       /* 0: use MQTTPort */
+    };
+
+/* place of a broker on the ring */
+struct mqtt_ring_point
+    {
+    apr_uint32_t hash;
+    int node;                       /* index into nodes */
+    };
+
+/* consistent hash ring over the brokers of an MQTTServer list, read-only after configuration */
+struct mqtt_ring
+    {
+    int count;                      /* brokers */
+    struct mqtt_ring_node *nodes;
+    struct mqtt_ring_point *points; /* count * MQTT_RING_POINTS, sorted by hash */
+    };
+
+/* one of several answers to a query, malloc'ed with its payload */
+struct mqtt_answer
+    {
+    struct mqtt_answer *next;
+    int len;
+    char data[];                    /* 0-terminated */
+    };
+
+/* a message of a stream hub, malloc'ed with its payload */
+struct mqtt_event
+    {
+    char id[32];                    /* SSE event id: hub epoch and sequence */
+    int len;
+    char data[];                    /* 0-terminated */
+    };
+
+/* request threads park on a waiter until a reactor completes their job */
+struct mqtt_waiter
+    {
+    struct mqtt_waiter *next;       /* free list link */
+    apr_thread_mutex_t *lock;
+    apr_thread_cond_t *cond;
+    volatile apr_uint32_t refs;     /* request thread and reactor */
+    int done;                       /* set by the reactor */
+    int rc;                         /* MOSQ_ERR_* or MQTT_ERR_TIMEOUT */
+    char *message;                  /* malloc'ed copy of the answer */
+    int msglen;
+    char correlation[MQTT_CORRELATION_LEN]; /* key in the response multiplexer */
+    void ( *notify ) ( void *baton ); /* called on completion instead of parking */
+    void *baton;
+    struct mqtt_waiter *follow;     /* next follower of the same flight */
+    int want;                       /* answers to collect, 0 for any number; 1 completes on the first */
+    int got;                        /* answers delivered, under the multiplexer's lock */
+    struct mqtt_answer *answers;    /* queued answers not taken yet when want != 1 */
+    struct mqtt_answer **tail;
+    };
+
+/* one unit of work for a reactor, malloc'ed with its strings */
+struct mqtt_job
+    {
+    struct mqtt_job * volatile next; /* submission queue link */
+    struct mqtt_job *link;          /* backlog or in-flight list link */
+    int type;                       /* JOB_* */
+    struct mqtt_broker broker;      /* copied from the request */
+    char *key;                      /* connection key derived from broker */
+    char *topic;
+    char *payload;
+    int payloadlen;
+    int qos;
+    int retain;
+    char *response;                 /* v5 response topic or NULL */
+    char correlation[MQTT_CORRELATION_LEN]; /* v5 correlation data, empty if none */
+    int expiry;                     /* v5 message expiry interval in seconds, 0 for none */
+    int mid;                        /* message id once handed to mosquitto */
+    int last;                       /* JOB_BURST: last of the burst for its connection, flushes it */
+    apr_time_t deadline;            /* mqtt_clock() the request gives up, 0 for none */
+    struct mqtt_waiter *waiter;     /* NULL if nobody waits */
+    };
+
+/* long-lived broker connection, owned and driven by one reactor thread */
+struct mqtt_conn
+    {
+    struct mqtt_conn *next;         /* next connection of the same reactor */
+    struct mqtt_reactor *reactor;   /* the only thread touching mosq */
+    const char *key;                /* host, port and credentials */
+    struct mqtt_broker broker;      /* the same, copied to the reactor pool */
+    struct mosq_config cfg;         /* connection settings, from the reactor pool */
+    struct mosquitto *mosq;         /* client handle, kept across requests */
+    int state;                      /* CONN_DOWN, CONN_CONNECTING or CONN_UP */
+    int sock;                       /* fd registered with epoll or -1 */
+    int events;                     /* epoll events registered for sock */
+    apr_time_t connect_by;          /* mqtt_clock() the current connect attempt times out */
+    apr_time_t retry_at;            /* mqtt_clock() of the next reconnect */
+    apr_uint32_t backoff;           /* ms of the last reconnect backoff, 0 after CONNACK */
+    unsigned int seed;              /* jitter */
+    struct mqtt_job *backlog;       /* jobs waiting for CONNACK */
+    struct mqtt_job *sending;       /* publish inside mosquitto_publish */
+    struct mqtt_job *pubs;          /* publishes waiting to be sent */
+    struct mqtt_job *batch;         /* fire-and-forget publishes not yet flushed */
+    struct mqtt_job *fences;        /* JOB_RETAINED waiting for their UNSUBACK */
+    int batched;                    /* jobs on batch */
+    apr_time_t batch_since;         /* mqtt_clock() of the oldest batched job */
+    apr_hash_t *filters;            /* long-lived response subscriptions */
+    apr_pool_t *alias_pool;         /* v5 topic aliases, cleared on reconnect */
+    apr_hash_t *aliases;            /* topic -> alias number */
+    int alias_max;                  /* topic alias maximum from CONNACK */
+    int alias_count;                /* aliases assigned since CONNACK */
+    apr_uint32_t spool_seen;        /* spool generation without records for us */
+    };
+
+/* I/O thread owning broker sockets, fed through a lock-free queue */
+struct mqtt_reactor
+    {
+    apr_pool_t *pool;               /* only used by the reactor thread */
+    apr_thread_t *thread;
+    int epfd;                       /* epoll set: evfd and broker sockets */
+    int evfd;                       /* eventfd, wakes the reactor for new jobs */
+    volatile apr_uint32_t sleeping; /* reactor is (about to be) in epoll_wait */
+    volatile apr_uint32_t stop;
+    struct mqtt_job * volatile head; /* producers push here */
+    struct mqtt_job *tail;          /* reactor pops here */
+    struct mqtt_job stub;           /* keeps the queue non-empty */
+    apr_hash_t *conns;              /* key -> connection */
+    struct mqtt_conn *all;
     };
 
 int mosquitto__parse_socks_url ( struct mosq_config *cfg, char *url );
 int client_config_line_proc ( struct mosq_config *cfg, int pub_or_sub, int argc, char *argv[] );
 
+void init_config ( apr_pool_t *pool, struct mosq_config *cfg );
+apr_time_t mqtt_clock ( void );
+void mqtt_etag(char *buf, const char *etag, const char *data, apr_size_t len);
 int client_config_basic (apr_pool_t *pool,  struct mosq_config *cfg, const char * msg, int msglen);
 int client_config_pub (struct mosq_config *cfg, const char * mqtt_server, int mqtt_port, const char * topic);
-int client_config_sub (struct mosq_config *cfg, const char * mqtt_server, int mqtt_port, const char * topic);
+int client_config_sub (struct mosq_config *cfg, const char * mqtt_server, int mqtt_port, const char * topic,
+                       int msg_count);
+int client_config_conn (struct mosq_config *cfg, const struct mqtt_broker *broker);
 
 int client_config_load (apr_pool_t *pool, struct mosq_config *config, int pub_or_sub, int argc, char *argv[] );
 
@@ -120,10 +466,142 @@ int client_opts_set ( struct mosquitto *mosq, struct mosq_config *cfg );
 int client_id_generate ( struct mosq_config *cfg, const char *id_base );
 int client_connect ( struct mosquitto *mosq, struct mosq_config *cfg );
 
-int  mqtt_pub(apr_pool_t *pool, const char * mqtt_server, int mqtt_port, const char * topic, const char * msg, int msglen);
-int  mqtt_sub(apr_pool_t *pool, const char * mqtt_server, int mqtt_port, const char * topic, char ** response, int * responselen);
-int  mqtt_sub_prepare(apr_pool_t *pool, const char * mqtt_server, int mqtt_port, const char * topic,
-         struct mosq_config ** pcfg,  struct mosquitto ** pmosq);
-int  mqtt_sub_loop(apr_pool_t *pool, struct mosq_config *pcfg,  struct mosquitto *pmosq, char ** response, int * responselen);
+void mqtt_conn_init(int nodelay, int sndbuf, int rcvbuf, int keepalive);
+struct mqtt_conn *mqtt_conn_create(struct mqtt_reactor *reactor, const struct mqtt_broker *broker, const char *key);
+void mqtt_conn_destroy(struct mqtt_conn *conn);
+void mqtt_conn_execute(struct mqtt_conn *conn, struct mqtt_job *job);
+void mqtt_conn_timer(struct mqtt_conn *conn, apr_time_t now, int tick);
+apr_time_t mqtt_conn_due(struct mqtt_conn *conn);
+void mqtt_conn_lost(struct mqtt_conn *conn, int rc);
+void mqtt_conn_pub_done(struct mqtt_conn *conn, int mid);
+void mqtt_conn_flush(struct mqtt_conn *conn, apr_time_t now);
+void mqtt_conn_replay(struct mqtt_conn *conn);
+int  mqtt_conn_retained(struct mqtt_conn *conn, const struct mosquitto_message *message);
+void mqtt_conn_unsub_done(struct mqtt_conn *conn, int mid);
+
+int  mqtt_reactor_init(apr_pool_t *pool, int count);
+void mqtt_reactor_submit(struct mqtt_job *job);
+void mqtt_reactor_submit_to(int index, struct mqtt_job *job);
+int  mqtt_reactor_count(void);
+void mqtt_reactor_watch(struct mqtt_conn *conn);
+
+struct mqtt_job *mqtt_job_create(int type, const struct mqtt_broker *broker, const char *topic,
+         const char *payload, int payloadlen, const char *response);
+void mqtt_job_finish(struct mqtt_job *job, int rc);
+int  mqtt_outbound_init(apr_pool_t *pool, int limit, int policy, int batch, int delay_ms);
+int  mqtt_outbound_reserve(apr_time_t deadline);
+void mqtt_outbound_done(void);
+int  mqtt_outbound_batch(void);
+apr_interval_time_t mqtt_outbound_delay(void);
+
+struct mqtt_ring *mqtt_ring_create(apr_pool_t *pool);
+const char *mqtt_ring_add(struct mqtt_ring *ring, apr_pool_t *pool, const char *spec);
+const struct mqtt_ring_node *mqtt_ring_pick(const struct mqtt_ring *ring, const char *topic, int port,
+                                             int *retry_after);
+const struct mqtt_ring_node *mqtt_ring_home(const struct mqtt_ring *ring, const char *topic);
+
+void mqtt_breaker_init(int failures, int max_s);
+apr_uint32_t mqtt_backoff(apr_uint32_t backoff, unsigned int *seed, apr_uint32_t *next);
+void mqtt_breaker_result(const char *host, int port, int up);
+int  mqtt_breaker_open(const char *host, int port);
+int  mqtt_breaker_allow(const char *host, int port, int *retry_after);
+
+int  mqtt_spool_init(apr_pool_t *pool, const char *dir, int size_mb, int sync, int rate);
+int  mqtt_spool_enabled(void);
+int  mqtt_spool_pending(void);
+int  mqtt_spool_put(const char *key, const char *topic, const char *payload, int payloadlen, int qos, int retain);
+void mqtt_spool_keys(apr_hash_t *keys);
+struct mqtt_job *mqtt_spool_get(const struct mqtt_broker *broker, const char *key, apr_uint32_t *seen);
+void mqtt_spool_flush(void);
+
+struct mqtt_hedge *mqtt_hedge_create(apr_pool_t *pool);
+apr_interval_time_t mqtt_hedge_delay(struct mqtt_hedge *hedge);
+int  mqtt_hedge_allow(struct mqtt_hedge *hedge);
+void mqtt_hedge_record(struct mqtt_hedge *hedge, apr_interval_time_t latency);
+
+struct mqtt_limit *mqtt_limit_create(apr_pool_t *pool, const char *name, int max, int queue_ms);
+int  mqtt_limit_init(apr_pool_t *pool);
+int  mqtt_limit_acquire(struct mqtt_limit *limit, apr_time_t deadline);
+void mqtt_limit_release(struct mqtt_limit *limit, apr_interval_time_t rtt, int ok);
+const char *mqtt_limit_report(apr_pool_t *pool);
+
+struct mqtt_rcache *mqtt_rcache_create(apr_pool_t *pool, const char *name, int ttl_ms, int swr_ms, int sie_ms);
+int  mqtt_rcache_init(apr_pool_t *pool);
+int  mqtt_rcache_get(struct mqtt_rcache *rc, apr_pool_t *pool, const char *key, int failed, int refresh_ms,
+         const char **ctype, const char **etag, const char **max_age, const char **data, int *len,
+         int *revalidate);
+void mqtt_rcache_put(struct mqtt_rcache *rc, const char *key, const char *ctype, const char *etag,
+         const char *max_age, const char *data, int len);
+int  mqtt_rcache_refresh(struct mqtt_rcache *rc, const char *key, struct mqtt_waiter *waiter);
+const char *mqtt_rcache_report(apr_pool_t *pool);
+
+int  mqtt_dns_init(apr_pool_t *pool, int ttl);
+void mqtt_dns_add(const char *host);
+int  mqtt_dns_lookup(const char *host, char *addr, int addrlen);
+
+#ifdef WITH_TLS
+int  mqtt_tls_init(apr_pool_t *pool);
+SSL_CTX *mqtt_tls_context(const struct mqtt_tls *tls);
+#endif
+
+int  mqtt_cache_create(apr_pool_t *pool, int slots, int value_max);
+int  mqtt_cache_start(apr_pool_t *pool, const struct mqtt_broker *broker, const apr_array_header_t *filters,
+                      int (*drop)(apr_pool_t *pool, void *data), void *data);
+int  mqtt_cache_get(apr_pool_t *pool, const char *topic, apr_interval_time_t max_stale,
+         char **value, int *len, apr_interval_time_t *age);
+const char *mqtt_cache_report(apr_pool_t *pool);
+
+int  mqtt_hub_init(apr_pool_t *pool);
+struct mqtt_hub *mqtt_hub_join(const struct mqtt_broker *broker, const char *topic);
+void mqtt_hub_leave(struct mqtt_hub *hub);
+void mqtt_hub_sweep(void);
+apr_uint64_t mqtt_hub_resume(struct mqtt_hub *hub, const char *last_event_id);
+int  mqtt_hub_deliver(const char *topic, const char *payload, int payloadlen);
+struct mqtt_event *mqtt_hub_next(struct mqtt_hub *hub, apr_uint64_t *seq, apr_time_t deadline);
+
+int  mqtt_mux_init(apr_pool_t *pool);
+void mqtt_mux_id(char *id);
+int  mqtt_mux_register(struct mqtt_waiter *waiter, const char *id);
+int  mqtt_mux_unregister(struct mqtt_waiter *waiter);
+int  mqtt_mux_deliver(const char *id, const char *payload, int payloadlen);
+struct mqtt_flight *mqtt_mux_join(const char *key, struct mqtt_waiter **follower);
+void mqtt_mux_land(struct mqtt_flight *flight, int rc, const char *message, int msglen);
+
+struct mqtt_waiter *mqtt_waiter_get(void);
+int  mqtt_waiter_wait(struct mqtt_waiter *waiter, apr_time_t deadline);
+void mqtt_waiter_complete(struct mqtt_waiter *waiter, int rc);
+void mqtt_waiter_queue(struct mqtt_waiter *waiter, const char *payload, int payloadlen, int last);
+int  mqtt_waiter_next(struct mqtt_waiter *waiter, apr_time_t deadline, struct mqtt_answer **answer);
+void mqtt_waiter_notify(struct mqtt_waiter *waiter, void ( *notify ) ( void *baton ), void *baton);
+void mqtt_waiter_release(struct mqtt_waiter *waiter);
+
+int  mqtt_pub(apr_pool_t *pool, const struct mqtt_broker *broker, const char * topic, const char * msg, int msglen,
+         const char * response, const char * correlation, apr_time_t deadline);
+int  mqtt_pub_submit(apr_pool_t *pool, const struct mqtt_broker *broker, const char * topic, const char * msg, int msglen,
+         const char * response, const char * correlation, apr_time_t deadline);
+int  mqtt_pub_records(apr_pool_t *pool, struct mqtt_record *records, int n, apr_time_t deadline);
+struct mqtt_job *mqtt_pub_job(apr_pool_t *pool, const struct mqtt_broker *broker, const char * topic, const char * msg,
+         int msglen, const char * response, const char * correlation, apr_time_t deadline);
+int  mqtt_post(apr_pool_t *pool, const struct mqtt_broker *broker, const char * topic, const char * msg, int msglen,
+         apr_time_t deadline);
+int  mqtt_sub(apr_pool_t *pool, const struct mqtt_broker *broker, const char * topic, const char * correlation,
+         char ** response, int * responselen);
+int  mqtt_sub_prepare(apr_pool_t *pool, const struct mqtt_broker *broker, const char * topic, const char * correlation,
+         int count, struct mosq_config ** pcfg);
+int  mqtt_sub_loop(apr_pool_t *pool, struct mosq_config *pcfg, apr_time_t deadline, char ** response, int * responselen);
+int  mqtt_sub_next(apr_pool_t *pool, struct mosq_config *cfg, apr_time_t deadline, char ** response, int * responselen);
+void mqtt_sub_abort(struct mosq_config *cfg);
+int  mqtt_sub_follow(apr_pool_t *pool, const char *key, struct mosq_config **pcfg, struct mqtt_flight **pflight);
+void mqtt_sub_hedge(struct mosq_config *cfg, apr_time_t at, struct mqtt_hedge *hedge, struct mqtt_job *job);
+int  mqtt_sub_filter(const struct mqtt_broker *broker, const char * topic);
+int  mqtt_sub_retained(apr_pool_t *pool, const struct mqtt_broker *broker, const char * topic, apr_time_t deadline,
+         char ** response, int * responselen);
+
+void my_pub_publish_callback ( struct mosquitto *mosq, void *obj, int mid );
+void my_sub_message_callback ( struct mosquitto *mosq, void *obj, const struct mosquitto_message *message );
+void my_sub_message_v5_callback ( struct mosquitto *mosq, void *obj, const struct mosquitto_message *message,
+                                  const mosquitto_property *props );
+void my_sub_subscribe_callback ( struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos );
+void my_sub_unsubscribe_callback ( struct mosquitto *mosq, void *obj, int mid );
 
 #endif
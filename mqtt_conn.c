@@ -0,0 +1,775 @@
+/*
+ * mqtt broker connections: long-lived, owned and driven by a reactor thread
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#ifndef WIN32
+#include <unistd.h>
+#else
+#include <process.h>
+#include <winsock2.h>
+#define snprintf sprintf_s
+#endif
+
+#include <mosquitto.h>
+#include "apr_atomic.h"
+#include "apr_strings.h"
+#include "mqtt_common.h"
+#include "keyValuePair.h"
+
+static volatile apr_uint32_t conn_seq = 0;      /* makes client ids unique per process */
+
+static int conn_nodelay = 1;                    /* TCP_NODELAY on broker sockets */
+static int conn_sndbuf = 0;                     /* SO_SNDBUF, 0 for the system default */
+static int conn_rcvbuf = 0;                     /* SO_RCVBUF, 0 for the system default */
+static int conn_keepalive = MQTT_KEEPALIVE;     /* seconds, MQTT PINGREQ and TCP keepalive */
+static const char conn_watched[] = "";          /* filters value of a filter only stream hubs use */
+
+/** set the socket options of broker connections, once per child
+  * \param nodelay 1 to send small packets at once (TCP_NODELAY)
+  * \param sndbuf send buffer bytes, 0 for the system default
+  * \param rcvbuf receive buffer bytes, 0 for the system default
+  * \param keepalive MQTT and TCP keepalive seconds
+  */
+void mqtt_conn_init ( int nodelay, int sndbuf, int rcvbuf, int keepalive )
+    {
+    conn_nodelay = nodelay;
+    conn_sndbuf = sndbuf;
+    conn_rcvbuf = rcvbuf;
+    conn_keepalive = ( keepalive > 0 ? keepalive : MQTT_KEEPALIVE );
+    }
+
+/** append a job to a list linked through job->link
+  * \param list list head
+  * \param job job to append
+  */
+static void jobs_append ( struct mqtt_job **list, struct mqtt_job *job )
+    {
+    job->link = NULL;
+    while ( *list )
+        list = & ( *list )->link;
+    *list = job;
+    }
+
+/** unlink a job from a list linked through job->link
+  * \param list list head
+  * \param job job to remove
+  * \return 1 if the job was on the list
+  */
+static int jobs_remove ( struct mqtt_job **list, struct mqtt_job *job )
+    {
+    for ( ; *list; list = & ( *list )->link )
+        {
+        if ( *list == job )
+            {
+            *list = job->link;
+            job->link = NULL;
+            return 1;
+            }
+        }
+    return 0;
+    }
+
+/** finish all jobs on a list
+  * \param list list head, empty afterwards
+  * \param rc result for the waiting requests
+  */
+static void jobs_fail ( struct mqtt_job **list, int rc )
+    {
+    struct mqtt_job *job;
+
+    while ( ( job = *list ) )
+        {
+        *list = job->link;
+        mqtt_job_finish ( job, rc );
+        }
+    }
+
+/** a connect failed or the connection broke: tell the circuit breaker and
+  * back off before the next reconnect, exponentially and with jitter
+  * \param conn connection, CONN_DOWN afterwards
+  */
+static void conn_failed ( struct mqtt_conn *conn )
+    {
+    apr_uint32_t wait = mqtt_backoff ( conn->backoff, &conn->seed, &conn->backoff );
+
+    mqtt_breaker_result ( conn->cfg.host, conn->cfg.port, 0 );
+    conn->state = CONN_DOWN;
+    conn->retry_at = mqtt_clock() + apr_time_from_msec ( wait );
+    }
+
+/** tune a new TCP socket, right after libmosquitto created it
+  * \param conn connection with a connect in progress
+  */
+static void conn_sockopts ( struct mqtt_conn *conn )
+    {
+    int sock = mosquitto_socket ( conn->mosq );
+    int on = 1;
+
+    /* unix domain sockets have neither Nagle nor keepalive */
+    if ( sock < 0 || !conn->cfg.port )
+        return;
+
+    setsockopt ( sock, IPPROTO_TCP, TCP_NODELAY, &conn_nodelay, sizeof ( conn_nodelay ) );
+    if ( conn_sndbuf > 0 )
+        setsockopt ( sock, SOL_SOCKET, SO_SNDBUF, &conn_sndbuf, sizeof ( conn_sndbuf ) );
+    if ( conn_rcvbuf > 0 )
+        setsockopt ( sock, SOL_SOCKET, SO_RCVBUF, &conn_rcvbuf, sizeof ( conn_rcvbuf ) );
+    setsockopt ( sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof ( on ) );
+#ifdef TCP_KEEPIDLE
+    setsockopt ( sock, IPPROTO_TCP, TCP_KEEPIDLE, &conn_keepalive, sizeof ( conn_keepalive ) );
+#endif
+    }
+
+/** start an asynchronous connect, the CONNACK arrives in the reactor
+  * \param conn connection to bring up
+  */
+static void conn_connect ( struct mqtt_conn *conn )
+    {
+    char addr[INET6_ADDRSTRLEN];
+    int rc;
+
+    DPRINTF ( "conn_connect %s (%d)\n", conn->key, conn->cfg.connected ) ;
+
+    conn->state = CONN_CONNECTING;
+    conn->connect_by = mqtt_clock() + apr_time_from_sec ( MQTT_CONNECT_TIMEOUT );
+
+    /* a cached address spares the reactor the lookup, and is renewed on every
+       connect where a reconnect would stick to the old one. TLS keeps the name
+       for SNI and the certificate check. */
+    if ( conn->cfg.port && !conn->broker.tls && mqtt_dns_lookup ( conn->cfg.host, addr, sizeof ( addr ) ) )
+        {
+        char *host = conn->cfg.host;
+
+        conn->cfg.host = addr;
+        rc = client_connect ( conn->mosq, &conn->cfg );
+        conn->cfg.host = host;
+        }
+    else if ( conn->cfg.connected )
+        rc = mosquitto_reconnect_async ( conn->mosq );
+    else
+        rc = client_connect ( conn->mosq, &conn->cfg );
+
+    if ( rc )
+        {
+        LPRINTF ( "Connect %s failed: %s\n", conn->key, mosquitto_strerror ( rc ) );
+        conn_failed ( conn );
+        jobs_fail ( &conn->backlog, rc );
+        }
+    else
+        conn_sockopts ( conn );
+    }
+
+/** MQTT v5 publish: response topic, correlation data and expiry travel as
+  * properties, long topics are replaced by a topic alias after first use
+  * \param conn connection in state CONN_UP
+  * \param job publish job
+  * \return MOSQ_ERR_SUCCESS or ...
+  */
+static int conn_publish_v5 ( struct mqtt_conn *conn, struct mqtt_job *job )
+    {
+    mosquitto_property *props = NULL;
+    const char *topic = job->topic;
+    int alias = 0;
+    int rc = MOSQ_ERR_SUCCESS;
+
+    if ( job->response )
+        rc = mosquitto_property_add_string ( &props, MQTT_PROP_RESPONSE_TOPIC, job->response );
+    if ( !rc && job->correlation[0] )
+        rc = mosquitto_property_add_binary ( &props, MQTT_PROP_CORRELATION_DATA, job->correlation,
+                                             ( uint16_t ) strlen ( job->correlation ) );
+    if ( !rc && job->expiry > 0 )
+        rc = mosquitto_property_add_int32 ( &props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, ( uint32_t ) job->expiry );
+
+    if ( !rc && conn->alias_max > 0 && strlen ( topic ) >= MQTT_ALIAS_MIN_LEN )
+        {
+        alias = ( int ) ( intptr_t ) apr_hash_get ( conn->aliases, topic, APR_HASH_KEY_STRING );
+        if ( alias )
+            topic = "";                 /* the broker knows it already */
+        else if ( conn->alias_count < conn->alias_max )
+            {
+            alias = ++conn->alias_count;
+            apr_hash_set ( conn->aliases, xstrdup ( conn->alias_pool, topic ), APR_HASH_KEY_STRING,
+                           ( void * ) ( intptr_t ) alias );
+            }
+        if ( alias )
+            rc = mosquitto_property_add_int16 ( &props, MQTT_PROP_TOPIC_ALIAS, ( uint16_t ) alias );
+        }
+
+    if ( !rc )
+        rc = mosquitto_publish_v5 ( conn->mosq, &job->mid, topic, job->payloadlen,
+                                    job->payload, job->qos, job->retain, props );
+
+    mosquitto_property_free_all ( &props );
+    return rc;
+    }
+
+/** hand a publish to mosquitto, it is finished once the broker has it
+  * \param conn connection in state CONN_UP
+  * \param job JOB_PUBLISH, JOB_SEND, JOB_REPLAY or JOB_BURST
+  */
+static void conn_publish ( struct mqtt_conn *conn, struct mqtt_job *job )
+    {
+    int rc;
+
+    /* QoS 0 may be written and acknowledged inside mosquitto_publish */
+    conn->sending = job;
+    if ( conn->cfg.protocol_version == MQTT_PROTOCOL_V5 )
+        rc = conn_publish_v5 ( conn, job );
+    else
+        rc = mosquitto_publish ( conn->mosq, &job->mid, job->topic, job->payloadlen,
+                                 job->payload, job->qos, job->retain );
+    if ( rc || !conn->sending )
+        mqtt_job_finish ( job, rc );
+    else
+        jobs_append ( &conn->pubs, job );
+    conn->sending = NULL;
+    }
+
+/** set TCP_CORK so a batch of publishes leaves in as few segments as possible
+  * \param conn connection in state CONN_UP
+  * \param on 1 to hold back partial segments, 0 to push them out
+  */
+static void conn_cork ( struct mqtt_conn *conn, int on )
+    {
+    int sock = mosquitto_socket ( conn->mosq );
+
+    if ( sock >= 0 && conn->cfg.port )
+        setsockopt ( sock, IPPROTO_TCP, TCP_CORK, &on, sizeof ( on ) );
+    }
+
+/** run a job on a connected broker connection
+  * \param conn connection in state CONN_UP
+  * \param job job to run
+  */
+static void conn_run ( struct mqtt_conn *conn, struct mqtt_job *job )
+    {
+    const char *filter;
+    int rc;
+
+    switch ( job->type )
+        {
+        case JOB_PUBLISH:
+            conn_publish ( conn, job );
+            break;
+
+        case JOB_SEND:
+        case JOB_REPLAY:
+            if ( !conn->batch )
+                conn->batch_since = mqtt_clock();
+            jobs_append ( &conn->batch, job );
+            if ( ++conn->batched >= mqtt_outbound_batch() )
+                mqtt_conn_flush ( conn, 0 );
+            break;
+
+        case JOB_BURST:
+            /* the request waits: its records leave together once all are in */
+            if ( !conn->batch )
+                conn->batch_since = mqtt_clock();
+            jobs_append ( &conn->batch, job );
+            if ( ++conn->batched >= mqtt_outbound_batch() || job->last )
+                mqtt_conn_flush ( conn, 0 );
+            break;
+
+        case JOB_CONNECT:
+            mqtt_job_finish ( job, MOSQ_ERR_SUCCESS );
+            break;
+
+        case JOB_SUBSCRIBE:
+        case JOB_WATCH:
+            /* response subscriptions are long-lived and shared by all requests,
+               a filter only watched by a stream hub is marked as such */
+            rc = MOSQ_ERR_SUCCESS;
+            filter = apr_hash_get ( conn->filters, job->topic, APR_HASH_KEY_STRING );
+            if ( !filter )
+                {
+                rc = mosquitto_subscribe ( conn->mosq, NULL, job->topic, job->qos );
+                if ( rc == MOSQ_ERR_SUCCESS )
+                    {
+                    filter = xstrdup ( conn->reactor->pool, job->topic );
+                    apr_hash_set ( conn->filters, filter, APR_HASH_KEY_STRING,
+                                   ( job->type == JOB_WATCH ? conn_watched : filter ) );
+                    }
+                }
+            else if ( filter == conn_watched && job->type == JOB_SUBSCRIBE )
+                apr_hash_set ( conn->filters, job->topic, APR_HASH_KEY_STRING, xstrdup ( conn->reactor->pool, job->topic ) );
+            mqtt_job_finish ( job, rc );
+            break;
+
+        case JOB_UNWATCH:
+            rc = MOSQ_ERR_SUCCESS;
+            if ( apr_hash_get ( conn->filters, job->topic, APR_HASH_KEY_STRING ) == conn_watched )
+                {
+                apr_hash_set ( conn->filters, job->topic, APR_HASH_KEY_STRING, NULL );
+                rc = mosquitto_unsubscribe ( conn->mosq, NULL, job->topic );
+                }
+            mqtt_job_finish ( job, rc );
+            break;
+
+        case JOB_RETAINED:
+            /* a new SUBSCRIBE makes the broker send the retained messages,
+               the UNSUBACK to the UNSUBSCRIBE right behind comes after them.
+               A filter in use stays subscribed, a dummy is unsubscribed instead. */
+            filter = apr_hash_get ( conn->filters, job->topic, APR_HASH_KEY_STRING );
+            rc = mosquitto_subscribe ( conn->mosq, NULL, job->topic, 0 );
+            if ( rc == MOSQ_ERR_SUCCESS )
+                rc = mosquitto_unsubscribe ( conn->mosq, &job->mid, ( filter ? MQTT_RETAINED_FENCE : job->topic ) );
+            if ( rc )
+                mqtt_job_finish ( job, rc );
+            else
+                jobs_append ( &conn->fences, job );
+            break;
+
+        default:
+            mqtt_job_finish ( job, MOSQ_ERR_INVAL );
+            break;
+        }
+    }
+
+/** the broker answered our CONNECT: renew subscriptions, run the backlog
+  * \param conn pooled connection
+  * \param result from connect operation
+  */
+static void conn_connected ( struct mqtt_conn *conn, int result )
+    {
+    struct mqtt_job *job, *backlog;
+    apr_hash_index_t *hi;
+
+    /* a CONNACK after the attempt timed out: the socket is on its way out */
+    if ( conn->state != CONN_CONNECTING )
+        {
+        DPRINTF ( "%s: late CONNACK ignored\n", conn->key );
+        mosquitto_disconnect ( conn->mosq );
+        return;
+        }
+
+    if ( result )
+        {
+        LPRINTF ( "%s: %s\n", conn->key, mosquitto_connack_string ( result ) );
+        conn_failed ( conn );
+        jobs_fail ( &conn->backlog, MOSQ_ERR_CONN_REFUSED );
+        return;
+        }
+
+    conn->state = CONN_UP;
+    conn->backoff = 0;
+    mqtt_breaker_result ( conn->cfg.host, conn->cfg.port, 1 );
+
+    /* clean session: response subscriptions must be renewed after a reconnect */
+    for ( hi = apr_hash_first ( NULL, conn->filters ); hi; hi = apr_hash_next ( hi ) )
+        {
+        const void *filter;
+        apr_hash_this ( hi, &filter, NULL, NULL );
+        mosquitto_subscribe ( conn->mosq, NULL, ( const char * ) filter, 0 );
+        }
+
+    backlog = conn->backlog;
+    conn->backlog = NULL;
+    while ( ( job = backlog ) )
+        {
+        backlog = job->link;
+        /* nobody waits for an answer to it anymore */
+        if ( job->deadline && job->deadline <= mqtt_clock() )
+            mqtt_job_finish ( job, MQTT_ERR_TIMEOUT );
+        else
+            conn_run ( conn, job );
+        }
+    }
+
+/** This is called when the broker sends a CONNACK message in response to a connection.
+  * \param mosq object
+  * \param obj pooled connection
+  * \param result from connect operation
+  */
+static void my_conn_connect_callback ( struct mosquitto *mosq, void *obj, int result )
+    {
+    struct mqtt_conn *conn = ( struct mqtt_conn * ) obj ;
+
+    DPRINTF ( "my_conn_connect_callback %s: %d\n", conn->key, result ) ;
+
+    conn_connected ( conn, result );
+    }
+
+/** This is called when the broker sends a CONNACK message on an MQTT v5 connection.
+  * Topic aliases are per network connection and start over.
+  * \param mosq object
+  * \param obj pooled connection
+  * \param result from connect operation
+  * \param flags connect flags
+  * \param props CONNACK properties
+  */
+static void my_conn_connect_v5_callback ( struct mosquitto *mosq, void *obj, int result, int flags,
+                                          const mosquitto_property *props )
+    {
+    struct mqtt_conn *conn = ( struct mqtt_conn * ) obj ;
+    uint16_t alias_max = 0;
+
+    DPRINTF ( "my_conn_connect_v5_callback %s: %d\n", conn->key, result ) ;
+
+    apr_pool_clear ( conn->alias_pool );
+    conn->aliases = apr_hash_make ( conn->alias_pool );
+    conn->alias_count = 0;
+
+    /* absent means the broker accepts no aliases */
+    mosquitto_property_read_int16 ( props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &alias_max, false );
+    conn->alias_max = alias_max;
+
+    conn_connected ( conn, result );
+    }
+
+/** This is called when the connection to the broker is closed or lost.
+  * \param mosq object
+  * \param obj pooled connection
+  * \param rc 0 if we asked for the disconnect, anything else if unexpected
+  */
+static void my_conn_disconnect_callback ( struct mosquitto *mosq, void *obj, int rc )
+    {
+    mqtt_conn_lost ( ( struct mqtt_conn * ) obj, ( rc ? rc : MOSQ_ERR_NO_CONN ) );
+    }
+
+/** create a new, not yet connected broker connection
+  * \param reactor owning reactor, the connection lives in its pool
+  * \param broker where to connect to
+  * \param key connection key
+  * \return new connection or NULL
+  */
+struct mqtt_conn *mqtt_conn_create ( struct mqtt_reactor *reactor, const struct mqtt_broker *broker, const char *key )
+    {
+    struct mqtt_conn *conn = apr_pcalloc ( reactor->pool, sizeof ( struct mqtt_conn ) );
+
+    init_config ( reactor->pool, &conn->cfg );
+
+    if ( client_config_conn ( &conn->cfg, broker ) != MOSQ_ERR_SUCCESS )
+        return NULL;
+    conn->cfg.keepalive = conn_keepalive;
+
+    conn->reactor = reactor;
+    conn->key = xstrdup ( reactor->pool, key );
+    conn->broker = *broker;
+    conn->broker.host = xstrdup ( reactor->pool, broker->host );
+    conn->broker.username = ( broker->username ? xstrdup ( reactor->pool, broker->username ) : NULL );
+    conn->broker.password = ( broker->password ? xstrdup ( reactor->pool, broker->password ) : NULL );
+    conn->filters = apr_hash_make ( reactor->pool );
+    apr_pool_create ( &conn->alias_pool, reactor->pool );
+    conn->aliases = apr_hash_make ( conn->alias_pool );
+    conn->cfg.id = apr_psprintf ( reactor->pool, "mod_mqtt-%d-%u", ( int ) getpid(),
+                                  apr_atomic_inc32 ( &conn_seq ) );
+
+    conn->mosq = mosquitto_new ( conn->cfg.id, true, conn );
+    if ( !conn->mosq )
+        {
+        LPRINTF ( "Error: mosquitto_new for %s: %s\n", key, strerror ( errno ) );
+        return NULL;
+        }
+
+    if ( client_opts_set ( conn->mosq, &conn->cfg ) )
+        {
+        mosquitto_destroy ( conn->mosq );
+        return NULL;
+        }
+
+#ifdef WITH_TLS
+    /* a context shared by the child: CAs and keys are loaded once, sessions resumed */
+    if ( broker->tls )
+        {
+        SSL_CTX *ctx = mqtt_tls_context ( broker->tls );
+
+        if ( !ctx || mosquitto_opts_set ( conn->mosq, MOSQ_OPT_SSL_CTX, ctx ) )
+            {
+            LPRINTF ( "Error: TLS for %s unavailable\n", key );
+            mosquitto_destroy ( conn->mosq );
+            return NULL;
+            }
+        }
+#endif
+
+    /* libmosquitto calls both flavours if both are set */
+    if ( conn->cfg.protocol_version == MQTT_PROTOCOL_V5 )
+        {
+        mosquitto_connect_v5_callback_set ( conn->mosq, my_conn_connect_v5_callback );
+        mosquitto_message_v5_callback_set ( conn->mosq, my_sub_message_v5_callback );
+        }
+    else
+        {
+        mosquitto_connect_callback_set ( conn->mosq, my_conn_connect_callback );
+        mosquitto_message_callback_set ( conn->mosq, my_sub_message_callback );
+        }
+    mosquitto_disconnect_callback_set ( conn->mosq, my_conn_disconnect_callback );
+    mosquitto_publish_callback_set ( conn->mosq, my_pub_publish_callback );
+    mosquitto_unsubscribe_callback_set ( conn->mosq, my_sub_unsubscribe_callback );
+#ifdef DEBUG
+    mosquitto_subscribe_callback_set ( conn->mosq, my_sub_subscribe_callback );
+#endif
+
+    conn->state = CONN_DOWN;
+    conn->sock = -1;
+    conn->seed = ( unsigned int ) getpid() ^ ( unsigned int ) mqtt_clock() ^ conn_seq;
+    conn->next = reactor->all;
+    reactor->all = conn;
+
+    return conn;
+    }
+
+/** close a connection and fail everything still waiting on it
+  * \param conn connection
+  */
+void mqtt_conn_destroy ( struct mqtt_conn *conn )
+    {
+    jobs_fail ( &conn->backlog, MOSQ_ERR_NO_CONN );
+    jobs_fail ( &conn->pubs, MOSQ_ERR_NO_CONN );
+    jobs_fail ( &conn->batch, MOSQ_ERR_NO_CONN );
+    jobs_fail ( &conn->fences, MOSQ_ERR_NO_CONN );
+
+    if ( conn->state == CONN_UP )
+        mosquitto_disconnect ( conn->mosq );
+    mosquitto_destroy ( conn->mosq );
+    conn->mosq = NULL;
+    }
+
+/** run a job now or, while the connection is not up, once the CONNACK arrives
+  * \param conn connection for the job's broker
+  * \param job job to run
+  */
+void mqtt_conn_execute ( struct mqtt_conn *conn, struct mqtt_job *job )
+    {
+    if ( conn->state == CONN_UP )
+        {
+        conn_run ( conn, job );
+        return;
+        }
+
+    /* while backing off, fire-and-forget publishes go to the spool at once */
+    if ( job->type == JOB_SEND && conn->state == CONN_DOWN && mqtt_clock() < conn->retry_at
+         && mqtt_spool_enabled() )
+        {
+        mqtt_job_finish ( job, MOSQ_ERR_NO_CONN );
+        return;
+        }
+
+    jobs_append ( &conn->backlog, job );
+
+    /* while backing off, the timer connects once it is time */
+    if ( conn->state == CONN_DOWN && mqtt_clock() >= conn->retry_at )
+        conn_connect ( conn );
+    }
+
+/** a publish has been handed to the broker
+  * \param conn connection
+  * \param mid message id from mosquitto_publish
+  */
+void mqtt_conn_pub_done ( struct mqtt_conn *conn, int mid )
+    {
+    struct mqtt_job *job;
+
+    if ( conn->sending && conn->sending->mid == mid )
+        {
+        /* still inside mosquitto_publish, conn_run finishes it */
+        conn->sending = NULL;
+        return;
+        }
+
+    for ( job = conn->pubs; job; job = job->link )
+        {
+        if ( job->mid == mid )
+            {
+            jobs_remove ( &conn->pubs, job );
+            mqtt_job_finish ( job, MOSQ_ERR_SUCCESS );
+            return;
+            }
+        }
+    }
+
+/** take a retained message for the JOB_RETAINED waiting on its topic
+  * \param conn connection
+  * \param message message received
+  * \return 1 if a JOB_RETAINED took it
+  */
+int mqtt_conn_retained ( struct mqtt_conn *conn, const struct mosquitto_message *message )
+    {
+    struct mqtt_job *job;
+    int taken = 0;
+
+    if ( !conn->fences || !message->retain )
+        return 0;
+
+    for ( job = conn->fences; job; job = job->link )
+        {
+        bool match = false;
+
+        if ( mosquitto_topic_matches_sub ( job->topic, message->topic, &match ) != MOSQ_ERR_SUCCESS || !match )
+            continue;
+        taken = 1;
+
+        /* a wildcard may match several, the first one is the answer */
+        if ( job->waiter && !job->waiter->message && message->payloadlen
+             && ( job->waiter->message = malloc ( message->payloadlen + 1 ) ) )
+            {
+            memcpy ( job->waiter->message, message->payload, message->payloadlen );
+            job->waiter->message[message->payloadlen] = 0;
+            job->waiter->msglen = message->payloadlen;
+            }
+        }
+    return taken;
+    }
+
+/** the broker acknowledged an UNSUBSCRIBE: a JOB_RETAINED has all
+  * retained messages of its topic by now
+  * \param conn connection
+  * \param mid message id from mosquitto_unsubscribe
+  */
+void mqtt_conn_unsub_done ( struct mqtt_conn *conn, int mid )
+    {
+    struct mqtt_job *job;
+
+    for ( job = conn->fences; job; job = job->link )
+        {
+        if ( job->mid == mid )
+            {
+            jobs_remove ( &conn->fences, job );
+            mqtt_job_finish ( job, ( job->waiter && job->waiter->message ? MOSQ_ERR_SUCCESS : MQTT_ERR_NOT_FOUND ) );
+            return;
+            }
+        }
+    }
+
+/** send the batched fire-and-forget publishes if the batch is full or old enough
+  * \param conn connection
+  * \param now mqtt_clock() time, 0 to flush in any case
+  */
+void mqtt_conn_flush ( struct mqtt_conn *conn, apr_time_t now )
+    {
+    struct mqtt_job *job, *batch = conn->batch;
+
+    if ( !batch || conn->state != CONN_UP )
+        return;
+    if ( now && conn->batched < mqtt_outbound_batch() && now - conn->batch_since < mqtt_outbound_delay() )
+        return;
+
+    DPRINTF ( "flush %d to %s\n", conn->batched, conn->key );
+
+    conn->batch = NULL;
+    conn->batched = 0;
+
+    conn_cork ( conn, 1 );
+    while ( ( job = batch ) )
+        {
+        batch = job->link;
+        conn_publish ( conn, job );
+        }
+    conn_cork ( conn, 0 );
+    }
+
+/** replay spooled publishes for this broker, as many as the rate allows
+  * \param conn connection, nothing happens unless it is up
+  */
+void mqtt_conn_replay ( struct mqtt_conn *conn )
+    {
+    struct mqtt_job *job;
+
+    while ( conn->state == CONN_UP && ( job = mqtt_spool_get ( &conn->broker, conn->key, &conn->spool_seen ) ) )
+        conn_run ( conn, job );
+    }
+
+/** the broker connection broke: publishes not yet sent are lost,
+  * batched ones and response subscriptions are kept for the reconnect.
+  * A connect that failed fails the backlog too, like conn_connect does.
+  * \param conn connection
+  * \param rc reason
+  */
+void mqtt_conn_lost ( struct mqtt_conn *conn, int rc )
+    {
+    int connecting;
+
+    if ( conn->state == CONN_DOWN )
+        return;
+
+    LPRINTF ( "Connection %s lost: %s\n", conn->key, mosquitto_strerror ( rc ) );
+
+    connecting = ( conn->state == CONN_CONNECTING );
+    conn_failed ( conn );
+    jobs_fail ( &conn->pubs, rc );
+    jobs_fail ( &conn->fences, rc );
+    if ( connecting )
+        {
+        jobs_fail ( &conn->backlog, rc );
+        return;
+        }
+
+    /* batched publishes never left, they go out after the reconnect */
+    if ( conn->batch )
+        {
+        struct mqtt_job **tail = &conn->batch;
+        while ( *tail )
+            tail = & ( *tail )->link;
+        *tail = conn->backlog;
+        conn->backlog = conn->batch;
+        conn->batch = NULL;
+        conn->batched = 0;
+        }
+    }
+
+/** when mqtt_conn_timer has something to do before the next second
+  * \param conn connection
+  * \return mqtt_clock() of the connect timeout or the reconnect, 0 for none
+  */
+apr_time_t mqtt_conn_due ( struct mqtt_conn *conn )
+    {
+    if ( conn->state == CONN_CONNECTING )
+        return conn->connect_by;
+    if ( conn->state == CONN_DOWN && ( conn->backlog || apr_hash_count ( conn->filters ) ) )
+        return conn->retry_at;
+    return 0;
+    }
+
+/** keepalive, connect timeout and reconnect after the backoff: once a
+  * second, and when mqtt_conn_due says so
+  * \param conn connection
+  * \param now mqtt_clock()
+  * \param tick 1 once a second, for the keepalive and breaker probes
+  */
+void mqtt_conn_timer ( struct mqtt_conn *conn, apr_time_t now, int tick )
+    {
+    int sock;
+
+    switch ( conn->state )
+        {
+        case CONN_UP:
+            if ( tick )
+                mosquitto_loop_misc ( conn->mosq );
+            break;
+
+        case CONN_CONNECTING:
+            if ( now >= conn->connect_by )
+                {
+                LPRINTF ( "Connect %s timed out\n", conn->key );
+                conn_failed ( conn );
+                jobs_fail ( &conn->backlog, MOSQ_ERR_CONN_LOST );
+                /* libmosquitto closes the socket when it reads the EOF,
+                   a CONNACK still on its way is not taken */
+                mosquitto_disconnect ( conn->mosq );
+                sock = mosquitto_socket ( conn->mosq );
+                if ( sock >= 0 )
+                    shutdown ( sock, SHUT_RDWR );
+                }
+            break;
+
+        case CONN_DOWN:
+            if ( now < conn->retry_at )
+                break;
+            if ( conn->backlog || apr_hash_count ( conn->filters ) )
+                conn_connect ( conn );
+            /* half-open: probe a broker requests are kept away from */
+            else if ( tick && mqtt_breaker_open ( conn->cfg.host, conn->cfg.port )
+                      && mqtt_breaker_allow ( conn->cfg.host, conn->cfg.port, NULL ) )
+                conn_connect ( conn );
+            break;
+        }
+    }
@@ -0,0 +1,242 @@
+/*
+ * mqtt broker address cache: broker host names are resolved once at child
+ * start and then again in the background before their TTL runs out, so no
+ * connect waits for DNS inside libmosquitto
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <mosquitto.h>
+#include "apr_strings.h"
+#include "apr_thread_cond.h"
+#include "mqtt_common.h"
+
+struct dns_entry
+    {
+    struct dns_entry *next;
+    const char *host;               /* name as configured */
+    char addr[INET6_ADDRSTRLEN];    /* numeric address, empty until resolved */
+    apr_time_t expires;             /* mqtt_clock() of the next lookup */
+    };
+
+static apr_pool_t *dns_pool = NULL;             /* entries, allocated under dns_lock */
+static apr_thread_mutex_t *dns_lock = NULL;     /* protects dns_hosts, dns_list and addr */
+static apr_thread_cond_t *dns_cond = NULL;      /* wakes the refresh thread */
+static apr_hash_t *dns_hosts = NULL;            /* host -> struct dns_entry */
+static struct dns_entry *dns_list = NULL;       /* the same, for the refresh thread */
+static apr_thread_t *dns_thread = NULL;
+static apr_interval_time_t dns_ttl = 0;         /* 0 while the cache is off */
+static int dns_stop = 0;
+
+/** resolve a host name, blocking
+  * \param host name
+  * \param addr set to the first address, numeric
+  * \param addrlen size of addr
+  * \return 1 if resolved
+  */
+static int dns_resolve ( const char *host, char *addr, int addrlen )
+    {
+    struct addrinfo hints, *res = NULL;
+    const void *in = NULL;
+
+    memset ( &hints, 0, sizeof ( hints ) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ( getaddrinfo ( host, NULL, &hints, &res ) || !res )
+        {
+        LPRINTF ( "mod_mqtt: cannot resolve %s\n", host );
+        return 0;
+        }
+
+    if ( res->ai_family == AF_INET )
+        in = & ( ( struct sockaddr_in * ) res->ai_addr )->sin_addr;
+    else if ( res->ai_family == AF_INET6 )
+        in = & ( ( struct sockaddr_in6 * ) res->ai_addr )->sin6_addr;
+
+    if ( in && !inet_ntop ( res->ai_family, in, addr, addrlen ) )
+        in = NULL;
+
+    freeaddrinfo ( res );
+    return ( in != NULL );
+    }
+
+/** look up one entry and store the result, keeping the old address if the
+  * lookup fails
+  * \param entry cache entry
+  */
+static void dns_refresh ( struct dns_entry *entry )
+    {
+    char addr[INET6_ADDRSTRLEN];
+    int ok = dns_resolve ( entry->host, addr, sizeof ( addr ) );
+
+    apr_thread_mutex_lock ( dns_lock );
+    if ( ok )
+        {
+        if ( strcmp ( entry->addr, addr ) )
+            {
+            DPRINTF ( "dns %s: %s\n", entry->host, addr );
+            }
+        strcpy ( entry->addr, addr );
+        }
+    entry->expires = mqtt_clock() + ( ok ? dns_ttl : apr_time_from_sec ( MQTT_DNS_RETRY ) );
+    apr_thread_mutex_unlock ( dns_lock );
+    }
+
+/** refresh thread: renews expired entries, wakes once a second
+  * \param thread this thread
+  * \param data unused
+  * \return NULL
+  */
+static void * APR_THREAD_FUNC dns_main ( apr_thread_t *thread, void *data )
+    {
+    apr_thread_mutex_lock ( dns_lock );
+    while ( !dns_stop )
+        {
+        struct dns_entry *entry;
+        apr_time_t now = mqtt_clock();
+
+        /* entries are never removed, so entry stays valid while unlocked */
+        for ( entry = dns_list; entry && !dns_stop; entry = entry->next )
+            {
+            if ( entry->expires > now )
+                continue;
+            apr_thread_mutex_unlock ( dns_lock );
+            dns_refresh ( entry );
+            apr_thread_mutex_lock ( dns_lock );
+            }
+
+        if ( !dns_stop )
+            apr_thread_cond_timedwait ( dns_cond, dns_lock, apr_time_from_sec ( 1 ) );
+        }
+    apr_thread_mutex_unlock ( dns_lock );
+
+    apr_thread_exit ( thread, APR_SUCCESS );
+    return NULL;
+    }
+
+/** stop the refresh thread, before the child pool goes away
+  * \param data unused
+  * \return APR_SUCCESS
+  */
+static apr_status_t mqtt_dns_cleanup ( void *data )
+    {
+    apr_status_t rv;
+
+    if ( !dns_thread )
+        return APR_SUCCESS;
+
+    apr_thread_mutex_lock ( dns_lock );
+    dns_stop = 1;
+    apr_thread_cond_signal ( dns_cond );
+    apr_thread_mutex_unlock ( dns_lock );
+
+    apr_thread_join ( &rv, dns_thread );
+    dns_thread = NULL;
+    return APR_SUCCESS;
+    }
+
+/** set up the cache and start its refresh thread, once per child
+  * \param pool child pool
+  * \param ttl seconds an address is used, 0 to resolve on every connect
+  * \return MOSQ_ERR_SUCCESS or ...
+  */
+int mqtt_dns_init ( apr_pool_t *pool, int ttl )
+    {
+    if ( ttl <= 0 )
+        return MOSQ_ERR_SUCCESS;
+
+    if ( apr_pool_create ( &dns_pool, pool ) != APR_SUCCESS
+         || apr_thread_mutex_create ( &dns_lock, APR_THREAD_MUTEX_DEFAULT, pool ) != APR_SUCCESS
+         || apr_thread_cond_create ( &dns_cond, pool ) != APR_SUCCESS )
+        return MOSQ_ERR_NOMEM;
+
+    dns_hosts = apr_hash_make ( dns_pool );
+    dns_ttl = apr_time_from_sec ( ttl );
+
+    if ( apr_thread_create ( &dns_thread, NULL, dns_main, NULL, pool ) != APR_SUCCESS )
+        {
+        LPRINTF ( "mqtt_dns_init: cannot start refresh thread\n" );
+        dns_ttl = 0;
+        return MOSQ_ERR_ERRNO;
+        }
+    apr_pool_pre_cleanup_register ( pool, NULL, mqtt_dns_cleanup );
+
+    return MOSQ_ERR_SUCCESS;
+    }
+
+/** find or add the entry of a host
+  * \param host name
+  * \param added set to 1 if the entry is new
+  * \return entry or NULL for unix sockets and while the cache is off
+  */
+static struct dns_entry *dns_entry ( const char *host, int *added )
+    {
+    struct dns_entry *entry;
+
+    *added = 0;
+    if ( !dns_ttl || !host || !strncmp ( host, MQTT_UNIX_PREFIX, strlen ( MQTT_UNIX_PREFIX ) ) )
+        return NULL;
+
+    apr_thread_mutex_lock ( dns_lock );
+    entry = apr_hash_get ( dns_hosts, host, APR_HASH_KEY_STRING );
+    if ( !entry )
+        {
+        entry = apr_pcalloc ( dns_pool, sizeof ( struct dns_entry ) );
+        entry->host = apr_pstrdup ( dns_pool, host );
+        apr_hash_set ( dns_hosts, entry->host, APR_HASH_KEY_STRING, entry );
+        entry->next = dns_list;
+        dns_list = entry;
+        *added = 1;
+        }
+    apr_thread_mutex_unlock ( dns_lock );
+
+    return entry;
+    }
+
+/** resolve a configured broker host now, at child start
+  * \param host name, NULL for localhost
+  */
+void mqtt_dns_add ( const char *host )
+    {
+    int added;
+    struct dns_entry *entry = dns_entry ( ( host ? host : "localhost" ), &added );
+
+    if ( added )
+        dns_refresh ( entry );
+    }
+
+/** the cached address of a broker. A host seen for the first time is
+  * handed to the refresh thread and resolved by the caller this once.
+  * \param host name, NULL for localhost
+  * \param addr set to the numeric address
+  * \param addrlen size of addr
+  * \return 1 if addr is set
+  */
+int mqtt_dns_lookup ( const char *host, char *addr, int addrlen )
+    {
+    int added;
+    struct dns_entry *entry = dns_entry ( ( host ? host : "localhost" ), &added );
+    int found = 0;
+
+    if ( !entry )
+        return 0;
+
+    apr_thread_mutex_lock ( dns_lock );
+    if ( entry->addr[0] )
+        {
+        apr_cpystrn ( addr, entry->addr, addrlen );
+        found = 1;
+        }
+    if ( added )
+        apr_thread_cond_signal ( dns_cond );
+    apr_thread_mutex_unlock ( dns_lock );
+
+    return found;
+    }
@@ -0,0 +1,130 @@
+/*
+ * mqtt request hedging: a location remembers how long its answers take and
+ * sends a query once more when its answer is later than most, within a
+ * budget so hedges cannot pile onto an overloaded responder
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mosquitto.h>
+#include "apr_atomic.h"
+#include "apr_strings.h"
+#include "mqtt_common.h"
+
+/** histogram bucket of a latency: exact below 8 us, then 4 per octave
+  * \param us latency
+  * \return bucket
+  */
+static int hedge_bucket ( apr_uint32_t us )
+    {
+    int msb, b;
+
+    if ( us < 8 )
+        return ( int ) us;
+
+    msb = 31 - __builtin_clz ( us );
+    b = 8 + ( msb - 3 ) * 4 + ( int ) ( ( us >> ( msb - 2 ) ) & 3 );
+    return ( b < MQTT_HEDGE_BUCKETS ? b : MQTT_HEDGE_BUCKETS - 1 );
+    }
+
+/** upper end of a histogram bucket
+  * \param b bucket
+  * \return us
+  */
+static apr_interval_time_t hedge_limit ( int b )
+    {
+    int octave;
+
+    if ( b < 8 )
+        return b + 1;
+
+    octave = ( b - 8 ) / 4 + 3;
+    return ( apr_interval_time_t ) ( 5 + ( b - 8 ) % 4 ) << ( octave - 2 );
+    }
+
+/** hedging settings with an empty histogram, at configuration time
+  * \param pool configuration pool
+  * \return hedging off
+  */
+struct mqtt_hedge *mqtt_hedge_create ( apr_pool_t *pool )
+    {
+    return apr_pcalloc ( pool, sizeof ( struct mqtt_hedge ) );
+    }
+
+/** when to hedge a request that starts now, and a share of a hedge for the
+  * budget
+  * \param hedge settings and histogram
+  * \return us after the query to hedge, 0 for no hedge
+  */
+apr_interval_time_t mqtt_hedge_delay ( struct mqtt_hedge *hedge )
+    {
+    apr_uint32_t counts[MQTT_HEDGE_BUCKETS];
+    apr_uint32_t total = 0, target, sum = 0;
+    int b;
+
+    if ( !hedge || hedge->percentile <= 0 )
+        return 0;
+
+    if ( apr_atomic_read32 ( &hedge->credit ) < MQTT_HEDGE_BURST * 100 )
+        apr_atomic_add32 ( &hedge->credit, hedge->budget );
+
+    for ( b = 0; b < MQTT_HEDGE_BUCKETS; b++ )
+        total += ( counts[b] = apr_atomic_read32 ( &hedge->buckets[b] ) );
+    if ( total < MQTT_HEDGE_MIN )
+        return 0;
+
+    target = ( apr_uint32_t ) ( ( apr_uint64_t ) total * hedge->percentile / 100 );
+    for ( b = 0; b < MQTT_HEDGE_BUCKETS - 1; b++ )
+        {
+        sum += counts[b];
+        if ( sum >= target )
+            break;
+        }
+    return hedge_limit ( b );
+    }
+
+/** take one hedge from the budget
+  * \param hedge settings and histogram
+  * \return 1 if the request may be hedged
+  */
+int mqtt_hedge_allow ( struct mqtt_hedge *hedge )
+    {
+    apr_uint32_t credit;
+
+    do
+        {
+        credit = apr_atomic_read32 ( &hedge->credit );
+        if ( credit < 100 )
+            return 0;
+        }
+    while ( apr_atomic_cas32 ( &hedge->credit, credit - 100, credit ) != credit );
+
+    return 1;
+    }
+
+/** count the latency of an answer. Old answers fade out: once the window
+  * is full, all buckets are halved.
+  * \param hedge settings and histogram
+  * \param latency from the query to the answer
+  */
+void mqtt_hedge_record ( struct mqtt_hedge *hedge, apr_interval_time_t latency )
+    {
+    int b = hedge_bucket ( ( apr_uint32_t ) ( latency > 0xffffffff ? 0xffffffff : ( latency > 0 ? latency : 0 ) ) );
+    apr_uint32_t total = 0;
+    int i;
+
+    if ( !hedge )
+        return;
+
+    apr_atomic_inc32 ( &hedge->buckets[b] );
+
+    for ( i = 0; i < MQTT_HEDGE_BUCKETS; i++ )
+        total += apr_atomic_read32 ( &hedge->buckets[i] );
+
+    /* races lose a few counts, which does not matter for a percentile */
+    if ( total >= MQTT_HEDGE_WINDOW )
+        for ( i = 0; i < MQTT_HEDGE_BUCKETS; i++ )
+            apr_atomic_set32 ( &hedge->buckets[i], apr_atomic_read32 ( &hedge->buckets[i] ) / 2 );
+    }
@@ -0,0 +1,403 @@
+/*
+ * mqtt stream hubs: all clients watching a topic share one subscription,
+ * the last messages are kept in a ring so a client reconnecting with
+ * Last-Event-ID misses nothing
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mosquitto.h>
+#include "apr_atomic.h"
+#include "apr_strings.h"
+#include "mqtt_common.h"
+
+/* the messages of one topic, per child. Idle hubs give up their
+ * subscription and messages and go to the free list. */
+struct mqtt_hub
+    {
+    struct mqtt_hub *next;          /* next hub with a wildcard topic, or free */
+    char *topic;                    /* subscription filter, rendered MQTTSubTopic, malloc'ed */
+    struct mqtt_broker broker;      /* where the subscription lives, strings from the configuration */
+    apr_thread_cond_t *cond;        /* broadcast on every message */
+    apr_uint32_t epoch;             /* differs per hub, child and start */
+    int clients;                    /* watching now */
+    int subscribed;                 /* JOB_WATCH sent, no JOB_UNWATCH since */
+    apr_time_t idle;                /* mqtt_clock() the last client left */
+    apr_uint64_t first;             /* sequence of the oldest event kept */
+    apr_uint64_t last;              /* sequence of the newest event, 0 for none */
+    struct mqtt_event *ring[MQTT_HUB_RING]; /* event n at n % MQTT_HUB_RING */
+    };
+
+static apr_pool_t *hub_pool = NULL;             /* hubs, allocated under hub_lock */
+static apr_thread_mutex_t *hub_lock = NULL;     /* protects everything here */
+static apr_hash_t *hubs = NULL;                 /* topic -> struct mqtt_hub */
+static struct mqtt_hub *hub_wild = NULL;        /* hubs with + or # in the topic */
+static struct mqtt_hub *hub_free = NULL;        /* swept hubs, kept for their cond */
+static volatile apr_uint32_t hub_count = 0;     /* 0 lets the reactor skip the lock */
+static volatile apr_uint32_t hub_wilds = 0;     /* hubs on hub_wild */
+static volatile apr_uint32_t hub_bloom[8];      /* bits of the exact topics, see hub_bit */
+
+/** the bit of a topic in hub_bloom
+  * \param topic topic
+  * \return bit number, 0 to 255
+  */
+static unsigned int hub_bit ( const char *topic )
+    {
+    apr_ssize_t len = APR_HASH_KEY_STRING;
+
+    return apr_hashfunc_default ( topic, &len ) & 255;
+    }
+
+/** whether a message may be for a hub, without taking hub_lock. Misses
+  * topics of hubs joined at this very moment, as hub_count did.
+  * \param topic topic of the message
+  * \return 0 if no hub watches the topic
+  */
+static int hub_maybe ( const char *topic )
+    {
+    unsigned int bit;
+
+    if ( !apr_atomic_read32 ( &hub_count ) )
+        return 0;
+    if ( apr_atomic_read32 ( &hub_wilds ) )
+        return 1;
+    bit = hub_bit ( topic );
+    return ( apr_atomic_read32 ( &hub_bloom[bit / 32] ) >> ( bit % 32 ) ) & 1;
+    }
+
+/** create the hub table, once per child
+  * \param pool child pool
+  * \return MOSQ_ERR_SUCCESS or MOSQ_ERR_NOMEM
+  */
+int mqtt_hub_init ( apr_pool_t *pool )
+    {
+    if ( apr_pool_create ( &hub_pool, pool ) != APR_SUCCESS
+         || apr_thread_mutex_create ( &hub_lock, APR_THREAD_MUTEX_DEFAULT, pool ) != APR_SUCCESS )
+        return MOSQ_ERR_NOMEM;
+
+    hubs = apr_hash_make ( hub_pool );
+    return MOSQ_ERR_SUCCESS;
+    }
+
+/** subscribe or unsubscribe a hub's topic, always through the first reactor
+  * \param hub hub, under hub_lock
+  * \param type JOB_WATCH or JOB_UNWATCH
+  */
+static void hub_watch ( struct mqtt_hub *hub, int type )
+    {
+    struct mqtt_job *job = mqtt_job_create ( type, &hub->broker, hub->topic, NULL, 0, NULL );
+
+    if ( !job )
+        return;
+    mqtt_reactor_submit_to ( 0, job );
+    hub->subscribed = ( type == JOB_WATCH );
+    }
+
+/** take a hub out of the tables and put it on the free list, under hub_lock
+  * \param hub idle hub
+  */
+static void hub_remove ( struct mqtt_hub *hub )
+    {
+    struct mqtt_hub **wild;
+    int i;
+
+    apr_hash_set ( hubs, hub->topic, APR_HASH_KEY_STRING, NULL );
+    for ( wild = &hub_wild; *wild; wild = & ( *wild )->next )
+        {
+        if ( *wild == hub )
+            {
+            *wild = hub->next;
+            apr_atomic_dec32 ( &hub_wilds );
+            break;
+            }
+        }
+
+    for ( i = 0; i < MQTT_HUB_RING; i++ )
+        free ( hub->ring[i] );
+    free ( hub->topic );
+    memset ( hub->ring, 0, sizeof ( hub->ring ) );
+    hub->topic = NULL;
+    hub->first = hub->last = 0;
+
+    hub->next = hub_free;
+    hub_free = hub;
+    apr_atomic_dec32 ( &hub_count );
+    }
+
+/** give up the hubs nobody watched for a while, under hub_lock
+  * \param now mqtt_clock()
+  */
+static void hub_sweep ( apr_time_t now )
+    {
+    apr_uint32_t bloom[8] = { 0 };
+    apr_hash_index_t *hi;
+    int removed = 0, i;
+
+    for ( hi = apr_hash_first ( NULL, hubs ); hi; hi = apr_hash_next ( hi ) )
+        {
+        struct mqtt_hub *hub;
+
+        apr_hash_this ( hi, NULL, NULL, ( void ** ) &hub );
+        if ( hub->clients || now < hub->idle + apr_time_from_sec ( MQTT_HUB_LINGER ) )
+            continue;
+
+        DPRINTF ( "hub %s idle\n", hub->topic );
+        if ( hub->subscribed )
+            hub_watch ( hub, JOB_UNWATCH );
+        hub_remove ( hub );
+        removed++;
+        }
+
+    if ( !removed )
+        return;
+
+    /* the bits of the hubs left */
+    for ( hi = apr_hash_first ( NULL, hubs ); hi; hi = apr_hash_next ( hi ) )
+        {
+        const char *topic;
+        unsigned int bit;
+
+        apr_hash_this ( hi, ( const void ** ) &topic, NULL, NULL );
+        bit = hub_bit ( topic );
+        bloom[bit / 32] |= 1u << ( bit % 32 );
+        }
+    for ( i = 0; i < 8; i++ )
+        apr_atomic_set32 ( &hub_bloom[i], bloom[i] );
+    }
+
+/** give up idle hubs, from the reactors once a second. Leaves it to the
+  * next call when another thread holds the lock.
+  */
+void mqtt_hub_sweep ( void )
+    {
+    if ( !hub_lock || !apr_atomic_read32 ( &hub_count ) )
+        return;
+    if ( apr_thread_mutex_trylock ( hub_lock ) != APR_SUCCESS )
+        return;
+    hub_sweep ( mqtt_clock() );
+    apr_thread_mutex_unlock ( hub_lock );
+    }
+
+/** start watching a topic: join its hub, subscribing if nobody watches it
+  * \param broker where the topic is published, strings must live as long
+  *        as the configuration
+  * \param topic subscription filter
+  * \return hub to leave with mqtt_hub_leave, NULL if there are too many
+  *         or mqtt_hub_init failed
+  */
+struct mqtt_hub *mqtt_hub_join ( const struct mqtt_broker *broker, const char *topic )
+    {
+    struct mqtt_hub *hub;
+
+    if ( !hub_lock )
+        return NULL;
+
+    apr_thread_mutex_lock ( hub_lock );
+    hub_sweep ( mqtt_clock() );
+
+    hub = apr_hash_get ( hubs, topic, APR_HASH_KEY_STRING );
+    if ( !hub && hub_free )
+        {
+        hub = hub_free;
+        hub_free = hub->next;
+        hub->next = NULL;
+        }
+    else if ( !hub && apr_atomic_read32 ( &hub_count ) < MQTT_HUB_MAX )
+        {
+        hub = apr_pcalloc ( hub_pool, sizeof ( struct mqtt_hub ) );
+        if ( apr_thread_cond_create ( &hub->cond, hub_pool ) != APR_SUCCESS )
+            hub = NULL;
+        }
+    if ( hub && !hub->topic )
+        {
+        hub->topic = strdup ( topic );
+        if ( !hub->topic )
+            {
+            hub->next = hub_free;
+            hub_free = hub;
+            apr_thread_mutex_unlock ( hub_lock );
+            return NULL;
+            }
+        hub->broker = *broker;
+        hub->epoch = ( apr_uint32_t ) getpid() ^ ( apr_uint32_t ) apr_time_now() ^ hub_count;
+        hub->first = 1;
+        hub->clients = 0;
+        hub->subscribed = 0;
+        apr_hash_set ( hubs, hub->topic, APR_HASH_KEY_STRING, hub );
+        if ( strpbrk ( topic, "+#" ) )
+            {
+            hub->next = hub_wild;
+            hub_wild = hub;
+            apr_atomic_inc32 ( &hub_wilds );
+            }
+        else
+            {
+            unsigned int bit = hub_bit ( topic );
+            apr_uint32_t word;
+
+            do
+                word = apr_atomic_read32 ( &hub_bloom[bit / 32] );
+            while ( apr_atomic_cas32 ( &hub_bloom[bit / 32], word | ( 1u << ( bit % 32 ) ), word ) != word );
+            }
+        apr_atomic_inc32 ( &hub_count );
+        }
+
+    if ( hub )
+        {
+        hub->clients++;
+        if ( !hub->subscribed )
+            hub_watch ( hub, JOB_WATCH );
+        }
+    apr_thread_mutex_unlock ( hub_lock );
+
+    if ( !hub )
+        LPRINTF ( "mqtt_hub_join: more than %d topics watched, %s refused\n", MQTT_HUB_MAX, topic );
+    return hub;
+    }
+
+/** stop watching. The subscription and the messages are kept a while for
+  * clients coming back.
+  * \param hub from mqtt_hub_join
+  */
+void mqtt_hub_leave ( struct mqtt_hub *hub )
+    {
+    apr_thread_mutex_lock ( hub_lock );
+    if ( !--hub->clients )
+        hub->idle = mqtt_clock();
+    apr_thread_mutex_unlock ( hub_lock );
+    }
+
+/** where a client continues
+  * \param hub from mqtt_hub_join
+  * \param last_event_id Last-Event-ID of a reconnecting client, or NULL
+  * \return sequence of the last event the client has, the newest one for
+  *         a new client or an id from another hub or child
+  */
+apr_uint64_t mqtt_hub_resume ( struct mqtt_hub *hub, const char *last_event_id )
+    {
+    unsigned int epoch = 0;
+    apr_uint64_t seq = 0, last;
+    char *end = NULL;
+
+    apr_thread_mutex_lock ( hub_lock );
+    last = hub->last;
+    apr_thread_mutex_unlock ( hub_lock );
+
+    if ( last_event_id && sscanf ( last_event_id, "%8x-", &epoch ) == 1 && strchr ( last_event_id, '-' ) )
+        seq = apr_strtoi64 ( strchr ( last_event_id, '-' ) + 1, &end, 10 );
+
+    if ( !end || *end || epoch != hub->epoch || seq > last )
+        return last;
+    return seq;
+    }
+
+/** add a message to a hub and wake its clients, under hub_lock
+  * \param hub hub
+  * \param payload message
+  * \param payloadlen message size
+  */
+static void hub_add ( struct mqtt_hub *hub, const char *payload, int payloadlen )
+    {
+    struct mqtt_event *event = malloc ( sizeof ( struct mqtt_event ) + payloadlen + 1 );
+    apr_uint64_t seq = hub->last + 1;
+
+    if ( !event )
+        {
+        LPRINTF ( "hub %s: message of %d bytes dropped\n", hub->topic, payloadlen );
+        return;
+        }
+
+    snprintf ( event->id, sizeof ( event->id ), "%08x-%" APR_UINT64_T_FMT, hub->epoch, seq );
+    event->len = payloadlen;
+    memcpy ( event->data, payload, payloadlen );
+    event->data[payloadlen] = 0;
+
+    free ( hub->ring[seq % MQTT_HUB_RING] );
+    hub->ring[seq % MQTT_HUB_RING] = event;
+    hub->last = seq;
+    apr_thread_cond_broadcast ( hub->cond );
+    }
+
+/** hand a message to the hubs watching its topic. Called by the reactor
+  * for every message, answers mostly get away with hub_maybe.
+  * \param topic topic of the message
+  * \param payload message
+  * \param payloadlen message size
+  * \return 1 if a hub took it
+  */
+int mqtt_hub_deliver ( const char *topic, const char *payload, int payloadlen )
+    {
+    struct mqtt_hub *hub;
+    int taken = 0;
+
+    if ( !hub_maybe ( topic ) )
+        return 0;
+
+    apr_thread_mutex_lock ( hub_lock );
+    hub = apr_hash_get ( hubs, topic, APR_HASH_KEY_STRING );
+    if ( hub && hub->subscribed )
+        {
+        hub_add ( hub, payload, payloadlen );
+        taken = 1;
+        }
+    for ( hub = hub_wild; hub; hub = hub->next )
+        {
+        bool match = false;
+
+        if ( hub->subscribed && mosquitto_topic_matches_sub ( hub->topic, topic, &match ) == MOSQ_ERR_SUCCESS
+             && match )
+            {
+            hub_add ( hub, payload, payloadlen );
+            taken = 1;
+            }
+        }
+    apr_thread_mutex_unlock ( hub_lock );
+
+    return taken;
+    }
+
+/** wait for the event after the one a client has. A client too far behind
+  * continues with the oldest event still kept.
+  * \param hub from mqtt_hub_join
+  * \param seq sequence of the client's last event, advanced
+  * \param deadline mqtt_clock() time to give up
+  * \return malloc'ed copy of the event, NULL if there was none in time
+  */
+struct mqtt_event *mqtt_hub_next ( struct mqtt_hub *hub, apr_uint64_t *seq, apr_time_t deadline )
+    {
+    struct mqtt_event *copy = NULL;
+
+    apr_thread_mutex_lock ( hub_lock );
+    while ( hub->last <= *seq )
+        {
+        apr_interval_time_t left = deadline - mqtt_clock();
+        if ( left <= 0 )
+            break;
+        apr_thread_cond_timedwait ( hub->cond, hub_lock, left );
+        }
+
+    if ( hub->last > *seq )
+        {
+        apr_uint64_t next = *seq + 1;
+        struct mqtt_event *event;
+
+        if ( hub->last > MQTT_HUB_RING && next <= hub->last - MQTT_HUB_RING )
+            next = hub->last - MQTT_HUB_RING + 1;
+        if ( next < hub->first )
+            next = hub->first;
+        event = hub->ring[next % MQTT_HUB_RING];
+        if ( event )
+            {
+            copy = malloc ( sizeof ( struct mqtt_event ) + event->len + 1 );
+            if ( copy )
+                memcpy ( copy, event, sizeof ( struct mqtt_event ) + event->len + 1 );
+            }
+        *seq = next;
+        }
+    apr_thread_mutex_unlock ( hub_lock );
+
+    return copy;
+    }
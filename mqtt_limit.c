@@ -0,0 +1,199 @@
+/*
+ * mqtt concurrency limits: how many requests of a route may wait for their
+ * answers at the same time, adapted to the round-trip time like a TCP
+ * congestion window (additive increase, multiplicative decrease)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mosquitto.h>
+#include "apr_strings.h"
+#include "mqtt_common.h"
+
+/* the limit of one route, per child. Created at configuration time,
+ * locks created by mqtt_limit_init in the child. */
+struct mqtt_limit
+    {
+    struct mqtt_limit *next;        /* all limits, for the status page */
+    const char *name;               /* location and publish topic */
+    int max;                        /* upper bound, MQTTConcurrency */
+    apr_interval_time_t queue;      /* max. wait for a slot, 0 to reject at once */
+    apr_thread_mutex_t *lock;       /* protects the rest */
+    apr_thread_cond_t *room;        /* signalled when a slot is free */
+    double limit;                   /* current limit, at least 1 */
+    int inflight;                   /* requests holding a slot */
+    int queued;                     /* requests waiting for one */
+    apr_interval_time_t min_rtt;    /* lowest round trip lately, 0 before the first */
+    apr_time_t hold;                /* mqtt_clock() before which the limit is not cut again */
+    apr_uint32_t rejected;          /* requests turned away */
+    };
+
+static struct mqtt_limit *limits = NULL;        /* in configuration order */
+
+/** forget the limits of a configuration that is going away
+  * \param data unused
+  * \return APR_SUCCESS
+  */
+static apr_status_t limit_cleanup ( void *data )
+    {
+    limits = NULL;
+    return APR_SUCCESS;
+    }
+
+/** create a limit, at configuration time
+  * \param pool configuration pool
+  * \param name shown in the status
+  * \param max upper bound of concurrent requests
+  * \param queue_ms max. ms to wait for a slot, 0 to reject at once
+  * \return limit
+  */
+struct mqtt_limit *mqtt_limit_create ( apr_pool_t *pool, const char *name, int max, int queue_ms )
+    {
+    struct mqtt_limit *limit = apr_pcalloc ( pool, sizeof ( struct mqtt_limit ) );
+
+    limit->name = apr_pstrdup ( pool, name );
+    limit->max = ( max > 0 ? max : 1 );
+    limit->queue = apr_time_from_msec ( queue_ms > 0 ? queue_ms : 0 );
+    limit->limit = ( limit->max < MQTT_LIMIT_START ? limit->max : MQTT_LIMIT_START );
+
+    if ( !limits )
+        apr_pool_cleanup_register ( pool, NULL, limit_cleanup, apr_pool_cleanup_null );
+    limit->next = limits;
+    limits = limit;
+
+    return limit;
+    }
+
+/** create the locks of all limits, once per child
+  * \param pool child pool
+  * \return MOSQ_ERR_SUCCESS or MOSQ_ERR_NOMEM
+  */
+int mqtt_limit_init ( apr_pool_t *pool )
+    {
+    struct mqtt_limit *limit;
+
+    for ( limit = limits; limit; limit = limit->next )
+        {
+        if ( apr_thread_mutex_create ( &limit->lock, APR_THREAD_MUTEX_DEFAULT, pool ) != APR_SUCCESS
+             || apr_thread_cond_create ( &limit->room, pool ) != APR_SUCCESS )
+            return MOSQ_ERR_NOMEM;
+        }
+    return MOSQ_ERR_SUCCESS;
+    }
+
+/** take a slot, waiting for one as long as the queue budget and the
+  * request allow
+  * \param limit limit of the route, NULL for none
+  * \param deadline mqtt_clock() time the request gives up
+  * \return MOSQ_ERR_SUCCESS or MQTT_ERR_QUEUE_FULL
+  */
+int mqtt_limit_acquire ( struct mqtt_limit *limit, apr_time_t deadline )
+    {
+    apr_time_t until;
+    int rc = MOSQ_ERR_SUCCESS;
+
+    if ( !limit || !limit->lock )
+        return MOSQ_ERR_SUCCESS;
+
+    until = mqtt_clock() + limit->queue;
+    if ( until > deadline )
+        until = deadline;
+
+    apr_thread_mutex_lock ( limit->lock );
+    if ( limit->inflight >= ( int ) limit->limit )
+        {
+        limit->queued++;
+        while ( limit->inflight >= ( int ) limit->limit )
+            {
+            apr_interval_time_t left = until - mqtt_clock();
+            if ( left <= 0 )
+                break;
+            apr_thread_cond_timedwait ( limit->room, limit->lock, left );
+            }
+        limit->queued--;
+        }
+
+    if ( limit->inflight < ( int ) limit->limit )
+        limit->inflight++;
+    else
+        {
+        limit->rejected++;
+        rc = MQTT_ERR_QUEUE_FULL;
+        }
+    apr_thread_mutex_unlock ( limit->lock );
+
+    return rc;
+    }
+
+/** give a slot back and adapt the limit: an answer close to the lowest
+  * round trip seen lately lets the limit grow by one per limit answers,
+  * a slow or missing one cuts it by a tenth, at most once per round trip
+  * \param limit limit of the route, NULL for none
+  * \param rtt round trip of the request, <0 if it tells nothing about the route
+  * \param ok 1 if the answer arrived
+  */
+void mqtt_limit_release ( struct mqtt_limit *limit, apr_interval_time_t rtt, int ok )
+    {
+    apr_time_t now = mqtt_clock();
+
+    if ( !limit || !limit->lock )
+        return;
+
+    apr_thread_mutex_lock ( limit->lock );
+    limit->inflight--;
+
+    if ( rtt >= 0 )
+        {
+        /* let the minimum creep up, a route may get slower for good */
+        if ( limit->min_rtt )
+            limit->min_rtt += limit->min_rtt / 128 + 1;
+        if ( ok && ( !limit->min_rtt || rtt < limit->min_rtt ) )
+            limit->min_rtt = rtt;
+
+        if ( !ok || rtt > limit->min_rtt * MQTT_LIMIT_TOLERANCE )
+            {
+            if ( now >= limit->hold )
+                {
+                limit->limit *= 0.9;
+                if ( limit->limit < 1 )
+                    limit->limit = 1;
+                limit->hold = now + ( ok ? rtt : limit->min_rtt );
+                }
+            }
+        else if ( limit->inflight + 1 >= ( int ) limit->limit / 2 )
+            {
+            /* only grow while the limit is actually used */
+            limit->limit += 1.0 / limit->limit;
+            if ( limit->limit > limit->max )
+                limit->limit = limit->max;
+            }
+        }
+
+    if ( limit->queued )
+        apr_thread_cond_signal ( limit->room );
+    apr_thread_mutex_unlock ( limit->lock );
+    }
+
+/** one line per limit for the status page
+  * \param pool request pool
+  * \return text, empty if there are no limits
+  */
+const char *mqtt_limit_report ( apr_pool_t *pool )
+    {
+    const char *report = "";
+    struct mqtt_limit *limit;
+
+    for ( limit = limits; limit; limit = limit->next )
+        {
+        if ( !limit->lock )
+            continue;
+        apr_thread_mutex_lock ( limit->lock );
+        report = apr_psprintf ( pool, "%slimit %s: %d of max %d, inflight %d, queued %d, rejected %u, "
+                                "min rtt %" APR_TIME_T_FMT " us\n", report, limit->name, ( int ) limit->limit,
+                                limit->max, limit->inflight, limit->queued, limit->rejected, limit->min_rtt );
+        apr_thread_mutex_unlock ( limit->lock );
+        }
+    return report;
+    }
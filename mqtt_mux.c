@@ -0,0 +1,253 @@
+/*
+ * mqtt response multiplexer: all requests share one subscription per
+ * response topic filter, answers find their request by correlation id
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mosquitto.h>
+#include "apr_atomic.h"
+#include "apr_time.h"
+#include "mqtt_common.h"
+
+struct mux_shard
+    {
+    apr_thread_mutex_t *lock;       /* protects waiting, flights and pool */
+    apr_pool_t *pool;               /* hash entries, allocated under lock */
+    apr_hash_t *waiting;            /* correlation id -> struct mqtt_waiter */
+    apr_hash_t *flights;            /* query key -> struct mqtt_flight */
+    };
+
+/* a query other requests wait for, malloc'ed with its key */
+struct mqtt_flight
+    {
+    char *key;                      /* topic, payload and broker */
+    struct mqtt_waiter *followers;  /* linked through follow, one reference each */
+    };
+
+static struct mux_shard shards[MQTT_MUX_SHARDS];
+
+static apr_uint32_t mux_seed = 0;               /* differs per child and start */
+static volatile apr_uint32_t mux_seq = 0;       /* differs per request */
+
+/** pick the shard for a correlation id
+  * \param id correlation id
+  * \return shard
+  */
+static struct mux_shard *mux_shard ( const char *id )
+    {
+    apr_uint32_t h = 2166136261u;       /* FNV-1a */
+
+    while ( *id )
+        h = ( h ^ ( unsigned char ) *id++ ) * 16777619u;
+    return &shards[h % MQTT_MUX_SHARDS];
+    }
+
+/** create the shards, once per child before any request runs
+  * \param pool child pool
+  * \return MOSQ_ERR_SUCCESS or MOSQ_ERR_NOMEM
+  */
+int mqtt_mux_init ( apr_pool_t *pool )
+    {
+    int i;
+
+    for ( i = 0; i < MQTT_MUX_SHARDS; i++ )
+        {
+        if ( apr_pool_create ( &shards[i].pool, pool ) != APR_SUCCESS
+             || apr_thread_mutex_create ( &shards[i].lock, APR_THREAD_MUTEX_DEFAULT, pool ) != APR_SUCCESS )
+            return MOSQ_ERR_NOMEM;
+        shards[i].waiting = apr_hash_make ( shards[i].pool );
+        shards[i].flights = apr_hash_make ( shards[i].pool );
+        }
+
+    mux_seed = ( apr_uint32_t ) getpid() ^ ( apr_uint32_t ) apr_time_now();
+    return MOSQ_ERR_SUCCESS;
+    }
+
+/** make a correlation id unique across children and restarts
+  * \param id buffer of MQTT_CORRELATION_LEN chars
+  */
+void mqtt_mux_id ( char *id )
+    {
+    snprintf ( id, MQTT_CORRELATION_LEN, "%08x%08x", mux_seed, apr_atomic_inc32 ( &mux_seq ) );
+    }
+
+/** make a waiter receive the answer carrying a correlation id.
+  * The map holds the waiter's second reference until the answer arrives
+  * or the request gives up.
+  * \param waiter from mqtt_waiter_get
+  * \param id correlation id
+  * \return MOSQ_ERR_SUCCESS, MOSQ_ERR_NOMEM if mqtt_mux_init failed
+  */
+int mqtt_mux_register ( struct mqtt_waiter *waiter, const char *id )
+    {
+    struct mux_shard *shard = mux_shard ( id );
+
+    if ( !shard->lock )
+        return MOSQ_ERR_NOMEM;
+
+    strncpy ( waiter->correlation, id, MQTT_CORRELATION_LEN - 1 );
+    waiter->correlation[MQTT_CORRELATION_LEN - 1] = 0;
+
+    apr_thread_mutex_lock ( shard->lock );
+    apr_hash_set ( shard->waiting, waiter->correlation, APR_HASH_KEY_STRING, waiter );
+    apr_thread_mutex_unlock ( shard->lock );
+    return MOSQ_ERR_SUCCESS;
+    }
+
+/** a request gives up: late answers for it are dropped
+  * \param waiter registered with mqtt_mux_register
+  * \return 1 if removed, 0 if an answer got there first
+  */
+int mqtt_mux_unregister ( struct mqtt_waiter *waiter )
+    {
+    struct mux_shard *shard = mux_shard ( waiter->correlation );
+    int found;
+
+    apr_thread_mutex_lock ( shard->lock );
+    found = ( apr_hash_get ( shard->waiting, waiter->correlation, APR_HASH_KEY_STRING ) == waiter );
+    if ( found )
+        apr_hash_set ( shard->waiting, waiter->correlation, APR_HASH_KEY_STRING, NULL );
+    apr_thread_mutex_unlock ( shard->lock );
+
+    if ( found )
+        mqtt_waiter_release ( waiter );
+    return found;
+    }
+
+/** hand an answer to the request waiting for it, or queue it for a request
+  * collecting several. Called by the reactor.
+  * \param id correlation id from the answer
+  * \param payload answer
+  * \param payloadlen answer size
+  * \return 1 if delivered, 0 if nobody waits for it
+  */
+int mqtt_mux_deliver ( const char *id, const char *payload, int payloadlen )
+    {
+    struct mux_shard *shard = mux_shard ( id );
+    struct mqtt_waiter *waiter;
+    int last = 1;
+
+    apr_thread_mutex_lock ( shard->lock );
+    waiter = apr_hash_get ( shard->waiting, id, APR_HASH_KEY_STRING );
+    /* a waiter collecting several answers stays registered until the last */
+    if ( waiter && waiter->want != 1 )
+        last = ( waiter->want && ++waiter->got >= waiter->want );
+    if ( waiter && last )
+        apr_hash_set ( shard->waiting, waiter->correlation, APR_HASH_KEY_STRING, NULL );
+    else if ( waiter )
+        apr_atomic_inc32 ( &waiter->refs );
+    apr_thread_mutex_unlock ( shard->lock );
+
+    if ( !waiter )
+        return 0;
+
+    if ( waiter->want != 1 )
+        {
+        mqtt_waiter_queue ( waiter, payload, payloadlen, last );
+        mqtt_waiter_release ( waiter );
+        return 1;
+        }
+
+    if ( payloadlen )
+        {
+        waiter->message = malloc ( payloadlen + 1 );
+        if ( waiter->message )
+            {
+            memcpy ( waiter->message, payload, payloadlen );
+            waiter->message[payloadlen] = 0;
+            waiter->msglen = payloadlen;
+            }
+        }
+
+    mqtt_waiter_complete ( waiter, ( waiter->message || !payloadlen ? MOSQ_ERR_SUCCESS : MOSQ_ERR_NOMEM ) );
+    mqtt_waiter_release ( waiter );
+    return 1;
+    }
+
+/** coalesce identical queries: join the one in flight with the same key,
+  * or lead a new flight if there is none
+  * \param key topic, payload and broker of the query
+  * \param follower set to a waiter completed with the leader's answer,
+  *        NULL if the caller leads or goes alone
+  * \return flight the leader lands with mqtt_mux_land, NULL when following
+  *         or out of memory
+  */
+struct mqtt_flight *mqtt_mux_join ( const char *key, struct mqtt_waiter **follower )
+    {
+    struct mux_shard *shard = mux_shard ( key );
+    struct mqtt_flight *flight, *lead = NULL;
+    struct mqtt_waiter *waiter = NULL;
+
+    *follower = NULL;
+    if ( !shard->lock )
+        return NULL;
+
+    apr_thread_mutex_lock ( shard->lock );
+    flight = apr_hash_get ( shard->flights, key, APR_HASH_KEY_STRING );
+    if ( flight )
+        {
+        waiter = mqtt_waiter_get ();
+        if ( waiter )
+            {
+            waiter->follow = flight->followers;
+            flight->followers = waiter;
+            }
+        }
+    else
+        {
+        lead = malloc ( sizeof ( struct mqtt_flight ) + strlen ( key ) + 1 );
+        if ( lead )
+            {
+            lead->key = strcpy ( ( char * ) ( lead + 1 ), key );
+            lead->followers = NULL;
+            apr_hash_set ( shard->flights, lead->key, APR_HASH_KEY_STRING, lead );
+            }
+        }
+    apr_thread_mutex_unlock ( shard->lock );
+
+    *follower = waiter;
+    return lead;
+    }
+
+/** the leader has its answer or gave up: the followers get the same.
+  * Later identical queries start a new flight.
+  * \param flight from mqtt_mux_join, freed
+  * \param rc result of the leader
+  * \param message answer or NULL
+  * \param msglen answer size
+  */
+void mqtt_mux_land ( struct mqtt_flight *flight, int rc, const char *message, int msglen )
+    {
+    struct mux_shard *shard = mux_shard ( flight->key );
+    struct mqtt_waiter *waiter, *next;
+
+    apr_thread_mutex_lock ( shard->lock );
+    apr_hash_set ( shard->flights, flight->key, APR_HASH_KEY_STRING, NULL );
+    waiter = flight->followers;
+    apr_thread_mutex_unlock ( shard->lock );
+
+    for ( ; waiter; waiter = next )
+        {
+        next = waiter->follow;
+
+        if ( !rc && message && msglen )
+            {
+            waiter->message = malloc ( msglen + 1 );
+            if ( waiter->message )
+                {
+                memcpy ( waiter->message, message, msglen );
+                waiter->message[msglen] = 0;
+                waiter->msglen = msglen;
+                }
+            }
+
+        mqtt_waiter_complete ( waiter, ( rc || waiter->message || !msglen ? rc : MOSQ_ERR_NOMEM ) );
+        mqtt_waiter_release ( waiter );
+        }
+
+    free ( flight );
+    }
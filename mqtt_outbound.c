@@ -0,0 +1,130 @@
+/*
+ * mqtt outbound queue: fire-and-forget publishes waiting for a reactor,
+ * bounded per child process and sent in batches
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <mosquitto.h>
+#include "apr_atomic.h"
+#include "mqtt_common.h"
+
+static apr_uint32_t outbound_limit = MQTT_OUTBOUND_SIZE;       /* max. queued publishes */
+static int outbound_policy = MQTT_OVERFLOW_REJECT;             /* what to do when full */
+static int outbound_batch = MQTT_BATCH_SIZE;                   /* publishes per flush */
+static apr_interval_time_t outbound_delay = 0;                 /* max. time a publish waits for its batch */
+
+static volatile apr_uint32_t outbound_pending = 0;             /* queued or batched publishes */
+static volatile apr_uint32_t outbound_waiting = 0;             /* request threads waiting for room */
+static volatile apr_uint32_t outbound_dropped = 0;             /* publishes lost to overflow */
+
+static apr_thread_mutex_t *outbound_lock = NULL;               /* with outbound_room for waiting */
+static apr_thread_cond_t *outbound_room = NULL;
+
+/** set up the outbound queue, once per child before the reactors start
+  * \param pool child pool
+  * \param limit max. publishes queued per child
+  * \param policy MQTT_OVERFLOW_REJECT, MQTT_OVERFLOW_DROP or MQTT_OVERFLOW_WAIT
+  * \param batch max. publishes sent in one go
+  * \param delay_ms max. ms a publish waits for its batch to fill
+  * \return MOSQ_ERR_SUCCESS or MOSQ_ERR_NOMEM
+  */
+int mqtt_outbound_init ( apr_pool_t *pool, int limit, int policy, int batch, int delay_ms )
+    {
+    if ( apr_thread_mutex_create ( &outbound_lock, APR_THREAD_MUTEX_DEFAULT, pool ) != APR_SUCCESS
+         || apr_thread_cond_create ( &outbound_room, pool ) != APR_SUCCESS )
+        return MOSQ_ERR_NOMEM;
+
+    outbound_limit = ( limit > 0 ? limit : MQTT_OUTBOUND_SIZE );
+    outbound_policy = policy;
+    outbound_batch = ( batch > 0 ? batch : 1 );
+    outbound_delay = apr_time_from_msec ( delay_ms > 0 ? delay_ms : 0 );
+    return MOSQ_ERR_SUCCESS;
+    }
+
+/** try to take a queue slot
+  * \return 1 on success, 0 if the queue is full
+  */
+static int outbound_take ( void )
+    {
+    apr_uint32_t n;
+
+    do
+        {
+        n = apr_atomic_read32 ( &outbound_pending );
+        if ( n >= outbound_limit )
+            return 0;
+        }
+    while ( apr_atomic_cas32 ( &outbound_pending, n + 1, n ) != n );
+
+    return 1;
+    }
+
+/** take a queue slot for a new publish, applying the overflow policy
+  * \param deadline mqtt_clock() time to give up waiting for room
+  * \return MOSQ_ERR_SUCCESS, MQTT_ERR_DROPPED, MQTT_ERR_QUEUE_FULL or MQTT_ERR_TIMEOUT
+  */
+int mqtt_outbound_reserve ( apr_time_t deadline )
+    {
+    int rc = MOSQ_ERR_SUCCESS;
+
+    if ( outbound_take() )
+        return MOSQ_ERR_SUCCESS;
+
+    switch ( outbound_policy )
+        {
+        case MQTT_OVERFLOW_DROP:
+            if ( apr_atomic_inc32 ( &outbound_dropped ) % 1000 == 0 )
+                LPRINTF ( "mod_mqtt: outbound queue full, %u publishes dropped\n",
+                          apr_atomic_read32 ( &outbound_dropped ) );
+            return MQTT_ERR_DROPPED;
+
+        case MQTT_OVERFLOW_WAIT:
+            apr_thread_mutex_lock ( outbound_lock );
+            apr_atomic_inc32 ( &outbound_waiting );
+            while ( !outbound_take() )
+                {
+                apr_interval_time_t left = deadline - mqtt_clock();
+                if ( left <= 0 )
+                    {
+                    rc = MQTT_ERR_TIMEOUT;
+                    break;
+                    }
+                apr_thread_cond_timedwait ( outbound_room, outbound_lock, left );
+                }
+            apr_atomic_dec32 ( &outbound_waiting );
+            apr_thread_mutex_unlock ( outbound_lock );
+            return rc;
+
+        default:
+            return MQTT_ERR_QUEUE_FULL;
+        }
+    }
+
+/** a queued publish left the process or failed. Called by the reactor.
+  */
+void mqtt_outbound_done ( void )
+    {
+    apr_atomic_dec32 ( &outbound_pending );
+
+    /* only pay for the lock when somebody waits for room */
+    if ( apr_atomic_read32 ( &outbound_waiting ) )
+        {
+        apr_thread_mutex_lock ( outbound_lock );
+        apr_thread_cond_signal ( outbound_room );
+        apr_thread_mutex_unlock ( outbound_lock );
+        }
+    }
+
+/** \return max. publishes sent in one go */
+int mqtt_outbound_batch ( void )
+    {
+    return outbound_batch;
+    }
+
+/** \return max. time a publish waits for its batch to fill */
+apr_interval_time_t mqtt_outbound_delay ( void )
+    {
+    return outbound_delay;
+    }
@@ -18,132 +18,17 @@
 #include <mosquitto.h>
 #include "mqtt_common.h"
 
- /** This is called when the broker sends a CONNACK message in response to a connection.
-    * mosq	the mosquitto instance making the callback.
-    * obj	the user data provided in mosquitto_new
-    * rc	the return code of the connection response, one of:
-    *   0 - success
-    *   1 - connection refused (unacceptable protocol version)
-    * 2 - connection refused (identifier rejected)
-    * 3 - connection refused (broker unavailable)
-    * 4-255 - reserved for future use
-    * \param mosq object
-    * \param obj config object for this request
-    * \param result from connect operation
-    */
-
-void my_pub_connect_callback ( struct mosquitto *mosq, void *obj, int result )
-    {
-    struct mosq_config *cb_obj = ( struct mosq_config *) obj ;
-    int rc = MOSQ_ERR_SUCCESS;
-
-    DPRINTF("my_pub_connect_callback %d: \n", result) ;
-
-    if ( !result )
-        {
-        switch ( cb_obj-> pub_mode )
-            {
-            case MSGMODE_CMD:
-            case MSGMODE_FILE:
-            case MSGMODE_STDIN_FILE:
-                rc = mosquitto_publish ( mosq, & (cb_obj -> mid_sent),
-                                            cb_obj -> topic, 
-                                            cb_obj -> msglen, 
-                                            cb_obj -> message, 
-                                            cb_obj -> qos, 
-                                            cb_obj -> retain );
-                break;
-
-            case MSGMODE_NULL:
-                rc = mosquitto_publish ( mosq, & (cb_obj -> mid_sent), 
-                                            cb_obj -> topic, 
-                                            0, 
-                                            NULL, 
-                                            cb_obj -> qos, 
-                                            cb_obj -> retain );
-                break;
-
-            case MSGMODE_STDIN_LINE:
-                cb_obj ->status = STATUS_CONNACK_RECVD;
-                break;
-            }
-
-        DPRINTF("my_pub_connect_callback rc %d: \n", rc) ;
-
-        if ( rc )
-            {
-            if ( !cb_obj ->quiet )
-                {
-                switch ( rc )
-                    {
-                    case MOSQ_ERR_INVAL:
-                        fprintf ( stderr, "Error: Invalid input. Does your topic contain '+' or '#'?\n" );
-                        break;
-
-                    case MOSQ_ERR_NOMEM:
-                        fprintf ( stderr, "Error: Out of memory when trying to publish message.\n" );
-                        break;
-
-                    case MOSQ_ERR_NO_CONN:
-                        fprintf ( stderr, "Error: Client not connected when trying to publish.\n" );
-                        break;
-
-                    case MOSQ_ERR_PROTOCOL:
-                        fprintf ( stderr, "Error: Protocol error when communicating with broker.\n" );
-                        break;
-
-                    case MOSQ_ERR_PAYLOAD_SIZE:
-                        fprintf ( stderr, "Error: Message payload is too large.\n" );
-                        break;
-                    }
-                }
-
-            mosquitto_disconnect ( mosq );
-            }
-        }
-    else
-        {
-        if ( result && !cb_obj->quiet )
-            {
-            fprintf ( stderr, "%s\n", mosquitto_connack_string ( result ) );
-            }
-        }
-    }
-
-/**  This is called when the broker has received the DISCONNECT command and has disconnected the client.
-  * \param mosq	the mosquitto instance making the callback.
-  * \param obj config for this request
-  * \param rc	integer value indicating the reason for the disconnect. 
-  *         A value of 0 means the client has called mosquitto_disconnect. 
-  *         Any other value indicates that the disconnect is unexpected.
-  */
-void my_pub_disconnect_callback ( struct mosquitto *mosq, void *obj, int rc )
-    {
-    struct mosq_config *cb_obj = ( struct mosq_config *) obj ;
-    cb_obj -> connected = false;
-
-    DPRINTF("my_pub_disconnect_callback %d: \n", rc) ;
-    }
-
 /** This is called when a message initiated with mosquitto_publish has been sent to the broker successfully.
  * @par mosq	the mosquitto instance making the callback.
- * @par obj	the user data provided in mosquitto_new
+ * @par obj	the pooled connection
  * @par mid	the message id of the sent message.
  */
 void my_pub_publish_callback ( struct mosquitto *mosq, void *obj, int mid )
     {
-    struct mosq_config *cb_obj = ( struct mosq_config *) obj ;
-    cb_obj-> last_mid_sent = mid;
-
     DPRINTF("my_pub_publish_callback %d: \n", mid) ;
 
-    if ( cb_obj->disconnect_sent == false )
-        {
-        mosquitto_disconnect ( mosq );
-        cb_obj->disconnect_sent = true;
-        }
+    mqtt_conn_pub_done ( ( struct mqtt_conn *) obj, mid );
     }
-
     
 
 /**  This should be used if you want event logging information from the client library.
@@ -157,106 +42,240 @@ void my_pub_log_callback ( struct mosquitto *mosq, void *obj, int level, const c
     /* struct mosq_config *cb_obj = ( struct mosq_cb_obj *) obj ; */
     }
 
-/**  single-shot publish one message
+/**  build the publish job for mqtt_pub, mqtt_pub_submit and mqtt_post
+ * \param type JOB_PUBLISH, JOB_SEND or JOB_BURST
  * \param pool request memory pool
- * \param mqtt_server server to use
- * \param mqtt_port server port to use
+ * \param broker server, port and credentials to use
  * \param topic topic
  * \param msg message 
  * \param msglen message size
+ * \param response MQTT v5: topic the answer is expected on, or NULL
+ * \param correlation MQTT v5: correlation data for the answer, or NULL
+ * \param deadline mqtt_clock() time the request gives up
+ * \param pjob new job
  * \return MOSQ_ERR_SUCCESS or ...
  */
-int  mqtt_pub(apr_pool_t *pool, const char * mqtt_server, int mqtt_port, const char * topic, const char * msg, int msglen)
+static int pub_job(int type, apr_pool_t *pool, const struct mqtt_broker *broker, const char * topic, const char * msg, int msglen,
+                   const char * response, const char * correlation, apr_time_t deadline, struct mqtt_job **pjob)
     {
     struct mosq_config cfg;
-    struct mosquitto *mosq = NULL;
+    struct mqtt_job *job;
     int rc;
 
-    DPRINTF("pub %s %d %s, %s %d: \n", mqtt_server, mqtt_port, topic, msg, msglen) ;
+    DPRINTF("pub %s %d %s, %s %d: \n", broker->host, broker->port, topic, msg, msglen) ;
     
     rc = client_config_basic (pool, &cfg, msg, msglen);
     if ( rc != MOSQ_ERR_SUCCESS )
         return rc ;
 
-    rc = client_config_pub (&cfg,  mqtt_server,  mqtt_port, topic) ;
+    rc = client_config_pub (&cfg,  broker->host,  broker->port, topic) ;
     if ( rc != MOSQ_ERR_SUCCESS )
         return rc ;
 
     DPRINTF("cfg %d: \n", rc) ;
 
-    mosquitto_lib_init();
-    DPRINTF("cfg init \n");
+    job = mqtt_job_create ( type, broker, cfg.topic, cfg.message, cfg.msglen, response );
+    if ( !job )
+        return MOSQ_ERR_NOMEM;
 
-    if ( client_id_generate ( &cfg, "mosqpub" ) )
+    /* fire-and-forget publishes are spooled rather than dropped */
+    job->deadline = ( type == JOB_SEND ? 0 : deadline );
+    job->qos = ( broker->qos > 0 ? broker->qos : cfg.qos );
+    job->retain = ( broker->retain > 0 ? broker->retain : cfg.retain );
+    if ( correlation )
         {
-        return 1;
+        strncpy ( job->correlation, correlation, MQTT_CORRELATION_LEN - 1 );
+        /* responders should not start on a query nobody waits for anymore */
+        job->expiry = ( int ) ( ( deadline - mqtt_clock() + APR_USEC_PER_SEC - 1 ) / APR_USEC_PER_SEC );
+        if ( job->expiry < 1 )
+            job->expiry = 1;
         }
 
-    DPRINTF("cfg id %d: \n", rc) ;
+    *pjob = job;
+    return MOSQ_ERR_SUCCESS;
+    }
+
+/**  publish one message through a reactor and wait until it is sent
+ * \param pool request memory pool
+ * \param broker server, port and credentials to use
+ * \param topic topic
+ * \param msg message 
+ * \param msglen message size
+ * \param response MQTT v5: topic the answer is expected on, or NULL
+ * \param correlation MQTT v5: correlation data for the answer, or NULL
+ * \param deadline mqtt_clock() time the request gives up
+ * \return MOSQ_ERR_SUCCESS or ...
+ */
+int  mqtt_pub(apr_pool_t *pool, const struct mqtt_broker *broker, const char * topic, const char * msg, int msglen,
+              const char * response, const char * correlation, apr_time_t deadline)
+    {
+    struct mqtt_waiter *waiter;
+    struct mqtt_job *job = NULL;
+    int rc;
+
+    rc = pub_job ( JOB_PUBLISH, pool, broker, topic, msg, msglen, response, correlation, deadline, &job );
+    if ( rc != MOSQ_ERR_SUCCESS )
+        return rc ;
+
+    waiter = mqtt_waiter_get ();
+    if ( !waiter )
+        {
+        free ( job );
+        return MOSQ_ERR_NOMEM;
+        }
+
+    job->waiter = waiter;
+    mqtt_reactor_submit ( job );
 
-    mosq = mosquitto_new ( cfg.id, true, &cfg );
-    DPRINTF("cfg new %ld: \n", (long int) mosq) ;
+    rc = mqtt_waiter_wait ( waiter, deadline );
+    mqtt_waiter_release ( waiter );
 
-    if ( !mosq )
+    if ( rc )
         {
-        switch ( errno )
-            {
-            case ENOMEM:
-                if ( !cfg.quiet )
-                    fprintf ( stderr, "Error: Out of memory.\n" );
+        fprintf ( stderr, "Error: %s\n", ( rc == MQTT_ERR_TIMEOUT ? "publish timed out" : mosquitto_strerror ( rc ) ) );
+        }
 
-                break;
+    DPRINTF("pub finished %d\n", rc ) ;
 
-            case EINVAL:
-                if ( !cfg.quiet )
-                    fprintf ( stderr, "Error: Invalid id.\n" );
+    return rc;
+    }
 
-                break;
+/**  publish many messages back to back, all handed to the reactors before
+ *   waiting for the first, and wait until they are sent. The records of a
+ *   connection go out as one corked burst, flushed by the last of them.
+ * \param pool request memory pool
+ * \param records messages, those without topic are skipped
+ * \param n number of records
+ * \param deadline mqtt_clock() time the request gives up
+ * \return records sent, rc of each record set to MOSQ_ERR_SUCCESS, MQTT_ERR_TIMEOUT or ...
+ */
+int  mqtt_pub_records(apr_pool_t *pool, struct mqtt_record *records, int n, apr_time_t deadline)
+    {
+    struct mqtt_waiter **waiters = apr_pcalloc ( pool, n * sizeof ( struct mqtt_waiter * ) );
+    struct mqtt_job **jobs = apr_pcalloc ( pool, n * sizeof ( struct mqtt_job * ) );
+    apr_hash_t *last = apr_hash_make ( pool );
+    int i, sent = 0;
+
+    for ( i = 0; i < n; i++ )
+        {
+        struct mqtt_job *job = NULL;
+
+        if ( !records[i].topic )
+            continue;
+
+        if ( pub_job ( JOB_BURST, pool, &records[i].broker, records[i].topic, records[i].msg, records[i].msglen,
+                       NULL, NULL, deadline, &job ) != MOSQ_ERR_SUCCESS )
+            job = NULL;
+        waiters[i] = ( job ? mqtt_waiter_get () : NULL );
+        if ( !waiters[i] )
+            {
+            free ( job );
+            records[i].rc = MOSQ_ERR_NOMEM;
+            continue;
             }
 
-        mosquitto_lib_cleanup();
-        return 1;
+        job->waiter = waiters[i];
+        jobs[i] = job;
+        apr_hash_set ( last, job->key, APR_HASH_KEY_STRING, job );
         }
 
-    if ( cfg.debug )
+    /* marked before any is submitted, a reactor frees what it finished */
+    for ( i = 0; i < n; i++ )
+        if ( jobs[i] )
+            jobs[i]->last = ( apr_hash_get ( last, jobs[i]->key, APR_HASH_KEY_STRING ) == jobs[i] );
+    for ( i = 0; i < n; i++ )
+        if ( jobs[i] )
+            mqtt_reactor_submit ( jobs[i] );
+
+    /* all are on their way, the first wait covers the others */
+    for ( i = 0; i < n; i++ )
         {
-        mosquitto_log_callback_set ( mosq, my_pub_log_callback );
+        if ( !waiters[i] )
+            continue;
+
+        records[i].rc = mqtt_waiter_wait ( waiters[i], deadline );
+        mqtt_waiter_release ( waiters[i] );
+        if ( records[i].rc == MOSQ_ERR_SUCCESS )
+            sent++;
         }
 
-    mosquitto_connect_callback_set ( mosq, my_pub_connect_callback );
-    mosquitto_disconnect_callback_set ( mosq, my_pub_disconnect_callback );
-    mosquitto_publish_callback_set ( mosq, my_pub_publish_callback );
+    DPRINTF("pub records %d of %d sent\n", sent, n ) ;
+    return sent;
+    }
 
-    DPRINTF("cb set: \n" ) ;
+/**  hand one message to a reactor without waiting, send errors are only
+ *   seen as a missing answer
+ * \param pool request memory pool
+ * \param broker server, port and credentials to use
+ * \param topic topic
+ * \param msg message 
+ * \param msglen message size
+ * \param response MQTT v5: topic the answer is expected on, or NULL
+ * \param correlation MQTT v5: correlation data for the answer, or NULL
+ * \param deadline mqtt_clock() time the request gives up
+ * \return MOSQ_ERR_SUCCESS or ...
+ */
+int  mqtt_pub_submit(apr_pool_t *pool, const struct mqtt_broker *broker, const char * topic, const char * msg, int msglen,
+                     const char * response, const char * correlation, apr_time_t deadline)
+    {
+    struct mqtt_job *job = NULL;
+    int rc;
 
-    if ( client_opts_set ( mosq, &cfg ) )
-        {
-        return 1;
-        }
+    rc = pub_job ( JOB_PUBLISH, pool, broker, topic, msg, msglen, response, correlation, deadline, &job );
+    if ( rc == MOSQ_ERR_SUCCESS )
+        mqtt_reactor_submit ( job );
 
-    DPRINTF("opts set\n" ) ;
+    return rc;
+    }
 
-    rc = client_connect ( mosq, &cfg );
-    DPRINTF("connected: %d\n", rc ) ;
+/**  build a query without sending it, for a hedge sent later with
+ *   mqtt_reactor_submit or dropped with free
+ * \param pool request memory pool
+ * \param broker server, port and credentials to use
+ * \param topic topic
+ * \param msg message 
+ * \param msglen message size
+ * \param response MQTT v5: topic the answer is expected on, or NULL
+ * \param correlation correlation data for the answer, or NULL
+ * \param deadline mqtt_clock() time the request gives up
+ * \return job or NULL
+ */
+struct mqtt_job *mqtt_pub_job(apr_pool_t *pool, const struct mqtt_broker *broker, const char * topic, const char * msg,
+                              int msglen, const char * response, const char * correlation, apr_time_t deadline)
+    {
+    struct mqtt_job *job = NULL;
 
-    if ( rc )
-        return rc;
+    if ( pub_job ( JOB_PUBLISH, pool, broker, topic, msg, msglen, response, correlation, deadline, &job ) )
+        return NULL;
+    return job;
+    }
 
-    do
-        {
-        rc = mosquitto_loop ( mosq, -1, 1 );
-        }
-    while ( rc == MOSQ_ERR_SUCCESS && cfg.connected );
+/**  queue one message for the batched outbound sender and return at once
+ * \param pool request memory pool
+ * \param broker server, port and credentials to use
+ * \param topic topic
+ * \param msg message 
+ * \param msglen message size
+ * \param deadline mqtt_clock() time to give up waiting for room in the queue
+ * \return MOSQ_ERR_SUCCESS, MQTT_ERR_DROPPED, MQTT_ERR_QUEUE_FULL, MQTT_ERR_TIMEOUT or ...
+ */
+int  mqtt_post(apr_pool_t *pool, const struct mqtt_broker *broker, const char * topic, const char * msg, int msglen,
+               apr_time_t deadline)
+    {
+    struct mqtt_job *job = NULL;
+    int rc;
 
-    mosquitto_destroy ( mosq );
-    mosquitto_lib_cleanup();
+    rc = mqtt_outbound_reserve ( deadline );
+    if ( rc != MOSQ_ERR_SUCCESS )
+        return rc;
 
-    if ( rc )
+    rc = pub_job ( JOB_SEND, pool, broker, topic, msg, msglen, NULL, NULL, deadline, &job );
+    if ( rc != MOSQ_ERR_SUCCESS )
         {
-        fprintf ( stderr, "Error: %s\n", mosquitto_strerror ( rc ) );
+        mqtt_outbound_done ();
+        return rc;
         }
 
-    DPRINTF("pub finished %d\n", rc ) ;
-
-    return rc;
+    mqtt_reactor_submit ( job );
+    return MOSQ_ERR_SUCCESS;
     }
@@ -0,0 +1,477 @@
+/*
+ * mqtt response cache: the answers of a location kept per child for a
+ * while, keyed by publish topic and query. Stale answers are served while
+ * one refresh is on its way, or when the broker or responder fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mosquitto.h>
+#include "apr_atomic.h"
+#include "apr_strings.h"
+#include "mqtt_common.h"
+#include "keyValuePair.h"
+
+/* a refresh on its way: owned by the entry and by the answer notification */
+struct rcache_refresh
+    {
+    struct mqtt_rcache *rc;
+    struct mqtt_waiter *waiter;     /* from mqtt_sub_prepare */
+    volatile apr_uint32_t refs;     /* entry and notification */
+    char key[];
+    };
+
+/* an answer as it is sent, malloc'ed: shared by its entry and the
+ * requests sending it, so a hit neither copies nor hashes it */
+struct rcache_answer
+    {
+    volatile apr_uint32_t refs;     /* entry and requests */
+    int len;                        /* data bytes */
+    const char *etag;               /* quoted, in text */
+    const char *max_age;            /* of the responder, in text, or NULL */
+    const char *data;               /* in text */
+    char text[];                    /* content type, NUL, etag, NUL, max-age, NUL, data, NUL */
+    };
+
+/* the answer to one query, malloc'ed with its key */
+struct rcache_entry
+    {
+    apr_time_t stored;              /* mqtt_clock() of the answer */
+    struct rcache_refresh *refresh; /* refresh on its way, or NULL */
+    apr_time_t refresh_until;       /* mqtt_clock() before which nobody else refreshes */
+    struct rcache_answer *answer;
+    char key[];
+    };
+
+/* the cache of one location, per child. Created at configuration time,
+ * lock and table created by mqtt_rcache_init in the child. */
+struct mqtt_rcache
+    {
+    struct mqtt_rcache *next;       /* all caches, for the status page */
+    const char *name;               /* location */
+    apr_interval_time_t ttl;        /* answers are fresh this long */
+    apr_interval_time_t swr;        /* then served while one refresh runs */
+    apr_interval_time_t sie;        /* after the ttl, served when the live path fails */
+    apr_thread_mutex_t *lock;       /* protects the rest */
+    apr_pool_t *pool;               /* of the table */
+    apr_hash_t *entries;            /* key -> struct rcache_entry */
+    apr_uint32_t hits;              /* fresh answers served */
+    apr_uint32_t stale;             /* stale answers served while refreshing */
+    apr_uint32_t errors;            /* stale answers served instead of an error */
+    apr_uint32_t misses;            /* live queries */
+    apr_uint32_t refreshes;         /* refreshes started */
+    };
+
+static struct mqtt_rcache *rcaches = NULL;      /* in configuration order */
+
+/** forget the caches of a configuration that is going away
+  * \param data unused
+  * \return APR_SUCCESS
+  */
+static apr_status_t rcache_cleanup ( void *data )
+    {
+    rcaches = NULL;
+    return APR_SUCCESS;
+    }
+
+/** create a cache, at configuration time
+  * \param pool configuration pool
+  * \param name shown in the status
+  * \param ttl_ms ms an answer is fresh
+  * \param swr_ms ms after that it is served while refreshing, 0 for never
+  * \param sie_ms ms after the ttl it is served when the live path fails, 0 for never
+  * \return cache
+  */
+struct mqtt_rcache *mqtt_rcache_create ( apr_pool_t *pool, const char *name, int ttl_ms, int swr_ms, int sie_ms )
+    {
+    struct mqtt_rcache *rc = apr_pcalloc ( pool, sizeof ( struct mqtt_rcache ) );
+
+    rc->name = apr_pstrdup ( pool, name );
+    rc->ttl = apr_time_from_msec ( ttl_ms );
+    rc->swr = apr_time_from_msec ( swr_ms );
+    rc->sie = apr_time_from_msec ( sie_ms );
+
+    if ( !rcaches )
+        apr_pool_cleanup_register ( pool, NULL, rcache_cleanup, apr_pool_cleanup_null );
+    rc->next = rcaches;
+    rcaches = rc;
+
+    return rc;
+    }
+
+/** create the locks and tables of all caches, once per child
+  * \param pool child pool
+  * \return MOSQ_ERR_SUCCESS or MOSQ_ERR_NOMEM
+  */
+int mqtt_rcache_init ( apr_pool_t *pool )
+    {
+    struct mqtt_rcache *rc;
+
+    for ( rc = rcaches; rc; rc = rc->next )
+        {
+        if ( apr_thread_mutex_create ( &rc->lock, APR_THREAD_MUTEX_DEFAULT, pool ) != APR_SUCCESS
+             || apr_pool_create ( &rc->pool, pool ) != APR_SUCCESS )
+            return MOSQ_ERR_NOMEM;
+        rc->entries = apr_hash_make ( rc->pool );
+        }
+    return MOSQ_ERR_SUCCESS;
+    }
+
+/** drop one owner of an answer, also as cleanup of a request pool
+  * \param data answer
+  * \return APR_SUCCESS
+  */
+static apr_status_t rcache_answer_release ( void *data )
+    {
+    struct rcache_answer *answer = ( struct rcache_answer * ) data;
+
+    if ( !apr_atomic_dec32 ( &answer->refs ) )
+        free ( answer );
+    return APR_SUCCESS;
+    }
+
+/** drop one owner of a refresh
+  * \param refresh refresh
+  */
+static void rcache_refresh_release ( struct rcache_refresh *refresh )
+    {
+    if ( !apr_atomic_dec32 ( &refresh->refs ) )
+        {
+        mqtt_waiter_release ( refresh->waiter );
+        free ( refresh );
+        }
+    }
+
+/** stop waiting for the refresh of an entry, under the lock. An answer
+  * already on its way still finishes it, but does not touch the entry.
+  * \param entry entry with a refresh
+  */
+static void rcache_refresh_drop ( struct rcache_entry *entry )
+    {
+    struct rcache_refresh *refresh = entry->refresh;
+
+    entry->refresh = NULL;
+    if ( mqtt_mux_unregister ( refresh->waiter ) )
+        rcache_refresh_release ( refresh );     /* no notification will come */
+    rcache_refresh_release ( refresh );
+    }
+
+/** remove an entry, under the lock
+  * \param rc cache
+  * \param entry entry
+  */
+static void rcache_remove ( struct mqtt_rcache *rc, struct rcache_entry *entry )
+    {
+    apr_hash_set ( rc->entries, entry->key, APR_HASH_KEY_STRING, NULL );
+    if ( entry->refresh )
+        rcache_refresh_drop ( entry );
+    rcache_answer_release ( entry->answer );
+    free ( entry );
+    }
+
+/** make room for a new entry, under the lock: entries past all stale
+  * windows go first, an arbitrary one if that is not enough
+  * \param rc cache
+  * \param now mqtt_clock()
+  */
+static void rcache_evict ( struct mqtt_rcache *rc, apr_time_t now )
+    {
+    apr_interval_time_t keep = rc->ttl + ( rc->swr > rc->sie ? rc->swr : rc->sie );
+    apr_hash_index_t *hi;
+    struct rcache_entry *entry = NULL;
+
+    for ( hi = apr_hash_first ( NULL, rc->entries ); hi; hi = apr_hash_next ( hi ) )
+        {
+        apr_hash_this ( hi, NULL, NULL, ( void ** ) &entry );
+        if ( now - entry->stored > keep )
+            rcache_remove ( rc, entry );
+        }
+
+    if ( apr_hash_count ( rc->entries ) >= MQTT_RCACHE_ENTRIES )
+        {
+        hi = apr_hash_first ( NULL, rc->entries );
+        apr_hash_this ( hi, NULL, NULL, ( void ** ) &entry );
+        rcache_remove ( rc, entry );
+        }
+    }
+
+/** an answer as it is sent, with the entity tag mqtt_send_body would
+  * give it. Outside the lock, hashing takes a while.
+  * \param ctype content type
+  * \param etag entity tag of the responder, NULL for none
+  * \param max_age max-age of the responder, NULL for none
+  * \param data body
+  * \param len body size
+  * \return answer owned by the caller, or NULL
+  */
+static struct rcache_answer *rcache_answer ( const char *ctype, const char *etag, const char *max_age,
+                                             const char *data, int len )
+    {
+    char tag[MQTT_ETAG_LEN];
+    int ctypelen = strlen ( ctype ), etaglen, agelen = ( max_age ? strlen ( max_age ) : 0 );
+    struct rcache_answer *answer;
+    char *p;
+
+    mqtt_etag ( tag, etag, data, len );
+    etaglen = strlen ( tag );
+    answer = malloc ( sizeof ( struct rcache_answer ) + ctypelen + 1 + etaglen + 1 + agelen + 1 + len + 1 );
+    if ( !answer )
+        return NULL;
+
+    p = answer->text;
+    memcpy ( p, ctype, ctypelen + 1 );
+    p += ctypelen + 1;
+    memcpy ( p, tag, etaglen + 1 );
+    answer->etag = p;
+    p += etaglen + 1;
+    memcpy ( p, ( max_age ? max_age : "" ), agelen + 1 );
+    answer->max_age = ( max_age ? p : NULL );
+    p += agelen + 1;
+    memcpy ( p, data, len );
+    p[len] = 0;
+    answer->data = p;
+    answer->len = len;
+    apr_atomic_set32 ( &answer->refs, 1 );
+    return answer;
+    }
+
+/** keep an answer, replacing an older one, under the lock
+  * \param rc cache
+  * \param key publish topic and query
+  * \param answer from rcache_answer, taken over
+  */
+static void rcache_store ( struct mqtt_rcache *rc, const char *key, struct rcache_answer *answer )
+    {
+    struct rcache_entry *entry = apr_hash_get ( rc->entries, key, APR_HASH_KEY_STRING );
+    apr_time_t now = mqtt_clock();
+
+    if ( !entry )
+        {
+        if ( apr_hash_count ( rc->entries ) >= MQTT_RCACHE_ENTRIES )
+            rcache_evict ( rc, now );
+        entry = calloc ( 1, sizeof ( struct rcache_entry ) + strlen ( key ) + 1 );
+        if ( !entry )
+            {
+            rcache_answer_release ( answer );
+            return;
+            }
+        strcpy ( entry->key, key );
+        apr_hash_set ( rc->entries, entry->key, APR_HASH_KEY_STRING, entry );
+        }
+
+    if ( entry->answer )
+        rcache_answer_release ( entry->answer );
+    entry->answer = answer;
+    entry->stored = now;
+    }
+
+/** keep the answer to a query
+  * \param rc cache of the location
+  * \param key publish topic and query
+  * \param ctype content type
+  * \param etag entity tag of the responder, NULL for none
+  * \param max_age max-age of the responder, NULL for none
+  * \param data body
+  * \param len body size
+  */
+void mqtt_rcache_put ( struct mqtt_rcache *rc, const char *key, const char *ctype, const char *etag,
+                       const char *max_age, const char *data, int len )
+    {
+    struct rcache_answer *answer;
+
+    if ( !rc || !rc->lock || !( answer = rcache_answer ( ctype, etag, max_age, data, len ) ) )
+        return;
+
+    apr_thread_mutex_lock ( rc->lock );
+    rcache_store ( rc, key, answer );
+    apr_thread_mutex_unlock ( rc->lock );
+    }
+
+/** the cached answer to a query. A stale one within the
+  * stale-while-revalidate window is returned too, and the first caller
+  * to find it so is asked to refresh it.
+  * \param rc cache of the location
+  * \param pool request pool, the answer is kept until it is cleared
+  * \param key publish topic and query
+  * \param failed 1 if the live path failed: anything within the
+  *        stale-if-error window will do
+  * \param refresh_ms ms a refresh may take before another caller tries
+  * \param ctype content type
+  * \param etag quoted entity tag, as mqtt_etag made it
+  * \param max_age max-age of the responder, NULL for none
+  * \param data body
+  * \param len body size
+  * \param revalidate set to 1 if the caller should refresh the entry
+  * \return MQTT_RCACHE_FRESH, MQTT_RCACHE_STALE or MQTT_RCACHE_MISS
+  */
+int mqtt_rcache_get ( struct mqtt_rcache *rc, apr_pool_t *pool, const char *key, int failed, int refresh_ms,
+                      const char **ctype, const char **etag, const char **max_age, const char **data, int *len,
+                      int *revalidate )
+    {
+    struct rcache_entry *entry;
+    apr_time_t now = mqtt_clock();
+    apr_interval_time_t age;
+    int state = MQTT_RCACHE_MISS;
+
+    *revalidate = 0;
+    if ( !rc || !rc->lock )
+        return MQTT_RCACHE_MISS;
+
+    apr_thread_mutex_lock ( rc->lock );
+    entry = apr_hash_get ( rc->entries, key, APR_HASH_KEY_STRING );
+    age = ( entry ? now - entry->stored : 0 );
+
+    if ( entry && age < rc->ttl )
+        state = MQTT_RCACHE_FRESH;
+    else if ( entry && ( failed ? age < rc->ttl + rc->sie : age < rc->ttl + rc->swr ) )
+        {
+        state = MQTT_RCACHE_STALE;
+        /* one refresh at a time, a new one if it takes too long */
+        if ( !failed && now >= entry->refresh_until )
+            {
+            if ( entry->refresh )
+                rcache_refresh_drop ( entry );
+            entry->refresh_until = now + apr_time_from_msec ( refresh_ms );
+            *revalidate = 1;
+            rc->refreshes++;
+            }
+        }
+
+    if ( state != MQTT_RCACHE_MISS )
+        {
+        struct rcache_answer *answer = entry->answer;
+
+        /* a newer answer may replace it while the request sends this one */
+        apr_atomic_inc32 ( &answer->refs );
+        apr_pool_cleanup_register ( pool, answer, rcache_answer_release, apr_pool_cleanup_null );
+        *ctype = answer->text;
+        *etag = answer->etag;
+        *max_age = answer->max_age;
+        *data = answer->data;
+        *len = answer->len;
+        }
+
+    if ( state == MQTT_RCACHE_FRESH )
+        rc->hits++;
+    else if ( state == MQTT_RCACHE_STALE && failed )
+        rc->errors++;
+    else if ( state == MQTT_RCACHE_STALE )
+        rc->stale++;
+    else if ( !failed )
+        rc->misses++;
+    apr_thread_mutex_unlock ( rc->lock );
+
+    return state;
+    }
+
+/** the answer to a refresh is there: store it. Called on a reactor thread.
+  * \param baton refresh
+  */
+static void rcache_refreshed ( void *baton )
+    {
+    struct rcache_refresh *refresh = ( struct rcache_refresh * ) baton;
+    struct mqtt_rcache *rc = refresh->rc;
+    struct mqtt_waiter *waiter = refresh->waiter;
+    struct rcache_entry *entry;
+    struct rcache_answer *answer = NULL;
+    apr_pool_t *pool;
+
+    /* converted as mqtt_respond does, so it matches a live answer */
+    if ( waiter->message && apr_pool_create ( &pool, NULL ) == APR_SUCCESS )
+        {
+        keyValuePair *kv = json2kv ( pool, apr_pstrmemdup ( pool, waiter->message, waiter->msglen ) );
+        const char *ctype = ( kv ? keyValue ( kv, "content-type" ) : NULL );
+        const char *data = ( kv ? keyValue ( kv, ".data" ) : NULL );
+
+        if ( ctype && data )
+            answer = rcache_answer ( ctype, keyValue ( kv, "etag" ), keyValue ( kv, "max-age" ), data, strlen ( data ) );
+        apr_pool_destroy ( pool );
+        }
+
+    apr_thread_mutex_lock ( rc->lock );
+    entry = apr_hash_get ( rc->entries, refresh->key, APR_HASH_KEY_STRING );
+    if ( entry && entry->refresh == refresh )
+        {
+        entry->refresh = NULL;
+        entry->refresh_until = 0;
+        if ( answer )
+            rcache_store ( rc, refresh->key, answer );
+        else
+            LPRINTF ( "cache %s: invalid answer to the refresh of %s\n", rc->name, refresh->key );
+        answer = NULL;
+        rcache_refresh_release ( refresh );
+        }
+    apr_thread_mutex_unlock ( rc->lock );
+
+    if ( answer )
+        rcache_answer_release ( answer );
+
+    rcache_refresh_release ( refresh );
+    }
+
+/** wait for the answer to a refresh in the background, the query is on
+  * its way already
+  * \param rc cache of the location
+  * \param key publish topic and query
+  * \param waiter from mqtt_sub_prepare, taken over on success
+  * \return MOSQ_ERR_SUCCESS, MQTT_ERR_NOT_FOUND if the entry went away
+  *         meanwhile, or MOSQ_ERR_NOMEM
+  */
+int mqtt_rcache_refresh ( struct mqtt_rcache *rc, const char *key, struct mqtt_waiter *waiter )
+    {
+    struct rcache_refresh *refresh = malloc ( sizeof ( struct rcache_refresh ) + strlen ( key ) + 1 );
+    struct rcache_entry *entry;
+    int attached = 0;
+
+    if ( !refresh )
+        return MOSQ_ERR_NOMEM;
+
+    refresh->rc = rc;
+    refresh->waiter = waiter;
+    strcpy ( refresh->key, key );
+    /* entry, notification, and this call until the notification is set */
+    apr_atomic_set32 ( &refresh->refs, 3 );
+
+    apr_thread_mutex_lock ( rc->lock );
+    entry = apr_hash_get ( rc->entries, key, APR_HASH_KEY_STRING );
+    if ( entry && !entry->refresh )
+        {
+        entry->refresh = refresh;
+        attached = 1;
+        }
+    apr_thread_mutex_unlock ( rc->lock );
+
+    if ( !attached )
+        {
+        free ( refresh );
+        return MQTT_ERR_NOT_FOUND;
+        }
+
+    mqtt_waiter_notify ( waiter, rcache_refreshed, refresh );
+    rcache_refresh_release ( refresh );
+    return MOSQ_ERR_SUCCESS;
+    }
+
+/** one line per cache for the status page
+  * \param pool request pool
+  * \return text, empty if there are no caches
+  */
+const char *mqtt_rcache_report ( apr_pool_t *pool )
+    {
+    const char *report = "";
+    struct mqtt_rcache *rc;
+
+    for ( rc = rcaches; rc; rc = rc->next )
+        {
+        if ( !rc->lock )
+            continue;
+        apr_thread_mutex_lock ( rc->lock );
+        report = apr_psprintf ( pool, "%scache %s: %u entries, %u hits, %u stale, %u stale-if-error, "
+                                "%u misses, %u refreshes\n", report, rc->name, apr_hash_count ( rc->entries ),
+                                rc->hits, rc->stale, rc->errors, rc->misses, rc->refreshes );
+        apr_thread_mutex_unlock ( rc->lock );
+        }
+    return report;
+    }
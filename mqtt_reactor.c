@@ -0,0 +1,725 @@
+/*
+ * mqtt I/O reactor: a few threads per child own all broker sockets,
+ * request threads hand them jobs through a lock-free queue
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <mosquitto.h>
+#include "apr_atomic.h"
+#include "apr_portable.h"
+#include "apr_strings.h"
+#include "mqtt_common.h"
+
+/* max. epoll events handled per wakeup */
+#define REACTOR_EVENTS 64
+
+static struct mqtt_reactor *reactors[MQTT_MAX_REACTORS];
+static int reactor_count = 0;
+
+static apr_pool_t *waiter_pool = NULL;          /* child pool, allocations under waiter_lock */
+static apr_thread_mutex_t *waiter_lock = NULL;  /* protects waiter_free */
+static struct mqtt_waiter *waiter_free = NULL;  /* recycled waiters */
+
+/*
+    ==============================================================================
+    waiters: completions request threads park on
+    ==============================================================================
+*/
+
+/** get a waiter from the free list, referenced by the caller and by the
+  * reactor job or the response multiplexer completing it
+  * \return waiter, NULL if out of memory or mqtt_reactor_init failed
+  */
+struct mqtt_waiter *mqtt_waiter_get ( void )
+    {
+    struct mqtt_waiter *waiter;
+
+    if ( !waiter_lock )
+        return NULL;
+
+    apr_thread_mutex_lock ( waiter_lock );
+    waiter = waiter_free;
+    if ( waiter )
+        waiter_free = waiter->next;
+    else
+        {
+        waiter = apr_pcalloc ( waiter_pool, sizeof ( struct mqtt_waiter ) );
+        if ( apr_thread_mutex_create ( &waiter->lock, APR_THREAD_MUTEX_DEFAULT, waiter_pool ) != APR_SUCCESS
+             || apr_thread_cond_create ( &waiter->cond, waiter_pool ) != APR_SUCCESS )
+            waiter = NULL;
+        }
+    apr_thread_mutex_unlock ( waiter_lock );
+
+    if ( !waiter )
+        return NULL;
+
+    waiter->next = NULL;
+    waiter->done = 0;
+    waiter->rc = MOSQ_ERR_SUCCESS;
+    waiter->message = NULL;
+    waiter->msglen = 0;
+    waiter->correlation[0] = 0;
+    waiter->notify = NULL;
+    waiter->baton = NULL;
+    waiter->follow = NULL;
+    waiter->want = 1;
+    waiter->got = 0;
+    waiter->answers = NULL;
+    waiter->tail = &waiter->answers;
+    apr_atomic_set32 ( &waiter->refs, 2 );
+    return waiter;
+    }
+
+/** drop one reference, the last one puts the waiter back on the free list
+  * \param waiter from mqtt_waiter_get
+  */
+void mqtt_waiter_release ( struct mqtt_waiter *waiter )
+    {
+    if ( !waiter || apr_atomic_dec32 ( &waiter->refs ) )
+        return;
+
+    free ( waiter->message );
+    waiter->message = NULL;
+    while ( waiter->answers )
+        {
+        struct mqtt_answer *answer = waiter->answers;
+        waiter->answers = answer->next;
+        free ( answer );
+        }
+
+    apr_thread_mutex_lock ( waiter_lock );
+    waiter->next = waiter_free;
+    waiter_free = waiter;
+    apr_thread_mutex_unlock ( waiter_lock );
+    }
+
+/** mark a waiter done and wake the request thread. Called by the reactor.
+  * \param waiter to complete, message may already be set
+  * \param rc result for the request thread
+  */
+void mqtt_waiter_complete ( struct mqtt_waiter *waiter, int rc )
+    {
+    void ( *notify ) ( void * );
+    void *baton;
+
+    apr_thread_mutex_lock ( waiter->lock );
+    waiter->rc = rc;
+    waiter->done = 1;
+    notify = waiter->notify;
+    baton = waiter->baton;
+    apr_thread_cond_signal ( waiter->cond );
+    apr_thread_mutex_unlock ( waiter->lock );
+
+    if ( notify )
+        notify ( baton );
+    }
+
+/** queue one of several answers and wake the request thread. Called by
+  * the reactor.
+  * \param waiter collecting answers, want != 1
+  * \param payload answer
+  * \param payloadlen answer size
+  * \param last 1 if it is the last answer wanted
+  */
+void mqtt_waiter_queue ( struct mqtt_waiter *waiter, const char *payload, int payloadlen, int last )
+    {
+    struct mqtt_answer *answer = malloc ( sizeof ( struct mqtt_answer ) + payloadlen + 1 );
+
+    if ( answer )
+        {
+        answer->next = NULL;
+        answer->len = payloadlen;
+        memcpy ( answer->data, payload, payloadlen );
+        answer->data[payloadlen] = 0;
+        }
+    else
+        LPRINTF ( "mqtt_waiter_queue: answer of %d bytes dropped\n", payloadlen );
+
+    apr_thread_mutex_lock ( waiter->lock );
+    if ( answer )
+        {
+        *waiter->tail = answer;
+        waiter->tail = &answer->next;
+        }
+    if ( last )
+        {
+        waiter->rc = MOSQ_ERR_SUCCESS;
+        waiter->done = 1;
+        }
+    apr_thread_cond_signal ( waiter->cond );
+    apr_thread_mutex_unlock ( waiter->lock );
+    }
+
+/** park the calling thread until the next queued answer
+  * \param waiter collecting answers, want != 1
+  * \param deadline give up at this mqtt_clock() time
+  * \param answer set to the oldest answer, to be freed, or NULL
+  * \return MOSQ_ERR_SUCCESS, with answer NULL once all wanted answers are
+  *         taken, or MQTT_ERR_TIMEOUT
+  */
+int mqtt_waiter_next ( struct mqtt_waiter *waiter, apr_time_t deadline, struct mqtt_answer **answer )
+    {
+    int rc = MOSQ_ERR_SUCCESS;
+
+    apr_thread_mutex_lock ( waiter->lock );
+    while ( !waiter->answers && !waiter->done )
+        {
+        apr_interval_time_t left = deadline - mqtt_clock();
+        if ( left <= 0 )
+            break;
+        apr_thread_cond_timedwait ( waiter->cond, waiter->lock, left );
+        }
+
+    *answer = waiter->answers;
+    if ( *answer )
+        {
+        waiter->answers = ( *answer )->next;
+        if ( !waiter->answers )
+            waiter->tail = &waiter->answers;
+        }
+    else if ( !waiter->done )
+        rc = MQTT_ERR_TIMEOUT;
+    apr_thread_mutex_unlock ( waiter->lock );
+
+    return rc;
+    }
+
+/** have the completing thread call back instead of waking a parked thread.
+  * Calls back at once if the waiter is already done.
+  * \param waiter from mqtt_waiter_get
+  * \param notify callback, runs on a reactor thread, must not block
+  * \param baton for notify
+  */
+void mqtt_waiter_notify ( struct mqtt_waiter *waiter, void ( *notify ) ( void *baton ), void *baton )
+    {
+    int done;
+
+    apr_thread_mutex_lock ( waiter->lock );
+    waiter->notify = notify;
+    waiter->baton = baton;
+    done = waiter->done;
+    apr_thread_mutex_unlock ( waiter->lock );
+
+    if ( done )
+        notify ( baton );
+    }
+
+/** park the calling thread until the reactor completes the waiter
+  * \param waiter from mqtt_waiter_get
+  * \param deadline give up at this mqtt_clock() time
+  * \return rc of the job or MQTT_ERR_TIMEOUT
+  */
+int mqtt_waiter_wait ( struct mqtt_waiter *waiter, apr_time_t deadline )
+    {
+    int rc;
+
+    apr_thread_mutex_lock ( waiter->lock );
+    while ( !waiter->done )
+        {
+        apr_interval_time_t left = deadline - mqtt_clock();
+        if ( left <= 0 )
+            break;
+        apr_thread_cond_timedwait ( waiter->cond, waiter->lock, left );
+        }
+    rc = ( waiter->done ? waiter->rc : MQTT_ERR_TIMEOUT );
+    apr_thread_mutex_unlock ( waiter->lock );
+
+    return rc;
+    }
+
+/*
+    ==============================================================================
+    jobs
+    ==============================================================================
+*/
+
+/** copy a string into job memory
+  * \param p where to copy to, advanced past the copy
+  * \param src string
+  * \return the copy
+  */
+static char *job_strcpy ( char **p, const char *src )
+    {
+    char *dst = *p;
+    strcpy ( dst, src );
+    *p += strlen ( src ) + 1;
+    return dst;
+    }
+
+/** create a job, topic, payload and broker strings are copied with it
+  * \param type JOB_*
+  * \param broker where to run the job
+  * \param topic topic to publish or subscribe to
+  * \param payload message or NULL
+  * \param payloadlen message size
+  * \param response v5 response topic or NULL
+  * \return job, free with mqtt_job_finish
+  */
+struct mqtt_job *mqtt_job_create ( int type, const struct mqtt_broker *broker, const char *topic,
+                                   const char *payload, int payloadlen, const char *response )
+    {
+    const char *host = ( broker->host ? broker->host : "localhost" );
+    const char *user = ( broker->username ? broker->username : "" );
+    const char *pass = ( broker->password ? broker->password : "" );
+    int port = ( broker->port > 0 ? broker->port : 1883 );
+    const char *tls = ( broker->tls ? broker->tls->key : "" );
+    int keylen = strlen ( host ) + strlen ( user ) + strlen ( pass ) + strlen ( tls ) + 36;
+    int size = sizeof ( struct mqtt_job ) + keylen + strlen ( host ) + strlen ( user ) + strlen ( pass ) + 3
+               + strlen ( topic ) + 1 + payloadlen + 1 + ( response ? strlen ( response ) + 1 : 0 );
+    struct mqtt_job *job = calloc ( 1, size );
+    char *p;
+
+    if ( !job )
+        return NULL;
+
+    p = ( char * ) ( job + 1 );
+
+    job->key = p;
+    snprintf ( p, keylen, "%s:%d:%s:%s:%d:%d:%s", host, port, user, pass, broker->protocol,
+               broker->max_inflight, tls );
+    p += keylen;
+
+    job->broker.host = job_strcpy ( &p, host );
+    job->broker.port = port;
+    job->broker.username = ( broker->username ? job_strcpy ( &p, user ) : NULL );
+    job->broker.password = ( broker->password ? job_strcpy ( &p, pass ) : NULL );
+    job->broker.protocol = broker->protocol;
+    job->broker.tls = broker->tls;
+    job->broker.max_inflight = broker->max_inflight;
+    job->broker.qos = broker->qos;
+    job->broker.retain = broker->retain;
+
+    job->topic = job_strcpy ( &p, topic );
+
+    job->payload = p;
+    if ( payload && payloadlen )
+        memcpy ( p, payload, payloadlen );
+    job->payloadlen = payloadlen;
+    p += payloadlen + 1;
+
+    job->response = ( response ? job_strcpy ( &p, response ) : NULL );
+
+    job->type = type;
+    return job;
+    }
+
+/** complete a job: wake its waiter and free it. Called by the reactor.
+  * \param job to finish
+  * \param rc result for the waiting request
+  */
+void mqtt_job_finish ( struct mqtt_job *job, int rc )
+    {
+    if ( job->type == JOB_SEND || job->type == JOB_REPLAY )
+        {
+        DPRINTF ( "send to %s: %d\n", job->key, rc );
+        /* the broker is out of reach: keep it for the replay */
+        if ( rc == MOSQ_ERR_NO_CONN || rc == MOSQ_ERR_CONN_LOST || rc == MOSQ_ERR_CONN_REFUSED
+             || rc == MOSQ_ERR_ERRNO || rc == MOSQ_ERR_EAI || rc == MOSQ_ERR_TLS )
+            mqtt_spool_put ( job->key, job->topic, job->payload, job->payloadlen, job->qos, job->retain );
+        if ( job->type == JOB_SEND )
+            mqtt_outbound_done ();
+        }
+
+    if ( job->waiter )
+        {
+        mqtt_waiter_complete ( job->waiter, rc );
+        mqtt_waiter_release ( job->waiter );
+        }
+    free ( job );
+    }
+
+/*
+    ==============================================================================
+    submission queue: intrusive multi producer, single consumer, lock-free
+    ==============================================================================
+*/
+
+/** push a job, safe from any thread
+  * \param reactor queue owner
+  * \param job job to append
+  */
+static void queue_push ( struct mqtt_reactor *reactor, struct mqtt_job *job )
+    {
+    struct mqtt_job *prev;
+
+    job->next = NULL;
+    prev = apr_atomic_xchgptr ( ( volatile void ** ) &reactor->head, job );
+    prev->next = job;
+    }
+
+/** pop the oldest job, reactor thread only
+  * \param reactor queue owner
+  * \return job or NULL if the queue is empty
+  */
+static struct mqtt_job *queue_pop ( struct mqtt_reactor *reactor )
+    {
+    struct mqtt_job *tail = reactor->tail;
+    struct mqtt_job *next = tail->next;
+
+    if ( tail == &reactor->stub )
+        {
+        if ( !next )
+            return NULL;
+        reactor->tail = next;
+        tail = next;
+        next = next->next;
+        }
+
+    if ( next )
+        {
+        reactor->tail = next;
+        return tail;
+        }
+
+    if ( tail != reactor->head )
+        {
+        /* a producer swapped head but has not linked its job yet */
+        sched_yield();
+        return queue_pop ( reactor );
+        }
+
+    queue_push ( reactor, &reactor->stub );
+    next = tail->next;
+
+    if ( next )
+        {
+        reactor->tail = next;
+        return tail;
+        }
+
+    return NULL;
+    }
+
+/** check for queued jobs, reactor thread only
+  * \param reactor queue owner
+  * \return nonzero if queue_pop would find a job
+  */
+static int queue_pending ( struct mqtt_reactor *reactor )
+    {
+    return reactor->tail->next != NULL || reactor->tail != reactor->head;
+    }
+
+/** hand a job to a reactor and wake it if it sleeps. The same request thread
+  * always gets the same reactor, so its jobs are executed in order.
+  * \param job from mqtt_job_create
+  */
+void mqtt_reactor_submit ( struct mqtt_job *job )
+    {
+    unsigned long self = ( unsigned long ) apr_os_thread_current();
+
+    mqtt_reactor_submit_to ( ( int ) ( ( self >> 4 ) % ( reactor_count ? reactor_count : 1 ) ), job );
+    }
+
+/** hand a job to a given reactor and wake it if it sleeps
+  * \param index reactor, 0 to mqtt_reactor_count() - 1
+  * \param job from mqtt_job_create
+  */
+void mqtt_reactor_submit_to ( int index, struct mqtt_job *job )
+    {
+    struct mqtt_reactor *reactor;
+    uint64_t one = 1;
+
+    if ( index < 0 || index >= reactor_count )
+        {
+        LPRINTF ( "mqtt_reactor_submit: no reactor running\n" );
+        mqtt_job_finish ( job, MOSQ_ERR_NO_CONN );
+        return;
+        }
+
+    reactor = reactors[index];
+    queue_push ( reactor, job );
+
+    if ( apr_atomic_cas32 ( &reactor->sleeping, 0, 1 ) == 1 )
+        {
+        if ( write ( reactor->evfd, &one, sizeof ( one ) ) != sizeof ( one ) )
+            LPRINTF ( "mqtt_reactor_submit: eventfd write: %s\n", strerror ( errno ) );
+        }
+    }
+
+/** \return number of reactor threads running */
+int mqtt_reactor_count ( void )
+    {
+    return reactor_count;
+    }
+
+/*
+    ==============================================================================
+    reactor thread
+    ==============================================================================
+*/
+
+/** keep the epoll registration of a connection in line with its socket
+  * \param conn connection, called on its reactor thread
+  */
+void mqtt_reactor_watch ( struct mqtt_conn *conn )
+    {
+    struct epoll_event ev;
+    int sock = mosquitto_socket ( conn->mosq );
+    int events = EPOLLIN | ( mosquitto_want_write ( conn->mosq ) ? EPOLLOUT : 0 );
+
+    if ( sock != conn->sock && conn->sock >= 0 )
+        epoll_ctl ( conn->reactor->epfd, EPOLL_CTL_DEL, conn->sock, NULL );
+
+    if ( sock < 0 )
+        {
+        conn->sock = -1;
+        return;
+        }
+
+    if ( sock == conn->sock && events == conn->events )
+        return;
+
+    memset ( &ev, 0, sizeof ( ev ) );
+    ev.events = events;
+    ev.data.ptr = conn;
+
+    if ( sock != conn->sock
+         || ( epoll_ctl ( conn->reactor->epfd, EPOLL_CTL_MOD, sock, &ev ) && errno == ENOENT ) )
+        {
+        /* new socket, or mosquitto closed and reopened it under the same number */
+        if ( epoll_ctl ( conn->reactor->epfd, EPOLL_CTL_ADD, sock, &ev ) )
+            LPRINTF ( "epoll add %s: %s\n", conn->key, strerror ( errno ) );
+        }
+
+    conn->sock = sock;
+    conn->events = events;
+    }
+
+/** route a job to the connection for its broker, creating it on first use
+  * \param reactor current reactor
+  * \param job job to run
+  */
+static void reactor_dispatch ( struct mqtt_reactor *reactor, struct mqtt_job *job )
+    {
+    struct mqtt_conn *conn = apr_hash_get ( reactor->conns, job->key, APR_HASH_KEY_STRING );
+
+    if ( !conn )
+        {
+        conn = mqtt_conn_create ( reactor, &job->broker, job->key );
+        if ( !conn )
+            {
+            mqtt_job_finish ( job, MOSQ_ERR_NOMEM );
+            return;
+            }
+        apr_hash_set ( reactor->conns, conn->key, APR_HASH_KEY_STRING, conn );
+        }
+
+    mqtt_conn_execute ( conn, job );
+    mqtt_reactor_watch ( conn );
+    }
+
+/** replay spooled publishes, flush batches that are full or old enough
+  * \param reactor reactor
+  * \return ms until the next batch, connect timeout or reconnect is due,
+  *         at most 1000
+  */
+static int reactor_flush ( struct mqtt_reactor *reactor )
+    {
+    struct mqtt_conn *conn;
+    apr_time_t now = mqtt_clock();
+    apr_interval_time_t next = apr_time_from_sec ( 1 );
+    int replay = mqtt_spool_pending();
+
+    for ( conn = reactor->all; conn; conn = conn->next )
+        {
+        apr_time_t due = mqtt_conn_due ( conn );
+
+        if ( due && due - now < next )
+            next = due - now;
+        if ( replay )
+            mqtt_conn_replay ( conn );
+        if ( !conn->batch )
+            continue;
+
+        mqtt_conn_flush ( conn, now );
+        mqtt_reactor_watch ( conn );
+
+        if ( conn->batch && conn->batch_since + mqtt_outbound_delay() - now < next )
+            next = conn->batch_since + mqtt_outbound_delay() - now;
+        }
+
+    /* round up, epoll_wait would spin on a sub-ms remainder */
+    return ( next > 0 ? ( int ) ( ( next + 999 ) / 1000 ) : 0 );
+    }
+
+/** drive all broker sockets of one reactor until the child exits
+  * \param thread this thread
+  * \param data reactor
+  * \return NULL
+  */
+static void * APR_THREAD_FUNC reactor_main ( apr_thread_t *thread, void *data )
+    {
+    struct mqtt_reactor *reactor = ( struct mqtt_reactor * ) data;
+    struct epoll_event events[REACTOR_EVENTS];
+    struct mqtt_job *job;
+    struct mqtt_conn *conn;
+    time_t last = 0;
+    apr_time_t now;
+    uint64_t count;
+    int n, i, rc, wait, tick;
+
+    while ( !apr_atomic_read32 ( &reactor->stop ) )
+        {
+        while ( ( job = queue_pop ( reactor ) ) )
+            reactor_dispatch ( reactor, job );
+
+        wait = reactor_flush ( reactor );
+
+        /* producers only signal the eventfd while we sleep */
+        apr_atomic_xchg32 ( &reactor->sleeping, 1 );
+        if ( queue_pending ( reactor ) )
+            {
+            apr_atomic_set32 ( &reactor->sleeping, 0 );
+            continue;
+            }
+
+        n = epoll_wait ( reactor->epfd, events, REACTOR_EVENTS, wait );
+        apr_atomic_set32 ( &reactor->sleeping, 0 );
+
+        for ( i = 0; i < n; i++ )
+            {
+            conn = ( struct mqtt_conn * ) events[i].data.ptr;
+            if ( !conn )
+                {
+                if ( read ( reactor->evfd, &count, sizeof ( count ) ) < 0 && errno != EAGAIN )
+                    LPRINTF ( "reactor eventfd read: %s\n", strerror ( errno ) );
+                continue;
+                }
+
+            rc = MOSQ_ERR_SUCCESS;
+            if ( events[i].events & ( EPOLLIN | EPOLLERR | EPOLLHUP ) )
+                rc = mosquitto_loop_read ( conn->mosq, 1 );
+            if ( rc == MOSQ_ERR_SUCCESS && ( events[i].events & EPOLLOUT ) )
+                rc = mosquitto_loop_write ( conn->mosq, 1 );
+            if ( rc != MOSQ_ERR_SUCCESS )
+                mqtt_conn_lost ( conn, rc );
+
+            mqtt_reactor_watch ( conn );
+            }
+
+        /* timeouts and reconnects when due, keepalive once a second */
+        tick = ( time ( NULL ) != last );
+        last = time ( NULL );
+        now = mqtt_clock();
+        for ( conn = reactor->all; conn; conn = conn->next )
+            {
+            apr_time_t due = mqtt_conn_due ( conn );
+
+            if ( tick || ( due && due <= now ) )
+                {
+                mqtt_conn_timer ( conn, now, tick );
+                mqtt_reactor_watch ( conn );
+                }
+            }
+        if ( tick )
+            {
+            mqtt_spool_flush();
+            mqtt_hub_sweep();
+            }
+        }
+
+    for ( conn = reactor->all; conn; conn = conn->next )
+        mqtt_conn_destroy ( conn );
+
+    apr_thread_exit ( thread, APR_SUCCESS );
+    return NULL;
+    }
+
+/** stop the reactor threads when the child exits
+  * \param data unused
+  * \return APR_SUCCESS
+  */
+static apr_status_t mqtt_reactor_cleanup ( void *data )
+    {
+    apr_status_t rv;
+    uint64_t one = 1;
+    int i;
+
+    for ( i = 0; i < reactor_count; i++ )
+        {
+        apr_atomic_set32 ( &reactors[i]->stop, 1 );
+        if ( write ( reactors[i]->evfd, &one, sizeof ( one ) ) != sizeof ( one ) )
+            LPRINTF ( "mqtt_reactor_cleanup: eventfd write: %s\n", strerror ( errno ) );
+        apr_thread_join ( &rv, reactors[i]->thread );
+        close ( reactors[i]->epfd );
+        close ( reactors[i]->evfd );
+        }
+
+    reactor_count = 0;
+    mosquitto_lib_cleanup();
+    return APR_SUCCESS;
+    }
+
+/** start the reactor threads, called once per child process
+  * \param pool child pool, lives as long as the process
+  * \param count number of reactor threads
+  * \return MOSQ_ERR_SUCCESS or ...
+  */
+int mqtt_reactor_init ( apr_pool_t *pool, int count )
+    {
+    struct epoll_event ev;
+    apr_thread_mutex_t *lock;
+    int i;
+
+    if ( apr_thread_mutex_create ( &lock, APR_THREAD_MUTEX_DEFAULT, pool ) != APR_SUCCESS
+         || mqtt_mux_init ( pool ) != MOSQ_ERR_SUCCESS
+         || mqtt_hub_init ( pool ) != MOSQ_ERR_SUCCESS )
+        return MOSQ_ERR_NOMEM;
+#ifdef WITH_TLS
+    if ( mqtt_tls_init ( pool ) != MOSQ_ERR_SUCCESS )
+        return MOSQ_ERR_NOMEM;
+#endif
+    /* waiters only once what completes them is there */
+    waiter_pool = pool;
+    waiter_lock = lock;
+
+    mosquitto_lib_init();
+    /* pre cleanup: the threads use subpools, which are gone before normal cleanups run */
+    apr_pool_pre_cleanup_register ( pool, NULL, mqtt_reactor_cleanup );
+
+    count = ( count < 1 ? 1 : ( count > MQTT_MAX_REACTORS ? MQTT_MAX_REACTORS : count ) );
+
+    for ( i = 0; i < count; i++ )
+        {
+        struct mqtt_reactor *reactor = apr_pcalloc ( pool, sizeof ( struct mqtt_reactor ) );
+
+        apr_pool_create ( &reactor->pool, pool );
+        reactor->conns = apr_hash_make ( reactor->pool );
+        reactor->head = reactor->tail = &reactor->stub;
+
+        reactor->epfd = epoll_create1 ( EPOLL_CLOEXEC );
+        reactor->evfd = eventfd ( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+        if ( reactor->epfd < 0 || reactor->evfd < 0 )
+            {
+            LPRINTF ( "mqtt_reactor_init: %s\n", strerror ( errno ) );
+            return MOSQ_ERR_ERRNO;
+            }
+
+        memset ( &ev, 0, sizeof ( ev ) );
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl ( reactor->epfd, EPOLL_CTL_ADD, reactor->evfd, &ev );
+
+        if ( apr_thread_create ( &reactor->thread, NULL, reactor_main, reactor, pool ) != APR_SUCCESS )
+            {
+            LPRINTF ( "mqtt_reactor_init: cannot start reactor thread\n" );
+            close ( reactor->epfd );
+            close ( reactor->evfd );
+            return MOSQ_ERR_ERRNO;
+            }
+
+        reactors[reactor_count++] = reactor;
+        }
+
+    DPRINTF ( "mqtt_reactor_init: %d reactors\n", reactor_count );
+    return MOSQ_ERR_SUCCESS;
+    }
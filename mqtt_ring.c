@@ -0,0 +1,363 @@
+/*
+ * mqtt broker ring: consistent hashing of topics onto a list of brokers,
+ * with failover to the next healthy broker on the ring, and the per-broker
+ * circuit breakers deciding what is healthy
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mosquitto.h>
+#include "apr_atomic.h"
+#include "apr_strings.h"
+#include "mqtt_common.h"
+
+/* per-broker circuit breaker, shared by all threads of a child: fed by the
+ * reactors, consulted by request threads. Open addressing on the hash of
+ * "host:port". Times are ms of mqtt_clock(), compared modulo 2^32. */
+struct health_slot
+    {
+    volatile apr_uint32_t hash;     /* 0 while free */
+    volatile apr_uint32_t failures; /* connect failures in a row */
+    volatile apr_uint32_t until;    /* open: no requests before this */
+    volatile apr_uint32_t backoff;  /* ms of the last open period, 0 while closed */
+    };
+
+static struct health_slot health[MQTT_HEALTH_SLOTS];
+
+static apr_uint32_t breaker_failures = MQTT_BREAKER_FAILURES;          /* failures that open it */
+static apr_uint32_t breaker_max = MQTT_BREAKER_MAX * 1000;             /* max. ms it stays open */
+/** FNV-1a, also used to place brokers and topics on the ring
+  * \param s string to hash
+  * \param h start value, 2166136261 or a previous result
+  * \return hash
+  */
+static apr_uint32_t ring_hash ( const char *s, apr_uint32_t h )
+    {
+    while ( *s )
+        h = ( h ^ ( unsigned char ) *s++ ) * 16777619u;
+    return h;
+    }
+
+/** hash of a broker address, never 0
+  * \param host broker host, NULL for localhost, or unix:/path
+  * \param port broker port, 0 for 1883
+  * \return hash
+  */
+static apr_uint32_t health_hash ( const char *host, int port )
+    {
+    char buf[16];
+    apr_uint32_t h;
+
+    host = ( host ? host : "localhost" );
+    h = ring_hash ( host, 2166136261u );
+
+    /* a unix socket has no port */
+    if ( strncmp ( host, MQTT_UNIX_PREFIX, strlen ( MQTT_UNIX_PREFIX ) ) )
+        {
+        snprintf ( buf, sizeof ( buf ), ":%d", ( port > 0 ? port : 1883 ) );
+        h = ring_hash ( buf, h );
+        }
+    return ( h ? h : 1 );
+    }
+
+/** find or claim the health slot of a broker
+  * \param host broker host
+  * \param port broker port
+  * \param claim take a free slot if the broker has none
+  * \return slot or NULL
+  */
+static struct health_slot *health_slot ( const char *host, int port, int claim )
+    {
+    apr_uint32_t h = health_hash ( host, port );
+    int i, n;
+
+    for ( i = h % MQTT_HEALTH_SLOTS, n = 0; n < MQTT_HEALTH_SLOTS; i = ( i + 1 ) % MQTT_HEALTH_SLOTS, n++ )
+        {
+        apr_uint32_t cur = apr_atomic_read32 ( &health[i].hash );
+
+        if ( cur == h )
+            return &health[i];
+        if ( cur == 0 )
+            {
+            if ( !claim )
+                return NULL;
+            cur = apr_atomic_cas32 ( &health[i].hash, h, 0 );
+            if ( cur == 0 || cur == h )
+                return &health[i];
+            }
+        }
+    return NULL;
+    }
+
+/** set up the circuit breakers, once per child
+  * \param failures connect failures in a row that open a breaker
+  * \param max_s max. seconds a breaker stays open before the next probe
+  */
+void mqtt_breaker_init ( int failures, int max_s )
+    {
+    breaker_failures = ( failures > 0 ? failures : MQTT_BREAKER_FAILURES );
+    breaker_max = ( max_s > 0 ? max_s : MQTT_BREAKER_MAX ) * 1000;
+    if ( breaker_max < MQTT_BACKOFF_MIN )
+        breaker_max = MQTT_BACKOFF_MIN;
+    }
+
+/** \return mqtt_clock() in ms, wrapping */
+static apr_uint32_t breaker_now ( void )
+    {
+    return ( apr_uint32_t ) apr_time_as_msec ( mqtt_clock() );
+    }
+
+/** next backoff: doubled, with full jitter over its upper half so the
+  * children of all servers do not come back in step
+  * \param backoff last backoff in ms, 0 for the first one
+  * \param seed random state of the caller
+  * \param next set to the doubled backoff
+  * \return ms to wait
+  */
+apr_uint32_t mqtt_backoff ( apr_uint32_t backoff, unsigned int *seed, apr_uint32_t *next )
+    {
+    backoff = ( backoff ? backoff * 2 : MQTT_BACKOFF_MIN );
+    if ( backoff > breaker_max )
+        backoff = breaker_max;
+    *next = backoff;
+    return backoff / 2 + ( apr_uint32_t ) rand_r ( seed ) % ( backoff / 2 + 1 );
+    }
+
+/** record the outcome of a connection to a broker. Called by the reactors.
+  * \param host broker host
+  * \param port broker port
+  * \param up 1 after CONNACK, 0 after a failed or lost connection
+  */
+void mqtt_breaker_result ( const char *host, int port, int up )
+    {
+    struct health_slot *slot = health_slot ( host, port, !up );
+    unsigned int seed;
+    apr_uint32_t n, backoff, wait;
+
+    if ( !slot )
+        return;
+
+    if ( up )
+        {
+        if ( apr_atomic_read32 ( &slot->failures ) >= breaker_failures )
+            LPRINTF ( "mod_mqtt: broker %s:%d back, circuit closed\n", host, port );
+        apr_atomic_set32 ( &slot->failures, 0 );
+        apr_atomic_set32 ( &slot->backoff, 0 );
+        return;
+        }
+
+    n = apr_atomic_inc32 ( &slot->failures ) + 1;
+    if ( n < breaker_failures )
+        return;
+
+    /* open, or open again after a failed probe, for longer each time */
+    seed = ( unsigned int ) getpid() ^ ( unsigned int ) mqtt_clock();
+    wait = mqtt_backoff ( apr_atomic_read32 ( &slot->backoff ), &seed, &backoff );
+    apr_atomic_set32 ( &slot->backoff, backoff );
+    apr_atomic_set32 ( &slot->until, breaker_now() + wait );
+
+    if ( n == breaker_failures )
+        LPRINTF ( "mod_mqtt: broker %s:%d down, circuit open\n", host, port );
+    }
+
+/** is the circuit of a broker open
+  * \param host broker host
+  * \param port broker port
+  * \return 1 while requests are kept away from it
+  */
+int mqtt_breaker_open ( const char *host, int port )
+    {
+    struct health_slot *slot = health_slot ( host, port, 0 );
+
+    return ( slot && apr_atomic_read32 ( &slot->failures ) >= breaker_failures );
+    }
+
+/** may a request go to a broker. Once an open circuit's time is up the
+  * first caller is let through as the probe (half-open), everybody else
+  * keeps failing fast until the probe's connect has succeeded or failed.
+  * \param host broker host
+  * \param port broker port
+  * \param retry_after set to the seconds to come back if refused, may be NULL
+  * \return 1 if closed or this caller is the probe, 0 if open
+  */
+int mqtt_breaker_allow ( const char *host, int port, int *retry_after )
+    {
+    struct health_slot *slot = health_slot ( host, port, 0 );
+    apr_uint32_t until, now;
+    apr_int32_t left;
+
+    if ( !slot || apr_atomic_read32 ( &slot->failures ) < breaker_failures )
+        return 1;
+
+    now = breaker_now();
+    until = apr_atomic_read32 ( &slot->until );
+    left = ( apr_int32_t ) ( until - now );
+
+    /* half-open: the probe gets as long as a connect may take */
+    if ( left <= 0
+         && apr_atomic_cas32 ( &slot->until, now + ( MQTT_CONNECT_TIMEOUT + 1 ) * 1000, until ) == until )
+        return 1;
+
+    if ( retry_after )
+        *retry_after = ( left > 0 ? ( left + 999 ) / 1000 : 1 );
+    return 0;
+    }
+
+/** compare ring points for qsort
+  * \param a point
+  * \param b point
+  * \return <0, 0, >0
+  */
+static int ring_cmp ( const void *a, const void *b )
+    {
+    apr_uint32_t x = ( ( const struct mqtt_ring_point * ) a )->hash;
+    apr_uint32_t y = ( ( const struct mqtt_ring_point * ) b )->hash;
+
+    return ( x < y ? -1 : ( x > y ? 1 : 0 ) );
+    }
+
+/** create an empty ring, at configuration time
+  * \param pool configuration pool
+  * \return ring
+  */
+struct mqtt_ring *mqtt_ring_create ( apr_pool_t *pool )
+    {
+    return apr_pcalloc ( pool, sizeof ( struct mqtt_ring ) );
+    }
+
+/** add a broker to the ring, at configuration time
+  * \param ring ring
+  * \param pool configuration pool
+  * \param spec "host", "host:port" or "unix:/path"
+  * \return NULL or error message
+  */
+const char *mqtt_ring_add ( struct mqtt_ring *ring, apr_pool_t *pool, const char *spec )
+    {
+    struct mqtt_ring_node *nodes;
+    struct mqtt_ring_point *points;
+    struct mqtt_ring_node *node;
+    char *host = apr_pstrdup ( pool, spec );
+    char *colon = strrchr ( host, ':' );
+    int port = 0;
+    int i;
+
+    /* unix:/path has no port, more than one colon: an IPv6 address without port */
+    if ( !strncmp ( host, MQTT_UNIX_PREFIX, strlen ( MQTT_UNIX_PREFIX ) ) )
+        {
+        if ( !host[strlen ( MQTT_UNIX_PREFIX )] )
+            return "MQTTServer: empty socket path";
+        }
+    else if ( colon && strchr ( host, ':' ) == colon )
+        {
+        *colon = 0;
+        port = atoi ( colon + 1 );
+        if ( port < 1 || port > 65535 )
+            return "MQTTServer: invalid port";
+        }
+    if ( !*host )
+        return "MQTTServer: empty host name";
+    if ( ring->count >= MQTT_RING_MAX )
+        return apr_psprintf ( pool, "MQTTServer: more than %d brokers", MQTT_RING_MAX );
+
+    nodes = apr_pcalloc ( pool, ( ring->count + 1 ) * sizeof ( struct mqtt_ring_node ) );
+    if ( ring->count )
+        memcpy ( nodes, ring->nodes, ring->count * sizeof ( struct mqtt_ring_node ) );
+    node = &nodes[ring->count];
+    node->host = host;
+    node->port = port;
+
+    points = apr_pcalloc ( pool, ( ring->count + 1 ) * MQTT_RING_POINTS * sizeof ( struct mqtt_ring_point ) );
+    ring->nodes = nodes;
+    ring->count++;
+
+    /* the nodes moved, rebuild all points */
+    for ( i = 0; i < ring->count * MQTT_RING_POINTS; i++ )
+        {
+        char buf[16];
+        struct mqtt_ring_node *n = &ring->nodes[i / MQTT_RING_POINTS];
+
+        snprintf ( buf, sizeof ( buf ), ":%d#%d", n->port, i % MQTT_RING_POINTS );
+        points[i].hash = ring_hash ( buf, ring_hash ( n->host, 2166136261u ) );
+        points[i].node = i / MQTT_RING_POINTS;
+        }
+    qsort ( points, ring->count * MQTT_RING_POINTS, sizeof ( struct mqtt_ring_point ), ring_cmp );
+    ring->points = points;
+
+    return NULL;
+    }
+
+/** the topic's place on the ring
+  * \param ring ring with at least one broker
+  * \param topic topic to place
+  * \return index of the first point at or after the topic's hash
+  */
+static int ring_first ( const struct mqtt_ring *ring, const char *topic )
+    {
+    int npoints = ring->count * MQTT_RING_POINTS;
+    apr_uint32_t h = ring_hash ( topic, 2166136261u );
+    int lo = 0, hi = npoints;
+
+    /* first point at or after h, wrapping around */
+    while ( lo < hi )
+        {
+        int mid = ( lo + hi ) / 2;
+        if ( ring->points[mid].hash < h )
+            lo = mid + 1;
+        else
+            hi = mid;
+        }
+    return lo % npoints;
+    }
+
+/** the broker a topic belongs to while all are up, circuits not asked
+  * \param ring ring with at least one broker
+  * \param topic topic to place
+  * \return broker node
+  */
+const struct mqtt_ring_node *mqtt_ring_home ( const struct mqtt_ring *ring, const char *topic )
+    {
+    return &ring->nodes[ring->points[ring_first ( ring, topic )].node];
+    }
+
+/** pick the broker for a topic: the first one clockwise from the topic's
+  * place on the ring whose circuit is closed, so a topic sticks to one
+  * broker while it is up
+  * \param ring ring with at least one broker
+  * \param topic topic to place
+  * \param port port for brokers listed without one
+  * \param retry_after set to the seconds to come back if all circuits are open
+  * \return broker node or NULL if all circuits are open
+  */
+const struct mqtt_ring_node *mqtt_ring_pick ( const struct mqtt_ring *ring, const char *topic, int port,
+                                              int *retry_after )
+    {
+    int npoints = ring->count * MQTT_RING_POINTS;
+    char checked[MQTT_RING_MAX];
+    int i, n, left = ring->count;
+    int wait = 0;
+
+    /* every broker has many points, ask its breaker only once */
+    memset ( checked, 0, sizeof ( checked ) );
+    for ( i = ring_first ( ring, topic ), n = 0; n < npoints && left; i = ( i + 1 ) % npoints, n++ )
+        {
+        const struct mqtt_ring_node *node = &ring->nodes[ring->points[i].node];
+        int after = 0;
+
+        if ( checked[ring->points[i].node] )
+            continue;
+        checked[ring->points[i].node] = 1;
+        left--;
+
+        if ( mqtt_breaker_allow ( node->host, ( node->port > 0 ? node->port : port ), &after ) )
+            return node;
+        if ( !wait || after < wait )
+            wait = after;
+        }
+
+    *retry_after = wait;
+    return NULL;
+    }
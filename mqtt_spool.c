@@ -0,0 +1,423 @@
+/*
+ * mqtt spool: fire-and-forget publishes the broker could not take are kept
+ * in a memory-mapped, append-only ring journal and replayed in order per
+ * connection, at a limited rate, once it is back. One file per child; a
+ * new child adopts the file of one that died, with whatever it left behind.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <mosquitto.h>
+#include "apr_atomic.h"
+#include "apr_strings.h"
+#include "mqtt_common.h"
+
+#define SPOOL_MAGIC 0x4d515332          /* "MQS2" */
+#define SPOOL_DATA 4096                 /* records start one page in */
+#define SPOOL_ALIGN(n) ( ( ( n ) + 7 ) & ~( apr_uint64_t ) 7 )
+
+/* file header, head and tail count bytes ever written, modulo size is the offset */
+struct spool_hdr
+    {
+    apr_uint32_t magic;
+    apr_uint32_t pad;
+    apr_uint64_t size;                  /* bytes of record space */
+    volatile apr_uint64_t head;         /* oldest record */
+    volatile apr_uint64_t tail;         /* end of the newest record */
+    };
+
+/* record header, followed by key, topic and payload. A record without
+ * key is padding up to the end of the file, or was replayed already. */
+struct spool_rec
+    {
+    apr_uint32_t len;                   /* whole record, aligned */
+    apr_uint32_t keylen;                /* connection key incl. NUL */
+    apr_uint32_t topiclen;              /* topic incl. NUL */
+    apr_uint32_t payloadlen;
+    apr_uint32_t qos;                   /* QoS, retain flag in bit 2 */
+    apr_uint32_t pad;
+    };
+
+static struct spool_hdr *spool = NULL;          /* the mapped file, NULL if not spooling */
+static char *spool_data = NULL;                 /* record space */
+static apr_size_t spool_maplen = 0;
+static int spool_sync = MQTT_SPOOL_SYNC_SECOND; /* MQTT_SPOOL_SYNC_* */
+static int spool_rate = MQTT_SPOOL_RATE;        /* replayed publishes per second */
+
+static apr_thread_mutex_t *spool_lock = NULL;   /* protects the file and the rate */
+static volatile apr_uint32_t spool_count = 0;   /* records in the file, read without lock */
+static volatile apr_uint32_t spool_dirty = 0;   /* written since the last msync */
+static volatile apr_uint32_t spool_lost = 0;    /* old records overwritten */
+static volatile apr_uint32_t spool_gen = 1;     /* changes with every record spooled */
+static apr_hash_t *spool_keys = NULL;           /* keys of the configured brokers, NULL for unknown */
+static apr_time_t spool_refill = 0;             /* mqtt_clock() of the last rate refill */
+static int spool_tokens = 0;                    /* publishes replayable now */
+
+/** open and lock the first spool file of the directory nobody else has
+  * \param dir spool directory
+  * \param pool child pool
+  * \return fd or -1
+  */
+static int spool_open ( const char *dir, apr_pool_t *pool )
+    {
+    int i, fd;
+
+    for ( i = 0; i < MQTT_SPOOL_FILES; i++ )
+        {
+        const char *path = apr_psprintf ( pool, "%s/spool.%d", dir, i );
+
+        fd = open ( path, O_RDWR | O_CREAT, 0600 );
+        if ( fd < 0 )
+            {
+            LPRINTF ( "mod_mqtt: spool %s: %s\n", path, strerror ( errno ) );
+            return -1;
+            }
+        /* the lock goes with the process, a dead child's file is free again */
+        if ( flock ( fd, LOCK_EX | LOCK_NB ) == 0 )
+            {
+            DPRINTF ( "spool %s\n", path );
+            return fd;
+            }
+        close ( fd );
+        }
+
+    LPRINTF ( "mod_mqtt: all %d spool files in %s busy\n", MQTT_SPOOL_FILES, dir );
+    return -1;
+    }
+
+/** map the spool file, once per child before the reactors start
+  * \param pool child pool
+  * \param dir spool directory, NULL for no spool
+  * \param size_mb record space in MB, used when the file is new or empty
+  * \param sync MQTT_SPOOL_SYNC_NEVER, _SECOND or _ALWAYS
+  * \param rate replayed publishes per second
+  * \return MOSQ_ERR_SUCCESS or MOSQ_ERR_ERRNO
+  */
+int mqtt_spool_init ( apr_pool_t *pool, const char *dir, int size_mb, int sync, int rate )
+    {
+    struct spool_hdr hdr;
+    struct stat st;
+    apr_uint64_t size = ( apr_uint64_t ) ( size_mb > 0 ? size_mb : MQTT_SPOOL_SIZE ) << 20;
+    void *map;
+    int fd;
+
+    if ( !dir )
+        return MOSQ_ERR_SUCCESS;
+
+    if ( apr_thread_mutex_create ( &spool_lock, APR_THREAD_MUTEX_DEFAULT, pool ) != APR_SUCCESS )
+        return MOSQ_ERR_NOMEM;
+
+    fd = spool_open ( dir, pool );
+    if ( fd < 0 )
+        return MOSQ_ERR_ERRNO;
+
+    /* adopt what is there unless it is garbage, empty or cut short: the
+       mapping must not reach past the end of the file */
+    if ( pread ( fd, &hdr, sizeof ( hdr ), 0 ) != sizeof ( hdr ) || hdr.magic != SPOOL_MAGIC
+         || hdr.size < sizeof ( struct spool_rec ) * 4 || hdr.size > ( apr_uint64_t ) MQTT_SPOOL_MAX_MB << 20
+         || hdr.size % 8 || fstat ( fd, &st ) || ( apr_uint64_t ) st.st_size < SPOOL_DATA + hdr.size
+         || hdr.tail - hdr.head > hdr.size || hdr.head == hdr.tail )
+        {
+        memset ( &hdr, 0, sizeof ( hdr ) );
+        hdr.magic = SPOOL_MAGIC;
+        hdr.size = size;
+        if ( ftruncate ( fd, SPOOL_DATA + size ) || pwrite ( fd, &hdr, sizeof ( hdr ), 0 ) != sizeof ( hdr ) )
+            {
+            LPRINTF ( "mod_mqtt: spool setup: %s\n", strerror ( errno ) );
+            close ( fd );
+            return MOSQ_ERR_ERRNO;
+            }
+        }
+
+    /* the fd is not needed any more, closing it would drop the lock */
+    spool_maplen = SPOOL_DATA + hdr.size;
+    map = mmap ( NULL, spool_maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if ( map == MAP_FAILED )
+        {
+        LPRINTF ( "mod_mqtt: spool mmap: %s\n", strerror ( errno ) );
+        close ( fd );
+        return MOSQ_ERR_ERRNO;
+        }
+
+    spool = ( struct spool_hdr * ) map;
+    spool_data = ( char * ) map + SPOOL_DATA;
+    spool_sync = sync;
+    spool_rate = ( rate > 0 ? rate : MQTT_SPOOL_RATE );
+
+    /* count what a dead child left behind */
+    for ( hdr.head = spool->head; hdr.head != spool->tail; )
+        {
+        struct spool_rec *rec = ( struct spool_rec * ) ( spool_data + hdr.head % spool->size );
+
+        if ( spool->size - hdr.head % spool->size < sizeof ( struct spool_rec ) )
+            hdr.head += spool->size - hdr.head % spool->size;
+        else if ( !rec->len || rec->len > spool->size )
+            {
+            LPRINTF ( "mod_mqtt: spool damaged, %u publishes kept\n", spool_count );
+            spool->tail = hdr.head;
+            }
+        else
+            {
+            if ( rec->keylen )
+                spool_count++;
+            hdr.head += rec->len;
+            }
+        }
+    if ( spool_count )
+        LPRINTF ( "mod_mqtt: %u spooled publishes to replay\n", spool_count );
+
+    return MOSQ_ERR_SUCCESS;
+    }
+
+/** \return 1 if publishes that fail are spooled */
+int mqtt_spool_enabled ( void )
+    {
+    return ( spool != NULL );
+    }
+
+/** \return 1 if there is something to replay, without locking */
+int mqtt_spool_pending ( void )
+    {
+    return ( apr_atomic_read32 ( &spool_count ) != 0 );
+    }
+
+/** flush a range of the mapping to disk
+  * \param from first byte, relative to the mapping
+  * \param len bytes
+  */
+static void spool_msync ( apr_size_t from, apr_size_t len )
+    {
+    apr_size_t page = ( apr_size_t ) sysconf ( _SC_PAGESIZE );
+    apr_size_t start = from - from % page;
+
+    msync ( ( char * ) spool + start, from + len - start, MS_SYNC );
+    }
+
+/** drop the oldest record, spool_lock held */
+static void spool_drop ( void )
+    {
+    apr_uint64_t left = spool->size - spool->head % spool->size;
+    struct spool_rec *rec = ( struct spool_rec * ) ( spool_data + spool->head % spool->size );
+
+    if ( left < sizeof ( struct spool_rec ) )
+        spool->head += left;
+    else
+        {
+        if ( rec->keylen )
+            apr_atomic_dec32 ( &spool_count );
+        spool->head += rec->len;
+        }
+    }
+
+/** the records of these connection keys are replayed, others are dropped
+  * as their broker is not configured any more
+  * \param keys connection key -> key, lives as long as the child
+  */
+void mqtt_spool_keys ( apr_hash_t *keys )
+    {
+    if ( !spool )
+        return;
+
+    apr_thread_mutex_lock ( spool_lock );
+    spool_keys = keys;
+    apr_thread_mutex_unlock ( spool_lock );
+    }
+
+/** whether the oldest record is still to be replayed, spool_lock held
+  * \return 0 for padding or a record replayed already
+  */
+static int spool_head_used ( void )
+    {
+    struct spool_rec *rec = ( struct spool_rec * ) ( spool_data + spool->head % spool->size );
+
+    return ( spool->size - spool->head % spool->size >= sizeof ( struct spool_rec ) && rec->keylen );
+    }
+
+/** mark a record as replayed, it is padding from now on. spool_lock held
+  * \param rec record
+  */
+static void spool_take ( struct spool_rec *rec )
+    {
+    rec->keylen = 0;
+    apr_atomic_dec32 ( &spool_count );
+    apr_atomic_set32 ( &spool_dirty, 1 );
+    }
+
+/** append a publish the broker did not get. Called by the reactors. When
+  * the spool is full the oldest publishes are overwritten.
+  * \param key connection key, replayed only on that connection
+  * \param topic topic
+  * \param payload message
+  * \param payloadlen message size
+  * \param qos QoS to publish with
+  * \param retain retain flag to publish with
+  * \return MOSQ_ERR_SUCCESS, MOSQ_ERR_NOT_SUPPORTED without spool or
+  *         MOSQ_ERR_PAYLOAD_SIZE if it can never fit
+  */
+int mqtt_spool_put ( const char *key, const char *topic, const char *payload, int payloadlen, int qos, int retain )
+    {
+    struct spool_rec rec;
+    apr_uint64_t need, left, pad, at;
+
+    if ( !spool )
+        return MOSQ_ERR_NOT_SUPPORTED;
+
+    rec.keylen = strlen ( key ) + 1;
+    rec.topiclen = strlen ( topic ) + 1;
+    rec.payloadlen = payloadlen;
+    rec.qos = ( qos & 3 ) | ( retain ? 4 : 0 );
+    rec.pad = 0;
+    need = SPOOL_ALIGN ( sizeof ( rec ) + rec.keylen + rec.topiclen + payloadlen );
+    rec.len = ( apr_uint32_t ) need;
+
+    if ( need > spool->size / 4 )
+        return MOSQ_ERR_PAYLOAD_SIZE;
+
+    apr_thread_mutex_lock ( spool_lock );
+
+    /* records do not wrap, pad up to the end of the file instead */
+    left = spool->size - spool->tail % spool->size;
+    pad = ( left < need ? left : 0 );
+
+    while ( spool->size - ( spool->tail - spool->head ) < pad + need )
+        {
+        spool_drop();
+        if ( apr_atomic_inc32 ( &spool_lost ) % 1000 == 0 )
+            LPRINTF ( "mod_mqtt: spool full, %u old publishes lost\n", apr_atomic_read32 ( &spool_lost ) );
+        }
+
+    if ( pad )
+        {
+        if ( pad >= sizeof ( struct spool_rec ) )
+            {
+            struct spool_rec filler = { ( apr_uint32_t ) pad, 0, 0, 0, 0, 0 };
+            memcpy ( spool_data + spool->tail % spool->size, &filler, sizeof ( filler ) );
+            }
+        spool->tail += pad;
+        }
+
+    at = spool->tail % spool->size;
+    memcpy ( spool_data + at, &rec, sizeof ( rec ) );
+    memcpy ( spool_data + at + sizeof ( rec ), key, rec.keylen );
+    memcpy ( spool_data + at + sizeof ( rec ) + rec.keylen, topic, rec.topiclen );
+    if ( payloadlen )
+        memcpy ( spool_data + at + sizeof ( rec ) + rec.keylen + rec.topiclen, payload, payloadlen );
+
+    /* the record is complete on disk before the tail points past it */
+    if ( spool_sync == MQTT_SPOOL_SYNC_ALWAYS )
+        spool_msync ( SPOOL_DATA + at, rec.len );
+    __sync_synchronize();
+    spool->tail += rec.len;
+    if ( spool_sync == MQTT_SPOOL_SYNC_ALWAYS )
+        spool_msync ( 0, sizeof ( struct spool_hdr ) );
+    else
+        apr_atomic_set32 ( &spool_dirty, 1 );
+
+    apr_atomic_inc32 ( &spool_count );
+    apr_atomic_inc32 ( &spool_gen );
+    apr_thread_mutex_unlock ( spool_lock );
+
+    DPRINTF ( "spooled %s for %s\n", topic, key );
+    return MOSQ_ERR_SUCCESS;
+    }
+
+/** take the oldest publish of a connection for replay if the replay rate
+  * allows. Called by the reactors. Records of other connections are
+  * skipped, so a broker that is down holds up only its own publishes;
+  * records of brokers no longer configured are dropped on the way.
+  * \param broker broker of the connection, the job is made for it
+  * \param key connection key
+  * \param seen spool generation the connection found nothing for, updated
+  * \return JOB_REPLAY job or NULL
+  */
+struct mqtt_job *mqtt_spool_get ( const struct mqtt_broker *broker, const char *key, apr_uint32_t *seen )
+    {
+    struct mqtt_job *job = NULL;
+    struct spool_rec *rec;
+    apr_uint64_t at;
+    apr_time_t now;
+    int found = 0;
+
+    if ( !spool || !mqtt_spool_pending() || *seen == apr_atomic_read32 ( &spool_gen ) )
+        return NULL;
+
+    apr_thread_mutex_lock ( spool_lock );
+
+    now = mqtt_clock();
+    if ( !spool_tokens )
+        {
+        /* refill for the time passed, at most one second's worth */
+        apr_int64_t add = ( now - spool_refill ) * spool_rate / APR_USEC_PER_SEC;
+        if ( add > 0 )
+            {
+            spool_tokens = ( add > spool_rate ? spool_rate : ( int ) add );
+            spool_refill = now;
+            }
+        }
+
+    at = spool->head;
+    while ( spool_tokens && at != spool->tail )
+        {
+        rec = ( struct spool_rec * ) ( spool_data + at % spool->size );
+        if ( spool->size - at % spool->size < sizeof ( struct spool_rec ) )
+            {
+            at += spool->size - at % spool->size;
+            continue;
+            }
+        at += rec->len;
+        if ( !rec->keylen )
+            continue;           /* padding or replayed */
+
+        if ( spool_keys && !apr_hash_get ( spool_keys, ( char * ) ( rec + 1 ), APR_HASH_KEY_STRING ) )
+            {
+            DPRINTF ( "spooled publish for %s dropped, broker not configured\n", ( char * ) ( rec + 1 ) );
+            spool_take ( rec );
+            apr_atomic_inc32 ( &spool_lost );
+            continue;
+            }
+        if ( strcmp ( ( char * ) ( rec + 1 ), key ) )
+            continue;
+
+        found = 1;
+        job = mqtt_job_create ( JOB_REPLAY, broker, ( char * ) ( rec + 1 ) + rec->keylen,
+                                ( char * ) ( rec + 1 ) + rec->keylen + rec->topiclen, rec->payloadlen, NULL );
+        if ( job )
+            {
+            job->qos = rec->qos & 3;
+            job->retain = ( rec->qos & 4 ) != 0;
+            spool_take ( rec );
+            spool_tokens--;
+            }
+        break;
+        }
+
+    /* nothing for this connection until more is spooled */
+    if ( !found && at == spool->tail )
+        *seen = apr_atomic_read32 ( &spool_gen );
+
+    while ( spool->head != spool->tail && !spool_head_used() )
+        spool_drop();
+
+    apr_thread_mutex_unlock ( spool_lock );
+    return job;
+    }
+
+/** once a second: write the spool to disk with MQTT_SPOOL_SYNC_SECOND.
+  * Any reactor may call, the first one after a change does the work.
+  */
+void mqtt_spool_flush ( void )
+    {
+    if ( !spool || spool_sync != MQTT_SPOOL_SYNC_SECOND || !apr_atomic_xchg32 ( &spool_dirty, 0 ) )
+        return;
+
+    msync ( spool, spool_maplen, MS_SYNC );
+    }
@@ -18,112 +18,100 @@
 #endif
 
 #include <mosquitto.h>
+#include <jansson.h>
+#include "apr_strings.h"
 #include "mqtt_common.h"
 
  /** This is called when a message is received from the broker.
+    * A retained message may be what a JOB_RETAINED waits for, messages on
+    * watched topics go to their stream hub, an answer goes to the request
+    * whose correlation id it carries.
     * \param mosq object
-    * \param obj config object for this request
+    * \param obj connection
     * \param message message received
     */
 
 void my_sub_message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message)
 {
-	struct mosq_config *cfg;
-	int i;
-	bool res;
+	json_t *json;
+	json_error_t error;
+	const char *id;
+	int watched;
 
-    DPRINTF("my_sub_message_callback\n" ) ;
+    DPRINTF("my_sub_message_callback %s\n", message->topic ) ;
 
 	assert(obj);
-	cfg = (struct mosq_config *)obj;
 
-	if (message->retain && cfg->no_retain)
+	if ( mqtt_conn_retained((struct mqtt_conn *) obj, message) )
 		return;
 
-    DPRINTF("my_sub_message_callback: retain\n" ) ;
-
-	if (cfg->filter_outs)
-	{
-		for (i = 0; i < cfg->filter_out_count; i++)
-		{
-    DPRINTF("my_sub_message_callback: filter\n" ) ;
-
-			mosquitto_topic_matches_sub(cfg->filter_outs[i], message->topic, &res);
-			if (res)
-				return;
-		}
-	}
+	/* a topic watched by stream clients may carry answers too */
+	watched = mqtt_hub_deliver(message->topic, (const char *) message->payload, message->payloadlen);
 
-    DPRINTF("my_sub_message_callback: topic matches\n" ) ;
+	json = json_loadb((const char *) message->payload, message->payloadlen, 0, &error);
+	id = ( json ? json_string_value(json_object_get(json, MQTT_CORRELATION_KEY)) : NULL );
 
-	if (message->payloadlen)
+	if ( ! id )
 		{
-		cfg -> message = apr_pcalloc(cfg->pool, message->payloadlen + 1 ) ;
-		cfg -> msglen = message->payloadlen ;
-		memcpy( (void *) cfg -> message, message->payload, message->payloadlen );
+		if ( ! watched )
+			LPRINTF("Answer on %s without %s dropped\n", message->topic, MQTT_CORRELATION_KEY);
+		json_decref(json);
+		return;
 		}
 
-	if (cfg->msg_count > 0)
+	if ( ! mqtt_mux_deliver(id, (const char *) message->payload, message->payloadlen) )
 		{
-		cfg->msg_received++;
-		if (cfg->msg_received >= cfg->msg_count)
-			{
-    		DPRINTF("my_sub_message_callback: disconnect\n" ) ;
-			mosquitto_disconnect(mosq);
-			}
+		/* late answer to a request that already gave up */
+		DPRINTF("my_sub_message_callback: nobody waiting for %s\n", id ) ;
 		}
 
     DPRINTF("my_sub_message_callback: return %d bytes\n",  message->payloadlen ) ;
 
+	json_decref(json);
 }
 
-/** This is called when the broker sends a CONNACK message in response to a connection.
-    * mosq	the mosquitto instance making the callback.
-    * obj	the user data provided in mosquitto_new
-    * rc	the return code of the connection response, one of:
-    *   0 - success
-    *   1 - connection refused (unacceptable protocol version)
-    * 2 - connection refused (identifier rejected)
-    * 3 - connection refused (broker unavailable)
-    * 4-255 - reserved for future use
+ /** This is called when a message is received on an MQTT v5 connection.
+    * The correlation data property picks the request, answers without it
+    * are handled like v3 answers.
     * \param mosq object
-    * \param obj config object for this request
-    * \param result from connect operation
+    * \param obj connection
+    * \param message message received
+    * \param props PUBLISH properties
     */
 
-void my_sub_connect_callback(struct mosquitto *mosq, void *obj, int result)
-	{
-	int i;
-	struct mosq_config *cfg;
-    DPRINTF("my_sub_connect_callback: %d\n", result ) ;
+void my_sub_message_v5_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message,
+								const mosquitto_property *props)
+{
+	char id[MQTT_CORRELATION_LEN];
+	void *data = NULL;
+	uint16_t len = 0;
 
-	assert(obj);
-	cfg = (struct mosq_config *)obj;
+	if ( mqtt_conn_retained((struct mqtt_conn *) obj, message) )
+		return;
 
-	if (!result)
-		{
-		for (i = 0; i < cfg->topic_count; i++)
-			{
-			DPRINTF("my_sub_connect_callback subs %s %d\n", cfg->topics[i], cfg->qos ) ;
-				mosquitto_subscribe(mosq, NULL, cfg->topics[i], cfg->qos);
-			}
-		}
-	else
+	if ( ! mosquitto_property_read_binary(props, MQTT_PROP_CORRELATION_DATA, &data, &len, false) )
 		{
-		cfg -> connected = 1;
-		if ( result && ! cfg->quiet )
-			{
-			fprintf(stderr, "%s\n", mosquitto_connack_string(result));
-			}
+		my_sub_message_callback(mosq, obj, message);
+		return;
 		}
-	}
 
+	if ( len >= MQTT_CORRELATION_LEN )
+		len = MQTT_CORRELATION_LEN - 1;
+	memcpy(id, data, len);
+	id[len] = 0;
+	free(data);
 
+    DPRINTF("my_sub_message_v5_callback %s %s\n", message->topic, id ) ;
+
+	if ( ! mqtt_mux_deliver(id, (const char *) message->payload, message->payloadlen) )
+		{
+		DPRINTF("my_sub_message_v5_callback: nobody waiting for %s\n", id ) ;
+		}
+}
 
 /** This is called when the broker responds to a subscription request.
     * \param mosq object
-    * \param obj config object for this request
-    * \param result from connect operation
+    * \param obj connection
 	* \param mid message id
 	* \param qos_count	the number of granted subscriptions (size of granted_qos).
 	* \param granted_qos	an array of integers indicating the granted QoS for each of the subscriptions.
@@ -132,22 +120,31 @@ void my_sub_connect_callback(struct mosquitto *mosq, void *obj, int result)
 void my_sub_subscribe_callback(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos)
 {
 	int i;
-	struct mosq_config *cfg;
 
 	assert(obj);
-	cfg = (struct mosq_config *)obj;
 
 	DPRINTF("my_sub_subscribe_callback %d\n", mid ) ;
 
-	if (!cfg->quiet)
-		printf("Subscribed (mid: %d): %d", mid, granted_qos[0]);
-	for (i = 1; i < qos_count; i++)
+	for (i = 0; i < qos_count; i++)
 	{
-		if (!cfg->quiet)
-			printf(", %d", granted_qos[i]);
+		DPRINTF("Subscribed (mid: %d): %d\n", mid, granted_qos[i]);
 	}
-	if (!cfg->quiet)
-		printf("\n");
+}
+
+/** This is called when the broker acknowledges an unsubscribe, the
+    * fence of a JOB_RETAINED among them.
+    * \param mosq object
+    * \param obj connection
+	* \param mid message id
+    */
+
+void my_sub_unsubscribe_callback(struct mosquitto *mosq, void *obj, int mid)
+{
+	assert(obj);
+
+	DPRINTF("my_sub_unsubscribe_callback %d\n", mid ) ;
+
+	mqtt_conn_unsub_done((struct mqtt_conn *) obj, mid);
 }
 
 /**  This should be used if you want event logging information from the client library.
@@ -161,159 +158,309 @@ void my_sub_log_callback(struct mosquitto *mosq, void *obj, int level, const cha
 	fprintf(stderr, "%s\n", str);
 }
 
-/**  single-shot subscribe to one message
+/**  single-shot wait for one answer
  * \param pool request memory pool
- * \param mqtt_server server to use
- * \param mqtt_port server port to use
- * \param topic topic
+ * \param broker server, port and credentials to use
+ * \param topic response topic filter
+ * \param correlation correlation id the answer carries
  * \param response response message 
  * \param responselen response size
  * \return MOSQ_ERR_SUCCESS or ...
  */
 
-int  mqtt_sub(apr_pool_t *pool, const char * mqtt_server, int mqtt_port, const char * topic, char ** response, int * responselen)
+int  mqtt_sub(apr_pool_t *pool, const struct mqtt_broker *broker, const char * topic, const char * correlation,
+		char ** response, int * responselen)
 	{
 	struct mosq_config * cfg = NULL ;
-    struct mosquitto * mosq = NULL;
 
-	int rc = mqtt_sub_prepare(pool, mqtt_server, mqtt_port, topic, &cfg, &mosq);
+	int rc = mqtt_sub_prepare(pool, broker, topic, correlation, 1, &cfg);
 
 	if ( rc != MOSQ_ERR_SUCCESS )
 		return rc;
 
-	if ( ! cfg || ! mosq )
+	if ( ! cfg || ! cfg->waiter )
 		return MOSQ_ERR_ERRNO ;
 
-	return mqtt_sub_loop(pool, cfg, mosq, response, responselen);
+	return mqtt_sub_loop(pool, cfg, mqtt_clock() + apr_time_from_sec(MQTT_RESPONSE_TIMEOUT), response, responselen);
 	}
 
-/** subscribe 
+/** wait for an answer through the calling thread's reactor. Makes sure the
+ *  connection subscribes to the response filter and registers the request
+ *  under its correlation id. Returns at once, the answer is collected with
+ *  mqtt_sub_loop or dropped with mqtt_sub_abort
  * \param pool request memory pool
- * \param mqtt_server server to use
- * \param mqtt_port server port to use
- * \param topic topic
+ * \param broker server, port and credentials to use
+ * \param topic response topic filter, shared by all requests
+ * \param correlation correlation id the answer carries
+ * \param count answers to collect, 1 for mqtt_sub_loop, else mqtt_sub_next
+ *        with 0 for any number
+ * \param pcfg request state for mqtt_sub_loop
  * \return MOSQ_ERR_SUCCESS or ...
  */
 
-int  mqtt_sub_prepare(apr_pool_t *pool, const char * mqtt_server, int mqtt_port, const char * topic, 
-			struct mosq_config ** pcfg,  struct mosquitto ** pmosq )
+int  mqtt_sub_prepare(apr_pool_t *pool, const struct mqtt_broker *broker, const char * topic, const char * correlation,
+			int count, struct mosq_config ** pcfg )
 	{
     struct mosq_config * cfg = NULL ;
-    struct mosquitto * mosq = NULL;
+    struct mqtt_job * job ;
     int rc;
 
 	cfg = (struct mosq_config *) apr_pcalloc(pool, sizeof(struct mosq_config) ) ;
 	*pcfg = cfg ;
 
-    DPRINTF("sub %s %d %s: \n", mqtt_server, mqtt_port, topic) ;
+    DPRINTF("sub %s %d %s %s: \n", broker->host, broker->port, topic, correlation) ;
     
     rc = client_config_basic (pool, cfg, NULL, 0);
     if ( rc != MOSQ_ERR_SUCCESS )
         return rc ;
 
-    rc = client_config_sub (cfg,  mqtt_server,  mqtt_port, topic) ;
+    rc = client_config_sub (cfg,  broker->host,  broker->port, topic, count) ;
     if ( rc != MOSQ_ERR_SUCCESS )
         return rc ;
 
     DPRINTF("cfg %d: \n", rc) ;
 
-	mosquitto_lib_init();
-
-	if (client_id_generate(cfg, "mosqsub"))
+	job = mqtt_job_create(JOB_SUBSCRIBE, broker, cfg->topics[0], NULL, 0, NULL);
+	cfg->waiter = mqtt_waiter_get();
+	if ( cfg->waiter )
+		cfg->waiter->want = cfg->msg_count ;
+	/* register before the query goes out, the answer may be quick */
+	if ( ! job || ! cfg->waiter || mqtt_mux_register(cfg->waiter, correlation) != MOSQ_ERR_SUCCESS )
 		{
-		return 1;
+		free(job);
+		mqtt_waiter_release(cfg->waiter);
+		mqtt_waiter_release(cfg->waiter);
+		cfg->waiter = NULL ;
+		return MOSQ_ERR_NOMEM ;
 		}
 
-    DPRINTF("cfg id %d: \n", rc) ;
+	cfg->broker = broker ;
+	job->qos = cfg->qos ;
+	mqtt_reactor_submit(job);
 
-	mosq = mosquitto_new(cfg->id, cfg->clean_session, cfg);
-	* pmosq = mosq ;
-	if (!mosq)
-		{
-		switch (errno)
+	DPRINTF("subscribe %s submitted\n", cfg->topics[0] ) ;
+	return MOSQ_ERR_SUCCESS;
+	}
+
+/** wait for an answer until it is time to hedge, then send the hedge if
+ *  the answer is still missing and the budget allows, or drop it
+ * \param cfg request state from mqtt_sub_prepare
+ * \param at mqtt_clock() time to hedge, before the deadline
+ * \param hedge settings and histogram
+ * \param job query to send again, from mqtt_pub_job
+ */
+
+void mqtt_sub_hedge(struct mosq_config *cfg, apr_time_t at, struct mqtt_hedge *hedge, struct mqtt_job *job)
+	{
+	if ( mqtt_waiter_wait(cfg->waiter, at) == MQTT_ERR_TIMEOUT && mqtt_hedge_allow(hedge) )
 		{
-		case ENOMEM:
-			if (!cfg->quiet)
-				fprintf(stderr, "Error: Out of memory.\n");
-			break;
-		case EINVAL:
-			if (!cfg->quiet)
-				fprintf(stderr, "Error: Invalid id and/or clean_session.\n");
-			break;
-		}
-		mosquitto_lib_cleanup();
-		return 1;
+		DPRINTF("hedge %s\n", job->topic ) ;
+		mqtt_reactor_submit(job);
 		}
+	else
+		free(job);
+	}
+
+/** make sure a broker's connection subscribes to a response filter, for
+ *  answers to a hedge sent to another broker
+ * \param broker server, port and credentials to use
+ * \param topic response topic filter
+ * \return MOSQ_ERR_SUCCESS or ...
+ */
+
+int  mqtt_sub_filter(const struct mqtt_broker *broker, const char * topic)
+	{
+	struct mqtt_job * job = mqtt_job_create(JOB_SUBSCRIBE, broker, topic, NULL, 0, NULL);
 
-	if (client_opts_set(mosq, cfg))
+	if ( ! job )
+		return MOSQ_ERR_NOMEM ;
+	mqtt_reactor_submit(job);
+	return MOSQ_ERR_SUCCESS;
+	}
+
+/** fetch the retained message of a topic: subscribe, take what the broker
+ *  sends right after the SUBACK, and stop at the UNSUBACK that follows
+ * \param pool request memory pool
+ * \param broker server, port and credentials to use
+ * \param topic topic or filter, the first retained message matching counts
+ * \param deadline mqtt_clock() time to give up
+ * \param response retained message
+ * \param responselen message size
+ * \return MOSQ_ERR_SUCCESS, MQTT_ERR_NOT_FOUND, MQTT_ERR_TIMEOUT or ...
+ */
+
+int  mqtt_sub_retained(apr_pool_t *pool, const struct mqtt_broker *broker, const char * topic, apr_time_t deadline,
+			char ** response, int * responselen)
+	{
+	struct mqtt_waiter * waiter ;
+	struct mqtt_job * job = mqtt_job_create(JOB_RETAINED, broker, topic, NULL, 0, NULL);
+	int rc;
+
+	DPRINTF("retained %s %d %s\n", broker->host, broker->port, topic) ;
+
+	waiter = ( job ? mqtt_waiter_get() : NULL ) ;
+	if ( ! waiter )
 		{
-		return 1;
+		free(job);
+		return MOSQ_ERR_NOMEM ;
 		}
-    DPRINTF("cb set: \n" ) ;
 
-	if (cfg->debug)
+	job->waiter = waiter ;
+	mqtt_reactor_submit(job);
+
+	rc = mqtt_waiter_wait(waiter, deadline);
+	if ( rc == MOSQ_ERR_SUCCESS && waiter->message )
 		{
-		mosquitto_log_callback_set(mosq, my_sub_log_callback);
-		mosquitto_subscribe_callback_set(mosq, my_sub_subscribe_callback);
+		* response 		= apr_pmemdup(pool, waiter->message, waiter->msglen + 1) ;
+		* responselen 	= waiter->msglen ;
 		}
-	mosquitto_connect_callback_set(mosq, my_sub_connect_callback);
-	mosquitto_message_callback_set(mosq, my_sub_message_callback);
+	mqtt_waiter_release(waiter);
+
+	if ( rc && rc != MQTT_ERR_NOT_FOUND )
+		fprintf(stderr, "Error: retained %s: %s\n", topic, ( rc == MQTT_ERR_TIMEOUT ? "timed out" : mosquitto_strerror(rc) ));
 
-	rc = client_connect(mosq, cfg);
 	return rc;
 	}
 
-/**  read one message
+/** wait for the answer to an identical query in flight instead of asking
+ *  again, or lead a new flight. The leader puts its flight in its request
+ *  state or lands it with mqtt_mux_land if it cannot ask.
+ * \param pool request memory pool
+ * \param key topic, payload and broker of the query
+ * \param pcfg request state for mqtt_sub_loop when following, else NULL
+ * \param pflight flight to lead, or NULL
+ * \return 1 when following
+ */
+
+int  mqtt_sub_follow(apr_pool_t *pool, const char *key, struct mosq_config **pcfg, struct mqtt_flight **pflight)
+	{
+	struct mqtt_waiter * follower = NULL ;
+
+	*pcfg = NULL ;
+	*pflight = mqtt_mux_join(key, &follower);
+	if ( ! follower )
+		return 0 ;
+
+	DPRINTF("follow %s\n", key ) ;
+	*pcfg = (struct mosq_config *) apr_pcalloc(pool, sizeof(struct mosq_config) ) ;
+	(*pcfg)->waiter = follower ;
+	return 1 ;
+	}
+
+/** hand the leader's result to the requests following it
+ * \param cfg request state from mqtt_sub_prepare
+ * \param rc result
+ * \param message answer or NULL
+ * \param msglen answer size
+ */
+
+static void sub_land(struct mosq_config *cfg, int rc, const char *message, int msglen)
+	{
+	if ( cfg->flight )
+		{
+		mqtt_mux_land(cfg->flight, rc, message, msglen);
+		cfg->flight = NULL ;
+		}
+	}
+
+/** give up waiting for an answer, a late answer is dropped
+ * \param cfg request state from mqtt_sub_prepare
+ */
+
+void mqtt_sub_abort(struct mosq_config *cfg)
+	{
+	if ( cfg )
+		sub_land(cfg, MOSQ_ERR_NO_CONN, NULL, 0);
+
+	if ( cfg && cfg->waiter )
+		{
+		mqtt_mux_unregister(cfg->waiter);
+		mqtt_waiter_release(cfg->waiter);
+		cfg->waiter = NULL ;
+		}
+	}
+
+/**  wait for one message
  * \param pool request memory pool
- * \param mqtt_server server to use
- * \param mqtt_port server port to use
- * \param topic topic
+ * \param cfg request state from mqtt_sub_prepare
+ * \param deadline mqtt_clock() time to give up
  * \param response response message 
  * \param responselen response size
- * \return MOSQ_ERR_SUCCESS or ...
+ * \return MOSQ_ERR_SUCCESS, MQTT_ERR_TIMEOUT or ...
  */
 
-int  mqtt_sub_loop(apr_pool_t *pool, struct mosq_config *cfg,  struct mosquitto *mosq, char ** response, int * responselen)
+int  mqtt_sub_loop(apr_pool_t *pool, struct mosq_config *cfg, apr_time_t deadline, char ** response, int * responselen)
 	{
     int rc;
+	struct mqtt_waiter * waiter = cfg->waiter ;
 
-    DPRINTF("mqtt_sub_loops: \n") ;
-    
-	time_t t = time(NULL) ;
-	int delta ;
- 	do
-        {
-        rc = mosquitto_loop ( mosq, -1, 1 );
-		delta = (int) (time(NULL) - t );
-		if ( delta > 5 )
-			rc = MOSQ_ERR_CONN_LOST ;
-        }
-    while ( (rc == MOSQ_ERR_SUCCESS) 
-		&& cfg->connected 
-		&& (cfg->msglen==0) ) ;
-
- 	DPRINTF("SUB mosquitto_loop: %d t=%d c=%d l=%ld \n", rc, delta, cfg->msg_count, cfg->msglen ) ;
-
-	/* rc = mosquitto_loop_forever(mosq, -1, 1);
-    DPRINTF("mosquitto_loop_forever: %d\n", rc ) ; */
-
-	mosquitto_destroy(mosq);
-	mosquitto_lib_cleanup();
-
-	if (cfg->msg_count > 0 && rc == MOSQ_ERR_NO_CONN)
+    DPRINTF("mqtt_sub_loop: \n") ;
+
+	rc = mqtt_waiter_wait(waiter, deadline);
+
+ 	DPRINTF("SUB wait: %d l=%d \n", rc, waiter->msglen ) ;
+
+	if ( rc == MQTT_ERR_TIMEOUT )
 		{
-		rc = 0;
+		sub_land(cfg, rc, NULL, 0);
+		mqtt_sub_abort(cfg);
+		fprintf(stderr, "Error: no answer on %s\n", ( cfg->topics ? cfg->topics[0] : "(followed)" ));
+		return rc ;
 		}
 
+	sub_land(cfg, rc, waiter->message, waiter->msglen);
+
 	if (rc)
 		{
 		fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
 		}
-	else
+	else if (waiter->message)
 		{
+		cfg -> message 	= apr_pmemdup(pool, waiter->message, waiter->msglen + 1) ;
+		cfg -> msglen 	= waiter->msglen ;
 		* response 		= (char *) cfg->message ; /* cast const away */
 		* responselen 	= cfg->msglen ;
 		}
+
+	cfg->waiter = NULL ;
+	mqtt_waiter_release(waiter);
 	
 	return rc;
 	}
+
+/**  wait for the next of several answers, as prepared with a count other
+ *   than 1. Stops waiting once all wanted answers are taken or the
+ *   deadline passed, later answers are dropped.
+ * \param pool request memory pool
+ * \param cfg request state from mqtt_sub_prepare
+ * \param deadline mqtt_clock() time to give up
+ * \param response next answer, NULL at the end
+ * \param responselen answer size
+ * \return MOSQ_ERR_SUCCESS or MQTT_ERR_TIMEOUT
+ */
+
+int  mqtt_sub_next(apr_pool_t *pool, struct mosq_config *cfg, apr_time_t deadline, char ** response, int * responselen)
+	{
+	struct mqtt_answer * answer = NULL ;
+	int rc;
+
+	* response = NULL ;
+	* responselen = 0 ;
+	if ( ! cfg->waiter )
+		return MOSQ_ERR_SUCCESS ;
+
+	rc = mqtt_waiter_next(cfg->waiter, deadline, &answer);
+	if ( ! answer )
+		{
+		DPRINTF("mqtt_sub_next: %d answers on %s, %d\n", cfg->msg_received, cfg->topics[0], rc ) ;
+		mqtt_sub_abort(cfg);
+		return rc ;
+		}
+
+	* response 		= apr_pmemdup(pool, answer->data, answer->len + 1) ;
+	* responselen 	= answer->len ;
+	cfg->msg_received++ ;
+	free(answer);
+
+	return MOSQ_ERR_SUCCESS;
+	}
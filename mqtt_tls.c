@@ -0,0 +1,205 @@
+/*
+ * mqtt TLS: one SSL_CTX per set of TLS settings, shared by all broker
+ * connections of a child, with a client session cache so reconnects
+ * resume the session instead of doing a full handshake
+ */
+
+#ifdef WITH_TLS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <mosquitto.h>
+#include "apr_strings.h"
+#include "mqtt_common.h"
+
+struct tls_ctx
+    {
+    SSL_CTX *ctx;                   /* shared by the connections, mosquitto holds a reference */
+    int insecure;                   /* no host name check */
+    apr_thread_mutex_t *lock;       /* protects sessions and pool */
+    apr_pool_t *pool;               /* host names */
+    apr_hash_t *sessions;           /* SNI host name -> SSL_SESSION */
+    };
+
+static apr_pool_t *tls_pool = NULL;             /* contexts, allocated under tls_lock */
+static apr_thread_mutex_t *tls_lock = NULL;
+static apr_hash_t *tls_ctxs = NULL;             /* struct mqtt_tls key -> struct tls_ctx */
+static int tls_index = -1;                      /* SSL_CTX ex data: struct tls_ctx */
+
+/** set up the context table, once per child before the reactors start
+  * \param pool child pool
+  * \return MOSQ_ERR_SUCCESS or MOSQ_ERR_NOMEM
+  */
+int mqtt_tls_init ( apr_pool_t *pool )
+    {
+    if ( apr_pool_create ( &tls_pool, pool ) != APR_SUCCESS
+         || apr_thread_mutex_create ( &tls_lock, APR_THREAD_MUTEX_DEFAULT, pool ) != APR_SUCCESS )
+        return MOSQ_ERR_NOMEM;
+
+    tls_ctxs = apr_hash_make ( tls_pool );
+    tls_index = SSL_CTX_get_ex_new_index ( 0, NULL, NULL, NULL, NULL );
+    return ( tls_index < 0 ? MOSQ_ERR_NOMEM : MOSQ_ERR_SUCCESS );
+    }
+
+/** the broker issued a session: keep the newest one per host
+  * \param ssl connection
+  * \param sess new session
+  * \return 1, we keep the reference
+  */
+static int tls_new_session ( SSL *ssl, SSL_SESSION *sess )
+    {
+    struct tls_ctx *tc = SSL_CTX_get_ex_data ( SSL_get_SSL_CTX ( ssl ), tls_index );
+    const char *host = SSL_get_servername ( ssl, TLSEXT_NAMETYPE_host_name );
+    SSL_SESSION *old;
+
+    if ( !tc || !host )
+        return 0;
+
+    apr_thread_mutex_lock ( tc->lock );
+    old = apr_hash_get ( tc->sessions, host, APR_HASH_KEY_STRING );
+    if ( old )
+        SSL_SESSION_free ( old );
+    else
+        host = apr_pstrdup ( tc->pool, host );
+    apr_hash_set ( tc->sessions, host, APR_HASH_KEY_STRING, sess );
+    apr_thread_mutex_unlock ( tc->lock );
+
+    DPRINTF ( "tls session for %s cached\n", host );
+    return 1;
+    }
+
+/** a handshake starts inside libmosquitto's SSL_connect: this is the only
+  * place we get hold of the SSL before the ClientHello goes out, so offer
+  * the cached session here and ask for the host name to be checked. When
+  * it is done, debug builds log whether the session was resumed
+  * (test/tls.pl looks for that).
+  * \param ssl connection, SNI already set by libmosquitto
+  * \param where SSL_CB_* event
+  * \param ret event value
+  */
+static void tls_info ( const SSL *ssl, int where, int ret )
+    {
+    SSL *s = ( SSL * ) ssl;
+    struct tls_ctx *tc;
+    const char *host;
+    SSL_SESSION *sess;
+
+    if ( where & SSL_CB_HANDSHAKE_DONE )
+        {
+        host = SSL_get_servername ( s, TLSEXT_NAMETYPE_host_name );
+        DPRINTF ( "tls %s: %s session\n", ( host ? host : "-" ), ( SSL_session_reused ( s ) ? "resumed" : "new" ) );
+        return;
+        }
+    if ( ! ( where & SSL_CB_HANDSHAKE_START ) || !SSL_in_before ( s ) )
+        return;
+
+    tc = SSL_CTX_get_ex_data ( SSL_get_SSL_CTX ( s ), tls_index );
+    host = SSL_get_servername ( s, TLSEXT_NAMETYPE_host_name );
+    if ( !tc || !host )
+        return;
+
+    if ( !tc->insecure )
+        SSL_set1_host ( s, host );
+
+    apr_thread_mutex_lock ( tc->lock );
+    sess = apr_hash_get ( tc->sessions, host, APR_HASH_KEY_STRING );
+    if ( sess )
+        SSL_set_session ( s, sess );
+    apr_thread_mutex_unlock ( tc->lock );
+    }
+
+/** build an SSL_CTX from TLS settings
+  * \param tls settings
+  * \return context or NULL
+  */
+static SSL_CTX *tls_ctx_new ( const struct mqtt_tls *tls )
+    {
+    SSL_CTX *ctx = SSL_CTX_new ( TLS_client_method() );
+    int version = 0;
+
+    if ( !ctx )
+        return NULL;
+
+    if ( tls->version )
+        {
+        if ( !strcmp ( tls->version, "tlsv1.3" ) )
+            version = TLS1_3_VERSION;
+        else if ( !strcmp ( tls->version, "tlsv1.2" ) )
+            version = TLS1_2_VERSION;
+        else if ( !strcmp ( tls->version, "tlsv1.1" ) )
+            version = TLS1_1_VERSION;
+        else if ( !strcmp ( tls->version, "tlsv1" ) )
+            version = TLS1_VERSION;
+        }
+
+    if ( ( version && !SSL_CTX_set_min_proto_version ( ctx, version ) )
+         || ( tls->ciphers && !SSL_CTX_set_cipher_list ( ctx, tls->ciphers ) )
+         || ( ( tls->cafile || tls->capath )
+              ? !SSL_CTX_load_verify_locations ( ctx, tls->cafile, tls->capath )
+              : !SSL_CTX_set_default_verify_paths ( ctx ) )
+         || ( tls->certfile && !SSL_CTX_use_certificate_chain_file ( ctx, tls->certfile ) )
+         || ( tls->keyfile && !SSL_CTX_use_PrivateKey_file ( ctx, tls->keyfile, SSL_FILETYPE_PEM ) )
+         || ( tls->certfile && tls->keyfile && !SSL_CTX_check_private_key ( ctx ) ) )
+        {
+        LPRINTF ( "mod_mqtt: TLS setup failed: %s\n", ERR_error_string ( ERR_get_error(), NULL ) );
+        SSL_CTX_free ( ctx );
+        return NULL;
+        }
+
+    SSL_CTX_set_verify ( ctx, SSL_VERIFY_PEER, NULL );
+
+    /* sessions live in our cache only, keyed by host instead of by SSL */
+    SSL_CTX_set_session_cache_mode ( ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE );
+    SSL_CTX_sess_set_new_cb ( ctx, tls_new_session );
+    SSL_CTX_set_info_callback ( ctx, tls_info );
+
+    return ctx;
+    }
+
+/** the shared context for TLS settings, created on first use. Called by
+  * the reactors when they create a connection.
+  * \param tls settings
+  * \return context or NULL
+  */
+SSL_CTX *mqtt_tls_context ( const struct mqtt_tls *tls )
+    {
+    struct tls_ctx *tc;
+
+    apr_thread_mutex_lock ( tls_lock );
+
+    tc = apr_hash_get ( tls_ctxs, tls->key, APR_HASH_KEY_STRING );
+    if ( !tc )
+        {
+        SSL_CTX *ctx = tls_ctx_new ( tls );
+
+        if ( ctx )
+            {
+            tc = apr_pcalloc ( tls_pool, sizeof ( struct tls_ctx ) );
+            tc->ctx = ctx;
+            tc->insecure = tls->insecure;
+            if ( apr_pool_create ( &tc->pool, tls_pool ) != APR_SUCCESS
+                 || apr_thread_mutex_create ( &tc->lock, APR_THREAD_MUTEX_DEFAULT, tls_pool ) != APR_SUCCESS )
+                {
+                SSL_CTX_free ( ctx );
+                tc = NULL;
+                }
+            else
+                {
+                tc->sessions = apr_hash_make ( tc->pool );
+                SSL_CTX_set_ex_data ( ctx, tls_index, tc );
+                apr_hash_set ( tls_ctxs, apr_pstrdup ( tls_pool, tls->key ), APR_HASH_KEY_STRING, tc );
+                }
+            }
+        }
+
+    apr_thread_mutex_unlock ( tls_lock );
+
+    return ( tc ? tc->ctx : NULL );
+    }
+
+#endif
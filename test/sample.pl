@@ -39,10 +39,14 @@ sub answer
     {
     my $in = shift ;
     my $query = $in -> {query};
+    # nobody waits for an answer after the deadline (ms since the epoch)
+    return undef if ( $in -> {deadline} && $in -> {deadline} < time * 1000 ) ;
     my $sensorid = $in -> {sensorid};
+    my $id = $in -> {"correlation-id"} // "" ;
     my $rnd = int rand 1000;
     my $reply = << "END_REPLY";
         {
+        "correlation-id": "$id",
         "content-type": "text/ascii",
         ".data": "$query of sensor $sensorid is $rnd" 
         }
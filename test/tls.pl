@@ -0,0 +1,110 @@
+#!/usr/bin/perl -w
+#
+# TLS session resumption against a local mosquitto: a broker connection
+# that is cut and made again must resume the TLS session instead of a
+# full handshake.
+#
+# Needs openssl, mosquitto, ss (iproute2, run as root to cut sockets) and
+# a module built with -DDEBUG -DWITH_TLS, so "tls <host>: new|resumed
+# session" shows in the error log. The first run creates the certificates
+# in <dir> and prints the configuration for the location; reload Apache
+# with it and run again.
+#
+# Usage: tls.pl [dir [url]]
+#   ERROR_LOG   Apache error log, default /var/log/apache2/error.log
+#   MQTT_PORT   TLS port of the broker, default 8883
+
+use strict;
+use LWP::UserAgent ();
+
+my $dir = shift || "/tmp/mod_mqtt_tls" ;
+my $url = shift || "http://127.0.0.1/mqtt/sensors" ;
+my $log = $ENV{ERROR_LOG} || "/var/log/apache2/error.log" ;
+my $port = $ENV{MQTT_PORT} || 8883 ;
+
+my $ua = LWP::UserAgent->new;
+$ua->timeout(10);
+
+sub run
+    {
+    my $cmd = shift ;
+    system($cmd) == 0 or die "failed: $cmd\n" ;
+    }
+
+# CA and a server certificate for 127.0.0.1 and localhost
+if ( ! -f "$dir/server.crt" )
+    {
+    mkdir $dir ;
+    run("openssl req -x509 -newkey rsa:2048 -nodes -days 30 -subj '/CN=mod_mqtt test CA'"
+        . " -keyout $dir/ca.key -out $dir/ca.crt 2>/dev/null") ;
+    run("openssl req -newkey rsa:2048 -nodes -subj '/CN=localhost'"
+        . " -keyout $dir/server.key -out $dir/server.csr 2>/dev/null") ;
+    open(my $ext, ">", "$dir/server.ext") or die "$dir/server.ext: $!" ;
+    print $ext "subjectAltName=DNS:localhost,IP:127.0.0.1\n" ;
+    close($ext) ;
+    run("openssl x509 -req -days 30 -in $dir/server.csr -CA $dir/ca.crt -CAkey $dir/ca.key"
+        . " -CAcreateserial -extfile $dir/server.ext -out $dir/server.crt 2>/dev/null") ;
+
+    print "Certificates in $dir. Configure the location, reload Apache and run again:\n\n" ;
+    print "    MQTTServer      localhost\n" ;
+    print "    MQTTPort        $port\n" ;
+    print "    MQTTTLS         on\n" ;
+    print "    MQTTTLSCAFile   $dir/ca.crt\n\n" ;
+    exit 0 ;
+    }
+
+open(my $conf, ">", "$dir/mosquitto.conf") or die "$dir/mosquitto.conf: $!" ;
+print $conf "listener $port 127.0.0.1\n" ;
+print $conf "allow_anonymous true\n" ;
+print $conf "cafile $dir/ca.crt\n" ;
+print $conf "certfile $dir/server.crt\n" ;
+print $conf "keyfile $dir/server.key\n" ;
+close($conf) ;
+
+my $broker = fork ;
+die "fork: $!" if ( ! defined $broker ) ;
+if ( ! $broker )
+    {
+    exec("mosquitto", "-c", "$dir/mosquitto.conf") or die "Can't start mosquitto: $!" ;
+    }
+END { kill 'TERM', $broker if ( $broker ) ; }
+sleep 1 ;
+
+# only what this run logs
+open(my $in, "<", $log) or die "$log: $!" ;
+seek($in, 0, 2) ;
+
+sub query
+    {
+    my $response = $ua->get("$url?sensorid=13&query=temperature") ;
+    print "GET: " . $response->status_line . "\n" ;
+    }
+
+# the first connection does the full handshake, the broker issues a session
+query() ;
+sleep 1 ;
+
+# cut the connection from our side, the reconnect should resume
+run("ss -K dst 127.0.0.1 dport = :$port >/dev/null") ;
+
+my ($new, $resumed) = (0, 0) ;
+for ( my $i = 0; $i < 10 && ! $resumed; $i++ )
+    {
+    sleep 1 ;
+    query() ;
+    while ( my $line = <$in> )
+        {
+        $new++ if ( $line =~ /tls \S+: new session/ ) ;
+        $resumed++ if ( $line =~ /tls \S+: resumed session/ ) ;
+        }
+    seek($in, 0, 1) ;
+    }
+
+print "Handshakes: new: $new, resumed: $resumed\n" ;
+if ( ! $new && ! $resumed )
+    {
+    print "FAIL: nothing logged, is the module built with -DDEBUG -DWITH_TLS and configured?\n" ;
+    exit 1 ;
+    }
+print ( $resumed ? "OK: session resumed\n" : "FAIL: no session resumed\n" ) ;
+exit ( $resumed ? 0 : 1 ) ;